@@ -0,0 +1,598 @@
+//
+//  benchmark.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+//  Micro benchmarks of the C sensor core.
+//
+//  usage: kinetic-benchmark [--format text|csv|json] [--filter substring] [--min-time seconds] [--batch n]... [--counters]
+//
+//  Every kernel runs over batches of frames (1, 16, 256 and 4096 by default). Each measurement is repeated and the
+//  fastest and median repetition are reported per item (frame, command, packet). The input frames come from the
+//  emulator with a fixed seed, so runs are comparable between machines and SDK versions.
+//
+//  --counters (Linux) also reads the hardware performance counters (perf_event_open) over the timed repetitions and
+//  reports cycles, instructions, branch misses and L1D read misses per item. Counters the CPU or the hypervisor does not
+//  expose are reported as missing; user space only, so kernel.perf_event_paranoid up to 2 is fine.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "Emulator.h"
+#include "inRide.h"
+#include "inRideBatch.h"
+#include "SmartControl.h"
+#include "Tracing.h"
+
+#define MAX_BATCH           4096
+#define MAX_BATCH_SIZES     16
+#define REPETITIONS         7
+
+typedef enum output_format
+{
+    OUTPUT_TEXT,
+    OUTPUT_CSV,
+    OUTPUT_JSON
+} output_format;
+
+typedef struct benchmark_data
+{
+    uint8_t inridePower[MAX_BATCH][20];
+    uint8_t smartControlPower[MAX_BATCH][20];
+    uint8_t smartControlConfig[MAX_BATCH][20];
+    uint8_t systemId[6];
+
+    // inRide counters as columns (inride_power_batch)
+    uint32_t ticks[MAX_BATCH];
+    uint8_t revs[MAX_BATCH];
+    uint32_t ticksPrevious[MAX_BATCH];
+    uint8_t revsPrevious[MAX_BATCH];
+    double spindownTime[MAX_BATCH];
+    int32_t power[MAX_BATCH];
+
+    // framed USB stream of power notifications
+    uint8_t usbStream[MAX_BATCH * SMART_CONTROL_USB_PACKET_MAX];
+    size_t usbStreamSize[MAX_BATCH + 1];    // stream size of the first n packets
+} benchmark_data;
+
+// Result of every kernel is folded in here so nothing is optimized away.
+static volatile uint64_t sink;
+
+typedef uint64_t (*kernel_function)(benchmark_data *data, size_t batch);
+
+typedef struct kernel
+{
+    const char *name;
+    const char *unit;
+    kernel_function run;
+} kernel;
+
+
+static uint64_t inride_decode(benchmark_data *data, size_t batch)
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i < batch; ++i) {
+        inride_power_data power = inride_process_power_data(data->inridePower[i]);
+        sum += (uint64_t)power.power + power.coasting;
+    }
+    return sum;
+}
+
+static uint64_t inride_deobfuscate(benchmark_data *data, size_t batch)
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i < batch; ++i) {
+        inride_raw_power_data raw = inride_decode_power_data(data->inridePower[i]);
+        sum += raw.ticks + raw.revs;
+    }
+    return sum;
+}
+
+static uint64_t inride_power_model_batch(benchmark_data *data, size_t batch)
+{
+    inride_batch_input input = { data->ticks, data->revs, data->ticksPrevious, data->revsPrevious, data->spindownTime };
+    inride_batch_output output = { NULL, NULL, NULL, data->power };
+    inride_power_batch(&input, batch, &output);
+    return (uint64_t)data->power[batch - 1];
+}
+
+static uint64_t smart_control_power_decode(benchmark_data *data, size_t batch)
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i < batch; ++i) {
+        smart_control_power_data power = smart_control_process_power_data(data->smartControlPower[i], 20);
+        sum += power.power + power.cadenceRPM;
+    }
+    return sum;
+}
+
+static uint64_t smart_control_config_decode(benchmark_data *data, size_t batch)
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i < batch; ++i) {
+        smart_control_config_data config = smart_control_process_config_data(data->smartControlConfig[i], 20);
+        sum += config.updateRate + config.brakeStrength;
+    }
+    return sum;
+}
+
+static uint64_t crc8_whitening(benchmark_data *data, size_t batch)
+{
+    // the de-whitening loop of the decoders, without the field parsing
+    uint64_t sum = 0;
+    for (size_t i = 0; i < batch; ++i) {
+        const uint8_t *frame = data->smartControlPower[i];
+        uint8_t plain[20];
+        uint8_t hash = hash8WithSeed(0x42, &frame[19], 1);
+        for (unsigned index = 0; index < 19; index++) {
+            plain[index] = frame[index] ^ hash;
+            hash = hash8WithSeed(hash, &plain[index], 1);
+        }
+        sum += plain[4];
+    }
+    return sum;
+}
+
+static uint64_t smart_control_erg_encode(benchmark_data *data, size_t batch)
+{
+    (void)data;
+    uint64_t sum = 0;
+    for (size_t i = 0; i < batch; ++i) {
+        smart_control_set_mode_erg_data command = smart_control_set_mode_erg_command((uint16_t)(100 + i));
+        sum += command.bytes[2];
+    }
+    return sum;
+}
+
+static uint64_t smart_control_simulation_encode(benchmark_data *data, size_t batch)
+{
+    (void)data;
+    uint64_t sum = 0;
+    for (size_t i = 0; i < batch; ++i) {
+        smart_control_set_mode_simulation_data command = smart_control_set_mode_simulation_command(80, 0.004f, 0.6f, (float)(i % 20) * 0.5f, 0);
+        sum += command.bytes[8];
+    }
+    return sum;
+}
+
+static uint64_t smart_control_batch_encode(benchmark_data *data, size_t batch)
+{
+    (void)data;
+    smart_control_command commands[64];
+    uint8_t output[64][SMART_CONTROL_COMMAND_MAX];
+    uint8_t sizes[64];
+    uint64_t sum = 0;
+    for (size_t offset = 0; offset < batch; offset += 64) {
+        size_t count = batch - offset < 64 ? batch - offset : 64;
+        for (size_t i = 0; i < count; ++i) {
+            commands[i] = (smart_control_command){ SMART_CONTROL_SET_MODE_SIMULATION, { 80, 0.004f, 0.6f, (float)((offset + i) % 20) * 0.5f, 0 } };
+        }
+        smart_control_encode_commands(commands, count, &output[0][0], SMART_CONTROL_COMMAND_MAX, sizes);
+        sum += output[0][8] + sizes[count - 1];
+    }
+    return sum;
+}
+
+static uint64_t inride_command_encode(benchmark_data *data, size_t batch)
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i < batch; ++i) {
+        inride_config_sensor_command command = inride_create_config_sensor_command_data(INRIDE_UPDATE_RATE_250, data->systemId);
+        sum += command.commandKey + i;
+    }
+    return sum;
+}
+
+static uint64_t usb_frame(benchmark_data *data, size_t batch)
+{
+    uint64_t sum = 0;
+    uint8_t packet[SMART_CONTROL_USB_PACKET_MAX];
+    for (size_t i = 0; i < batch; ++i) {
+        sum += smart_control_usb_request(false, true, 0x0203, data->smartControlPower[i], 20, packet);
+    }
+    return sum;
+}
+
+static void count_packet(void *context, const smart_control_usb_packet *packet)
+{
+    *(uint64_t *)context += packet->size;
+}
+
+static uint64_t usb_unframe(benchmark_data *data, size_t batch)
+{
+    uint64_t sum = 0;
+    smart_control_usb_parser parser;
+    smart_control_usb_parser_init(&parser);
+    smart_control_usb_process_data(&parser, data->usbStream, data->usbStreamSize[batch], count_packet, &sum);
+    return sum;
+}
+
+#ifdef KINETIC_TRACING
+static uint64_t trace_span(benchmark_data *data, size_t batch)
+{
+    (void)data;
+    for (size_t i = 0; i < batch; ++i) {
+        KINETIC_TRACE_BEGIN(traceStart);
+        KINETIC_TRACE_END(traceStart, "benchmark");
+    }
+    return batch;
+}
+#endif
+
+static const kernel kernels[] = {
+    { "inride_decode",                  "frame",    inride_decode },
+    { "inride_deobfuscate",             "frame",    inride_deobfuscate },
+    { "inride_power_batch",             "frame",    inride_power_model_batch },
+    { "smart_control_power_decode",     "frame",    smart_control_power_decode },
+    { "smart_control_config_decode",    "frame",    smart_control_config_decode },
+    { "crc8_whitening",                 "frame",    crc8_whitening },
+    { "smart_control_erg_encode",       "command",  smart_control_erg_encode },
+    { "smart_control_simulation_encode","command",  smart_control_simulation_encode },
+    { "smart_control_batch_encode",     "command",  smart_control_batch_encode },
+    { "inride_command_encode",          "command",  inride_command_encode },
+    { "usb_frame",                      "packet",   usb_frame },
+    { "usb_unframe",                    "packet",   usb_unframe },
+#ifdef KINETIC_TRACING
+    { "trace_span",                     "span",     trace_span },
+#endif
+};
+
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+    return da < db ? -1 : da > db ? 1 : 0;
+}
+
+
+// Hardware performance counters
+
+typedef enum counter_id
+{
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_L1D_MISSES,
+    COUNTER_COUNT
+} counter_id;
+
+static const char *counterNames[COUNTER_COUNT] = { "cycles", "instructions", "branch_misses", "l1d_misses" };
+
+typedef struct counter_group
+{
+    int fd[COUNTER_COUNT];      // -1 when the counter is not available
+    bool enabled;
+} counter_group;
+
+#ifdef __linux__
+
+static int counter_open(uint32_t type, uint64_t config, int groupFd)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = groupFd == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, 0);
+}
+
+static bool counters_open(counter_group *group)
+{
+    group->enabled = false;
+    group->fd[COUNTER_CYCLES] = counter_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1);
+    if (group->fd[COUNTER_CYCLES] < 0) {
+        return false;
+    }
+    int leader = group->fd[COUNTER_CYCLES];
+    group->fd[COUNTER_INSTRUCTIONS] = counter_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, leader);
+    group->fd[COUNTER_BRANCH_MISSES] = counter_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, leader);
+    group->fd[COUNTER_L1D_MISSES] = counter_open(PERF_TYPE_HW_CACHE,
+                                                 PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+                                                 leader);
+    group->enabled = true;
+    return true;
+}
+
+static void counters_start(counter_group *group)
+{
+    ioctl(group->fd[COUNTER_CYCLES], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(group->fd[COUNTER_CYCLES], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+// Counts since counters_start, scaled up if the kernel multiplexed the group. Missing counters are negative.
+static void counters_stop(counter_group *group, double values[COUNTER_COUNT])
+{
+    ioctl(group->fd[COUNTER_CYCLES], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    for (int c = 0; c < COUNTER_COUNT; ++c) {
+        uint64_t read_values[3];    // value, time enabled, time running
+        values[c] = -1;
+        if (group->fd[c] >= 0 && read(group->fd[c], read_values, sizeof(read_values)) == sizeof(read_values) && read_values[2] > 0) {
+            values[c] = (double)read_values[0] * ((double)read_values[1] / (double)read_values[2]);
+        }
+    }
+}
+
+static void counters_close(counter_group *group)
+{
+    for (int c = 0; c < COUNTER_COUNT; ++c) {
+        if (group->fd[c] >= 0) {
+            close(group->fd[c]);
+        }
+    }
+    group->enabled = false;
+}
+
+#else
+
+static bool counters_open(counter_group *group)
+{
+    group->enabled = false;
+    return false;
+}
+
+static void counters_start(counter_group *group)
+{
+    (void)group;
+}
+
+static void counters_stop(counter_group *group, double values[COUNTER_COUNT])
+{
+    (void)group;
+    for (int c = 0; c < COUNTER_COUNT; ++c) {
+        values[c] = -1;
+    }
+}
+
+static void counters_close(counter_group *group)
+{
+    (void)group;
+}
+
+#endif
+
+
+static void prepare(benchmark_data *data)
+{
+    const uint8_t systemId[6] = { 0xC4, 0x7F, 0x51, 0x02, 0x9A, 0x3B };
+    memcpy(data->systemId, systemId, 6);
+
+    kinetic_emulator_device inRide;
+    kinetic_emulator_device smartControl;
+    kinetic_emulator_init_inride(&inRide, systemId, 1);
+    kinetic_emulator_init_smart_control(&smartControl, systemId, 2);
+    inRide.inRide.spindownTicks = (uint32_t)(1.8 * 32768);
+
+    // a ride with speed and cadence changes, including coasting
+    for (size_t i = 0; i < MAX_BATCH; ++i) {
+        double phase = (double)(i % 240) / 240.0;
+        double speed = 15 + 25 * phase;
+        double cadence = (i % 97) < 12 ? 0 : 60 + 40 * phase;
+        inRide.speedKPH = speed;
+        inRide.cadenceRPM = cadence;
+        smartControl.speedKPH = speed;
+        smartControl.cadenceRPM = cadence;
+        kinetic_emulator_power_frame(&inRide, data->inridePower[i]);
+        kinetic_emulator_power_frame(&smartControl, data->smartControlPower[i]);
+        kinetic_emulator_config_frame(&smartControl, data->smartControlConfig[i]);
+
+        inride_raw_power_data raw = inride_decode_power_data(data->inridePower[i]);
+        bool proFlywheel;
+        data->ticks[i] = raw.ticks;
+        data->revs[i] = raw.revs;
+        data->ticksPrevious[i] = raw.ticksPrevious;
+        data->revsPrevious[i] = raw.revsPrevious;
+        data->spindownTime[i] = inride_spindown_time_for_result(raw.spindownTicks / 32768.0, &proFlywheel);
+    }
+
+    data->usbStreamSize[0] = 0;
+    for (size_t i = 0; i < MAX_BATCH; ++i) {
+        size_t size = smart_control_usb_request(false, true, 0x0201, data->smartControlPower[i], 20, &data->usbStream[data->usbStreamSize[i]]);
+        data->usbStreamSize[i + 1] = data->usbStreamSize[i] + size;
+    }
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: kinetic-benchmark [--format text|csv|json] [--filter substring] [--min-time seconds] [--batch n]... [--counters]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    output_format format = OUTPUT_TEXT;
+    const char *filter = NULL;
+    double minTime = 0.1;
+    size_t batchSizes[MAX_BATCH_SIZES] = { 1, 16, 256, 4096 };
+    size_t batchSizeCount = 4;
+    bool customBatch = false;
+    bool useCounters = false;
+
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(arg, "--format") == 0 && value != NULL) {
+            format = strcmp(value, "json") == 0 ? OUTPUT_JSON : strcmp(value, "csv") == 0 ? OUTPUT_CSV : OUTPUT_TEXT;
+            i++;
+        } else if (strcmp(arg, "--filter") == 0 && value != NULL) {
+            filter = value;
+            i++;
+        } else if (strcmp(arg, "--min-time") == 0 && value != NULL) {
+            minTime = strtod(value, NULL);
+            i++;
+        } else if (strcmp(arg, "--batch") == 0 && value != NULL) {
+            if (!customBatch) {
+                batchSizeCount = 0;
+                customBatch = true;
+            }
+            long batch = strtol(value, NULL, 10);
+            if (batch < 1 || batch > MAX_BATCH || batchSizeCount == MAX_BATCH_SIZES) {
+                fprintf(stderr, "kinetic-benchmark: batch sizes are 1 to %d (at most %d of them)\n", MAX_BATCH, MAX_BATCH_SIZES);
+                return 2;
+            }
+            batchSizes[batchSizeCount++] = (size_t)batch;
+            i++;
+        } else if (strcmp(arg, "--counters") == 0) {
+            useCounters = true;
+        } else {
+            usage();
+            return strcmp(arg, "--help") == 0 ? 0 : 2;
+        }
+    }
+
+    static benchmark_data data;
+    prepare(&data);
+
+    counter_group counters = { { -1, -1, -1, -1 }, false };
+    if (useCounters && !counters_open(&counters)) {
+        fprintf(stderr, "kinetic-benchmark: hardware counters are not available (perf_event_open), continuing without\n");
+    }
+
+    if (format == OUTPUT_CSV) {
+        printf("kernel,unit,batch,iterations,min_ns,median_ns,items_per_second");
+        if (counters.enabled) {
+            for (int c = 0; c < COUNTER_COUNT; ++c) {
+                printf(",%s", counterNames[c]);
+            }
+            printf(",ipc");
+        }
+        printf("\n");
+    } else if (format == OUTPUT_TEXT) {
+        printf("%-32s %7s %12s %12s %14s", "kernel", "batch", "min ns", "median ns", "items / s");
+        if (counters.enabled) {
+            printf(" %10s %10s %10s %10s %6s", "cycles", "instr", "br-miss", "l1d-miss", "ipc");
+        }
+        printf("\n");
+    }
+
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k) {
+        const kernel *kern = &kernels[k];
+        if (filter != NULL && strstr(kern->name, filter) == NULL) {
+            continue;
+        }
+        for (size_t b = 0; b < batchSizeCount; ++b) {
+            size_t batch = batchSizes[b];
+
+            // calibrate the number of calls per repetition
+            uint64_t calls = 1;
+            for (;;) {
+                double start = now_seconds();
+                for (uint64_t c = 0; c < calls; ++c) {
+                    sink += kern->run(&data, batch);
+                }
+                if (now_seconds() - start >= minTime / REPETITIONS || calls >= (1ull << 40)) {
+                    break;
+                }
+                calls *= 2;
+            }
+
+            double perItem[REPETITIONS];
+            if (counters.enabled) {
+                counters_start(&counters);
+            }
+            for (int r = 0; r < REPETITIONS; ++r) {
+                double start = now_seconds();
+                for (uint64_t c = 0; c < calls; ++c) {
+                    sink += kern->run(&data, batch);
+                }
+                perItem[r] = (now_seconds() - start) * 1e9 / ((double)calls * batch);
+            }
+            double counts[COUNTER_COUNT];
+            if (counters.enabled) {
+                counters_stop(&counters, counts);
+                for (int c = 0; c < COUNTER_COUNT; ++c) {
+                    if (counts[c] >= 0) {
+                        counts[c] /= (double)calls * batch * REPETITIONS;
+                    }
+                }
+            }
+            double ipc = counters.enabled && counts[COUNTER_CYCLES] > 0 && counts[COUNTER_INSTRUCTIONS] >= 0 ? counts[COUNTER_INSTRUCTIONS] / counts[COUNTER_CYCLES] : -1;
+            qsort(perItem, REPETITIONS, sizeof(double), compare_doubles);
+            double best = perItem[0];
+            double median = perItem[REPETITIONS / 2];
+            double rate = median > 0 ? 1e9 / median : 0;
+            unsigned long long iterations = (unsigned long long)(calls * batch);
+
+            switch (format) {
+                case OUTPUT_TEXT:
+                    printf("%-32s %7zu %12.2f %12.2f %14.0f", kern->name, batch, best, median, rate);
+                    if (counters.enabled) {
+                        for (int c = 0; c < COUNTER_COUNT; ++c) {
+                            if (counts[c] >= 0) {
+                                printf(" %10.2f", counts[c]);
+                            } else {
+                                printf(" %10s", "-");
+                            }
+                        }
+                        if (ipc >= 0) {
+                            printf(" %6.2f", ipc);
+                        } else {
+                            printf(" %6s", "-");
+                        }
+                    }
+                    printf("\n");
+                    break;
+                case OUTPUT_CSV:
+                    printf("%s,%s,%zu,%llu,%.3f,%.3f,%.0f", kern->name, kern->unit, batch, iterations, best, median, rate);
+                    if (counters.enabled) {
+                        for (int c = 0; c < COUNTER_COUNT; ++c) {
+                            if (counts[c] >= 0) {
+                                printf(",%.3f", counts[c]);
+                            } else {
+                                printf(",");
+                            }
+                        }
+                        if (ipc >= 0) {
+                            printf(",%.3f", ipc);
+                        } else {
+                            printf(",");
+                        }
+                    }
+                    printf("\n");
+                    break;
+                case OUTPUT_JSON:
+                    printf("{\"kernel\":\"%s\",\"unit\":\"%s\",\"batch\":%zu,\"iterations\":%llu,\"min_ns\":%.3f,\"median_ns\":%.3f,\"items_per_second\":%.0f",
+                           kern->name, kern->unit, batch, iterations, best, median, rate);
+                    if (counters.enabled) {
+                        for (int c = 0; c < COUNTER_COUNT; ++c) {
+                            if (counts[c] >= 0) {
+                                printf(",\"%s\":%.3f", counterNames[c], counts[c]);
+                            } else {
+                                printf(",\"%s\":null", counterNames[c]);
+                            }
+                        }
+                        if (ipc >= 0) {
+                            printf(",\"ipc\":%.3f", ipc);
+                        } else {
+                            printf(",\"ipc\":null");
+                        }
+                    }
+                    printf("}\n");
+                    break;
+            }
+        }
+    }
+    counters_close(&counters);
+    return 0;
+}
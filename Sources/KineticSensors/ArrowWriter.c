@@ -0,0 +1,572 @@
+//
+//  ArrowWriter.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#include "ArrowWriter.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define Continuation            0xFFFFFFFFu
+#define MetadataVersionV5       4
+#define DictionaryId            0
+#define ModeCount               8
+#define IovMax                  (2 + 2 * 3 * KINETIC_ARROW_COLUMNS)
+
+// Message.fbs: MessageHeader union
+#define HeaderSchema            1
+#define HeaderDictionaryBatch   2
+#define HeaderRecordBatch       3
+
+// Schema.fbs: Type union
+#define TypeInt                 2
+#define TypeFloatingPoint       3
+#define TypeUtf8                5
+#define TypeBool                6
+#define TypeTimestamp           10
+
+#define PrecisionSingle         1
+#define TimeUnitMicrosecond     2
+
+#define ColumnMode              5
+
+
+////////////////////////////////////
+// Flatbuffers (the subset the Arrow messages need)
+////////////////////////////////////
+
+// The buffer is built back to front, like the reference builder: an object is written before the objects referring
+// to it, and is referred to by its distance from the end of the buffer (fb_ref).
+
+typedef uint32_t fb_ref;
+
+typedef struct fb_builder
+{
+    uint8_t *buffer;
+    size_t capacity;
+    size_t size;
+    bool overflow;
+} fb_builder;
+
+#define TableFieldsMax          8
+
+typedef struct fb_field
+{
+    /*! Size of the scalar, 0 if the field is absent */
+    uint8_t size;
+    bool isOffset;
+    uint64_t value;
+} fb_field;
+
+typedef struct fb_table
+{
+    fb_field fields[TableFieldsMax];
+    uint8_t count;
+} fb_table;
+
+static void fb_push(fb_builder *builder, const void *data, size_t size)
+{
+    if (builder->size + size > builder->capacity) {
+        builder->overflow = true;
+        return;
+    }
+    builder->size += size;
+    memcpy(&builder->buffer[builder->capacity - builder->size], data, size);
+}
+
+static void fb_pad(fb_builder *builder, size_t size)
+{
+    static const uint8_t zeros[8] = { 0 };
+    fb_push(builder, zeros, size);
+}
+
+// Pads so that size is a multiple of alignment once extra more bytes are written
+static void fb_align(fb_builder *builder, size_t alignment, size_t extra)
+{
+    fb_pad(builder, (alignment - ((builder->size + extra) & (alignment - 1))) & (alignment - 1));
+}
+
+static void fb_scalar(fb_builder *builder, uint64_t value, size_t size)
+{
+    uint8_t bytes[8];
+    for (size_t i = 0; i < size; ++i) {
+        bytes[i] = (uint8_t)(value >> (8 * i));
+    }
+    fb_align(builder, size, 0);
+    fb_push(builder, bytes, size);
+}
+
+static void fb_offset(fb_builder *builder, fb_ref target)
+{
+    fb_align(builder, 4, 0);
+    fb_scalar(builder, builder->size + 4 - target, 4);
+}
+
+static fb_ref fb_string(fb_builder *builder, const char *string)
+{
+    size_t length = strlen(string);
+    fb_align(builder, 4, length + 1);
+    fb_pad(builder, 1);
+    fb_push(builder, string, length);
+    fb_scalar(builder, length, 4);
+    return (fb_ref)builder->size;
+}
+
+static fb_ref fb_offsets(fb_builder *builder, const fb_ref *targets, size_t count)
+{
+    fb_align(builder, 4, 4 * count);
+    for (size_t i = count; i-- > 0;) {
+        fb_offset(builder, targets[i]);
+    }
+    fb_scalar(builder, count, 4);
+    return (fb_ref)builder->size;
+}
+
+// Vector of structs of two longs (FieldNode, Buffer)
+static fb_ref fb_pairs(fb_builder *builder, const int64_t (*pairs)[2], size_t count)
+{
+    fb_align(builder, 8, 16 * count);
+    for (size_t i = count; i-- > 0;) {
+        fb_scalar(builder, (uint64_t)pairs[i][1], 8);
+        fb_scalar(builder, (uint64_t)pairs[i][0], 8);
+    }
+    fb_scalar(builder, count, 4);
+    return (fb_ref)builder->size;
+}
+
+static void fb_table_scalar(fb_table *table, uint8_t id, uint64_t value, uint8_t size)
+{
+    table->fields[id] = (fb_field){ size, false, value };
+    if (id >= table->count) {
+        table->count = id + 1;
+    }
+}
+
+static void fb_table_offset(fb_table *table, uint8_t id, fb_ref target)
+{
+    table->fields[id] = (fb_field){ 4, true, target };
+    if (id >= table->count) {
+        table->count = id + 1;
+    }
+}
+
+// Writes the fields (widest first, so there is little padding), then the table and its vtable just before it
+static fb_ref fb_table_end(fb_builder *builder, const fb_table *table)
+{
+    size_t start = builder->size;
+    size_t positions[TableFieldsMax] = { 0 };
+    for (uint8_t size = 8; size > 0; size /= 2) {
+        for (uint8_t id = 0; id < table->count; ++id) {
+            const fb_field *field = &table->fields[id];
+            if (field->size != size) {
+                continue;
+            }
+            if (field->isOffset) {
+                fb_offset(builder, (fb_ref)field->value);
+            } else {
+                fb_scalar(builder, field->value, size);
+            }
+            positions[id] = builder->size;
+        }
+    }
+    fb_align(builder, 4, 0);
+    fb_pad(builder, 4);
+    size_t object = builder->size;
+
+    for (uint8_t id = table->count; id-- > 0;) {
+        fb_scalar(builder, positions[id] ? object - positions[id] : 0, 2);
+    }
+    fb_scalar(builder, object - start, 2);
+    fb_scalar(builder, 4 + 2 * (size_t)table->count, 2);
+    if (!builder->overflow) {
+        uint32_t vtable = (uint32_t)(builder->size - object);
+        uint8_t *soffset = &builder->buffer[builder->capacity - object];
+        for (int i = 0; i < 4; ++i) {
+            soffset[i] = (uint8_t)(vtable >> (8 * i));
+        }
+    }
+    return (fb_ref)object;
+}
+
+static const uint8_t *fb_finish(fb_builder *builder, fb_ref root, size_t *size)
+{
+    fb_align(builder, 8, 4);
+    fb_offset(builder, root);
+    *size = builder->size;
+    return &builder->buffer[builder->capacity - builder->size];
+}
+
+
+////////////////////////////////////
+// Arrow messages
+////////////////////////////////////
+
+typedef struct column
+{
+    const char *name;
+    uint8_t type;
+    uint8_t bitWidth;
+    bool isSigned;
+} column;
+
+static const column columns[KINETIC_ARROW_COLUMNS] = {
+    { "timestamp",          TypeTimestamp,      64, true  },
+    { "power",              TypeInt,            16, false },
+    { "speedKPH",           TypeFloatingPoint,  32, true  },
+    { "cadenceRPM",         TypeFloatingPoint,  32, true  },
+    { "coasting",           TypeBool,           1,  false },
+    { "mode",               TypeInt,            8,  false },
+    { "targetResistance",   TypeInt,            16, false }
+};
+
+static const char *modeNames[ModeCount] = {
+    "erg", "fluid", "brake", "simulation",
+    "normal", "spindown_idle", "spindown_ready", "spindown_active"
+};
+
+static fb_ref int_type(fb_builder *builder, uint8_t bitWidth, bool isSigned)
+{
+    fb_table table = { 0 };
+    fb_table_scalar(&table, 0, bitWidth, 4);
+    fb_table_scalar(&table, 1, isSigned, 1);
+    return fb_table_end(builder, &table);
+}
+
+static fb_ref column_type(fb_builder *builder, const column *column, uint8_t *typeId)
+{
+    fb_table table = { 0 };
+    *typeId = column->type;
+    switch (column->type) {
+        case TypeInt:
+            return int_type(builder, column->bitWidth, column->isSigned);
+        case TypeFloatingPoint:
+            fb_table_scalar(&table, 0, PrecisionSingle, 2);
+            break;
+        case TypeTimestamp: {
+            fb_ref timezone = fb_string(builder, "UTC");
+            fb_table_scalar(&table, 0, TimeUnitMicrosecond, 2);
+            fb_table_offset(&table, 1, timezone);
+            break;
+        }
+        default:
+            break;
+    }
+    return fb_table_end(builder, &table);
+}
+
+static fb_ref schema_field(fb_builder *builder, const column *column, bool dictionary)
+{
+    fb_ref name = fb_string(builder, column->name);
+    fb_ref children = fb_offsets(builder, NULL, 0);
+    uint8_t typeId;
+    fb_ref type;
+    fb_ref encoding = 0;
+    if (dictionary) {
+        // the field has the type of the dictionary values, the column holds the indexes
+        fb_table utf8 = { 0 };
+        typeId = TypeUtf8;
+        type = fb_table_end(builder, &utf8);
+        fb_ref indexType = int_type(builder, 8, true);
+        fb_table table = { 0 };
+        fb_table_scalar(&table, 0, DictionaryId, 8);
+        fb_table_offset(&table, 1, indexType);
+        fb_table_scalar(&table, 2, false, 1);
+        encoding = fb_table_end(builder, &table);
+    } else {
+        type = column_type(builder, column, &typeId);
+    }
+
+    fb_table table = { 0 };
+    fb_table_offset(&table, 0, name);
+    fb_table_scalar(&table, 1, false, 1);
+    fb_table_scalar(&table, 2, typeId, 1);
+    fb_table_offset(&table, 3, type);
+    if (dictionary) {
+        fb_table_offset(&table, 4, encoding);
+    }
+    fb_table_offset(&table, 5, children);
+    return fb_table_end(builder, &table);
+}
+
+static fb_ref record_batch(fb_builder *builder, int64_t length, const int64_t (*nodes)[2], size_t nodeCount, const int64_t (*buffers)[2], size_t bufferCount)
+{
+    fb_ref nodeVector = fb_pairs(builder, nodes, nodeCount);
+    fb_ref bufferVector = fb_pairs(builder, buffers, bufferCount);
+    fb_table table = { 0 };
+    fb_table_scalar(&table, 0, (uint64_t)length, 8);
+    fb_table_offset(&table, 1, nodeVector);
+    fb_table_offset(&table, 2, bufferVector);
+    return fb_table_end(builder, &table);
+}
+
+static bool writev_all(int fd, struct iovec *iov, int count)
+{
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + written;
+            iov->iov_len -= (size_t)written;
+        }
+    }
+    return true;
+}
+
+// Writes the encapsulated message (continuation, metadata size, metadata) followed by its body.
+// body holds iovCount - 2 parts, iov[0] and iov[1] are filled here.
+static bool write_message(kinetic_arrow_writer *writer, fb_builder *builder, uint8_t headerType, fb_ref header, int64_t bodyLength,
+                          struct iovec *iov, int iovCount)
+{
+    fb_table table = { 0 };
+    fb_table_scalar(&table, 0, MetadataVersionV5, 2);
+    fb_table_scalar(&table, 1, headerType, 1);
+    fb_table_offset(&table, 2, header);
+    fb_table_scalar(&table, 3, (uint64_t)bodyLength, 8);
+    size_t size;
+    const uint8_t *metadata = fb_finish(builder, fb_table_end(builder, &table), &size);
+    if (builder->overflow || writer->failed) {
+        writer->failed = true;
+        return false;
+    }
+
+    uint8_t prefix[8];
+    for (int i = 0; i < 4; ++i) {
+        prefix[i] = (uint8_t)(Continuation >> (8 * i));
+        prefix[4 + i] = (uint8_t)(size >> (8 * i));
+    }
+    iov[0] = (struct iovec){ prefix, sizeof(prefix) };
+    iov[1] = (struct iovec){ (void *)metadata, size };
+    writer->failed = !writev_all(writer->fd, iov, iovCount);
+    return !writer->failed;
+}
+
+static fb_builder metadata_builder(kinetic_arrow_writer *writer)
+{
+    return (fb_builder){ writer->metadata, sizeof(writer->metadata), 0, false };
+}
+
+// Adds a body buffer (and its padding) to the iovecs and the buffer list, returns the next body offset
+static int64_t body_buffer(const void *data, size_t length, struct iovec *iov, int *iovCount, int64_t (*buffer)[2], int64_t offset)
+{
+    static const uint8_t zeros[8] = { 0 };
+    (*buffer)[0] = offset;
+    (*buffer)[1] = (int64_t)length;
+    if (length > 0) {
+        iov[(*iovCount)++] = (struct iovec){ (void *)data, length };
+    }
+    size_t padding = KINETIC_ARROW_PAD(length) - length;
+    if (padding > 0) {
+        iov[(*iovCount)++] = (struct iovec){ (void *)zeros, padding };
+    }
+    return offset + (int64_t)KINETIC_ARROW_PAD(length);
+}
+
+static bool write_schema(kinetic_arrow_writer *writer)
+{
+    fb_builder builder = metadata_builder(writer);
+    fb_ref fields[KINETIC_ARROW_COLUMNS];
+    for (int i = KINETIC_ARROW_COLUMNS; i-- > 0;) {
+        fields[i] = schema_field(&builder, &columns[i], writer->dictionary && i == ColumnMode);
+    }
+    fb_ref fieldVector = fb_offsets(&builder, fields, KINETIC_ARROW_COLUMNS);
+    fb_table table = { 0 };
+    fb_table_scalar(&table, 0, 0, 2);   // little endian
+    fb_table_offset(&table, 1, fieldVector);
+    fb_ref schema = fb_table_end(&builder, &table);
+    struct iovec iov[2];
+    return write_message(writer, &builder, HeaderSchema, schema, 0, iov, 2);
+}
+
+static bool write_dictionary(kinetic_arrow_writer *writer)
+{
+    int32_t offsets[ModeCount + 1];
+    char values[128];
+    offsets[0] = 0;
+    for (int i = 0; i < ModeCount; ++i) {
+        size_t length = strlen(modeNames[i]);
+        memcpy(&values[offsets[i]], modeNames[i], length);
+        offsets[i + 1] = offsets[i] + (int32_t)length;
+    }
+
+    struct iovec iov[2 + 4];
+    int iovCount = 2;
+    int64_t buffers[3][2];
+    int64_t bodyLength = body_buffer(NULL, 0, iov, &iovCount, &buffers[0], 0);
+    bodyLength = body_buffer(offsets, sizeof(offsets), iov, &iovCount, &buffers[1], bodyLength);
+    bodyLength = body_buffer(values, (size_t)offsets[ModeCount], iov, &iovCount, &buffers[2], bodyLength);
+    int64_t nodes[1][2] = { { ModeCount, 0 } };
+
+    fb_builder builder = metadata_builder(writer);
+    fb_ref data = record_batch(&builder, ModeCount, nodes, 1, buffers, 3);
+    fb_table table = { 0 };
+    fb_table_scalar(&table, 0, DictionaryId, 8);
+    fb_table_offset(&table, 1, data);
+    fb_table_scalar(&table, 2, false, 1);
+    fb_ref dictionary = fb_table_end(&builder, &table);
+    return write_message(writer, &builder, HeaderDictionaryBatch, dictionary, bodyLength, iov, iovCount);
+}
+
+bool kinetic_arrow_writer_flush(kinetic_arrow_writer *writer)
+{
+    if (writer->failed) {
+        return false;
+    }
+    uint32_t rows = writer->rows;
+    if (rows == 0) {
+        return true;
+    }
+    const void *data[KINETIC_ARROW_COLUMNS] = {
+        writer->timestamp, writer->power, writer->speedKPH, writer->cadenceRPM, writer->coasting, writer->mode, writer->targetResistance
+    };
+
+    // two buffers per column: validity (empty, there are no nulls) and values, straight from the columns
+    struct iovec iov[IovMax];
+    int iovCount = 2;
+    int64_t nodes[KINETIC_ARROW_COLUMNS][2];
+    int64_t buffers[2 * KINETIC_ARROW_COLUMNS][2];
+    int64_t bodyLength = 0;
+    for (int i = 0; i < KINETIC_ARROW_COLUMNS; ++i) {
+        size_t length = columns[i].bitWidth == 1 ? (rows + 7) / 8 : (size_t)rows * columns[i].bitWidth / 8;
+        nodes[i][0] = rows;
+        nodes[i][1] = 0;
+        bodyLength = body_buffer(NULL, 0, iov, &iovCount, &buffers[2 * i], bodyLength);
+        bodyLength = body_buffer(data[i], length, iov, &iovCount, &buffers[2 * i + 1], bodyLength);
+    }
+
+    fb_builder builder = metadata_builder(writer);
+    fb_ref batch = record_batch(&builder, rows, nodes, KINETIC_ARROW_COLUMNS, buffers, 2 * KINETIC_ARROW_COLUMNS);
+    writer->rows = 0;
+    writer->batches++;
+    return write_message(writer, &builder, HeaderRecordBatch, batch, bodyLength, iov, iovCount);
+}
+
+
+////////////////////////////////////
+// Writer
+////////////////////////////////////
+
+bool kinetic_arrow_writer_open_fd(kinetic_arrow_writer *writer, int fd, void *storage, uint32_t batchSize, bool dictionary)
+{
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = fd;
+    writer->dictionary = dictionary;
+    writer->batchSize = batchSize;
+    if (fd < 0 || batchSize == 0 || storage == NULL || ((uintptr_t)storage & 7) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        writer->fd = -1;
+        writer->failed = true;
+        return false;
+    }
+
+    uint8_t *column = storage;
+    writer->timestamp = (int64_t *)column;
+    column += KINETIC_ARROW_PAD(8 * (size_t)batchSize);
+    writer->speedKPH = (float *)column;
+    column += KINETIC_ARROW_PAD(4 * (size_t)batchSize);
+    writer->cadenceRPM = (float *)column;
+    column += KINETIC_ARROW_PAD(4 * (size_t)batchSize);
+    writer->power = (uint16_t *)column;
+    column += KINETIC_ARROW_PAD(2 * (size_t)batchSize);
+    writer->targetResistance = (uint16_t *)column;
+    column += KINETIC_ARROW_PAD(2 * (size_t)batchSize);
+    writer->coasting = column;
+    column += KINETIC_ARROW_PAD(((size_t)batchSize + 7) / 8);
+    writer->mode = column;
+
+    if (!write_schema(writer) || (dictionary && !write_dictionary(writer))) {
+        close(fd);
+        writer->fd = -1;
+        return false;
+    }
+    return true;
+}
+
+bool kinetic_arrow_writer_open(kinetic_arrow_writer *writer, const char *path, void *storage, uint32_t batchSize, bool dictionary)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    return kinetic_arrow_writer_open_fd(writer, fd, storage, batchSize, dictionary);
+}
+
+static bool add_row(kinetic_arrow_writer *writer, double timestamp, double power, double speedKPH, double cadenceRPM, bool coasting,
+                    kinetic_arrow_mode mode, uint16_t targetResistance)
+{
+    if (writer->failed) {
+        return false;
+    }
+    uint32_t row = writer->rows++;
+    writer->timestamp[row] = llround(timestamp * 1e6);
+    writer->power[row] = (uint16_t)(power > 0 ? (power < UINT16_MAX ? lround(power) : UINT16_MAX) : 0);
+    writer->speedKPH[row] = (float)speedKPH;
+    writer->cadenceRPM[row] = (float)cadenceRPM;
+    if ((row & 7) == 0) {
+        writer->coasting[row >> 3] = 0;
+    }
+    writer->coasting[row >> 3] |= (uint8_t)(coasting << (row & 7));
+    writer->mode[row] = (uint8_t)mode;
+    writer->targetResistance[row] = targetResistance;
+    if (writer->rows == writer->batchSize) {
+        return kinetic_arrow_writer_flush(writer);
+    }
+    return true;
+}
+
+static inline kinetic_arrow_mode inride_mode(uint8_t state)
+{
+    return (kinetic_arrow_mode)(KINETIC_ARROW_MODE_INRIDE_NORMAL + ((state >> 4) & 0x03));
+}
+
+bool inride_arrow_writer_add(kinetic_arrow_writer *writer, double timestamp, const inride_power_data *data)
+{
+    return add_row(writer, timestamp, data->power, data->speedKPH, data->cadenceRPM, data->coasting, inride_mode(data->state), 0);
+}
+
+bool smart_control_arrow_writer_add(kinetic_arrow_writer *writer, double timestamp, const smart_control_power_data *data)
+{
+    return add_row(writer, timestamp, data->power, data->speedKPH, data->cadenceRPM, false, (kinetic_arrow_mode)(data->mode & 0x03), data->targetResistance);
+}
+
+bool kinetic_arrow_writer_add_record(kinetic_arrow_writer *writer, double timestamp, const kinetic_sample_record *record)
+{
+    if (record->flags & KINETIC_SAMPLE_FLAG_SMART_CONTROL) {
+        return add_row(writer, timestamp, record->power, record->speed / 1000.0, record->cadence / 10.0, false,
+                       (kinetic_arrow_mode)(record->status & 0x03), record->resistance);
+    }
+    return add_row(writer, timestamp, record->power, record->speed / 1000.0, record->cadence / 10.0,
+                   (record->flags & KINETIC_SAMPLE_FLAG_COASTING) != 0, inride_mode(record->status), 0);
+}
+
+bool kinetic_arrow_writer_close(kinetic_arrow_writer *writer)
+{
+    if (writer->fd < 0) {
+        return false;
+    }
+    if (kinetic_arrow_writer_flush(writer)) {
+        // end of stream: continuation and a 0 metadata size
+        uint8_t end[8] = { 0xFF, 0xFF, 0xFF, 0xFF, 0, 0, 0, 0 };
+        struct iovec iov = { end, sizeof(end) };
+        writer->failed = !writev_all(writer->fd, &iov, 1);
+    }
+    if (close(writer->fd) != 0) {
+        writer->failed = true;
+    }
+    writer->fd = -1;
+    return !writer->failed;
+}
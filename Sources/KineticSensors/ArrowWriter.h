@@ -0,0 +1,118 @@
+//
+//  ArrowWriter.h
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#ifndef ArrowWriter_h
+#define ArrowWriter_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "inRide.h"
+#include "SmartControl.h"
+#include "SampleRecord.h"
+
+// Arrow IPC stream writer for decoded samples (read it with pyarrow.ipc.open_stream, arrow::ipc::RecordBatchStreamReader ...).
+// - Samples are laid out in column buffers (caller storage, batchSize rows). When the columns are full they are written
+//   as a record batch straight from those buffers (writev): the rows are never copied again.
+// - Columns: timestamp (timestamp[us, UTC]), power (uint16), speedKPH (float), cadenceRPM (float), coasting (bool),
+//   mode (kinetic_arrow_mode, uint8 or dictionary<int8, utf8>), targetResistance (uint16). No nulls.
+// - With dictionary encoding the mode names are sent once, in a dictionary batch after the schema.
+// - The message headers (flatbuffers) are encoded by hand into a small buffer of the writer: no dependency.
+
+#define KINETIC_ARROW_COLUMNS           7
+#define KINETIC_ARROW_METADATA_MAX      2048
+
+#define KINETIC_ARROW_PAD(size)         (((size_t)(size) + 7) & ~(size_t)7)
+
+/*! Bytes of column storage for a batch size (8 byte aligned storage) */
+#define KINETIC_ARROW_STORAGE_SIZE(batchSize) \
+    (KINETIC_ARROW_PAD(8 * (size_t)(batchSize)) + 2 * KINETIC_ARROW_PAD(2 * (size_t)(batchSize)) + \
+     2 * KINETIC_ARROW_PAD(4 * (size_t)(batchSize)) + KINETIC_ARROW_PAD(((size_t)(batchSize) + 7) / 8) + KINETIC_ARROW_PAD(batchSize))
+
+
+/*! Values of the mode column: the Smart Control mode, or the inRide state */
+typedef enum kinetic_arrow_mode
+{
+    KINETIC_ARROW_MODE_ERG                      = 0,
+    KINETIC_ARROW_MODE_FLUID                    = 1,
+    KINETIC_ARROW_MODE_BRAKE                    = 2,
+    KINETIC_ARROW_MODE_SIMULATION               = 3,
+    KINETIC_ARROW_MODE_INRIDE_NORMAL            = 4,
+    KINETIC_ARROW_MODE_INRIDE_SPINDOWN_IDLE     = 5,
+    KINETIC_ARROW_MODE_INRIDE_SPINDOWN_READY    = 6,
+    KINETIC_ARROW_MODE_INRIDE_SPINDOWN_ACTIVE   = 7
+} kinetic_arrow_mode;
+
+/*! Writer State */
+typedef struct kinetic_arrow_writer
+{
+    int fd;
+    bool failed;
+    bool dictionary;
+    uint32_t batchSize;
+    uint32_t rows;
+    uint64_t batches;
+
+    /*! Columns (in the caller storage) */
+    int64_t *timestamp;
+    uint16_t *power;
+    float *speedKPH;
+    float *cadenceRPM;
+    uint8_t *coasting;
+    uint8_t *mode;
+    uint16_t *targetResistance;
+
+    /*! Message header being encoded */
+    uint8_t metadata[KINETIC_ARROW_METADATA_MAX];
+} kinetic_arrow_writer;
+
+
+/*!
+ Creates an Arrow IPC stream file and writes the schema (and the mode dictionary).
+
+ @param writer Writer
+ @param path File path (replaced if it exists)
+ @param storage Column storage: KINETIC_ARROW_STORAGE_SIZE(batchSize) bytes, 8 byte aligned
+ @param batchSize Rows per record batch
+ @param dictionary Dictionary encode the mode column
+
+ @return false if the file cannot be created or written
+ */
+bool kinetic_arrow_writer_open(kinetic_arrow_writer *writer, const char *path, void *storage, uint32_t batchSize, bool dictionary);
+
+/*!
+ Same as kinetic_arrow_writer_open on a file descriptor open for writing (file, pipe, socket). The writer closes it.
+ */
+bool kinetic_arrow_writer_open_fd(kinetic_arrow_writer *writer, int fd, void *storage, uint32_t batchSize, bool dictionary);
+
+/*!
+ Adds a sample (a record batch is written when batchSize rows are buffered).
+
+ @param writer Writer
+ @param timestamp Unix time (seconds)
+ @param data Decoded power data
+
+ @return false if writing failed (the writer stays failed)
+ */
+bool inride_arrow_writer_add(kinetic_arrow_writer *writer, double timestamp, const inride_power_data *data);
+bool smart_control_arrow_writer_add(kinetic_arrow_writer *writer, double timestamp, const smart_control_power_data *data);
+bool kinetic_arrow_writer_add_record(kinetic_arrow_writer *writer, double timestamp, const kinetic_sample_record *record);
+
+/*!
+ Writes the buffered rows as a (short) record batch.
+ */
+bool kinetic_arrow_writer_flush(kinetic_arrow_writer *writer);
+
+/*!
+ Writes the buffered rows and the end of stream marker, and closes the file.
+
+ @return false if anything failed to write
+ */
+bool kinetic_arrow_writer_close(kinetic_arrow_writer *writer);
+
+
+#endif /* ArrowWriter_h */
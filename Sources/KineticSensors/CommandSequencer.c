@@ -0,0 +1,177 @@
+//
+//  CommandSequencer.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#include "CommandSequencer.h"
+
+#include <string.h>
+
+#define ConfigCommand           0x01
+#define ConfigCommandSize       15
+#define ConfigRateOffset        11
+
+
+void inride_sequencer_init(inride_sequencer *sequencer, uint8_t systemId[6], inride_update_rate defaultRate, inride_sequencer_handler handler, void *context)
+{
+    memset(sequencer, 0, sizeof(*sequencer));
+    memcpy(sequencer->systemId, systemId, 6);
+    sequencer->defaultRate = defaultRate;
+    sequencer->currentRate = defaultRate;
+    sequencer->boostThreshold = 3;
+    sequencer->maxAttempts = 3;
+    sequencer->timeoutMargin = 0.5;
+    sequencer->handler = handler;
+    sequencer->context = context;
+}
+
+static bool is_config_command(const uint8_t *data, size_t size)
+{
+    return size >= ConfigCommandSize && data[2] == ConfigCommand;
+}
+
+static uint16_t config_rate(const uint8_t *data)
+{
+    return (uint16_t)data[ConfigRateOffset] | ((uint16_t)data[ConfigRateOffset + 1] << 8);
+}
+
+bool inride_sequencer_enqueue(inride_sequencer *sequencer, const void *data, size_t size, uint32_t tag)
+{
+    if (sequencer->count >= INRIDE_SEQUENCER_QUEUE_MAX || size < 3 || size > INRIDE_SEQUENCER_COMMAND_MAX) {
+        return false;
+    }
+    inride_sequencer_command *command = &sequencer->queue[(sequencer->head + sequencer->count) % INRIDE_SEQUENCER_QUEUE_MAX];
+    memcpy(command->data, data, size);
+    command->size = (uint8_t)size;
+    command->tag = tag;
+    sequencer->count++;
+    if (is_config_command(command->data, size)) {
+        sequencer->defaultRate = (inride_update_rate)config_rate(command->data);
+    }
+    return true;
+}
+
+static size_t config_command(inride_sequencer *sequencer, inride_update_rate rate, uint8_t data[INRIDE_SEQUENCER_COMMAND_MAX])
+{
+    inride_config_sensor_command command = inride_create_config_sensor_command_data(rate, sequencer->systemId);
+    memcpy(data, &command, sizeof(command));
+    return sizeof(command);
+}
+
+// Bytes of the command in flight
+static size_t command_data(inride_sequencer *sequencer, uint8_t data[INRIDE_SEQUENCER_COMMAND_MAX])
+{
+    switch (sequencer->phase) {
+        case INRIDE_SEQUENCER_BOOST:
+            return config_command(sequencer, INRIDE_UPDATE_RATE_250, data);
+        case INRIDE_SEQUENCER_RESTORE:
+            return config_command(sequencer, sequencer->defaultRate, data);
+        case INRIDE_SEQUENCER_COMMAND: {
+            const inride_sequencer_command *command = &sequencer->queue[sequencer->head];
+            memcpy(data, command->data, command->size);
+            if (sequencer->boosted && is_config_command(data, command->size)) {
+                // stay fast until the batch is done, the restore applies the new default rate
+                data[ConfigRateOffset] = (uint8_t)INRIDE_UPDATE_RATE_250;
+                data[ConfigRateOffset + 1] = 0;
+            }
+            return command->size;
+        }
+        case INRIDE_SEQUENCER_IDLE:
+        default:
+            return 0;
+    }
+}
+
+static double timeout(const inride_sequencer *sequencer)
+{
+    // the result comes with the next update, which may be up to one interval after the one already on its way
+    return 2.0 * sequencer->currentRate / 32.0 + sequencer->timeoutMargin;
+}
+
+// Completes the command in flight (result NONE: gave up)
+static void complete(inride_sequencer *sequencer, inride_command_result result)
+{
+    bool success = result == INRIDE_COM_RESULT_SUCCESS;
+    switch (sequencer->phase) {
+        case INRIDE_SEQUENCER_BOOST:
+            sequencer->boosted = success;
+            sequencer->boostSkipped = !success;
+            if (success) {
+                sequencer->currentRate = INRIDE_UPDATE_RATE_250;
+            }
+            break;
+        case INRIDE_SEQUENCER_RESTORE:
+            // on failure the sensor may stay fast, which is harmless: give up rather than retry forever
+            sequencer->boosted = false;
+            sequencer->boostSkipped = false;
+            if (success) {
+                sequencer->currentRate = sequencer->defaultRate;
+            }
+            break;
+        case INRIDE_SEQUENCER_COMMAND: {
+            inride_sequencer_command *command = &sequencer->queue[sequencer->head];
+            if (success && !sequencer->boosted && is_config_command(command->data, command->size)) {
+                sequencer->currentRate = config_rate(command->data);
+            }
+            uint32_t tag = command->tag;
+            sequencer->head = (sequencer->head + 1) % INRIDE_SEQUENCER_QUEUE_MAX;
+            sequencer->count--;
+            if (sequencer->count == 0 && !sequencer->boosted) {
+                sequencer->boostSkipped = false;
+            }
+            if (sequencer->handler != NULL) {
+                sequencer->handler(sequencer->context, tag, result, sequencer->attempts);
+            }
+            break;
+        }
+        case INRIDE_SEQUENCER_IDLE:
+        default:
+            break;
+    }
+    sequencer->inFlight = false;
+    sequencer->phase = INRIDE_SEQUENCER_IDLE;
+}
+
+size_t inride_sequencer_poll(inride_sequencer *sequencer, double now, uint8_t data[INRIDE_SEQUENCER_COMMAND_MAX])
+{
+    if (sequencer->inFlight) {
+        if (now - sequencer->sentTime < timeout(sequencer)) {
+            return 0;
+        }
+        if (sequencer->attempts < sequencer->maxAttempts) {
+            sequencer->attempts++;
+            sequencer->sentTime = now;
+            return command_data(sequencer, data);
+        }
+        complete(sequencer, INRIDE_COM_RESULT_NONE);
+    }
+
+    if (sequencer->count > 0) {
+        bool boost = !sequencer->boosted && !sequencer->boostSkipped && sequencer->boostThreshold > 0 &&
+                     sequencer->count >= sequencer->boostThreshold && sequencer->currentRate > INRIDE_UPDATE_RATE_250;
+        sequencer->phase = boost ? INRIDE_SEQUENCER_BOOST : INRIDE_SEQUENCER_COMMAND;
+    } else if (sequencer->boosted) {
+        sequencer->phase = INRIDE_SEQUENCER_RESTORE;
+    } else {
+        return 0;
+    }
+    sequencer->inFlight = true;
+    sequencer->attempts = 1;
+    sequencer->sentTime = now;
+    return command_data(sequencer, data);
+}
+
+bool inride_sequencer_power_update(inride_sequencer *sequencer, inride_command_result result)
+{
+    if (!sequencer->inFlight || result == INRIDE_COM_RESULT_NONE || result == INRIDE_COM_RESULT_CALIBRATION_RESULT) {
+        return false;
+    }
+    complete(sequencer, result);
+    return true;
+}
+
+bool inride_sequencer_busy(const inride_sequencer *sequencer)
+{
+    return sequencer->inFlight || sequencer->count > 0 || sequencer->boosted;
+}
@@ -0,0 +1,135 @@
+//
+//  CommandSequencer.h
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#ifndef CommandSequencer_h
+#define CommandSequencer_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "inRide.h"
+
+// Sends inRide Control Point commands one at a time and matches each to the commandResult of a later power update.
+// - The sensor reports a command result once, in the next power update: a second command before that update loses the
+//   first result. The sequencer keeps one command in flight, so every result is observed.
+// - When a batch is queued (boostThreshold commands or more) the sensor is first switched to the fast update rate with a
+//   config command, so the results come back every 250 ms instead of every second. The default rate is restored once
+//   the queue is empty.
+// - A command without result within its timeout (lost write or lost update) is sent again, up to maxAttempts times.
+// - To change the default rate, queue a config command (inride_create_config_sensor_command_data): the sequencer
+//   adopts its rate as the one to restore and keeps the fast rate until the batch is done.
+// - INRIDE_COM_RESULT_CALIBRATION_RESULT is reported by the sensor on its own (end of a spindown) and is not a result.
+//
+// The sequencer does not talk to the device: write what inride_sequencer_poll returns to the Control Point
+// (INRIDE_SERVICE_CONTROL_UUID), and hand it the commandResult of every power update. Keep one per sensor.
+
+#define INRIDE_SEQUENCER_QUEUE_MAX      16
+#define INRIDE_SEQUENCER_COMMAND_MAX    20
+
+
+/*! Receives the outcome of a queued command (result is INRIDE_COM_RESULT_NONE if it timed out on every attempt) */
+typedef void (*inride_sequencer_handler)(void *context, uint32_t tag, inride_command_result result, uint8_t attempts);
+
+/*! Queued Command */
+typedef struct inride_sequencer_command
+{
+    uint8_t data[INRIDE_SEQUENCER_COMMAND_MAX];
+    uint8_t size;
+    uint32_t tag;
+} inride_sequencer_command;
+
+/*! What the command in flight is */
+typedef enum inride_sequencer_phase
+{
+    INRIDE_SEQUENCER_IDLE           = 0,
+    INRIDE_SEQUENCER_BOOST          = 1,    // switching to the fast rate
+    INRIDE_SEQUENCER_COMMAND        = 2,    // a queued command
+    INRIDE_SEQUENCER_RESTORE        = 3     // switching back to the default rate
+} inride_sequencer_phase;
+
+/*! Sequencer State */
+typedef struct inride_sequencer
+{
+    uint8_t systemId[6];
+    /*! Rate the sensor runs at outside of a batch */
+    inride_update_rate defaultRate;
+    /*! Rate the sensor runs at now (as far as the sequencer knows) */
+    uint16_t currentRate;
+    /*! Queued commands that start a batch at the fast rate (0 never switches) */
+    uint8_t boostThreshold;
+    uint8_t maxAttempts;
+    /*! Seconds a result may take beyond two update intervals (BLE latency) */
+    double timeoutMargin;
+
+    inride_sequencer_command queue[INRIDE_SEQUENCER_QUEUE_MAX];
+    uint8_t head;
+    uint8_t count;
+
+    inride_sequencer_phase phase;
+    bool inFlight;
+    bool boosted;
+    /*! The sensor did not switch to the fast rate, the batch runs at the default rate */
+    bool boostSkipped;
+    uint8_t attempts;
+    double sentTime;
+
+    inride_sequencer_handler handler;
+    void *context;
+} inride_sequencer;
+
+
+/*!
+ Initializes a sequencer (boost from 3 queued commands, 3 attempts, 0.5 s timeout margin).
+
+ @param sequencer Sequencer
+ @param systemId System Id of the sensor (for the config commands the sequencer sends)
+ @param defaultRate Update rate the sensor is configured with
+ @param handler Receives the outcome of each queued command (may be NULL)
+ @param context Passed to the handler
+ */
+void inride_sequencer_init(inride_sequencer *sequencer, uint8_t systemId[6], inride_update_rate defaultRate, inride_sequencer_handler handler, void *context);
+
+/*!
+ Queues a command.
+
+ @param sequencer Sequencer
+ @param data Command bytes (an inride_create_* struct)
+ @param size Size of the command
+ @param tag Passed to the handler with the outcome
+
+ @return false if the queue is full or the command is too large
+ */
+bool inride_sequencer_enqueue(inride_sequencer *sequencer, const void *data, size_t size, uint32_t tag);
+
+/*!
+ The next bytes to write to the Control Point, if any. Call it after every power update and on a timer (timeouts).
+
+ @param sequencer Sequencer
+ @param now Current time (seconds, any monotonic clock)
+ @param data Output (INRIDE_SEQUENCER_COMMAND_MAX bytes)
+
+ @return Size of the command to write, 0 if there is nothing to write now
+ */
+size_t inride_sequencer_poll(inride_sequencer *sequencer, double now, uint8_t data[INRIDE_SEQUENCER_COMMAND_MAX]);
+
+/*!
+ Hands the sequencer the command result of a power update.
+
+ @param sequencer Sequencer
+ @param result commandResult of the decoded power update
+
+ @return true if the result completed the command in flight
+ */
+bool inride_sequencer_power_update(inride_sequencer *sequencer, inride_command_result result);
+
+/*!
+ Whether commands are queued or in flight (including the restore of the default rate).
+ */
+bool inride_sequencer_busy(const inride_sequencer *sequencer);
+
+
+#endif /* CommandSequencer_h */
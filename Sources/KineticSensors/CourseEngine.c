@@ -0,0 +1,146 @@
+//
+//  CourseEngine.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#include "CourseEngine.h"
+
+#include <math.h>
+#include <string.h>
+
+#define GradeMax                45.0f   // range of the simulation command
+
+
+bool kinetic_course_load(kinetic_course *course, kinetic_course_segment *segments, const double *distances, const double *elevations, uint32_t count)
+{
+    if (count < 2) {
+        return false;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (i > 0 && !(distances[i] > distances[i - 1])) {
+            return false;
+        }
+        segments[i].distance = distances[i] - distances[0];
+        segments[i].elevation = (float)elevations[i];
+        segments[i].grade = 0;
+        if (i > 0) {
+            segments[i - 1].grade = (float)((elevations[i] - elevations[i - 1]) / (distances[i] - distances[i - 1]) * 100.0);
+        }
+    }
+    course->segments = segments;
+    course->count = count;
+    course->length = segments[count - 1].distance;
+    return true;
+}
+
+// Steps a cursor forward to the segment containing distance
+static inline uint32_t seek(const kinetic_course *course, uint32_t cursor, double distance)
+{
+    while (cursor + 2 < course->count && course->segments[cursor + 1].distance <= distance) {
+        cursor++;
+    }
+    return cursor;
+}
+
+static inline double elevation_at(const kinetic_course *course, uint32_t cursor, double distance)
+{
+    const kinetic_course_segment *segment = &course->segments[cursor];
+    return segment->elevation + (distance - segment->distance) * segment->grade * 0.01;
+}
+
+double kinetic_course_elevation(const kinetic_course *course, double distance)
+{
+    if (distance <= 0) {
+        return course->segments[0].elevation;
+    }
+    if (distance >= course->length) {
+        return course->segments[course->count - 1].elevation;
+    }
+    // binary search, riders use their cursor instead
+    uint32_t low = 0;
+    uint32_t high = course->count - 1;
+    while (high - low > 1) {
+        uint32_t middle = low + (high - low) / 2;
+        if (course->segments[middle].distance <= distance) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return elevation_at(course, low, distance);
+}
+
+void kinetic_course_rider_init(kinetic_course_rider *rider, const kinetic_course *course, float weightKG, double lookAhead, float threshold)
+{
+    memset(rider, 0, sizeof(*rider));
+    rider->course = course;
+    rider->lookAhead = lookAhead > 0 ? lookAhead : 0;
+    rider->threshold = threshold;
+    rider->weightKG = weightKG;
+    rider->rollingCoeff = 0.004f;
+    rider->windCoeff = 0.6f;
+    rider->windSpeedMPS = 0;
+    rider->aheadCursor = seek(course, 0, rider->lookAhead);
+}
+
+bool kinetic_course_rider_advance(kinetic_course_rider *rider, double meters)
+{
+    const kinetic_course *course = rider->course;
+    if (meters > 0 && !rider->finished) {
+        rider->distance += meters;
+        if (rider->distance >= course->length) {
+            rider->distance = course->length;
+            rider->finished = true;
+        }
+        rider->cursor = seek(course, rider->cursor, rider->distance);
+        rider->aheadCursor = seek(course, rider->aheadCursor, rider->distance + rider->lookAhead);
+    }
+    return !rider->finished;
+}
+
+float kinetic_course_rider_grade(const kinetic_course_rider *rider)
+{
+    const kinetic_course *course = rider->course;
+    double ahead = rider->distance + rider->lookAhead;
+    if (ahead > course->length) {
+        ahead = course->length;
+    }
+    double span = ahead - rider->distance;
+    if (span < 1.0) {
+        // at the end of the course (or no look ahead): the grade under the wheel
+        return course->segments[rider->cursor].grade;
+    }
+    double rise = elevation_at(course, rider->aheadCursor, ahead) - elevation_at(course, rider->cursor, rider->distance);
+    return (float)(rise / span * 100.0);
+}
+
+bool kinetic_course_rider_command(kinetic_course_rider *rider, smart_control_set_mode_simulation_data *command)
+{
+    float grade = kinetic_course_rider_grade(rider);
+    if (grade > GradeMax) {
+        grade = GradeMax;
+    } else if (grade < -GradeMax) {
+        grade = -GradeMax;
+    }
+    if (rider->sent && fabsf(grade - rider->sentGrade) < rider->threshold) {
+        return false;
+    }
+    rider->sentGrade = grade;
+    rider->sent = true;
+    *command = smart_control_set_mode_simulation_command(rider->weightKG, rider->rollingCoeff, rider->windCoeff, grade, rider->windSpeedMPS);
+    return true;
+}
+
+bool inride_course_advance(kinetic_course_rider *rider, const inride_raw_power_data *raw)
+{
+    return kinetic_course_rider_advance(rider, raw->revs * KINETIC_COURSE_ROLLER_METERS);
+}
+
+bool smart_control_course_update(kinetic_course_rider *rider, double elapsed, const smart_control_power_data *data, smart_control_set_mode_simulation_data *command)
+{
+    if (elapsed > 0) {
+        kinetic_course_rider_advance(rider, data->speedKPH / 3.6 * elapsed);
+    }
+    return kinetic_course_rider_command(rider, command);
+}
@@ -0,0 +1,154 @@
+//
+//  CourseEngine.h
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#ifndef CourseEngine_h
+#define CourseEngine_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "inRide.h"
+#include "SmartControl.h"
+
+// Rides an elevation profile: tracks the distance of each rider and produces the Smart Control simulation commands.
+// - A course is loaded once into a segment array (start distance, start elevation, grade) and is read only afterwards:
+//   any number of riders (threads) can share it.
+// - A rider is a small struct with a cursor into the segments. Riders only move forward, so finding the segment is
+//   O(1) amortized (the cursor steps over the segments passed since the last update).
+// - Distance comes from the decoded speed (speed x elapsed time), or for an inRide from the roller revolutions, which
+//   is exact (no speed rounding or timing jitter).
+// - The grade sent to the trainer is the average grade of the road ahead (elevation difference over lookAhead meters),
+//   which smooths noisy profiles and lets the resistance ramp in before the hill. A command is only produced when that
+//   grade moved by threshold (percent) or more since the last one sent.
+// - Storage is passed in by the caller, nothing is allocated.
+
+#define KINETIC_COURSE_ROLLER_METERS    (20012.256849 / 3.6 / 32768.0)  // roller circumference (see inride_speed_for_ticks)
+
+
+/*! Segment of a course (from its start to the next segment's start) */
+typedef struct kinetic_course_segment
+{
+    /*! Distance from the start of the course (meters) */
+    double distance;
+    /*! Elevation at the start of the segment (meters) */
+    float elevation;
+    /*! Grade of the segment (percent) */
+    float grade;
+} kinetic_course_segment;
+
+/*! Course (shared by the riders) */
+typedef struct kinetic_course
+{
+    const kinetic_course_segment *segments;
+    /*! Number of segments (the last one only marks the end of the course) */
+    uint32_t count;
+    double length;
+} kinetic_course;
+
+/*! Rider on a course */
+typedef struct kinetic_course_rider
+{
+    const kinetic_course *course;
+    /*! Distance from the start (meters) */
+    double distance;
+    /*! Segment at the rider and at the end of the look ahead */
+    uint32_t cursor;
+    uint32_t aheadCursor;
+    double lookAhead;
+    float threshold;
+
+    /*! Simulation parameters (see smart_control_set_mode_simulation_command) */
+    float weightKG;
+    float rollingCoeff;
+    float windCoeff;
+    float windSpeedMPS;
+
+    /*! Grade of the last command produced */
+    float sentGrade;
+    bool sent;
+    bool finished;
+} kinetic_course_rider;
+
+
+/*!
+ Loads an elevation profile.
+
+ @param course Course
+ @param segments Segment storage (count)
+ @param distances Distance of each point from the start (meters, increasing)
+ @param elevations Elevation of each point (meters)
+ @param count Number of points (2 or more)
+
+ @return false if the profile is invalid (too short, distances not increasing)
+ */
+bool kinetic_course_load(kinetic_course *course, kinetic_course_segment *segments, const double *distances, const double *elevations, uint32_t count);
+
+/*!
+ Elevation (meters) at a distance (clamped to the course).
+ */
+double kinetic_course_elevation(const kinetic_course *course, double distance);
+
+/*!
+ Puts a rider at the start of a course.
+
+ @param rider Rider
+ @param course Course (must outlive the rider)
+ @param weightKG Weight of rider and bike
+ @param lookAhead Meters of road the grade is averaged over (0 uses the grade at the rider)
+ @param threshold Smallest grade change (percent) that produces a new command, e.g. 0.25
+ */
+void kinetic_course_rider_init(kinetic_course_rider *rider, const kinetic_course *course, float weightKG, double lookAhead, float threshold);
+
+/*!
+ Moves a rider forward.
+
+ @param rider Rider
+ @param meters Distance ridden since the last call
+
+ @return false once the rider reached the end of the course
+ */
+bool kinetic_course_rider_advance(kinetic_course_rider *rider, double meters);
+
+/*!
+ Grade (percent) the rider should feel now (average of the road ahead).
+ */
+float kinetic_course_rider_grade(const kinetic_course_rider *rider);
+
+/*!
+ The simulation command for the rider's position, if the grade changed enough to send one.
+
+ @param rider Rider
+ @param command Output
+
+ @return true if command was set and should be written to the Control Point
+ */
+bool kinetic_course_rider_command(kinetic_course_rider *rider, smart_control_set_mode_simulation_data *command);
+
+/*!
+ Moves a rider by the distance of an inRide update (roller revolutions).
+
+ @param rider Rider
+ @param raw Raw counters of the update (inride_decode_power_data)
+
+ @return false once the rider reached the end of the course
+ */
+bool inride_course_advance(kinetic_course_rider *rider, const inride_raw_power_data *raw);
+
+/*!
+ Moves a rider by the distance of a Smart Control update and produces its simulation command.
+
+ @param rider Rider
+ @param elapsed Seconds since the previous update
+ @param data Decoded update
+ @param command Output
+
+ @return true if command was set and should be written to the Control Point
+ */
+bool smart_control_course_update(kinetic_course_rider *rider, double elapsed, const smart_control_power_data *data, smart_control_set_mode_simulation_data *command);
+
+
+#endif /* CourseEngine_h */
@@ -0,0 +1,133 @@
+//
+//  DeviceRegistry.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#include "DeviceRegistry.h"
+#include "inRide.h"
+
+#include <string.h>
+
+// Fibonacci hashing: the high bits of key x 2^64 / phi spread consecutive System Ids over the table
+#define HashMultiplier          0x9E3779B97F4A7C15ull
+
+
+static inline uint32_t slot_for_key(const kinetic_registry *registry, uint64_t key)
+{
+    return (uint32_t)((key * HashMultiplier) >> registry->shift);
+}
+
+uint64_t kinetic_system_id_key(const uint8_t systemId[KINETIC_SYSTEM_ID_SIZE])
+{
+    uint64_t key = 0;
+    for (int i = 0; i < KINETIC_SYSTEM_ID_SIZE; ++i) {
+        key = (key << 8) | systemId[i];
+    }
+    return key;
+}
+
+void kinetic_system_id_string(uint64_t key, char string[KINETIC_SYSTEM_ID_STRING_SIZE])
+{
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 2 * KINETIC_SYSTEM_ID_SIZE - 1; i >= 0; --i) {
+        string[i] = digits[key & 0xF];
+        key >>= 4;
+    }
+    string[2 * KINETIC_SYSTEM_ID_SIZE] = '\0';
+}
+
+bool kinetic_registry_init(kinetic_registry *registry, kinetic_registry_entry *entries, uint32_t capacity)
+{
+    if (capacity < 4 || (capacity & (capacity - 1)) != 0) {
+        return false;
+    }
+    uint8_t bits = 0;
+    while ((1u << bits) < capacity) {
+        bits++;
+    }
+    registry->entries = entries;
+    registry->capacity = capacity;
+    registry->limit = capacity - capacity / 4;
+    registry->shift = (uint8_t)(64 - bits);
+    kinetic_registry_clear(registry);
+    return true;
+}
+
+void kinetic_registry_clear(kinetic_registry *registry)
+{
+    for (uint32_t i = 0; i < registry->capacity; ++i) {
+        registry->entries[i].key = KINETIC_REGISTRY_EMPTY;
+    }
+    registry->count = 0;
+}
+
+kinetic_registry_entry *kinetic_registry_find_key(const kinetic_registry *registry, uint64_t key)
+{
+    uint32_t mask = registry->capacity - 1;
+    for (uint32_t slot = slot_for_key(registry, key); ; slot = (slot + 1) & mask) {
+        kinetic_registry_entry *entry = &registry->entries[slot];
+        if (entry->key == key) {
+            return entry;
+        }
+        if (entry->key == KINETIC_REGISTRY_EMPTY) {
+            return NULL;
+        }
+    }
+}
+
+kinetic_registry_entry *kinetic_registry_find(const kinetic_registry *registry, const uint8_t systemId[KINETIC_SYSTEM_ID_SIZE])
+{
+    return kinetic_registry_find_key(registry, kinetic_system_id_key(systemId));
+}
+
+static void set_type(kinetic_registry_entry *entry, kinetic_capture_device type)
+{
+    entry->type = type;
+    switch (type) {
+        case KINETIC_CAPTURE_DEVICE_INRIDE:
+        case KINETIC_CAPTURE_DEVICE_SMART_CONTROL:
+            entry->powerFrameSize = 20;
+            entry->configFrameSize = 20;
+            break;
+        default:
+            entry->powerFrameSize = 0;
+            entry->configFrameSize = 0;
+            break;
+    }
+}
+
+kinetic_registry_entry *kinetic_registry_intern(kinetic_registry *registry, const uint8_t *systemId, size_t size, kinetic_capture_device type)
+{
+    if (systemId == NULL || size != KINETIC_SYSTEM_ID_SIZE) {
+        return NULL;
+    }
+    uint64_t key = kinetic_system_id_key(systemId);
+    uint32_t mask = registry->capacity - 1;
+    uint32_t slot = slot_for_key(registry, key);
+    kinetic_registry_entry *entry;
+    for (;; slot = (slot + 1) & mask) {
+        entry = &registry->entries[slot];
+        if (entry->key == key) {
+            if (entry->type == KINETIC_CAPTURE_DEVICE_UNKNOWN) {
+                set_type(entry, type);
+            }
+            return entry;
+        }
+        if (entry->key == KINETIC_REGISTRY_EMPTY) {
+            break;
+        }
+    }
+    if (registry->count == registry->limit) {
+        return NULL;
+    }
+
+    memset(entry, 0, sizeof(*entry));
+    entry->key = key;
+    memcpy(entry->systemId, systemId, KINETIC_SYSTEM_ID_SIZE);
+    entry->commandKey = inride_command_key(entry->systemId);
+    kinetic_system_id_string(key, entry->string);
+    set_type(entry, type);
+    entry->index = registry->count++;
+    return entry;
+}
@@ -0,0 +1,106 @@
+//
+//  DeviceRegistry.h
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#ifndef DeviceRegistry_h
+#define DeviceRegistry_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "FrameCapture.h"
+
+// Registry of the known devices, keyed by their System Id (Device Information 0x2A23).
+// - The 6 byte System Id is packed into a 48 bit integer key: an open addressing table (linear probing, caller
+//   storage) finds the entry of any device in O(1) from a transport callback, without allocating.
+// - An entry is interned on first sight and never removed: its length is validated once, its command key and hex
+//   string are computed once, and it keeps its index (0, 1, 2 ... in order of first sight) for per-device state arrays
+//   (filters, sequencers, kinetic_fanout_encoder / kinetic_shared_metrics slots ...).
+// - Up to 3/4 of the capacity can be interned, so the probes stay short.
+// - Not thread safe: intern from one thread (or under a lock). Finds are safe alongside finds.
+
+#define KINETIC_SYSTEM_ID_SIZE          6
+#define KINETIC_SYSTEM_ID_STRING_SIZE   (2 * KINETIC_SYSTEM_ID_SIZE + 1)
+
+/*! Registered Device */
+typedef struct kinetic_registry_entry
+{
+    /*! Packed System Id (kinetic_system_id_key), KINETIC_REGISTRY_EMPTY if the slot is free */
+    uint64_t key;
+    uint8_t systemId[KINETIC_SYSTEM_ID_SIZE];
+    /*! inRide command key (inride_command_key) */
+    uint16_t commandKey;
+    /*! Lowercase hex System Id (as +[KineticSDK systemIdToString:]) */
+    char string[KINETIC_SYSTEM_ID_STRING_SIZE];
+    kinetic_capture_device type;
+    /*! Size of the power and config notifications of the device type (0 while the type is unknown) */
+    uint8_t powerFrameSize;
+    uint8_t configFrameSize;
+    /*! Index of the device in per-device state arrays */
+    uint32_t index;
+} kinetic_registry_entry;
+
+#define KINETIC_REGISTRY_EMPTY          UINT64_MAX
+
+/*! Registry */
+typedef struct kinetic_registry
+{
+    kinetic_registry_entry *entries;
+    uint32_t capacity;
+    uint32_t limit;
+    uint32_t count;
+    uint8_t shift;
+} kinetic_registry;
+
+
+/*!
+ Packs a System Id into its 48 bit key (first byte most significant).
+ */
+uint64_t kinetic_system_id_key(const uint8_t systemId[KINETIC_SYSTEM_ID_SIZE]);
+
+/*!
+ Formats a System Id key as lowercase hex (12 characters and the terminator).
+ */
+void kinetic_system_id_string(uint64_t key, char string[KINETIC_SYSTEM_ID_STRING_SIZE]);
+
+/*!
+ Initializes an empty registry.
+
+ @param registry Registry
+ @param entries Table storage
+ @param capacity Number of entries (a power of two, at least 4). Up to capacity * 3 / 4 devices can be interned.
+
+ @return false if the capacity is not a power of two
+ */
+bool kinetic_registry_init(kinetic_registry *registry, kinetic_registry_entry *entries, uint32_t capacity);
+
+/*!
+ Forgets every device (indexes restart at 0).
+ */
+void kinetic_registry_clear(kinetic_registry *registry);
+
+/*!
+ Finds a device, or registers it if it is new.
+
+ @param registry Registry
+ @param systemId System Id value
+ @param size Size of the value (anything but KINETIC_SYSTEM_ID_SIZE is rejected)
+ @param type Device type, kinetic_capture_device (a known type replaces an unknown one, and sets the frame sizes)
+
+ @return Entry of the device, NULL if the System Id is invalid or the registry is full
+ */
+kinetic_registry_entry *kinetic_registry_intern(kinetic_registry *registry, const uint8_t *systemId, size_t size, kinetic_capture_device type);
+
+/*!
+ Finds a registered device.
+
+ @return Entry of the device, NULL if it is not registered
+ */
+kinetic_registry_entry *kinetic_registry_find(const kinetic_registry *registry, const uint8_t systemId[KINETIC_SYSTEM_ID_SIZE]);
+kinetic_registry_entry *kinetic_registry_find_key(const kinetic_registry *registry, uint64_t key);
+
+
+#endif /* DeviceRegistry_h */
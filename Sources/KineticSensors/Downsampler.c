@@ -0,0 +1,214 @@
+//
+//  Downsampler.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#include "Downsampler.h"
+
+#include <math.h>
+
+
+// Twice the signed area of the triangle o, a, b (positive when counterclockwise)
+static inline double cross(const kinetic_downsample_point *o, const kinetic_downsample_point *a, const kinetic_downsample_point *b)
+{
+    return (a->time - o->time) * (b->value - o->value) - (a->value - o->value) * (b->time - o->time);
+}
+
+// Monotone chain step: upper hulls turn clockwise (sign -1), lower hulls counterclockwise (sign 1)
+static void hull_add(kinetic_downsample_point *hull, uint8_t *size, const kinetic_downsample_point *point, double sign)
+{
+    uint8_t n = *size;
+    while (n >= 2 && sign * cross(&hull[n - 2], &hull[n - 1], point) <= 0) {
+        n--;
+    }
+    if (n == KINETIC_DOWNSAMPLE_HULL_MAX) {
+        // drop the flattest interior vertex
+        uint8_t flattest = 1;
+        double smallest = INFINITY;
+        for (uint8_t i = 1; i < n - 1; ++i) {
+            double area = fabs(cross(&hull[i - 1], &hull[i], &hull[i + 1]));
+            if (area < smallest) {
+                smallest = area;
+                flattest = i;
+            }
+        }
+        for (uint8_t i = flattest; i < n - 1; ++i) {
+            hull[i] = hull[i + 1];
+        }
+        n--;
+    }
+    hull[n++] = *point;
+    *size = n;
+}
+
+static void bucket_start(kinetic_downsample_bucket *bucket, int64_t index)
+{
+    bucket->index = index;
+    bucket->count = 0;
+    bucket->sumTime = 0;
+    bucket->sumValue = 0;
+    bucket->upperSize = 0;
+    bucket->lowerSize = 0;
+}
+
+static void bucket_add(kinetic_downsample_bucket *bucket, const kinetic_downsample_point *point)
+{
+    if (bucket->count == 0 || point->value < bucket->minimum.value) {
+        bucket->minimum = *point;
+    }
+    if (bucket->count == 0 || point->value > bucket->maximum.value) {
+        bucket->maximum = *point;
+    }
+    bucket->count++;
+    bucket->sumTime += point->time;
+    bucket->sumValue += point->value;
+    bucket->last = *point;
+    hull_add(bucket->upper, &bucket->upperSize, point, -1);
+    hull_add(bucket->lower, &bucket->lowerSize, point, 1);
+}
+
+static kinetic_downsample_point bucket_mean(const kinetic_downsample_bucket *bucket)
+{
+    return (kinetic_downsample_point){ bucket->sumTime / bucket->count, bucket->sumValue / bucket->count };
+}
+
+// The hull vertex making the largest triangle with a and c
+static kinetic_downsample_point bucket_select(const kinetic_downsample_bucket *bucket, const kinetic_downsample_point *a, const kinetic_downsample_point *c)
+{
+    kinetic_downsample_point selected = bucket->last;
+    double largest = -1;
+    const kinetic_downsample_point *hulls[2] = { bucket->upper, bucket->lower };
+    uint8_t sizes[2] = { bucket->upperSize, bucket->lowerSize };
+    for (int h = 0; h < 2; ++h) {
+        for (uint8_t i = 0; i < sizes[h]; ++i) {
+            double area = fabs(cross(a, &hulls[h][i], c));
+            if (area > largest) {
+                largest = area;
+                selected = hulls[h][i];
+            }
+        }
+    }
+    return selected;
+}
+
+static void emit_point(kinetic_downsampler *downsampler, const kinetic_downsample_point *point)
+{
+    if (downsampler->pointHandler) {
+        downsampler->pointHandler(downsampler->context, point);
+    }
+}
+
+static void emit_envelope(kinetic_downsampler *downsampler, const kinetic_downsample_bucket *bucket)
+{
+    if (downsampler->envelopeHandler) {
+        kinetic_downsample_envelope envelope = {
+            downsampler->origin + bucket->index * downsampler->bucketSeconds,
+            bucket->minimum.value,
+            bucket->maximum.value,
+            bucket->sumValue / bucket->count,
+            bucket->count
+        };
+        downsampler->envelopeHandler(downsampler->context, &envelope);
+    }
+}
+
+// Keeps the point of the pending bucket now that the mean of the one after it (c) is known
+static void select_pending(kinetic_downsampler *downsampler, const kinetic_downsample_point *c)
+{
+    kinetic_downsample_bucket *pending = &downsampler->buckets[downsampler->current ^ 1];
+    kinetic_downsample_point selected = bucket_select(pending, &downsampler->selected, c);
+    if (selected.time != downsampler->selected.time) {
+        emit_point(downsampler, &selected);
+        downsampler->selected = selected;
+    }
+    downsampler->pending = false;
+}
+
+void kinetic_downsampler_init(kinetic_downsampler *downsampler, double bucketSeconds, kinetic_downsample_point_handler pointHandler,
+                              kinetic_downsample_envelope_handler envelopeHandler, void *context)
+{
+    downsampler->bucketSeconds = bucketSeconds > 0 ? bucketSeconds : 1;
+    downsampler->started = false;
+    downsampler->pending = false;
+    downsampler->current = 0;
+    downsampler->pointHandler = pointHandler;
+    downsampler->envelopeHandler = envelopeHandler;
+    downsampler->context = context;
+}
+
+void kinetic_downsampler_add(kinetic_downsampler *downsampler, double time, double value)
+{
+    kinetic_downsample_point point = { time, value };
+    if (!downsampler->started) {
+        downsampler->started = true;
+        downsampler->origin = time;
+        downsampler->selected = point;
+        downsampler->pending = false;
+        bucket_start(&downsampler->buckets[downsampler->current], 0);
+        emit_point(downsampler, &point);
+    }
+
+    int64_t index = (int64_t)floor((time - downsampler->origin) / downsampler->bucketSeconds);
+    kinetic_downsample_bucket *bucket = &downsampler->buckets[downsampler->current];
+    if (bucket->count > 0 && index != bucket->index) {
+        emit_envelope(downsampler, bucket);
+        if (downsampler->pending) {
+            kinetic_downsample_point mean = bucket_mean(bucket);
+            select_pending(downsampler, &mean);
+        }
+        downsampler->pending = true;
+        downsampler->current ^= 1;
+        bucket = &downsampler->buckets[downsampler->current];
+        bucket_start(bucket, index);
+    }
+    bucket_add(bucket, &point);
+}
+
+void kinetic_downsampler_flush(kinetic_downsampler *downsampler)
+{
+    if (!downsampler->started) {
+        return;
+    }
+    kinetic_downsample_bucket *bucket = &downsampler->buckets[downsampler->current];
+    if (bucket->count > 0) {
+        emit_envelope(downsampler, bucket);
+        if (downsampler->pending) {
+            kinetic_downsample_point mean = bucket_mean(bucket);
+            select_pending(downsampler, &mean);
+        }
+        // the last bucket has no next one: its point is chosen against the last sample, which is kept too
+        kinetic_downsample_point last = bucket->last;
+        kinetic_downsample_point selected = bucket_select(bucket, &downsampler->selected, &last);
+        if (selected.time != downsampler->selected.time && selected.time != last.time) {
+            emit_point(downsampler, &selected);
+        }
+        if (last.time != downsampler->selected.time) {
+            emit_point(downsampler, &last);
+        }
+    }
+    downsampler->started = false;
+    downsampler->pending = false;
+}
+
+static inline void add(const kinetic_channel_downsamplers *downsamplers, kinetic_channel channel, double timestamp, double value)
+{
+    if (downsamplers->channel[channel]) {
+        kinetic_downsampler_add(downsamplers->channel[channel], timestamp, value);
+    }
+}
+
+void inride_downsample_power_data(const kinetic_channel_downsamplers *downsamplers, double timestamp, const inride_power_data *data)
+{
+    add(downsamplers, KINETIC_CHANNEL_POWER, timestamp, data->power);
+    add(downsamplers, KINETIC_CHANNEL_SPEED, timestamp, data->speedKPH);
+    add(downsamplers, KINETIC_CHANNEL_CADENCE, timestamp, data->cadenceRPM);
+    add(downsamplers, KINETIC_CHANNEL_ROLLER_RPM, timestamp, data->rollerRPM);
+}
+
+void smart_control_downsample_power_data(const kinetic_channel_downsamplers *downsamplers, double timestamp, const smart_control_power_data *data)
+{
+    add(downsamplers, KINETIC_CHANNEL_POWER, timestamp, data->power);
+    add(downsamplers, KINETIC_CHANNEL_SPEED, timestamp, data->speedKPH);
+    add(downsamplers, KINETIC_CHANNEL_CADENCE, timestamp, data->cadenceRPM);
+}
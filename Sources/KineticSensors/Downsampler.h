@@ -0,0 +1,130 @@
+//
+//  Downsampler.h
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#ifndef Downsampler_h
+#define Downsampler_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "inRide.h"
+#include "SmartControl.h"
+#include "FilterBank.h"
+
+// Streaming downsampling of decoded channels to display resolution.
+// - Time is cut into buckets of bucketSeconds (one pixel column, say). Samples are added as they arrive.
+// - Envelope: the minimum, maximum and mean of every bucket, reported as soon as the bucket is over.
+// - Largest-Triangle-Three-Buckets: one sample per bucket, the one making the largest triangle with the sample kept
+//   for the previous bucket and the mean of the next bucket. Peaks (sprints) survive where averaging flattens them.
+//   The point of a bucket is known once the next bucket is over (one bucket of delay). The first and last samples are kept.
+// - Constant memory: the triangle area is linear in the candidate, so its maximum is on the convex hull of the bucket.
+//   Only the hull is kept (up to KINETIC_DOWNSAMPLE_HULL_MAX vertices per side: beyond that the flattest vertex is
+//   dropped, which only happens on long smooth curves where it makes no visible difference).
+// - Empty buckets (gaps in the data) are skipped. Times must not decrease.
+
+#define KINETIC_DOWNSAMPLE_HULL_MAX     16
+
+
+/*! Kept Sample */
+typedef struct kinetic_downsample_point
+{
+    double time;
+    double value;
+} kinetic_downsample_point;
+
+/*! Bucket Envelope */
+typedef struct kinetic_downsample_envelope
+{
+    /*! Start of the bucket */
+    double time;
+    double minimum;
+    double maximum;
+    double mean;
+    uint32_t count;
+} kinetic_downsample_envelope;
+
+/*! Receives the kept samples (in time order) */
+typedef void (*kinetic_downsample_point_handler)(void *context, const kinetic_downsample_point *point);
+
+/*! Receives the bucket envelopes (in time order) */
+typedef void (*kinetic_downsample_envelope_handler)(void *context, const kinetic_downsample_envelope *envelope);
+
+/*! Bucket being filled (or waiting for the next one to end) */
+typedef struct kinetic_downsample_bucket
+{
+    int64_t index;
+    uint32_t count;
+    double sumTime;
+    double sumValue;
+    kinetic_downsample_point minimum;
+    kinetic_downsample_point maximum;
+    kinetic_downsample_point last;
+    /*! Upper and lower convex hull, in time order */
+    kinetic_downsample_point upper[KINETIC_DOWNSAMPLE_HULL_MAX];
+    kinetic_downsample_point lower[KINETIC_DOWNSAMPLE_HULL_MAX];
+    uint8_t upperSize;
+    uint8_t lowerSize;
+} kinetic_downsample_bucket;
+
+/*! Downsampler of one channel */
+typedef struct kinetic_downsampler
+{
+    double bucketSeconds;
+    double origin;
+    bool started;
+    bool pending;
+    uint8_t current;
+    /*! Last kept sample */
+    kinetic_downsample_point selected;
+    kinetic_downsample_bucket buckets[2];
+
+    kinetic_downsample_point_handler pointHandler;
+    kinetic_downsample_envelope_handler envelopeHandler;
+    void *context;
+} kinetic_downsampler;
+
+/*! Downsamplers of a device's channels (NULL skips a channel) */
+typedef struct kinetic_channel_downsamplers
+{
+    kinetic_downsampler *channel[KINETIC_CHANNEL_COUNT];
+} kinetic_channel_downsamplers;
+
+
+/*!
+ Initializes a downsampler.
+
+ @param downsampler Downsampler
+ @param bucketSeconds Bucket duration (e.g. ride duration / plot width)
+ @param pointHandler Receives the LTTB samples (NULL if not needed)
+ @param envelopeHandler Receives the envelopes (NULL if not needed)
+ @param context Passed to the handlers
+ */
+void kinetic_downsampler_init(kinetic_downsampler *downsampler, double bucketSeconds, kinetic_downsample_point_handler pointHandler,
+                              kinetic_downsample_envelope_handler envelopeHandler, void *context);
+
+/*!
+ Adds a sample (the first sample starts the first bucket).
+
+ @param downsampler Downsampler
+ @param time Time of the sample (seconds)
+ @param value Value
+ */
+void kinetic_downsampler_add(kinetic_downsampler *downsampler, double time, double value);
+
+/*!
+ Ends the series: reports the buckets still open and the last sample. The next sample starts a new series.
+ */
+void kinetic_downsampler_flush(kinetic_downsampler *downsampler);
+
+/*!
+ Adds the channels of a decoded update to their downsamplers.
+ */
+void inride_downsample_power_data(const kinetic_channel_downsamplers *downsamplers, double timestamp, const inride_power_data *data);
+void smart_control_downsample_power_data(const kinetic_channel_downsamplers *downsamplers, double timestamp, const smart_control_power_data *data);
+
+
+#endif /* Downsampler_h */
@@ -0,0 +1,453 @@
+//
+//  Emulator.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#include "Emulator.h"
+#include "VirtualSpeed.h"
+
+#include <string.h>
+
+#define InRideSensorHz              32768
+#define InRideSpeedTicks            20012.256849    // speed (KPH) = InRideSpeedTicks * revs / ticks
+#define InRideCalibrationReady      602             // ticks per revolution the spindown starts at (see inride_create_config_sensor_command_data)
+#define SmartControlSensorHz        10000
+#define SmartControlSpeedTicks      6107.2561186    // speed (KPH) = SmartControlSpeedTicks / ticks
+
+
+static uint32_t next_random(kinetic_emulator_device *device)
+{
+    // xorshift32
+    uint32_t x = device->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    device->random = x;
+    return x;
+}
+
+// Whitens a Smart Control frame in place. The last byte is the nonce and stays in the clear.
+static void whiten(kinetic_emulator_device *device, uint8_t *data, size_t size)
+{
+    data[size - 1] = (uint8_t)next_random(device);
+    uint8_t hash = hash8WithSeed(0x42, &data[size - 1], 1);
+    for (size_t index = 0; index < size - 1; index++) {
+        uint8_t temp = data[index];
+        data[index] ^= hash;
+        hash = hash8WithSeed(hash, &temp, 1);
+    }
+}
+
+static void dewhiten(uint8_t *data, size_t size)
+{
+    uint8_t hash = hash8WithSeed(0x42, &data[size - 1], 1);
+    for (size_t index = 0; index < size - 1; index++) {
+        data[index] ^= hash;
+        hash = hash8WithSeed(hash, &data[index], 1);
+    }
+}
+
+
+void kinetic_emulator_init_inride(kinetic_emulator_device *device, const uint8_t systemId[6], uint32_t seed)
+{
+    memset(device, 0, sizeof(*device));
+    device->type = KINETIC_EMULATOR_INRIDE;
+    memcpy(device->systemId, systemId, 6);
+    device->random = seed != 0 ? seed : 0x9E3779B9;
+    device->spindownTime = SpindownDefault;
+    device->inRide.state = INRIDE_STATE_NORMAL;
+    device->inRide.commandResult = INRIDE_COM_RESULT_NONE;
+    device->inRide.updateRateDefault = INRIDE_UPDATE_RATE_1000;
+    device->inRide.updateRateCalibration = INRIDE_UPDATE_RATE_250;
+}
+
+void kinetic_emulator_init_smart_control(kinetic_emulator_device *device, const uint8_t systemId[6], uint32_t seed)
+{
+    memset(device, 0, sizeof(*device));
+    device->type = KINETIC_EMULATOR_SMART_CONTROL;
+    memcpy(device->systemId, systemId, 6);
+    device->random = seed != 0 ? seed : 0x9E3779B9;
+    device->spindownTime = 1.0;
+    device->smartControl.mode = SMART_CONTROL_MODE_ERG;
+    device->smartControl.targetWatts = 100;
+    device->smartControl.weightKG = 85;
+    device->smartControl.rollingCoeff = 0.004f;
+    device->smartControl.windCoeff = 0.6f;
+    device->smartControl.updateRate = 4;
+    device->smartControl.calibrationState = SMART_CONTROL_CALIBRATION_STATE_NOT_PERFORMED;
+    device->smartControl.calibrationThresholdKPH = 33.8;
+}
+
+double kinetic_emulator_update_interval(const kinetic_emulator_device *device)
+{
+    if (device->type == KINETIC_EMULATOR_INRIDE) {
+        uint16_t rate = device->inRide.state == INRIDE_STATE_NORMAL ? device->inRide.updateRateDefault : device->inRide.updateRateCalibration;
+        return rate / 32.0;
+    }
+    return 1.0 / (device->smartControl.updateRate > 0 ? device->smartControl.updateRate : 1);
+}
+
+double kinetic_emulator_power(const kinetic_emulator_device *device)
+{
+    if (device->speedKPH <= 0) {
+        return 0;
+    }
+    if (device->type == KINETIC_EMULATOR_INRIDE) {
+        // steady state frame through the sensor's own calculation
+        inride_raw_power_data raw;
+        memset(&raw, 0, sizeof(raw));
+        raw.ticks = (uint32_t)(InRideSpeedTicks / device->speedKPH + 0.5);
+        raw.revs = 1;
+        raw.ticksPrevious = raw.ticks;
+        raw.revsPrevious = 1;
+        raw.spindownTicks = device->inRide.spindownTicks;
+        return inride_process_raw_power_data(&raw).power;
+    }
+
+    const kinetic_emulator_smart_control *sc = &device->smartControl;
+    switch (sc->mode) {
+        case SMART_CONTROL_MODE_ERG:
+            return sc->targetWatts;
+        case SMART_CONTROL_MODE_FLUID:
+            return smart_control_simulation_power(device->speedKPH, 85, 0.004, 0.6, sc->fluidLevel, 0);
+        case SMART_CONTROL_MODE_BRAKE:
+            return (device->speedKPH / 3.6) * (5 + 60 * sc->brakePercent);
+        case SMART_CONTROL_MODE_SIMULATION:
+            return smart_control_simulation_power(device->speedKPH, sc->weightKG, sc->rollingCoeff, sc->windCoeff, sc->grade, sc->windSpeedMPS);
+    }
+    return 0;
+}
+
+void kinetic_emulator_advance(kinetic_emulator_device *device, double seconds)
+{
+    bool pedaling = device->cadenceRPM > 0;
+
+    if (device->type == KINETIC_EMULATOR_INRIDE) {
+        kinetic_emulator_inride *ir = &device->inRide;
+        switch (ir->state) {
+            case INRIDE_STATE_SPINDOWN_IDLE:
+                if (device->speedKPH >= InRideSpeedTicks / InRideCalibrationReady) {
+                    ir->state = INRIDE_STATE_SPINDOWN_READY;
+                }
+                break;
+            case INRIDE_STATE_SPINDOWN_READY:
+                if (!pedaling) {
+                    ir->state = INRIDE_STATE_SPINDOWN_ACTIVE;
+                    device->coastTime = 0;
+                }
+                break;
+            case INRIDE_STATE_SPINDOWN_ACTIVE:
+                device->coastTime += seconds;
+                if (pedaling) {
+                    ir->state = INRIDE_STATE_SPINDOWN_IDLE;
+                } else if (device->coastTime >= device->spindownTime) {
+                    ir->state = INRIDE_STATE_NORMAL;
+                    ir->spindownTicks = (uint32_t)(device->spindownTime * InRideSensorHz);
+                    ir->commandResult = INRIDE_COM_RESULT_CALIBRATION_RESULT;
+                }
+                break;
+            default:
+                break;
+        }
+        return;
+    }
+
+    kinetic_emulator_smart_control *sc = &device->smartControl;
+    switch (sc->calibrationState) {
+        case SMART_CONTROL_CALIBRATION_STATE_INITIALIZING:
+        case SMART_CONTROL_CALIBRATION_STATE_SPEED_UP_DETECTED:
+            sc->calibrationState = SMART_CONTROL_CALIBRATION_STATE_SPEED_UP;
+            break;
+        case SMART_CONTROL_CALIBRATION_STATE_SPEED_UP:
+            if (device->speedKPH >= sc->calibrationThresholdKPH) {
+                sc->calibrationState = SMART_CONTROL_CALIBRATION_STATE_START_COASTING;
+            }
+            break;
+        case SMART_CONTROL_CALIBRATION_STATE_START_COASTING:
+            if (!pedaling) {
+                sc->calibrationState = SMART_CONTROL_CALIBRATION_STATE_COASTING;
+                device->coastTime = 0;
+            }
+            break;
+        case SMART_CONTROL_CALIBRATION_STATE_COASTING:
+            device->coastTime += seconds;
+            if (pedaling) {
+                sc->calibrationState = SMART_CONTROL_CALIBRATION_STATE_SPEED_UP_DETECTED;
+            } else if (device->coastTime >= device->spindownTime) {
+                sc->calibrationState = SMART_CONTROL_CALIBRATION_STATE_COMPLETE;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static size_t inride_power_frame(kinetic_emulator_device *device, uint8_t data[20])
+{
+    kinetic_emulator_inride *ir = &device->inRide;
+    uint16_t rate = ir->state == INRIDE_STATE_NORMAL ? ir->updateRateDefault : ir->updateRateCalibration;
+
+    inride_raw_power_data raw;
+    raw.status = (uint8_t)ir->state | (uint8_t)ir->commandResult;
+    raw.interval = (uint32_t)rate * (InRideSensorHz / 32);
+
+    // whole roller revolutions in this interval, the fraction carries over
+    double revolutions = 0;
+    if (device->speedKPH > 0) {
+        revolutions = ir->revolutionPhase + raw.interval * device->speedKPH / InRideSpeedTicks;
+    }
+    double whole = floor(revolutions);
+    raw.revs = (uint8_t)(whole > 255 ? 255 : whole);
+    ir->revolutionPhase = whole > 255 ? 0 : revolutions - whole;
+    raw.ticks = raw.revs > 0 ? (uint32_t)(raw.revs * InRideSpeedTicks / device->speedKPH + 0.5) : 0;
+    raw.ticksPrevious = ir->ticksPrevious;
+    raw.revsPrevious = ir->revsPrevious;
+
+    double cadenceRaw = device->cadenceRPM > 0 ? (device->cadenceRPM - 5.2617) / 0.8652 + 0.5 : 0;
+    raw.cadenceRaw = (uint16_t)(cadenceRaw < 1 ? (device->cadenceRPM > 0 ? 1 : 0) : cadenceRaw > 65535 ? 65535 : cadenceRaw);
+    raw.spindownTicks = ir->spindownTicks;
+
+    inride_encode_power_data(&raw, (uint8_t)next_random(device), data);
+
+    if (raw.revs > 0) {
+        ir->ticksPrevious = raw.ticks;
+        ir->revsPrevious = raw.revs;
+    }
+    // the result of a command is only reported once
+    ir->commandResult = INRIDE_COM_RESULT_NONE;
+    return 20;
+}
+
+static size_t smart_control_power_frame(kinetic_emulator_device *device, uint8_t data[20])
+{
+    kinetic_emulator_smart_control *sc = &device->smartControl;
+    double power = kinetic_emulator_power(device);
+    uint16_t watts = (uint16_t)(power > 65535 ? 65535 : power + 0.5);
+    uint16_t target = sc->mode == SMART_CONTROL_MODE_ERG ? sc->targetWatts : watts;
+    uint16_t rollerTicks = 0;
+    if (device->speedKPH > 0) {
+        double ticks = SmartControlSpeedTicks / device->speedKPH + 0.5;
+        rollerTicks = (uint16_t)(ticks >= 65535 ? 0 : ticks);
+    }
+    uint32_t metersPerHour = (uint32_t)(device->speedKPH * 1000.0 + 0.5);
+    uint8_t cadence = (uint8_t)(device->cadenceRPM > 255 ? 255 : device->cadenceRPM + 0.5);
+
+    memset(data, 0, 20);
+    data[0] = sc->mode;
+    data[1] = target >> 8;
+    data[2] = target;
+    data[3] = watts >> 8;
+    data[4] = watts;
+    data[5] = rollerTicks >> 8;
+    data[6] = rollerTicks;
+    data[12] = cadence;
+    data[13] = metersPerHour >> 24;
+    data[14] = metersPerHour >> 16;
+    data[15] = metersPerHour >> 8;
+    data[16] = metersPerHour;
+    whiten(device, data, 20);
+    return 20;
+}
+
+size_t kinetic_emulator_power_frame(kinetic_emulator_device *device, uint8_t data[20])
+{
+    device->framesSent++;
+    if (device->type == KINETIC_EMULATOR_INRIDE) {
+        return inride_power_frame(device, data);
+    }
+    return smart_control_power_frame(device, data);
+}
+
+size_t kinetic_emulator_config_frame(kinetic_emulator_device *device, uint8_t data[20])
+{
+    memset(data, 0, 20);
+    if (device->type == KINETIC_EMULATOR_INRIDE) {
+        // not obfuscated, little endian (see inride_process_config_data)
+        const uint16_t calibration[4] = { 602, 655, 950, 327 };
+        for (int i = 0; i < 4; ++i) {
+            data[i * 2] = calibration[i];
+            data[i * 2 + 1] = calibration[i] >> 8;
+        }
+        uint32_t spindownTicks = device->inRide.spindownTicks;
+        data[8] = spindownTicks;
+        data[9] = spindownTicks >> 8;
+        data[10] = spindownTicks >> 16;
+        data[11] = spindownTicks >> 24;
+        data[12] = device->inRide.updateRateDefault;
+        data[13] = device->inRide.updateRateDefault >> 8;
+        data[14] = device->inRide.updateRateCalibration;
+        data[15] = device->inRide.updateRateCalibration >> 8;
+        return 20;
+    }
+
+    const kinetic_emulator_smart_control *sc = &device->smartControl;
+    bool calibrated = sc->calibrationState == SMART_CONTROL_CALIBRATION_STATE_COMPLETE;
+    uint32_t spindownTicks = calibrated ? (uint32_t)(device->spindownTime * SmartControlSensorHz) : 0;
+    uint16_t threshold = (uint16_t)(sc->calibrationThresholdKPH * 1000);
+    uint16_t brakeThreshold = 45000;
+    data[0] = sc->updateRate;
+    data[1] = (SmartControlSensorHz >> 16) & 0xFF;
+    data[2] = (SmartControlSensorHz >> 8) & 0xFF;
+    data[3] = SmartControlSensorHz & 0xFF;
+    data[4] = 0;    // firmware update state
+    data[5] = 0;    // system status
+    data[6] = 0;
+    data[7] = sc->calibrationState;
+    data[8] = spindownTicks >> 24;
+    data[9] = spindownTicks >> 16;
+    data[10] = spindownTicks >> 8;
+    data[11] = spindownTicks;
+    data[12] = threshold >> 8;
+    data[13] = threshold;
+    data[14] = brakeThreshold >> 8;
+    data[15] = brakeThreshold;
+    data[16] = 55;  // brake strength
+    data[17] = 128; // brake offset
+    data[18] = 1;   // noise filter
+    whiten(device, data, 20);
+    return 20;
+}
+
+static bool inride_control_point(kinetic_emulator_device *device, const uint8_t *data, size_t size)
+{
+    kinetic_emulator_inride *ir = &device->inRide;
+    if (size < 3) {
+        ir->commandResult = INRIDE_COM_RESULT_INVALID_REQUEST;
+        return false;
+    }
+    uint16_t commandKey = (uint16_t)data[0] | ((uint16_t)data[1] << 8);
+    if (commandKey != inride_command_key(device->systemId)) {
+        ir->commandResult = INRIDE_COM_RESULT_INVALID_REQUEST;
+        return false;
+    }
+
+    bool accepted = true;
+    switch (data[2]) {
+        case 0x01: // config sensor
+            if (size < 15) {
+                accepted = false;
+                break;
+            }
+            ir->updateRateDefault = (uint16_t)data[11] | ((uint16_t)data[12] << 8);
+            ir->updateRateCalibration = (uint16_t)data[13] | ((uint16_t)data[14] << 8);
+            // 8 Hz is as fast as the sensor goes
+            accepted = ir->updateRateDefault >= 4 && ir->updateRateCalibration >= 4;
+            if (!accepted) {
+                ir->updateRateDefault = INRIDE_UPDATE_RATE_1000;
+                ir->updateRateCalibration = INRIDE_UPDATE_RATE_250;
+            }
+            break;
+        case 0x02: // name
+            accepted = size >= 6 && size <= 11;
+            break;
+        case 0x03: // start calibration
+            ir->state = INRIDE_STATE_SPINDOWN_IDLE;
+            break;
+        case 0x04: // stop calibration
+            ir->state = INRIDE_STATE_NORMAL;
+            break;
+        case 0x05: // set spindown time
+            if (size < 7) {
+                accepted = false;
+                break;
+            }
+            ir->spindownTicks = (uint32_t)data[3] | ((uint32_t)data[4] << 8) | ((uint32_t)data[5] << 16) | ((uint32_t)data[6] << 24);
+            break;
+        default:
+            ir->commandResult = INRIDE_COM_RESULT_NOT_SUPPORTED;
+            return false;
+    }
+    ir->commandResult = accepted ? INRIDE_COM_RESULT_SUCCESS : INRIDE_COM_RESULT_INVALID_REQUEST;
+    return accepted;
+}
+
+static bool smart_control_control_point(kinetic_emulator_device *device, const uint8_t *command, size_t size)
+{
+    if (size < 3 || size > 20) {
+        return false;
+    }
+    uint8_t data[20];
+    memcpy(data, command, size);
+    dewhiten(data, size);
+
+    kinetic_emulator_smart_control *sc = &device->smartControl;
+    if (data[0] == 0x03 && size >= 4) {
+        if (data[1] == 0x01) {
+            sc->calibrationState = SMART_CONTROL_CALIBRATION_STATE_INITIALIZING;
+            sc->brakeCalibration = data[2] != 0;
+        } else {
+            sc->calibrationState = SMART_CONTROL_CALIBRATION_STATE_NOT_PERFORMED;
+        }
+        return true;
+    }
+    if (data[0] != 0x00) {
+        return false;
+    }
+    switch (data[1]) {
+        case SMART_CONTROL_MODE_ERG:
+            if (size < 5) {
+                return false;
+            }
+            sc->targetWatts = ((uint16_t)data[2] << 8) | data[3];
+            break;
+        case SMART_CONTROL_MODE_FLUID:
+            if (size < 4) {
+                return false;
+            }
+            sc->fluidLevel = data[2] > 9 ? 9 : data[2];
+            break;
+        case SMART_CONTROL_MODE_BRAKE:
+            if (size < 5) {
+                return false;
+            }
+            sc->brakePercent = (((uint16_t)data[2] << 8) | data[3]) / 65535.0f;
+            break;
+        case SMART_CONTROL_MODE_SIMULATION:
+            if (size < 13) {
+                return false;
+            }
+            sc->weightKG = (((uint16_t)data[2] << 8) | data[3]) / 100.0f;
+            sc->rollingCoeff = (((uint16_t)data[4] << 8) | data[5]) / 10000.0f;
+            sc->windCoeff = (((uint16_t)data[6] << 8) | data[7]) / 10000.0f;
+            sc->grade = (int16_t)(((uint16_t)data[8] << 8) | data[9]) / 100.0f;
+            sc->windSpeedMPS = (int16_t)(((uint16_t)data[10] << 8) | data[11]) / 100.0f;
+            break;
+        default:
+            return false;
+    }
+    sc->mode = data[1];
+    return true;
+}
+
+bool kinetic_emulator_write_control_point(kinetic_emulator_device *device, const uint8_t *data, size_t size)
+{
+    if (device->type == KINETIC_EMULATOR_INRIDE) {
+        return inride_control_point(device, data, size);
+    }
+    return smart_control_control_point(device, data, size);
+}
+
+size_t kinetic_emulator_step(kinetic_emulator_device *devices, size_t count, double now, kinetic_emulator_frame_handler handler, void *context)
+{
+    size_t frames = 0;
+    uint8_t data[20];
+    for (size_t i = 0; i < count; ++i) {
+        kinetic_emulator_device *device = &devices[i];
+        if (now < device->nextUpdate) {
+            continue;
+        }
+        double interval = kinetic_emulator_update_interval(device);
+        kinetic_emulator_advance(device, interval);
+        size_t size = kinetic_emulator_power_frame(device, data);
+        handler(context, i, data, size);
+        frames++;
+
+        // stay on the device's own grid, unless the caller fell behind by more than an update
+        device->nextUpdate += interval;
+        if (device->nextUpdate <= now) {
+            device->nextUpdate = now + interval;
+        }
+    }
+    return frames;
+}
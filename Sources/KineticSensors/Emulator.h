@@ -0,0 +1,180 @@
+//
+//  Emulator.h
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#ifndef Emulator_h
+#define Emulator_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "inRide.h"
+#include "SmartControl.h"
+
+// Virtual inRide and Smart Control devices.
+// - Produces the same bytes the hardware sends (obfuscated inRide power frames, whitened Smart Control frames)
+// - Accepts the Control Point commands created by this library and reacts to them (resistance modes, calibration, update rates)
+// - Output is deterministic for a given seed, so runs can be reproduced bit for bit
+// - A device is a plain struct: keep thousands in an array and drive them with kinetic_emulator_step
+//
+// The rider is an input: set speedKPH and cadenceRPM on the device (cadence 0 means coasting).
+// The trainer model (power at a given speed in each mode) is an approximation and not the firmware's.
+
+
+/*! Emulated Device Type */
+typedef enum kinetic_emulator_type
+{
+    KINETIC_EMULATOR_INRIDE         = 0x01,
+    KINETIC_EMULATOR_SMART_CONTROL  = 0x02
+} kinetic_emulator_type;
+
+/*! Emulated inRide state */
+typedef struct kinetic_emulator_inride
+{
+    inride_sensor_state state;
+    inride_command_result commandResult;
+    /*! Update interval (32 Hz cycles, see inride_update_rate) when normal and when calibrating */
+    uint16_t updateRateDefault;
+    uint16_t updateRateCalibration;
+    /*! Spindown result reported in the power data (32768 Hz ticks) */
+    uint32_t spindownTicks;
+    /*! Counters of the previous frame */
+    uint32_t ticksPrevious;
+    uint8_t revsPrevious;
+    /*! Fraction of a roller revolution carried over to the next frame */
+    double revolutionPhase;
+} kinetic_emulator_inride;
+
+/*! Emulated Smart Control state */
+typedef struct kinetic_emulator_smart_control
+{
+    smart_control_mode mode;
+    uint16_t targetWatts;
+    uint8_t fluidLevel;
+    float brakePercent;
+    float weightKG;
+    float rollingCoeff;
+    float windCoeff;
+    float grade;
+    float windSpeedMPS;
+    /*! Power data update rate (Hz) */
+    uint8_t updateRate;
+    smart_control_calibration_state calibrationState;
+    bool brakeCalibration;
+    double calibrationThresholdKPH;
+} kinetic_emulator_smart_control;
+
+/*! Emulated Device */
+typedef struct kinetic_emulator_device
+{
+    kinetic_emulator_type type;
+    uint8_t systemId[6];
+    uint32_t random;
+
+    /*! Rider input: roller speed (KPH) */
+    double speedKPH;
+    /*! Rider input: cadence (RPM), 0 when coasting */
+    double cadenceRPM;
+    /*! Spindown time the trainer produces when calibrated (seconds) */
+    double spindownTime;
+
+    /*! Time of the next power update (seconds, same clock as kinetic_emulator_step) */
+    double nextUpdate;
+    /*! Calibration coast down timer (seconds) */
+    double coastTime;
+    uint64_t framesSent;
+
+    kinetic_emulator_inride inRide;
+    kinetic_emulator_smart_control smartControl;
+} kinetic_emulator_device;
+
+
+/*!
+ Initializes an emulated inRide (normal state, 1 update / second, not calibrated).
+
+ @param device Device to initialize
+ @param systemId System Id the device reports (used for the command key)
+ @param seed Seed of the frame randomization (obfuscation rotation)
+ */
+void kinetic_emulator_init_inride(kinetic_emulator_device *device, const uint8_t systemId[6], uint32_t seed);
+
+/*!
+ Initializes an emulated Smart Control (ERG mode at 100 watts, 4 updates / second, not calibrated).
+
+ @param device Device to initialize
+ @param systemId System Id the device reports
+ @param seed Seed of the frame randomization (nonces)
+ */
+void kinetic_emulator_init_smart_control(kinetic_emulator_device *device, const uint8_t systemId[6], uint32_t seed);
+
+/*!
+ Seconds between power updates in the current state.
+ */
+double kinetic_emulator_update_interval(const kinetic_emulator_device *device);
+
+/*!
+ Power (Watts) the trainer model produces at the rider's current speed. For an inRide this is what the sensor calculation reports.
+ */
+double kinetic_emulator_power(const kinetic_emulator_device *device);
+
+/*!
+ Advances the calibration state machines.
+
+ @param device Device
+ @param seconds Time since the last call
+ */
+void kinetic_emulator_advance(kinetic_emulator_device *device, double seconds);
+
+/*!
+ Builds the next power notification and advances the frame counters.
+
+ @param device Device
+ @param data Output (20 bytes)
+
+ @return Size of the notification
+ */
+size_t kinetic_emulator_power_frame(kinetic_emulator_device *device, uint8_t data[20]);
+
+/*!
+ Builds the value of the config characteristic.
+
+ @param device Device
+ @param data Output (20 bytes)
+
+ @return Size of the value
+ */
+size_t kinetic_emulator_config_frame(kinetic_emulator_device *device, uint8_t data[20]);
+
+/*!
+ Handles a write to the Control Point characteristic.
+
+ @param device Device
+ @param data Command bytes (as created by inride_create_* / smart_control_*_command)
+ @param size Size of the command
+
+ @return false if the command was rejected (bad key, unknown command, bad length)
+ */
+bool kinetic_emulator_write_control_point(kinetic_emulator_device *device, const uint8_t *data, size_t size);
+
+
+/*! Receives the frames of kinetic_emulator_step */
+typedef void (*kinetic_emulator_frame_handler)(void *context, size_t deviceIndex, const uint8_t *data, size_t size);
+
+/*!
+ Emits the power updates of every device that is due.
+
+ @param devices Devices
+ @param count Number of devices
+ @param now Current time (seconds, any monotonic clock)
+ @param handler Receives each frame
+ @param context Passed to the handler
+
+ @return Number of frames emitted
+ */
+size_t kinetic_emulator_step(kinetic_emulator_device *devices, size_t count, double now, kinetic_emulator_frame_handler handler, void *context);
+
+
+#endif /* Emulator_h */
@@ -0,0 +1,273 @@
+//
+//  FilterBank.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#include "FilterBank.h"
+#include "Tracing.h"
+
+#include <math.h>
+#include <string.h>
+
+static uint16_t clamp_window(uint16_t window)
+{
+    if (window < 1) {
+        return 1;
+    }
+    return window > KINETIC_FILTER_WINDOW_MAX ? KINETIC_FILTER_WINDOW_MAX : window;
+}
+
+static void init(kinetic_filter *filter, kinetic_filter_type type, uint16_t window, double weight)
+{
+    memset(filter, 0, sizeof(*filter));
+    filter->type = type;
+    filter->window = clamp_window(window);
+    filter->weight = weight;
+}
+
+void kinetic_filter_init_sma(kinetic_filter *filter, uint16_t window)
+{
+    init(filter, KINETIC_FILTER_SMA, window, 1);
+}
+
+void kinetic_filter_init_ema(kinetic_filter *filter, double alpha)
+{
+    init(filter, KINETIC_FILTER_EMA, 1, alpha < 0 ? 0 : alpha > 1 ? 1 : alpha);
+}
+
+void kinetic_filter_init_weighted_sma(kinetic_filter *filter, uint16_t window, double weight)
+{
+    // below 1 the divisor reaches 0 (NaN) or goes negative (NaN included)
+    init(filter, KINETIC_FILTER_WEIGHTED_SMA, window, weight >= 1 ? weight : 1);
+}
+
+void kinetic_filter_init_median(kinetic_filter *filter, uint16_t window)
+{
+    init(filter, KINETIC_FILTER_MEDIAN, window, 1);
+}
+
+void kinetic_filter_reset(kinetic_filter *filter)
+{
+    filter->count = 0;
+    filter->head = 0;
+    filter->sum = 0;
+    filter->sumError = 0;
+    filter->value = 0;
+    filter->lowSize = 0;
+    filter->highSize = 0;
+}
+
+
+// Compensated (Neumaier) running sum: adding and removing samples forever does not drift.
+static void sum_add(kinetic_filter *filter, double value)
+{
+    double sum = filter->sum + value;
+    if (fabs(filter->sum) >= fabs(value)) {
+        filter->sumError += (filter->sum - sum) + value;
+    } else {
+        filter->sumError += (value - sum) + filter->sum;
+    }
+    filter->sum = sum;
+}
+
+static double sum_value(const kinetic_filter *filter)
+{
+    return filter->sum + filter->sumError;
+}
+
+// Stores a sample in the ring. Returns the slot, and the evicted sample if the window was full.
+static uint16_t ring_push(kinetic_filter *filter, double sample, bool *evicted, double *evictedSample)
+{
+    uint16_t slot;
+    if (filter->count < filter->window) {
+        slot = (filter->head + filter->count) % filter->window;
+        filter->count++;
+        *evicted = false;
+    } else {
+        slot = filter->head;
+        filter->head = (filter->head + 1) % filter->window;
+        *evicted = true;
+        *evictedSample = filter->samples[slot];
+    }
+    filter->samples[slot] = sample;
+    return slot;
+}
+
+
+// Median heaps. low is a max-heap, high a min-heap, both of slots. low has as many elements as high, or one more.
+
+static inline bool heap_before(const kinetic_filter *filter, bool low, uint8_t a, uint8_t b)
+{
+    return low ? filter->samples[a] > filter->samples[b] : filter->samples[a] < filter->samples[b];
+}
+
+static void heap_set(kinetic_filter *filter, bool low, uint8_t index, uint8_t slot)
+{
+    (low ? filter->low : filter->high)[index] = slot;
+    filter->heapIndex[slot] = index;
+    filter->inLow[slot] = low;
+}
+
+static void heap_sift(kinetic_filter *filter, bool low, uint8_t index)
+{
+    uint8_t *heap = low ? filter->low : filter->high;
+    uint8_t size = low ? filter->lowSize : filter->highSize;
+    uint8_t slot = heap[index];
+    // up
+    while (index > 0) {
+        uint8_t parent = (uint8_t)((index - 1) / 2);
+        if (!heap_before(filter, low, slot, heap[parent])) {
+            break;
+        }
+        heap_set(filter, low, index, heap[parent]);
+        index = parent;
+    }
+    // down
+    for (;;) {
+        uint8_t child = (uint8_t)(2 * index + 1);
+        if (child >= size) {
+            break;
+        }
+        if (child + 1 < size && heap_before(filter, low, heap[child + 1], heap[child])) {
+            child++;
+        }
+        if (!heap_before(filter, low, heap[child], slot)) {
+            break;
+        }
+        heap_set(filter, low, index, heap[child]);
+        index = child;
+    }
+    heap_set(filter, low, index, slot);
+}
+
+static void heap_push(kinetic_filter *filter, bool low, uint8_t slot)
+{
+    uint8_t index = low ? filter->lowSize++ : filter->highSize++;
+    heap_set(filter, low, index, slot);
+    heap_sift(filter, low, index);
+}
+
+static uint8_t heap_pop(kinetic_filter *filter, bool low)
+{
+    uint8_t *heap = low ? filter->low : filter->high;
+    uint8_t top = heap[0];
+    uint8_t last = low ? --filter->lowSize : --filter->highSize;
+    if (last > 0) {
+        heap_set(filter, low, 0, heap[last]);
+        heap_sift(filter, low, 0);
+    }
+    return top;
+}
+
+static void median_balance(kinetic_filter *filter)
+{
+    if (filter->lowSize > filter->highSize + 1) {
+        heap_push(filter, false, heap_pop(filter, true));
+    } else if (filter->highSize > filter->lowSize) {
+        heap_push(filter, true, heap_pop(filter, false));
+    }
+    // a replaced sample may have crossed the middle
+    if (filter->highSize > 0 && filter->samples[filter->low[0]] > filter->samples[filter->high[0]]) {
+        uint8_t lowTop = filter->low[0];
+        uint8_t highTop = filter->high[0];
+        heap_set(filter, true, 0, highTop);
+        heap_set(filter, false, 0, lowTop);
+        heap_sift(filter, true, 0);
+        heap_sift(filter, false, 0);
+    }
+}
+
+static double median_update(kinetic_filter *filter, double sample)
+{
+    bool evicted;
+    double evictedSample;
+    uint8_t slot = (uint8_t)ring_push(filter, sample, &evicted, &evictedSample);
+    if (evicted) {
+        // the new sample takes the place of the oldest in its heap
+        heap_sift(filter, filter->inLow[slot], filter->heapIndex[slot]);
+    } else {
+        bool low = filter->lowSize == 0 || sample <= filter->samples[filter->low[0]];
+        heap_push(filter, low, slot);
+    }
+    median_balance(filter);
+    if (filter->lowSize > filter->highSize) {
+        return filter->samples[filter->low[0]];
+    }
+    return (filter->samples[filter->low[0]] + filter->samples[filter->high[0]]) * 0.5;
+}
+
+double kinetic_filter_update(kinetic_filter *filter, double sample)
+{
+    if (filter->zeroResets && sample == 0) {
+        kinetic_filter_reset(filter);
+        return 0;
+    }
+    bool evicted;
+    double evictedSample = 0;
+    switch (filter->type) {
+        case KINETIC_FILTER_SMA:
+            ring_push(filter, sample, &evicted, &evictedSample);
+            sum_add(filter, sample);
+            if (evicted) {
+                sum_add(filter, -evictedSample);
+            }
+            filter->value = sum_value(filter) / filter->count;
+            break;
+
+        case KINETIC_FILTER_EMA:
+            filter->value = filter->count == 0 ? sample : filter->value + filter->weight * (sample - filter->value);
+            filter->count = 1;
+            break;
+
+        case KINETIC_FILTER_WEIGHTED_SMA:
+            // sum holds the window without its newest sample
+            if (filter->count > 0) {
+                sum_add(filter, filter->samples[(filter->head + filter->count - 1) % filter->window]);
+            }
+            ring_push(filter, sample, &evicted, &evictedSample);
+            if (evicted) {
+                sum_add(filter, -evictedSample);
+            }
+            filter->value = (sample * filter->weight + sum_value(filter)) / (filter->weight + filter->count - 1);
+            break;
+
+        case KINETIC_FILTER_MEDIAN:
+            filter->value = median_update(filter, sample);
+            break;
+
+        case KINETIC_FILTER_NONE:
+        default:
+            filter->value = sample;
+            break;
+    }
+    return filter->value;
+}
+
+
+static double apply(const kinetic_channel_filters *filters, kinetic_channel channel, double value)
+{
+    kinetic_filter *filter = filters->channel[channel];
+    return filter != NULL ? kinetic_filter_update(filter, value) : value;
+}
+
+void inride_filter_power_data(const kinetic_channel_filters *filters, inride_power_data *data)
+{
+    KINETIC_TRACE_BEGIN(traceStart);
+    data->power = (int)lround(apply(filters, KINETIC_CHANNEL_POWER, data->power));
+    data->speedKPH = apply(filters, KINETIC_CHANNEL_SPEED, data->speedKPH);
+    data->cadenceRPM = apply(filters, KINETIC_CHANNEL_CADENCE, data->cadenceRPM);
+    data->rollerRPM = apply(filters, KINETIC_CHANNEL_ROLLER_RPM, data->rollerRPM);
+    KINETIC_TRACE_END(traceStart, "filter");
+}
+
+void smart_control_filter_power_data(const kinetic_channel_filters *filters, smart_control_power_data *data)
+{
+    KINETIC_TRACE_BEGIN(traceStart);
+    double power = apply(filters, KINETIC_CHANNEL_POWER, data->power);
+    double cadence = apply(filters, KINETIC_CHANNEL_CADENCE, data->cadenceRPM);
+    data->power = (uint16_t)lround(power < 0 ? 0 : power > 65535 ? 65535 : power);
+    data->speedKPH = apply(filters, KINETIC_CHANNEL_SPEED, data->speedKPH);
+    data->cadenceRPM = (uint8_t)lround(cadence < 0 ? 0 : cadence > 255 ? 255 : cadence);
+    KINETIC_TRACE_END(traceStart, "filter");
+}
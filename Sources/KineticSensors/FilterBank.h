@@ -0,0 +1,140 @@
+//
+//  FilterBank.h
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#ifndef FilterBank_h
+#define FilterBank_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "inRide.h"
+#include "SmartControl.h"
+
+// Smoothing filters for decoded channels (power, speed, cadence, roller RPM) of either device.
+// - Every filter is a plain struct with its storage inline (windows up to KINETIC_FILTER_WINDOW_MAX samples):
+//   keep as many as needed in arrays, nothing is allocated.
+// - Updates are constant time: running (compensated) sums for the averages, and two heaps over the window for the
+//   median (O(log window)).
+// - Weighted SMA is the average of the Objective-C cadence smoothing (setCadenceRollingParams:weight:): the newest
+//   sample counts weight times.
+// - zeroResets (set after init): a 0 sample restarts the filter and passes through (cadence: the rider stopped pedaling).
+
+#define KINETIC_FILTER_WINDOW_MAX       64
+
+
+/*! Filter Type */
+typedef enum kinetic_filter_type
+{
+    KINETIC_FILTER_NONE             = 0,
+    KINETIC_FILTER_SMA              = 1,
+    KINETIC_FILTER_EMA              = 2,
+    KINETIC_FILTER_WEIGHTED_SMA     = 3,
+    KINETIC_FILTER_MEDIAN           = 4
+} kinetic_filter_type;
+
+/*! Filter State */
+typedef struct kinetic_filter
+{
+    kinetic_filter_type type;
+    bool zeroResets;
+    uint16_t window;
+    uint16_t count;
+    /*! Slot of the oldest sample */
+    uint16_t head;
+    /*! EMA: weight of a new sample (0 ... 1). Weighted SMA: weight of the newest sample. */
+    double weight;
+    /*! Running sum and its compensation (SMA, weighted SMA) */
+    double sum;
+    double sumError;
+    double value;
+    double samples[KINETIC_FILTER_WINDOW_MAX];
+    /*! Median: max-heap of the lower half and min-heap of the upper half (slots), and where each slot is */
+    uint8_t low[KINETIC_FILTER_WINDOW_MAX];
+    uint8_t high[KINETIC_FILTER_WINDOW_MAX];
+    uint8_t lowSize;
+    uint8_t highSize;
+    uint8_t heapIndex[KINETIC_FILTER_WINDOW_MAX];
+    bool inLow[KINETIC_FILTER_WINDOW_MAX];
+} kinetic_filter;
+
+/*! Channels of the decoded power data */
+typedef enum kinetic_channel
+{
+    KINETIC_CHANNEL_POWER           = 0,
+    KINETIC_CHANNEL_SPEED           = 1,
+    KINETIC_CHANNEL_CADENCE         = 2,
+    KINETIC_CHANNEL_ROLLER_RPM      = 3,    // inRide only
+    KINETIC_CHANNEL_COUNT
+} kinetic_channel;
+
+/*! Filters of a device's channels (NULL leaves a channel as decoded) */
+typedef struct kinetic_channel_filters
+{
+    kinetic_filter *channel[KINETIC_CHANNEL_COUNT];
+} kinetic_channel_filters;
+
+
+/*!
+ Simple moving average.
+
+ @param filter Filter
+ @param window Samples averaged (1 ... KINETIC_FILTER_WINDOW_MAX)
+ */
+void kinetic_filter_init_sma(kinetic_filter *filter, uint16_t window);
+
+/*!
+ Exponential moving average.
+
+ @param filter Filter
+ @param alpha Weight of a new sample (0 ... 1, 2 / (N + 1) matches the lag of an N sample SMA)
+ */
+void kinetic_filter_init_ema(kinetic_filter *filter, double alpha);
+
+/*!
+ Moving average where the newest sample counts weight times.
+
+ @param filter Filter
+ @param window Samples averaged (1 ... KINETIC_FILTER_WINDOW_MAX)
+ @param weight Weight of the newest sample (1 is a simple moving average, less is taken as 1)
+ */
+void kinetic_filter_init_weighted_sma(kinetic_filter *filter, uint16_t window, double weight);
+
+/*!
+ Sliding median (removes spikes without smearing steps).
+
+ @param filter Filter
+ @param window Samples (1 ... KINETIC_FILTER_WINDOW_MAX)
+ */
+void kinetic_filter_init_median(kinetic_filter *filter, uint16_t window);
+
+/*!
+ Forgets the samples (keeps the configuration).
+ */
+void kinetic_filter_reset(kinetic_filter *filter);
+
+/*!
+ Adds a sample.
+
+ @param filter Filter
+ @param sample New sample
+
+ @return Filtered value
+ */
+double kinetic_filter_update(kinetic_filter *filter, double sample);
+
+/*!
+ Filters the channels of a decoded inRide update in place (power is rounded to the watt).
+ */
+void inride_filter_power_data(const kinetic_channel_filters *filters, inride_power_data *data);
+
+/*!
+ Filters the channels of a decoded Smart Control update in place (power and cadence are rounded).
+ */
+void smart_control_filter_power_data(const kinetic_channel_filters *filters, smart_control_power_data *data);
+
+
+#endif /* FilterBank_h */
@@ -0,0 +1,461 @@
+//
+//  FitWriter.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#include "FitWriter.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FitEpoch                631065600       // 1989-12-31 00:00 UTC in Unix time
+#define ProtocolVersion         0x20            // 2.0
+#define ProfileVersion          2132            // 21.32
+#define CrcPolynomial           0xA001          // CRC-16 (x^16 + x^15 + x^2 + 1), reflected
+#define MessageMax              64
+#define DistanceGapMax          10.0            // seconds, longer gaps do not add distance
+
+// Global message numbers
+#define MesgFileId              0
+#define MesgSession             18
+#define MesgLap                 19
+#define MesgRecord              20
+#define MesgActivity            34
+
+// Local message types (one definition each)
+#define LocalFileId             0
+#define LocalRecord             1
+#define LocalLap                2
+#define LocalSession            3
+#define LocalActivity           4
+
+// Base types
+#define Enum                    0x00
+#define UInt8                   0x02
+#define UInt16                  0x84
+#define UInt32                  0x86
+#define UInt32z                 0x8C
+
+typedef struct field
+{
+    uint8_t number;
+    uint8_t size;
+    uint8_t type;
+} field;
+
+static const field fileIdFields[] = {
+    { 0, 1, Enum },             // type: activity
+    { 1, 2, UInt16 },           // manufacturer
+    { 2, 2, UInt16 },           // product
+    { 3, 4, UInt32z },          // serial number
+    { 4, 4, UInt32 },           // time created
+};
+
+static const field recordFields[] = {
+    { 253, 4, UInt32 },         // timestamp
+    { 5, 4, UInt32 },           // distance (cm)
+    { 6, 2, UInt16 },           // speed (mm / s)
+    { 7, 2, UInt16 },           // power (W)
+    { 4, 1, UInt8 },            // cadence (RPM)
+};
+
+static const field lapFields[] = {
+    { 253, 4, UInt32 },         // timestamp
+    { 2, 4, UInt32 },           // start time
+    { 7, 4, UInt32 },           // total elapsed time (ms)
+    { 8, 4, UInt32 },           // total timer time (ms)
+    { 9, 4, UInt32 },           // total distance (cm)
+    { 19, 2, UInt16 },          // average power
+    { 20, 2, UInt16 },          // max power
+    { 0, 1, Enum },             // event: lap
+    { 1, 1, Enum },             // event type: stop
+};
+
+static const field sessionFields[] = {
+    { 253, 4, UInt32 },         // timestamp
+    { 2, 4, UInt32 },           // start time
+    { 7, 4, UInt32 },           // total elapsed time (ms)
+    { 8, 4, UInt32 },           // total timer time (ms)
+    { 9, 4, UInt32 },           // total distance (cm)
+    { 20, 2, UInt16 },          // average power
+    { 21, 2, UInt16 },          // max power
+    { 5, 1, Enum },             // sport: cycling
+    { 6, 1, Enum },             // sub sport: indoor cycling
+    { 0, 1, Enum },             // event: session
+    { 1, 1, Enum },             // event type: stop
+};
+
+static const field activityFields[] = {
+    { 253, 4, UInt32 },         // timestamp
+    { 0, 4, UInt32 },           // total timer time (ms)
+    { 1, 2, UInt16 },           // number of sessions
+    { 2, 1, Enum },             // type: manual
+    { 3, 1, Enum },             // event: activity
+    { 4, 1, Enum },             // event type: stop
+};
+
+#define FieldCount(fields)      (sizeof(fields) / sizeof(fields[0]))
+
+
+static uint16_t crc16(uint16_t crc, const uint8_t *data, size_t size)
+{
+    static const uint16_t table[16] = {
+        0x0000, 0xCC01, 0xD801, 0x1400, 0xF001, 0x3C00, 0x2800, 0xE401,
+        0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400
+    };
+    for (size_t index = 0; index < size; index++) {
+        uint8_t byte = data[index];
+        crc = (uint16_t)((crc >> 4) ^ table[crc & 0x0F] ^ table[byte & 0x0F]);
+        crc = (uint16_t)((crc >> 4) ^ table[crc & 0x0F] ^ table[byte >> 4]);
+    }
+    return crc;
+}
+
+// CRC combination (as zlib's crc32_combine): crc(A B) from crc(A), crc(B) and the length of B, with 16 x 16 GF(2)
+// matrices that feed zero bits through the CRC register.
+static uint16_t gf2_times(const uint16_t *matrix, uint16_t vector)
+{
+    uint16_t sum = 0;
+    for (; vector != 0; vector >>= 1, matrix++) {
+        if (vector & 1) {
+            sum ^= *matrix;
+        }
+    }
+    return sum;
+}
+
+static void gf2_square(uint16_t *square, const uint16_t *matrix)
+{
+    for (int n = 0; n < 16; n++) {
+        square[n] = gf2_times(matrix, matrix[n]);
+    }
+}
+
+static uint16_t crc16_combine(uint16_t crcA, uint16_t crcB, uint32_t sizeB)
+{
+    if (sizeB == 0) {
+        return crcA;
+    }
+    uint16_t even[16];
+    uint16_t odd[16];
+    odd[0] = CrcPolynomial;     // one zero bit
+    for (int n = 1; n < 16; n++) {
+        odd[n] = (uint16_t)(1u << (n - 1));
+    }
+    gf2_square(even, odd);      // two zero bits
+    gf2_square(odd, even);      // four zero bits
+    do {
+        gf2_square(even, odd);
+        if (sizeB & 1) {
+            crcA = gf2_times(even, crcA);
+        }
+        sizeB >>= 1;
+        if (sizeB == 0) {
+            break;
+        }
+        gf2_square(odd, even);
+        if (sizeB & 1) {
+            crcA = gf2_times(odd, crcA);
+        }
+        sizeB >>= 1;
+    } while (sizeB != 0);
+    return crcA ^ crcB;
+}
+
+
+static inline size_t put16(uint8_t *data, size_t offset, uint32_t value)
+{
+    data[offset] = (uint8_t)value;
+    data[offset + 1] = (uint8_t)(value >> 8);
+    return offset + 2;
+}
+
+static inline size_t put32(uint8_t *data, size_t offset, uint32_t value)
+{
+    offset = put16(data, offset, value);
+    return put16(data, offset, value >> 16);
+}
+
+static bool write_all(int fd, const uint8_t *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+static bool write_header(kinetic_fit_writer *writer, uint8_t header[KINETIC_FIT_HEADER_SIZE])
+{
+    header[0] = KINETIC_FIT_HEADER_SIZE;
+    header[1] = ProtocolVersion;
+    put16(header, 2, ProfileVersion);
+    put32(header, 4, writer->dataSize);
+    memcpy(&header[8], ".FIT", 4);
+    put16(header, 12, crc16(0, header, 12));
+    for (size_t offset = 0; offset < KINETIC_FIT_HEADER_SIZE;) {
+        ssize_t written = pwrite(writer->fd, &header[offset], KINETIC_FIT_HEADER_SIZE - offset, (off_t)offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        offset += (size_t)written;
+    }
+    return true;
+}
+
+static bool write_buffer(kinetic_fit_writer *writer)
+{
+    if (writer->used > 0 && !writer->failed) {
+        writer->failed = !write_all(writer->fd, writer->buffer, writer->used);
+    }
+    writer->used = 0;
+    return !writer->failed;
+}
+
+static void emit(kinetic_fit_writer *writer, const uint8_t *message, size_t size)
+{
+    if (writer->used + size > writer->capacity) {
+        write_buffer(writer);
+    }
+    memcpy(&writer->buffer[writer->used], message, size);
+    writer->used += size;
+    writer->dataSize += (uint32_t)size;
+    writer->dataCrc = crc16(writer->dataCrc, message, size);
+}
+
+static void emit_definition(kinetic_fit_writer *writer, uint8_t local, uint16_t global, const field *fields, size_t count)
+{
+    uint8_t message[MessageMax];
+    message[0] = 0x40 | local;  // definition message header
+    message[1] = 0;             // reserved
+    message[2] = 0;             // little endian
+    put16(message, 3, global);
+    message[5] = (uint8_t)count;
+    size_t size = 6;
+    for (size_t index = 0; index < count; index++) {
+        message[size++] = fields[index].number;
+        message[size++] = fields[index].size;
+        message[size++] = fields[index].type;
+    }
+    emit(writer, message, size);
+}
+
+bool kinetic_fit_writer_open_fd(kinetic_fit_writer *writer, int fd, uint8_t *buffer, size_t capacity, double startTime, uint16_t product, uint32_t serialNumber)
+{
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = fd;
+    writer->buffer = buffer;
+    writer->capacity = capacity;
+    writer->startTime = (uint32_t)(startTime - FitEpoch);
+    if (fd < 0 || capacity < MessageMax) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        writer->fd = -1;
+        writer->failed = true;
+        return false;
+    }
+
+    uint8_t header[KINETIC_FIT_HEADER_SIZE];
+    if (!write_header(writer, header) || lseek(fd, KINETIC_FIT_HEADER_SIZE, SEEK_SET) < 0) {
+        close(fd);
+        writer->fd = -1;
+        writer->failed = true;
+        return false;
+    }
+
+    uint8_t message[MessageMax];
+    emit_definition(writer, LocalFileId, MesgFileId, fileIdFields, FieldCount(fileIdFields));
+    message[0] = LocalFileId;
+    message[1] = 4;             // activity
+    put16(message, 2, 255);     // development
+    put16(message, 4, product);
+    put32(message, 6, serialNumber != 0 ? serialNumber : 1);
+    put32(message, 10, writer->startTime);
+    emit(writer, message, 14);
+
+    emit_definition(writer, LocalRecord, MesgRecord, recordFields, FieldCount(recordFields));
+    return true;
+}
+
+bool kinetic_fit_writer_open(kinetic_fit_writer *writer, const char *path, uint8_t *buffer, size_t capacity, double startTime, uint16_t product, uint32_t serialNumber)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    return kinetic_fit_writer_open_fd(writer, fd, buffer, capacity, startTime, product, serialNumber);
+}
+
+// Writes the record of the second accumulated so far
+static void emit_record(kinetic_fit_writer *writer)
+{
+    if (!writer->hasSecond || writer->samples == 0) {
+        return;
+    }
+    double power = writer->powerSum / writer->samples;
+    double speed = writer->speedSum / writer->samples / 3.6;
+    double cadence = writer->cadenceSum / writer->samples;
+
+    uint8_t message[MessageMax];
+    message[0] = LocalRecord;
+    size_t size = put32(message, 1, writer->second);
+    size = put32(message, size, (uint32_t)llround(writer->distance * 100.0));
+    size = put16(message, size, (uint32_t)lround(fmin(speed * 1000.0, 65534)));
+    size = put16(message, size, (uint32_t)lround(fmin(power, 65534)));
+    message[size++] = (uint8_t)lround(fmin(cadence, 254));
+    emit(writer, message, size);
+
+    uint16_t watts = (uint16_t)lround(fmin(power, 65534));
+    writer->ridePowerSum += watts;
+    writer->rideSeconds++;
+    if (watts > writer->maxPower) {
+        writer->maxPower = watts;
+    }
+    writer->powerSum = 0;
+    writer->speedSum = 0;
+    writer->cadenceSum = 0;
+    writer->samples = 0;
+}
+
+bool kinetic_fit_writer_add(kinetic_fit_writer *writer, double timestamp, double power, double speedKPH, double cadenceRPM)
+{
+    if (writer->failed) {
+        return false;
+    }
+    power = power > 0 ? power : 0;
+    speedKPH = speedKPH > 0 ? speedKPH : 0;
+    cadenceRPM = cadenceRPM > 0 ? cadenceRPM : 0;
+
+    uint32_t second = (uint32_t)floor(timestamp - FitEpoch);
+    if (!writer->hasSecond || second > writer->second) {
+        emit_record(writer);
+        writer->second = second;
+        writer->hasSecond = true;
+    }
+
+    if (writer->lastTimestamp > 0) {
+        double elapsed = timestamp - writer->lastTimestamp;
+        if (elapsed > 0 && elapsed <= DistanceGapMax) {
+            writer->distance += (writer->lastSpeed + speedKPH) * 0.5 / 3.6 * elapsed;
+        }
+    }
+    if (timestamp >= writer->lastTimestamp) {
+        writer->lastTimestamp = timestamp;
+    }
+    writer->lastSpeed = speedKPH;
+    writer->powerSum += power;
+    writer->speedSum += speedKPH;
+    writer->cadenceSum += cadenceRPM;
+    writer->samples++;
+    return !writer->failed;
+}
+
+bool inride_fit_writer_add(kinetic_fit_writer *writer, double timestamp, const inride_power_data *data)
+{
+    return kinetic_fit_writer_add(writer, timestamp, data->power, data->speedKPH, data->cadenceRPM);
+}
+
+bool smart_control_fit_writer_add(kinetic_fit_writer *writer, double timestamp, const smart_control_power_data *data)
+{
+    return kinetic_fit_writer_add(writer, timestamp, data->power, data->speedKPH, data->cadenceRPM);
+}
+
+bool kinetic_fit_writer_add_record(kinetic_fit_writer *writer, double timestamp, const kinetic_sample_record *record)
+{
+    return kinetic_fit_writer_add(writer, timestamp, record->power, record->speed / 1000.0, record->cadence / 10.0);
+}
+
+bool kinetic_fit_writer_flush(kinetic_fit_writer *writer)
+{
+    if (!write_buffer(writer)) {
+        return false;
+    }
+    uint8_t header[KINETIC_FIT_HEADER_SIZE];
+    writer->failed = !write_header(writer, header);
+    return !writer->failed;
+}
+
+static void emit_summary(kinetic_fit_writer *writer)
+{
+    uint32_t end = writer->hasSecond ? writer->second + 1 : writer->startTime;
+    uint32_t elapsed = (end > writer->startTime ? end - writer->startTime : 0) * 1000;
+    uint32_t timer = writer->rideSeconds * 1000;
+    uint32_t distance = (uint32_t)llround(writer->distance * 100.0);
+    uint16_t averagePower = (uint16_t)(writer->rideSeconds > 0 ? lround(writer->ridePowerSum / writer->rideSeconds) : 0);
+    uint8_t message[MessageMax];
+    size_t size;
+
+    emit_definition(writer, LocalLap, MesgLap, lapFields, FieldCount(lapFields));
+    message[0] = LocalLap;
+    size = put32(message, 1, end);
+    size = put32(message, size, writer->startTime);
+    size = put32(message, size, elapsed);
+    size = put32(message, size, timer);
+    size = put32(message, size, distance);
+    size = put16(message, size, averagePower);
+    size = put16(message, size, writer->maxPower);
+    message[size++] = 9;        // lap
+    message[size++] = 1;        // stop
+    emit(writer, message, size);
+
+    emit_definition(writer, LocalSession, MesgSession, sessionFields, FieldCount(sessionFields));
+    message[0] = LocalSession;
+    size = put32(message, 1, end);
+    size = put32(message, size, writer->startTime);
+    size = put32(message, size, elapsed);
+    size = put32(message, size, timer);
+    size = put32(message, size, distance);
+    size = put16(message, size, averagePower);
+    size = put16(message, size, writer->maxPower);
+    message[size++] = 2;        // cycling
+    message[size++] = 6;        // indoor cycling
+    message[size++] = 8;        // session
+    message[size++] = 1;        // stop
+    emit(writer, message, size);
+
+    emit_definition(writer, LocalActivity, MesgActivity, activityFields, FieldCount(activityFields));
+    message[0] = LocalActivity;
+    size = put32(message, 1, end);
+    size = put32(message, size, timer);
+    size = put16(message, size, 1);
+    message[size++] = 0;        // manual
+    message[size++] = 26;       // activity
+    message[size++] = 1;        // stop
+    emit(writer, message, size);
+}
+
+bool kinetic_fit_writer_close(kinetic_fit_writer *writer)
+{
+    if (writer->fd < 0) {
+        return false;
+    }
+    if (!writer->failed) {
+        emit_record(writer);
+        emit_summary(writer);
+        write_buffer(writer);
+    }
+    if (!writer->failed) {
+        uint8_t header[KINETIC_FIT_HEADER_SIZE];
+        writer->failed = !write_header(writer, header);
+        uint8_t crc[2];
+        put16(crc, 0, crc16_combine(crc16(0, header, KINETIC_FIT_HEADER_SIZE), writer->dataCrc, writer->dataSize));
+        writer->failed = writer->failed || !write_all(writer->fd, crc, sizeof(crc));
+    }
+    if (close(writer->fd) != 0) {
+        writer->failed = true;
+    }
+    writer->fd = -1;
+    return !writer->failed;
+}
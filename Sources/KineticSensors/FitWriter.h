@@ -0,0 +1,113 @@
+//
+//  FitWriter.h
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#ifndef FitWriter_h
+#define FitWriter_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "inRide.h"
+#include "SmartControl.h"
+#include "SampleRecord.h"
+
+// Streaming FIT activity file writer.
+// - Samples are written as they come through a fixed buffer (caller storage): memory does not grow with the ride.
+// - The samples of each second are averaged into one record message (timestamp, power, speed, cadence, distance).
+//   Distance is integrated from the speed.
+// - The definition messages are written once at the start. Lap, session and activity messages are written at close.
+// - The header (data size) is patched in place (pwrite) at every flush and at close, so a file cut short by a crash is
+//   readable up to its last flush. The file CRC is computed while streaming and joined with the final header's CRC
+//   (CRC combination), the data is never read back.
+
+#define KINETIC_FIT_HEADER_SIZE         14
+
+
+/*! Writer State */
+typedef struct kinetic_fit_writer
+{
+    int fd;
+    uint8_t *buffer;
+    size_t capacity;
+    size_t used;
+    /*! Bytes after the header, and their CRC */
+    uint32_t dataSize;
+    uint16_t dataCrc;
+    bool failed;
+
+    /*! FIT time (seconds since 1989-12-31 00:00 UTC) of the start, and of the second being accumulated */
+    uint32_t startTime;
+    uint32_t second;
+    bool hasSecond;
+    double lastTimestamp;
+    double lastSpeed;
+    double distance;
+
+    /*! Samples of the current second */
+    double powerSum;
+    double speedSum;
+    double cadenceSum;
+    uint32_t samples;
+
+    /*! Ride totals */
+    double ridePowerSum;
+    uint32_t rideSeconds;
+    uint16_t maxPower;
+} kinetic_fit_writer;
+
+
+/*!
+ Creates a FIT activity file.
+
+ @param writer Writer
+ @param path File path (replaced if it exists)
+ @param buffer Output buffer (at least 64 bytes, a few KB keeps the writes rare)
+ @param capacity Size of the buffer
+ @param startTime Start of the ride (Unix time, seconds)
+ @param product Product identifier written in the file id
+ @param serialNumber Serial number written in the file id (e.g. from the System Id)
+
+ @return false if the file cannot be created
+ */
+bool kinetic_fit_writer_open(kinetic_fit_writer *writer, const char *path, uint8_t *buffer, size_t capacity, double startTime, uint16_t product, uint32_t serialNumber);
+
+/*!
+ Same as kinetic_fit_writer_open on a file descriptor open for writing (must support pwrite). The writer closes it.
+ */
+bool kinetic_fit_writer_open_fd(kinetic_fit_writer *writer, int fd, uint8_t *buffer, size_t capacity, double startTime, uint16_t product, uint32_t serialNumber);
+
+/*!
+ Adds a sample.
+
+ @param writer Writer
+ @param timestamp Unix time (seconds), not decreasing
+ @param power Watts
+ @param speedKPH Speed
+ @param cadenceRPM Cadence
+
+ @return false if writing failed (the writer stays failed)
+ */
+bool kinetic_fit_writer_add(kinetic_fit_writer *writer, double timestamp, double power, double speedKPH, double cadenceRPM);
+
+bool inride_fit_writer_add(kinetic_fit_writer *writer, double timestamp, const inride_power_data *data);
+bool smart_control_fit_writer_add(kinetic_fit_writer *writer, double timestamp, const smart_control_power_data *data);
+bool kinetic_fit_writer_add_record(kinetic_fit_writer *writer, double timestamp, const kinetic_sample_record *record);
+
+/*!
+ Writes the buffer to the file and updates the header (the file is valid up to here, but for its CRC).
+ */
+bool kinetic_fit_writer_flush(kinetic_fit_writer *writer);
+
+/*!
+ Writes the last record and the summary messages, the CRC and the final header, and closes the file.
+
+ @return false if anything failed to write
+ */
+bool kinetic_fit_writer_close(kinetic_fit_writer *writer);
+
+
+#endif /* FitWriter_h */
@@ -0,0 +1,290 @@
+//
+//  FitnessMachine.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#include "FitnessMachine.h"
+
+#include <math.h>
+#include <string.h>
+
+// Offset of the zeroed scratch area in the decode buffer (past any value), absent fields point there
+#define Scratch                 32
+#define ScratchSize             8
+
+
+// Indoor Bike Data layouts. Fields 0 ... 7 depend on the low byte of the flags (bit 0 is inverted: speed is present
+// when it is clear), fields 8 ... 12 on bits 8 ... 12. The high fields follow the low ones, so their offsets are
+// relative: the absolute offset is offset + base x present, which keeps absent fields at the scratch area without a branch.
+
+#define Bit(f, b)               (((f) >> (b)) & 1)
+
+#define LowPresent0(f)          (!Bit(f, 0))
+#define LowPresent(f, k)        ((k) == 0 ? LowPresent0(f) : Bit(f, k))
+#define LowOffset1(f)           (LowPresent0(f) * 2)
+#define LowOffset2(f)           (LowOffset1(f) + Bit(f, 1) * 2)
+#define LowOffset3(f)           (LowOffset2(f) + Bit(f, 2) * 2)
+#define LowOffset4(f)           (LowOffset3(f) + Bit(f, 3) * 2)
+#define LowOffset5(f)           (LowOffset4(f) + Bit(f, 4) * 3)
+#define LowOffset6(f)           (LowOffset5(f) + Bit(f, 5) * 2)
+#define LowOffset7(f)           (LowOffset6(f) + Bit(f, 6) * 2)
+#define LowSize(f)              (LowOffset7(f) + Bit(f, 7) * 2)
+#define LowField(f, k, offset)  (LowPresent(f, k) ? 2 + (offset) : Scratch)
+#define LowLayout(f)            { { LowField(f, 0, 0), LowField(f, 1, LowOffset1(f)), LowField(f, 2, LowOffset2(f)), LowField(f, 3, LowOffset3(f)), \
+                                    LowField(f, 4, LowOffset4(f)), LowField(f, 5, LowOffset5(f)), LowField(f, 6, LowOffset6(f)), LowField(f, 7, LowOffset7(f)) }, \
+                                  LowSize(f) },
+
+#define HighOffset1(f)          (Bit(f, 0) * 5)
+#define HighOffset2(f)          (HighOffset1(f) + Bit(f, 1))
+#define HighOffset3(f)          (HighOffset2(f) + Bit(f, 2))
+#define HighOffset4(f)          (HighOffset3(f) + Bit(f, 3) * 2)
+#define HighSize(f)             (HighOffset4(f) + Bit(f, 4) * 2)
+#define HighField(f, k, offset) (Bit(f, k) ? (offset) : Scratch)
+#define HighLayout(f)           { { HighField(f, 0, 0), HighField(f, 1, HighOffset1(f)), HighField(f, 2, HighOffset2(f)), HighField(f, 3, HighOffset3(f)), \
+                                    HighField(f, 4, HighOffset4(f)) }, \
+                                  HighSize(f), (f) },
+
+#define Repeat4(M, n)           M(n) M((n) + 1) M((n) + 2) M((n) + 3)
+#define Repeat16(M, n)          Repeat4(M, n) Repeat4(M, (n) + 4) Repeat4(M, (n) + 8) Repeat4(M, (n) + 12)
+#define Repeat64(M, n)          Repeat16(M, n) Repeat16(M, (n) + 16) Repeat16(M, (n) + 32) Repeat16(M, (n) + 48)
+#define Repeat256(M, n)         Repeat64(M, n) Repeat64(M, (n) + 64) Repeat64(M, (n) + 128) Repeat64(M, (n) + 192)
+
+typedef struct low_layout
+{
+    uint8_t offset[8];
+    uint8_t size;
+} low_layout;
+
+typedef struct high_layout
+{
+    uint8_t offset[5];
+    uint8_t size;
+    uint8_t present;
+} high_layout;
+
+static const low_layout lowLayouts[256] = { Repeat256(LowLayout, 0) };
+static const high_layout highLayouts[32] = { Repeat16(HighLayout, 0) Repeat16(HighLayout, 16) };
+
+
+static inline uint16_t u16(const uint8_t *data)
+{
+    return (uint16_t)(data[0] | (data[1] << 8));
+}
+
+static inline int16_t s16(const uint8_t *data)
+{
+    return (int16_t)u16(data);
+}
+
+static inline uint32_t u24(const uint8_t *data)
+{
+    return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16);
+}
+
+static inline uint32_t u32(const uint8_t *data)
+{
+    return u24(data) | ((uint32_t)data[3] << 24);
+}
+
+static inline size_t put16(uint8_t *data, size_t offset, int32_t value)
+{
+    data[offset] = (uint8_t)value;
+    data[offset + 1] = (uint8_t)(value >> 8);
+    return offset + 2;
+}
+
+static inline int32_t clamp(double value, int32_t minimum, int32_t maximum)
+{
+    long rounded = lround(value);
+    return (int32_t)(rounded < minimum ? minimum : rounded > maximum ? maximum : rounded);
+}
+
+
+bool ftms_process_indoor_bike_data(const uint8_t *data, size_t size, ftms_indoor_bike_data *bikeData)
+{
+    if (size < 2) {
+        return false;
+    }
+    uint16_t flags = u16(data);
+    const low_layout *low = &lowLayouts[flags & 0xFF];
+    const high_layout *high = &highLayouts[(flags >> 8) & 0x1F];
+    size_t length = 2 + low->size + high->size;
+    if (size < length) {
+        return false;
+    }
+
+    uint8_t buffer[Scratch + ScratchSize];
+    memcpy(buffer, data, length);
+    memset(&buffer[length], 0, sizeof(buffer) - length);
+
+    const uint8_t *o = low->offset;
+    uint8_t base = (uint8_t)(2 + low->size);
+    uint8_t present = high->present;
+    const uint8_t *energy = &buffer[high->offset[0] + base * Bit(present, 0)];
+
+    bikeData->present = (uint16_t)((flags ^ 1) & 0x1FFF);
+    bikeData->speedKPH = u16(&buffer[o[0]]) * 0.01;
+    bikeData->averageSpeedKPH = u16(&buffer[o[1]]) * 0.01;
+    bikeData->cadenceRPM = u16(&buffer[o[2]]) * 0.5;
+    bikeData->averageCadenceRPM = u16(&buffer[o[3]]) * 0.5;
+    bikeData->totalDistance = u24(&buffer[o[4]]);
+    bikeData->resistanceLevel = s16(&buffer[o[5]]);
+    bikeData->power = s16(&buffer[o[6]]);
+    bikeData->averagePower = s16(&buffer[o[7]]);
+    bikeData->totalEnergy = u16(&energy[0]);
+    bikeData->energyPerHour = u16(&energy[2]);
+    bikeData->energyPerMinute = energy[4];
+    bikeData->heartRate = buffer[high->offset[1] + base * Bit(present, 1)];
+    bikeData->metabolicEquivalent = buffer[high->offset[2] + base * Bit(present, 2)] * 0.1;
+    bikeData->elapsedTime = u16(&buffer[high->offset[3] + base * Bit(present, 3)]);
+    bikeData->remainingTime = u16(&buffer[high->offset[4] + base * Bit(present, 4)]);
+    return true;
+}
+
+bool ftms_process_feature(const uint8_t *data, size_t size, ftms_feature *feature)
+{
+    if (size < 8) {
+        return false;
+    }
+    feature->machine = u32(data);
+    feature->targetSetting = u32(&data[4]);
+    return true;
+}
+
+static bool process_range(const uint8_t *data, size_t size, double resolution, ftms_range *range)
+{
+    if (size < 6) {
+        return false;
+    }
+    range->minimum = s16(data) * resolution;
+    range->maximum = s16(&data[2]) * resolution;
+    range->increment = u16(&data[4]) * resolution;
+    return true;
+}
+
+bool ftms_process_resistance_range(const uint8_t *data, size_t size, ftms_range *range)
+{
+    return process_range(data, size, 0.1, range);
+}
+
+bool ftms_process_power_range(const uint8_t *data, size_t size, ftms_range *range)
+{
+    return process_range(data, size, 1.0, range);
+}
+
+bool ftms_process_status(const uint8_t *data, size_t size, ftms_status *status)
+{
+    if (size < 1 || size - 1 > sizeof(status->parameters)) {
+        return false;
+    }
+    status->opcode = data[0];
+    status->parameterSize = (uint8_t)(size - 1);
+    memcpy(status->parameters, &data[1], size - 1);
+    return true;
+}
+
+bool ftms_process_training_status(const uint8_t *data, size_t size, ftms_training_status *status)
+{
+    if (size < 2) {
+        return false;
+    }
+    status->flags = data[0];
+    status->status = data[1];
+    return true;
+}
+
+bool ftms_process_control_response(const uint8_t *data, size_t size, ftms_control_response *response)
+{
+    if (size < 3 || data[0] != FTMS_CONTROL_RESPONSE || size - 3 > sizeof(response->parameters)) {
+        return false;
+    }
+    response->requestOpcode = (ftms_control_opcode)data[1];
+    response->result = (ftms_control_result)data[2];
+    response->parameterSize = (uint8_t)(size - 3);
+    memcpy(response->parameters, &data[3], size - 3);
+    return true;
+}
+
+
+static size_t opcode_command(ftms_control_opcode opcode, uint8_t *data)
+{
+    data[0] = opcode;
+    return 1;
+}
+
+size_t ftms_request_control_command(uint8_t *data)
+{
+    return opcode_command(FTMS_CONTROL_REQUEST_CONTROL, data);
+}
+
+size_t ftms_reset_command(uint8_t *data)
+{
+    return opcode_command(FTMS_CONTROL_RESET, data);
+}
+
+size_t ftms_start_command(uint8_t *data)
+{
+    return opcode_command(FTMS_CONTROL_START_OR_RESUME, data);
+}
+
+size_t ftms_stop_command(bool stop, uint8_t *data)
+{
+    data[0] = FTMS_CONTROL_STOP_OR_PAUSE;
+    data[1] = stop ? 0x01 : 0x02;
+    return 2;
+}
+
+size_t ftms_set_target_power_command(int16_t watts, uint8_t *data)
+{
+    data[0] = FTMS_CONTROL_SET_TARGET_POWER;
+    return put16(data, 1, watts);
+}
+
+size_t ftms_set_target_resistance_command(double level, uint8_t *data)
+{
+    data[0] = FTMS_CONTROL_SET_TARGET_RESISTANCE;
+    data[1] = (uint8_t)clamp(level * 10.0, 0, UINT8_MAX);
+    return 2;
+}
+
+size_t ftms_set_target_speed_command(double speedKPH, uint8_t *data)
+{
+    data[0] = FTMS_CONTROL_SET_TARGET_SPEED;
+    return put16(data, 1, clamp(speedKPH * 100.0, 0, UINT16_MAX));
+}
+
+size_t ftms_set_target_inclination_command(double grade, uint8_t *data)
+{
+    data[0] = FTMS_CONTROL_SET_TARGET_INCLINATION;
+    return put16(data, 1, clamp(grade * 10.0, INT16_MIN, INT16_MAX));
+}
+
+size_t ftms_set_target_cadence_command(double cadenceRPM, uint8_t *data)
+{
+    data[0] = FTMS_CONTROL_SET_TARGET_CADENCE;
+    return put16(data, 1, clamp(cadenceRPM * 2.0, 0, UINT16_MAX));
+}
+
+size_t ftms_set_simulation_command(double windSpeedMPS, double grade, double rollingCoeff, double windCoeff, uint8_t *data)
+{
+    data[0] = FTMS_CONTROL_SET_SIMULATION;
+    size_t offset = put16(data, 1, clamp(windSpeedMPS * 1000.0, INT16_MIN, INT16_MAX));
+    offset = put16(data, offset, clamp(grade * 100.0, INT16_MIN, INT16_MAX));
+    data[offset++] = (uint8_t)clamp(rollingCoeff * 10000.0, 0, UINT8_MAX);
+    data[offset++] = (uint8_t)clamp(windCoeff * 100.0, 0, UINT8_MAX);
+    return offset;
+}
+
+size_t ftms_set_wheel_circumference_command(double millimeters, uint8_t *data)
+{
+    data[0] = FTMS_CONTROL_SET_WHEEL_CIRCUMFERENCE;
+    return put16(data, 1, clamp(millimeters * 10.0, 0, UINT16_MAX));
+}
+
+size_t ftms_spin_down_command(bool start, uint8_t *data)
+{
+    data[0] = FTMS_CONTROL_SPIN_DOWN;
+    data[1] = start ? 0x01 : 0x02;
+    return 2;
+}
@@ -0,0 +1,201 @@
+//
+//  FitnessMachine.h
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#ifndef FitnessMachine_h
+#define FitnessMachine_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Fitness Machine Service (FTMS) codec: Indoor Bike Data, Control Point requests and responses, Feature, Status,
+// Training Status and the supported ranges.
+// - The characteristics have the same identifiers over BLE (UUID16) and over USB (smart_control_usb_packet identifier).
+// - Indoor Bike Data: the flags word selects which fields follow. The field offsets of every flags value are tables
+//   built at compile time (one for the low byte, one for the high bits), and absent fields read from a zeroed scratch
+//   area: a notification decodes with the same straight line of loads whatever fields it has. present tells which are real.
+// - Control Point requests are encoded into caller buffers (FTMS_CONTROL_POINT_MAX bytes). Nothing is allocated.
+
+#define FTMS_SERVICE_UUID16                         0x1826
+
+#define FTMS_CHARACTERISTIC_FEATURE                 0x2ACC
+#define FTMS_CHARACTERISTIC_TRAINING_STATUS         0x2AD3
+#define FTMS_CHARACTERISTIC_INDOOR_BIKE_DATA        0x2AD2
+#define FTMS_CHARACTERISTIC_RESISTANCE_RANGE        0x2AD6
+#define FTMS_CHARACTERISTIC_POWER_RANGE             0x2AD8
+#define FTMS_CHARACTERISTIC_CONTROL_POINT           0x2AD9
+#define FTMS_CHARACTERISTIC_STATUS                  0x2ADA
+
+/*! Largest Indoor Bike Data value (every field present) */
+#define FTMS_INDOOR_BIKE_DATA_MAX                   30
+
+/*! Largest Control Point request */
+#define FTMS_CONTROL_POINT_MAX                      7
+
+
+/*! Indoor Bike Data fields (bits of ftms_indoor_bike_data.present) */
+typedef enum ftms_bike_field
+{
+    FTMS_BIKE_SPEED                 = 1 << 0,
+    FTMS_BIKE_AVERAGE_SPEED         = 1 << 1,
+    FTMS_BIKE_CADENCE               = 1 << 2,
+    FTMS_BIKE_AVERAGE_CADENCE       = 1 << 3,
+    FTMS_BIKE_TOTAL_DISTANCE        = 1 << 4,
+    FTMS_BIKE_RESISTANCE_LEVEL      = 1 << 5,
+    FTMS_BIKE_POWER                 = 1 << 6,
+    FTMS_BIKE_AVERAGE_POWER         = 1 << 7,
+    FTMS_BIKE_EXPENDED_ENERGY       = 1 << 8,
+    FTMS_BIKE_HEART_RATE            = 1 << 9,
+    FTMS_BIKE_METABOLIC_EQUIVALENT  = 1 << 10,
+    FTMS_BIKE_ELAPSED_TIME          = 1 << 11,
+    FTMS_BIKE_REMAINING_TIME        = 1 << 12
+} ftms_bike_field;
+
+/*! Indoor Bike Data (fields not in present are 0) */
+typedef struct ftms_indoor_bike_data
+{
+    uint16_t present;
+    double speedKPH;
+    double averageSpeedKPH;
+    double cadenceRPM;
+    double averageCadenceRPM;
+    /*! Meters */
+    uint32_t totalDistance;
+    int16_t resistanceLevel;
+    int16_t power;
+    int16_t averagePower;
+    /*! Kilo Calories, total / per hour / per minute */
+    uint16_t totalEnergy;
+    uint16_t energyPerHour;
+    uint8_t energyPerMinute;
+    uint8_t heartRate;
+    double metabolicEquivalent;
+    /*! Seconds */
+    uint16_t elapsedTime;
+    uint16_t remainingTime;
+} ftms_indoor_bike_data;
+
+/*! Control Point Op Codes */
+typedef enum ftms_control_opcode
+{
+    FTMS_CONTROL_REQUEST_CONTROL            = 0x00,
+    FTMS_CONTROL_RESET                      = 0x01,
+    FTMS_CONTROL_SET_TARGET_SPEED           = 0x02,
+    FTMS_CONTROL_SET_TARGET_INCLINATION     = 0x03,
+    FTMS_CONTROL_SET_TARGET_RESISTANCE      = 0x04,
+    FTMS_CONTROL_SET_TARGET_POWER           = 0x05,
+    FTMS_CONTROL_SET_TARGET_HEART_RATE      = 0x06,
+    FTMS_CONTROL_START_OR_RESUME            = 0x07,
+    FTMS_CONTROL_STOP_OR_PAUSE              = 0x08,
+    FTMS_CONTROL_SET_SIMULATION             = 0x11,
+    FTMS_CONTROL_SET_WHEEL_CIRCUMFERENCE    = 0x12,
+    FTMS_CONTROL_SPIN_DOWN                  = 0x13,
+    FTMS_CONTROL_SET_TARGET_CADENCE         = 0x14,
+    FTMS_CONTROL_RESPONSE                   = 0x80
+} ftms_control_opcode;
+
+/*! Control Point Result Codes */
+typedef enum ftms_control_result
+{
+    FTMS_RESULT_SUCCESS                     = 0x01,
+    FTMS_RESULT_NOT_SUPPORTED               = 0x02,
+    FTMS_RESULT_INVALID_PARAMETER           = 0x03,
+    FTMS_RESULT_FAILED                      = 0x04,
+    FTMS_RESULT_CONTROL_NOT_PERMITTED       = 0x05
+} ftms_control_result;
+
+/*! Control Point Response (indication) */
+typedef struct ftms_control_response
+{
+    ftms_control_opcode requestOpcode;
+    ftms_control_result result;
+    /*! Response parameters (e.g. the spin down target speeds) */
+    uint8_t parameters[16];
+    uint8_t parameterSize;
+} ftms_control_response;
+
+/*! Fitness Machine Feature */
+typedef struct ftms_feature
+{
+    /*! Fitness Machine Features (bit 14: power measurement, bit 1: cadence, ...) */
+    uint32_t machine;
+    /*! Target Setting Features (bit 3: power, bit 13: simulation parameters, ...) */
+    uint32_t targetSetting;
+} ftms_feature;
+
+/*! Supported Resistance Level or Power Range */
+typedef struct ftms_range
+{
+    double minimum;
+    double maximum;
+    double increment;
+} ftms_range;
+
+/*! Fitness Machine Status (notification) */
+typedef struct ftms_status
+{
+    uint8_t opcode;
+    uint8_t parameters[16];
+    uint8_t parameterSize;
+} ftms_status;
+
+/*! Training Status */
+typedef struct ftms_training_status
+{
+    uint8_t flags;
+    uint8_t status;
+} ftms_training_status;
+
+
+/*!
+ Decodes an Indoor Bike Data notification.
+
+ @param data Characteristic value
+ @param size Size of the value
+ @param bikeData Output
+
+ @return false if the value is shorter than its flags announce
+ */
+bool ftms_process_indoor_bike_data(const uint8_t *data, size_t size, ftms_indoor_bike_data *bikeData);
+
+bool ftms_process_feature(const uint8_t *data, size_t size, ftms_feature *feature);
+bool ftms_process_resistance_range(const uint8_t *data, size_t size, ftms_range *range);
+bool ftms_process_power_range(const uint8_t *data, size_t size, ftms_range *range);
+bool ftms_process_status(const uint8_t *data, size_t size, ftms_status *status);
+bool ftms_process_training_status(const uint8_t *data, size_t size, ftms_training_status *status);
+bool ftms_process_control_response(const uint8_t *data, size_t size, ftms_control_response *response);
+
+// Control Point requests: each returns the size of the request written to data (FTMS_CONTROL_POINT_MAX bytes).
+// Request control first, then send the targets. The machine answers each request with an ftms_control_response.
+
+size_t ftms_request_control_command(uint8_t *data);
+size_t ftms_reset_command(uint8_t *data);
+size_t ftms_start_command(uint8_t *data);
+// stop: true stops, false pauses
+size_t ftms_stop_command(bool stop, uint8_t *data);
+size_t ftms_set_target_power_command(int16_t watts, uint8_t *data);
+// level: unitless, 0.1 resolution
+size_t ftms_set_target_resistance_command(double level, uint8_t *data);
+size_t ftms_set_target_speed_command(double speedKPH, uint8_t *data);
+// grade: percent, 0.1 resolution
+size_t ftms_set_target_inclination_command(double grade, uint8_t *data);
+size_t ftms_set_target_cadence_command(double cadenceRPM, uint8_t *data);
+/*!
+ Indoor Bike Simulation Parameters (the FTMS counterpart of smart_control_set_mode_simulation_command; the weight is not part of it).
+
+ @param windSpeedMPS Head (positive) or tail wind speed
+ @param grade Grade (percent)
+ @param rollingCoeff Rolling resistance coefficient
+ @param windCoeff Wind resistance coefficient (kg / m)
+ @param data Output
+ */
+size_t ftms_set_simulation_command(double windSpeedMPS, double grade, double rollingCoeff, double windCoeff, uint8_t *data);
+size_t ftms_set_wheel_circumference_command(double millimeters, uint8_t *data);
+// start: true starts a spin down, false ignores the request of the machine
+size_t ftms_spin_down_command(bool start, uint8_t *data);
+
+
+#endif /* FitnessMachine_h */
@@ -0,0 +1,322 @@
+//
+//  FrameCapture.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#include "FrameCapture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+static size_t payload_size(const kinetic_capture_record *record)
+{
+    if (record->type == KINETIC_CAPTURE_RECORD_BLE_FRAME) {
+        return KINETIC_CAPTURE_FRAME_SIZE;
+    }
+    return ((size_t)record->length + 7) & ~(size_t)7;
+}
+
+static bool write_all(int fd, const uint8_t *bytes, size_t size)
+{
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        bytes += written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+static bool write_buffer(kinetic_capture_writer *writer)
+{
+    if (writer->bufferUsed == 0) {
+        return true;
+    }
+    bool success = write_all(writer->fd, writer->buffer, writer->bufferUsed);
+    writer->bufferUsed = 0;
+    return success;
+}
+
+static bool append_record(kinetic_capture_writer *writer, const kinetic_capture_record *record, const uint8_t *data, size_t size)
+{
+    size_t payload = payload_size(record);
+    size_t total = sizeof(kinetic_capture_record) + payload;
+
+    if (writer->bufferUsed + total > sizeof(writer->buffer)) {
+        if (!write_buffer(writer)) {
+            return false;
+        }
+    }
+    if (total > sizeof(writer->buffer)) {
+        // Larger than the whole buffer (a huge USB read), write it straight through.
+        static const uint8_t padding[8] = { 0 };
+        if (!write_all(writer->fd, (const uint8_t *)record, sizeof(kinetic_capture_record)) ||
+            !write_all(writer->fd, data, size) ||
+            !write_all(writer->fd, padding, payload - size)) {
+            return false;
+        }
+    } else {
+        uint8_t *out = &writer->buffer[writer->bufferUsed];
+        memcpy(out, record, sizeof(kinetic_capture_record));
+        memcpy(out + sizeof(kinetic_capture_record), data, size);
+        memset(out + sizeof(kinetic_capture_record) + size, 0, payload - size);
+        writer->bufferUsed += total;
+    }
+
+    writer->unsyncedRecords++;
+    if (writer->syncInterval > 0 && writer->unsyncedRecords >= writer->syncInterval) {
+        return kinetic_capture_writer_flush(writer);
+    }
+    return true;
+}
+
+bool kinetic_capture_writer_open(kinetic_capture_writer *writer, const char *path, const kinetic_capture_header *header, uint32_t syncInterval)
+{
+    writer->syncInterval = syncInterval;
+    writer->unsyncedRecords = 0;
+    writer->bufferUsed = 0;
+    writer->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (writer->fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(writer->fd, &st) != 0) {
+        close(writer->fd);
+        return false;
+    }
+
+    // A header cut short (a crash while the capture was created) holds no frames: start the file over.
+    if (st.st_size < (off_t)sizeof(kinetic_capture_header)) {
+        if (st.st_size > 0 && ftruncate(writer->fd, 0) != 0) {
+            close(writer->fd);
+            return false;
+        }
+        kinetic_capture_header fileHeader = *header;
+        fileHeader.magic = KINETIC_CAPTURE_MAGIC;
+        fileHeader.version = KINETIC_CAPTURE_VERSION;
+        if (!write_all(writer->fd, (const uint8_t *)&fileHeader, sizeof(fileHeader))) {
+            close(writer->fd);
+            return false;
+        }
+        return true;
+    }
+
+    // Appending to an existing capture: drop a record that was cut short by a crash so the new records stay aligned.
+    kinetic_capture_reader reader;
+    if (!kinetic_capture_reader_open(&reader, path)) {
+        close(writer->fd);
+        return false;
+    }
+    // a capture holds the frames of one device
+    if (reader.header.deviceType != header->deviceType || memcmp(reader.header.systemId, header->systemId, sizeof(header->systemId)) != 0) {
+        kinetic_capture_reader_close(&reader);
+        close(writer->fd);
+        errno = EINVAL;
+        return false;
+    }
+    kinetic_capture_entry entry;
+    while (kinetic_capture_next(&reader, &entry)) {
+    }
+    off_t validSize = (off_t)reader.offset;
+    kinetic_capture_reader_close(&reader);
+    if (validSize < st.st_size && ftruncate(writer->fd, validSize) != 0) {
+        close(writer->fd);
+        return false;
+    }
+    return true;
+}
+
+bool kinetic_capture_write_frame(kinetic_capture_writer *writer, uint64_t timestamp, uint16_t characteristic, const uint8_t *data, size_t size)
+{
+    if (size > KINETIC_CAPTURE_FRAME_SIZE) {
+        return false;
+    }
+    kinetic_capture_record record;
+    record.timestamp = timestamp;
+    record.type = KINETIC_CAPTURE_RECORD_BLE_FRAME;
+    record.characteristic = characteristic;
+    record.length = (uint32_t)size;
+    return append_record(writer, &record, data, size);
+}
+
+bool kinetic_capture_write_usb(kinetic_capture_writer *writer, uint64_t timestamp, const uint8_t *data, size_t size)
+{
+    kinetic_capture_record record;
+    record.timestamp = timestamp;
+    record.type = KINETIC_CAPTURE_RECORD_USB_CHUNK;
+    record.characteristic = 0;
+    record.length = (uint32_t)size;
+    return append_record(writer, &record, data, size);
+}
+
+bool kinetic_capture_writer_flush(kinetic_capture_writer *writer)
+{
+    bool success = write_buffer(writer);
+    writer->unsyncedRecords = 0;
+    return fsync(writer->fd) == 0 && success;
+}
+
+bool kinetic_capture_writer_close(kinetic_capture_writer *writer)
+{
+    bool success = kinetic_capture_writer_flush(writer);
+    success = close(writer->fd) == 0 && success;
+    writer->fd = -1;
+    return success;
+}
+
+
+bool kinetic_capture_reader_open(kinetic_capture_reader *reader, const char *path)
+{
+    reader->base = NULL;
+    reader->size = 0;
+    reader->offset = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(kinetic_capture_header)) {
+        close(fd);
+        return false;
+    }
+    void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return false;
+    }
+    madvise(base, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+    memcpy(&reader->header, base, sizeof(kinetic_capture_header));
+    if (reader->header.magic != KINETIC_CAPTURE_MAGIC || reader->header.version != KINETIC_CAPTURE_VERSION) {
+        munmap(base, (size_t)st.st_size);
+        return false;
+    }
+    reader->base = base;
+    reader->size = (size_t)st.st_size;
+    reader->offset = sizeof(kinetic_capture_header);
+    return true;
+}
+
+bool kinetic_capture_next(kinetic_capture_reader *reader, kinetic_capture_entry *entry)
+{
+    if (reader->offset + sizeof(kinetic_capture_record) > reader->size) {
+        return false;
+    }
+    kinetic_capture_record record;
+    memcpy(&record, reader->base + reader->offset, sizeof(record));
+    size_t payload = payload_size(&record);
+    if (record.length > payload || reader->offset + sizeof(record) + payload > reader->size) {
+        return false;
+    }
+    entry->timestamp = record.timestamp;
+    entry->type = record.type;
+    entry->characteristic = record.characteristic;
+    entry->data = reader->base + reader->offset + sizeof(record);
+    entry->size = record.length;
+    reader->offset += sizeof(record) + payload;
+    return true;
+}
+
+void kinetic_capture_rewind(kinetic_capture_reader *reader)
+{
+    reader->offset = sizeof(kinetic_capture_header);
+}
+
+void kinetic_capture_reader_close(kinetic_capture_reader *reader)
+{
+    if (reader->base != NULL) {
+        munmap((void *)reader->base, reader->size);
+    }
+    reader->base = NULL;
+    reader->size = 0;
+    reader->offset = 0;
+}
+
+static void replay_frame(const kinetic_capture_handlers *handlers, void *context, uint64_t timestamp, uint16_t characteristic, const uint8_t *data, size_t size)
+{
+    if (size == 0) {
+        return;
+    }
+    switch (characteristic) {
+        case KINETIC_CAPTURE_INRIDE_POWER:
+            if (handlers->inridePower != NULL && size == 20) {
+                inride_power_data decoded = inride_process_power_data((uint8_t *)data);
+                handlers->inridePower(context, timestamp, &decoded);
+            }
+            break;
+
+        case KINETIC_CAPTURE_INRIDE_CONFIG:
+            if (handlers->inrideConfig != NULL && size == 20) {
+                inride_config_data decoded = inride_process_config_data((uint8_t *)data);
+                handlers->inrideConfig(context, timestamp, &decoded);
+            }
+            break;
+
+        case KINETIC_CAPTURE_SMART_CONTROL_POWER:
+            if (handlers->smartControlPower != NULL) {
+                smart_control_power_data decoded = smart_control_process_power_data((uint8_t *)data, size);
+                handlers->smartControlPower(context, timestamp, &decoded);
+            }
+            break;
+
+        case KINETIC_CAPTURE_SMART_CONTROL_CONFIG:
+            if (handlers->smartControlConfig != NULL) {
+                smart_control_config_data decoded = smart_control_process_config_data((uint8_t *)data, size);
+                handlers->smartControlConfig(context, timestamp, &decoded);
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+typedef struct usb_replay
+{
+    const kinetic_capture_handlers *handlers;
+    void *context;
+    uint64_t timestamp;
+} usb_replay;
+
+// USB packets carry the Characteristic Identifiers of the BLE service (0x0201 power, 0x0202 config)
+static void replay_usb_packet(void *context, const smart_control_usb_packet *packet)
+{
+    const usb_replay *replay = context;
+    replay_frame(replay->handlers, replay->context, replay->timestamp, packet->identifier, packet->data, packet->size);
+}
+
+size_t kinetic_capture_replay(kinetic_capture_reader *reader, const kinetic_capture_handlers *handlers, void *context)
+{
+    size_t count = 0;
+    // packets may be split across chunks
+    smart_control_usb_parser parser;
+    smart_control_usb_parser_init(&parser);
+    usb_replay replay = { handlers, context, 0 };
+    kinetic_capture_entry entry;
+    while (kinetic_capture_next(reader, &entry)) {
+        count++;
+        if (entry.type == KINETIC_CAPTURE_RECORD_USB_CHUNK) {
+            if (handlers->usbChunk != NULL) {
+                handlers->usbChunk(context, entry.timestamp, entry.data, entry.size);
+            }
+            replay.timestamp = entry.timestamp;
+            smart_control_usb_process_data(&parser, entry.data, entry.size, replay_usb_packet, &replay);
+        } else if (entry.type == KINETIC_CAPTURE_RECORD_BLE_FRAME) {
+            replay_frame(handlers, context, entry.timestamp, entry.characteristic, entry.data, entry.size);
+        }
+    }
+    return count;
+}
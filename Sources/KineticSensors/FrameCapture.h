@@ -0,0 +1,217 @@
+//
+//  FrameCapture.h
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#ifndef FrameCapture_h
+#define FrameCapture_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "inRide.h"
+#include "SmartControl.h"
+
+// Append-only capture of the raw bytes received from a sensor, for reprocessing and bug reproduction.
+//
+// File layout (little-endian):
+// - kinetic_capture_header (40 bytes)
+// - records: kinetic_capture_record (16 bytes) + payload padded to a multiple of 8 bytes
+//   - BLE notifications are fixed size: the payload area is always 24 bytes (40 byte records)
+//   - USB reads are stored as chunks of the raw (still framed) serial byte stream
+//
+// A record cut short by a crash is ignored by the reader, everything before it is still readable.
+
+#define KINETIC_CAPTURE_MAGIC           0x5041434B  // "KCAP"
+#define KINETIC_CAPTURE_VERSION         1
+#define KINETIC_CAPTURE_FRAME_SIZE      24          // payload area of a BLE frame record (notifications are <= 20 bytes)
+#define KINETIC_CAPTURE_BUFFER_SIZE     65536
+
+
+/*! Device that produced the capture */
+typedef enum kinetic_capture_device
+{
+    KINETIC_CAPTURE_DEVICE_UNKNOWN          = 0x00,
+    KINETIC_CAPTURE_DEVICE_INRIDE           = 0x01,
+    KINETIC_CAPTURE_DEVICE_SMART_CONTROL    = 0x02
+} kinetic_capture_device;
+
+/*! Capture Record Type */
+typedef enum kinetic_capture_record_type
+{
+    KINETIC_CAPTURE_RECORD_BLE_FRAME        = 0x01,
+    KINETIC_CAPTURE_RECORD_USB_CHUNK        = 0x02
+} kinetic_capture_record_type;
+
+/*! Characteristic of a BLE frame record (short form of the E941xxxx-B434-446B-B5CC-36592FC4C724 UUIDs) */
+typedef enum kinetic_capture_characteristic
+{
+    KINETIC_CAPTURE_INRIDE_POWER            = 0x0101,
+    KINETIC_CAPTURE_INRIDE_CONTROL          = 0x0102,
+    KINETIC_CAPTURE_INRIDE_CONFIG           = 0x0104,
+    KINETIC_CAPTURE_SMART_CONTROL_POWER     = 0x0201,
+    KINETIC_CAPTURE_SMART_CONTROL_CONFIG    = 0x0202,
+    KINETIC_CAPTURE_SMART_CONTROL_CONTROL   = 0x0203
+} kinetic_capture_characteristic;
+
+
+/*! Capture File Header */
+typedef struct kinetic_capture_header
+{
+    uint32_t magic;
+    uint16_t version;
+    /*! kinetic_capture_device */
+    uint16_t deviceType;
+    /*! Value of the System Id Characteristic (0x2A23) */
+    uint8_t systemId[6];
+    uint8_t reserved[2];
+    /*! Value of the Firmware Revision Characteristic (0x2A26), NUL padded */
+    char firmwareRevision[16];
+    /*! Start of the capture (microseconds since 1970) */
+    uint64_t startTime;
+} __attribute__((packed)) kinetic_capture_header;
+
+/*! Capture Record Header */
+typedef struct kinetic_capture_record
+{
+    /*! Receive time (microseconds since 1970) */
+    uint64_t timestamp;
+    /*! kinetic_capture_record_type */
+    uint16_t type;
+    /*! kinetic_capture_characteristic (BLE frames only) */
+    uint16_t characteristic;
+    /*! Number of valid payload bytes */
+    uint32_t length;
+} __attribute__((packed)) kinetic_capture_record;
+
+
+/*! Capture Writer. Owns the file descriptor and a write buffer, allocate it once per capture. */
+typedef struct kinetic_capture_writer
+{
+    int fd;
+    /*! fsync after this many records (0 = only on flush / close) */
+    uint32_t syncInterval;
+    uint32_t unsyncedRecords;
+    size_t bufferUsed;
+    uint8_t buffer[KINETIC_CAPTURE_BUFFER_SIZE];
+} kinetic_capture_writer;
+
+/*!
+ Opens a capture file for appending. A new or empty file, or one whose header was cut short by a crash, gets the header. An existing
+ file must be a capture of the same version, device type and System Id (errno is EINVAL otherwise).
+
+ @param writer Writer to initialize
+ @param path File path
+ @param header Capture header (magic and version are filled in)
+ @param syncInterval fsync after this many records (0 = only on flush / close)
+
+ @return false if the file could not be opened or is not a compatible capture
+ */
+bool kinetic_capture_writer_open(kinetic_capture_writer *writer, const char *path, const kinetic_capture_header *header, uint32_t syncInterval);
+
+/*!
+ Appends a BLE notification (or a command written to a Control Point).
+
+ @param writer Open writer
+ @param timestamp Receive time (microseconds since 1970)
+ @param characteristic kinetic_capture_characteristic the data belongs to
+ @param data Raw characteristic value
+ @param size Size of the data (at most KINETIC_CAPTURE_FRAME_SIZE)
+
+ @return false on a write error or an oversized frame
+ */
+bool kinetic_capture_write_frame(kinetic_capture_writer *writer, uint64_t timestamp, uint16_t characteristic, const uint8_t *data, size_t size);
+
+/*!
+ Appends a chunk of the raw USB serial byte stream.
+
+ @param writer Open writer
+ @param timestamp Receive time (microseconds since 1970)
+ @param data Raw bytes as read from the serial device
+ @param size Size of the chunk
+
+ @return false on a write error
+ */
+bool kinetic_capture_write_usb(kinetic_capture_writer *writer, uint64_t timestamp, const uint8_t *data, size_t size);
+
+/*! Writes out the buffered records and fsyncs the file. */
+bool kinetic_capture_writer_flush(kinetic_capture_writer *writer);
+
+/*! Flushes and closes the capture file. */
+bool kinetic_capture_writer_close(kinetic_capture_writer *writer);
+
+
+/*! A record returned by the reader. The data points into the mapped file. */
+typedef struct kinetic_capture_entry
+{
+    uint64_t timestamp;
+    kinetic_capture_record_type type;
+    uint16_t characteristic;
+    const uint8_t *data;
+    size_t size;
+} kinetic_capture_entry;
+
+/*! Memory mapped Capture Reader */
+typedef struct kinetic_capture_reader
+{
+    kinetic_capture_header header;
+    const uint8_t *base;
+    size_t size;
+    size_t offset;
+} kinetic_capture_reader;
+
+/*!
+ Maps a capture file for reading.
+
+ @param reader Reader to initialize
+ @param path File path
+
+ @return false if the file could not be mapped or is not a capture
+ */
+bool kinetic_capture_reader_open(kinetic_capture_reader *reader, const char *path);
+
+/*!
+ Returns the next record.
+
+ @param reader Open reader
+ @param entry Filled with the record
+
+ @return false at the end of the capture
+ */
+bool kinetic_capture_next(kinetic_capture_reader *reader, kinetic_capture_entry *entry);
+
+/*! Moves the reader back to the first record. */
+void kinetic_capture_rewind(kinetic_capture_reader *reader);
+
+/*! Unmaps the capture file. */
+void kinetic_capture_reader_close(kinetic_capture_reader *reader);
+
+
+/*! Replay callbacks (any may be NULL) */
+typedef struct kinetic_capture_handlers
+{
+    void (*inridePower)(void *context, uint64_t timestamp, const inride_power_data *data);
+    void (*inrideConfig)(void *context, uint64_t timestamp, const inride_config_data *data);
+    void (*smartControlPower)(void *context, uint64_t timestamp, const smart_control_power_data *data);
+    void (*smartControlConfig)(void *context, uint64_t timestamp, const smart_control_config_data *data);
+    /*! Raw USB chunk, before its packets are unframed and decoded */
+    void (*usbChunk)(void *context, uint64_t timestamp, const uint8_t *data, size_t size);
+} kinetic_capture_handlers;
+
+/*!
+ Runs every remaining record through the decoders and hands the results to the handlers. USB chunks are unframed
+ (smart_control_usb_process_data, a packet may span chunks) and their power and config packets decoded like BLE frames,
+ with the timestamp of the chunk that completes the packet.
+
+ @param reader Open reader
+ @param handlers Callbacks
+ @param context Passed to the callbacks
+
+ @return Number of records replayed
+ */
+size_t kinetic_capture_replay(kinetic_capture_reader *reader, const kinetic_capture_handlers *handlers, void *context);
+
+
+#endif /* FrameCapture_h */
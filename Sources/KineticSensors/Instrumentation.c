@@ -0,0 +1,165 @@
+//
+//  Instrumentation.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#include "Instrumentation.h"
+
+#ifdef KINETIC_INSTRUMENTATION
+
+#include <string.h>
+#include <time.h>
+
+#define SubBuckets              (1u << KINETIC_HISTOGRAM_SUB_BUCKET_BITS)
+
+static kinetic_device_stats globalStats;
+static _Thread_local kinetic_device_stats *boundStats;
+
+
+void kinetic_instrumentation_init(kinetic_device_stats *stats)
+{
+    for (size_t i = 0; i < KINETIC_COUNTER_COUNT; ++i) {
+        atomic_init(&stats->counters[i], 0);
+    }
+    for (size_t i = 0; i < KINETIC_COMMAND_RESULT_COUNT; ++i) {
+        atomic_init(&stats->commandResults[i], 0);
+    }
+    kinetic_histogram *histograms[2] = { &stats->decodeTime, &stats->latency };
+    for (size_t h = 0; h < 2; ++h) {
+        for (size_t i = 0; i < KINETIC_HISTOGRAM_BUCKETS; ++i) {
+            atomic_init(&histograms[h]->buckets[i], 0);
+        }
+        atomic_init(&histograms[h]->count, 0);
+        atomic_init(&histograms[h]->total, 0);
+        atomic_init(&histograms[h]->max, 0);
+    }
+}
+
+kinetic_device_stats *kinetic_instrumentation_bind(kinetic_device_stats *stats)
+{
+    kinetic_device_stats *previous = boundStats;
+    boundStats = stats;
+    return previous;
+}
+
+kinetic_device_stats *kinetic_instrumentation_current(void)
+{
+    kinetic_device_stats *stats = boundStats;
+    return stats != NULL ? stats : &globalStats;
+}
+
+kinetic_device_stats *kinetic_instrumentation_global(void)
+{
+    return &globalStats;
+}
+
+uint64_t kinetic_instrumentation_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void kinetic_instrumentation_count(kinetic_counter counter)
+{
+    atomic_fetch_add_explicit(&kinetic_instrumentation_current()->counters[counter], 1, memory_order_relaxed);
+}
+
+void kinetic_instrumentation_command_result(uint8_t result)
+{
+    atomic_fetch_add_explicit(&kinetic_instrumentation_current()->commandResults[result & 0x0F], 1, memory_order_relaxed);
+}
+
+void kinetic_instrumentation_decode_time(uint64_t start)
+{
+    kinetic_histogram_record(&kinetic_instrumentation_current()->decodeTime, kinetic_instrumentation_now() - start);
+}
+
+void kinetic_instrumentation_record_latency(kinetic_device_stats *stats, uint64_t notificationTime)
+{
+    if (stats == NULL) {
+        stats = kinetic_instrumentation_current();
+    }
+    uint64_t now = kinetic_instrumentation_now();
+    kinetic_histogram_record(&stats->latency, now > notificationTime ? now - notificationTime : 0);
+}
+
+
+// Values below 8 have a bucket each, above that every power of two is split into 8 buckets.
+static size_t bucket_for_value(uint64_t value)
+{
+    if (value < SubBuckets) {
+        return (size_t)value;
+    }
+    unsigned exponent = 63 - (unsigned)__builtin_clzll(value);
+    size_t bucket = (exponent - KINETIC_HISTOGRAM_SUB_BUCKET_BITS + 1) * SubBuckets + ((value >> (exponent - KINETIC_HISTOGRAM_SUB_BUCKET_BITS)) & (SubBuckets - 1));
+    return bucket < KINETIC_HISTOGRAM_BUCKETS ? bucket : KINETIC_HISTOGRAM_BUCKETS - 1;
+}
+
+uint64_t kinetic_histogram_bucket_value(size_t bucket)
+{
+    if (bucket < SubBuckets) {
+        return bucket;
+    }
+    unsigned exponent = (unsigned)(bucket / SubBuckets) + KINETIC_HISTOGRAM_SUB_BUCKET_BITS - 1;
+    return (uint64_t)(SubBuckets + bucket % SubBuckets) << (exponent - KINETIC_HISTOGRAM_SUB_BUCKET_BITS);
+}
+
+void kinetic_histogram_record(kinetic_histogram *histogram, uint64_t value)
+{
+    atomic_fetch_add_explicit(&histogram->buckets[bucket_for_value(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->total, value, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    while (value > max && !atomic_compare_exchange_weak_explicit(&histogram->max, &max, value, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+static void histogram_snapshot(const kinetic_histogram *histogram, kinetic_histogram_snapshot *snapshot)
+{
+    // the count is the sum of the copied buckets, so percentiles stay consistent with the buckets
+    uint64_t count = 0;
+    for (size_t i = 0; i < KINETIC_HISTOGRAM_BUCKETS; ++i) {
+        snapshot->buckets[i] = atomic_load_explicit(&((kinetic_histogram *)histogram)->buckets[i], memory_order_relaxed);
+        count += snapshot->buckets[i];
+    }
+    snapshot->count = count;
+    snapshot->total = atomic_load_explicit(&((kinetic_histogram *)histogram)->total, memory_order_relaxed);
+    snapshot->max = atomic_load_explicit(&((kinetic_histogram *)histogram)->max, memory_order_relaxed);
+}
+
+void kinetic_instrumentation_snapshot(const kinetic_device_stats *stats, kinetic_device_stats_snapshot *snapshot)
+{
+    kinetic_device_stats *source = (kinetic_device_stats *)stats;
+    for (size_t i = 0; i < KINETIC_COUNTER_COUNT; ++i) {
+        snapshot->counters[i] = atomic_load_explicit(&source->counters[i], memory_order_relaxed);
+    }
+    for (size_t i = 0; i < KINETIC_COMMAND_RESULT_COUNT; ++i) {
+        snapshot->commandResults[i] = atomic_load_explicit(&source->commandResults[i], memory_order_relaxed);
+    }
+    histogram_snapshot(&source->decodeTime, &snapshot->decodeTime);
+    histogram_snapshot(&source->latency, &snapshot->latency);
+}
+
+uint64_t kinetic_histogram_percentile(const kinetic_histogram_snapshot *histogram, double percentile)
+{
+    if (histogram->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)((percentile / 100.0) * (double)histogram->count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < KINETIC_HISTOGRAM_BUCKETS; ++i) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            uint64_t upper = i + 1 < KINETIC_HISTOGRAM_BUCKETS ? kinetic_histogram_bucket_value(i + 1) - 1 : histogram->max;
+            return upper < histogram->max ? upper : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+#endif /* KINETIC_INSTRUMENTATION */
@@ -0,0 +1,167 @@
+//
+//  Instrumentation.h
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#ifndef Instrumentation_h
+#define Instrumentation_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Decode health counters and latency histograms (build with KINETIC_INSTRUMENTATION defined to enable).
+// - Every device gets its own kinetic_device_stats; bind it to the thread before handing that device's data to the
+//   decoders (kinetic_instrumentation_bind). Data decoded with nothing bound is counted in the global stats.
+// - Counters and histogram buckets are relaxed atomics: the decoders never lock and never wait on a reader.
+// - kinetic_instrumentation_snapshot copies the stats at any time from any thread (each value is exact, the set of
+//   values is not a single point in time).
+// - Histograms are log bucketed like HDR histograms: 8 buckets per power of two, so any value is within 12.5%.
+// Without KINETIC_INSTRUMENTATION the hooks in the decoders compile to nothing and this header declares no functions.
+
+
+#define KINETIC_HISTOGRAM_SUB_BUCKET_BITS   3
+#define KINETIC_HISTOGRAM_BUCKETS           304     // values up to 2^40 ns (18 minutes), larger values land in the last bucket
+#define KINETIC_COMMAND_RESULT_COUNT        16
+
+/*! Instrumentation Counters */
+typedef enum kinetic_counter
+{
+    /*! Power and config updates decoded (inRide and Smart Control) */
+    KINETIC_COUNTER_FRAMES_DECODED,
+    /*! Updates or USB packets that were too short to decode */
+    KINETIC_COUNTER_BAD_LENGTH,
+    /*! inRide power updates flagged as coasting */
+    KINETIC_COUNTER_COASTING,
+    /*! Valid USB packets */
+    KINETIC_COUNTER_USB_PACKETS,
+    /*! USB packets dropped because of a bad CRC */
+    KINETIC_COUNTER_USB_CRC_FAILURES,
+    /*! USB packets that overran the buffer (lost delimiter or escape), the parser skipped to the next delimiter */
+    KINETIC_COUNTER_USB_RESYNCS,
+    KINETIC_COUNTER_COUNT
+} kinetic_counter;
+
+
+#ifdef KINETIC_INSTRUMENTATION
+
+#include <stdatomic.h>
+
+typedef struct kinetic_histogram
+{
+    _Atomic uint64_t buckets[KINETIC_HISTOGRAM_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t total;
+    _Atomic uint64_t max;
+} kinetic_histogram;
+
+typedef struct kinetic_device_stats
+{
+    _Atomic uint64_t counters[KINETIC_COUNTER_COUNT];
+    /*! inRide command results, indexed by inride_command_result */
+    _Atomic uint64_t commandResults[KINETIC_COMMAND_RESULT_COUNT];
+    /*! Time spent in the decoders (ns) */
+    kinetic_histogram decodeTime;
+    /*! Notification received to metric delivered (ns), see kinetic_instrumentation_record_latency */
+    kinetic_histogram latency;
+} kinetic_device_stats;
+
+typedef struct kinetic_histogram_snapshot
+{
+    uint64_t buckets[KINETIC_HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+} kinetic_histogram_snapshot;
+
+typedef struct kinetic_device_stats_snapshot
+{
+    uint64_t counters[KINETIC_COUNTER_COUNT];
+    uint64_t commandResults[KINETIC_COMMAND_RESULT_COUNT];
+    kinetic_histogram_snapshot decodeTime;
+    kinetic_histogram_snapshot latency;
+} kinetic_device_stats_snapshot;
+
+
+/*!
+ Zeroes the stats of a device.
+ */
+void kinetic_instrumentation_init(kinetic_device_stats *stats);
+
+/*!
+ Directs the counts of the calling thread to the stats of a device.
+
+ @param stats Stats of the device whose data the thread decodes next (NULL for the global stats)
+
+ @return The previously bound stats (NULL if none)
+ */
+kinetic_device_stats *kinetic_instrumentation_bind(kinetic_device_stats *stats);
+
+/*!
+ Stats the calling thread counts into (the bound stats or the global stats).
+ */
+kinetic_device_stats *kinetic_instrumentation_current(void);
+
+/*!
+ Stats of the data decoded without bound stats.
+ */
+kinetic_device_stats *kinetic_instrumentation_global(void);
+
+/*!
+ Monotonic clock (ns) the histograms are recorded with. Use it to timestamp the BLE / USB notifications.
+ */
+uint64_t kinetic_instrumentation_now(void);
+
+void kinetic_instrumentation_count(kinetic_counter counter);
+void kinetic_instrumentation_command_result(uint8_t result);
+void kinetic_instrumentation_decode_time(uint64_t start);
+
+/*!
+ Records the notification to metric latency of an update.
+
+ @param stats Device stats (NULL for the stats bound to the thread)
+ @param notificationTime kinetic_instrumentation_now() when the notification was received
+ */
+void kinetic_instrumentation_record_latency(kinetic_device_stats *stats, uint64_t notificationTime);
+
+void kinetic_histogram_record(kinetic_histogram *histogram, uint64_t value);
+
+/*!
+ Copies the stats without blocking the decoders.
+ */
+void kinetic_instrumentation_snapshot(const kinetic_device_stats *stats, kinetic_device_stats_snapshot *snapshot);
+
+/*!
+ Smallest value that lands in a histogram bucket.
+ */
+uint64_t kinetic_histogram_bucket_value(size_t bucket);
+
+/*!
+ Value at a percentile of a histogram snapshot.
+
+ @param histogram Histogram snapshot
+ @param percentile 0 ... 100
+
+ @return Upper bound of the bucket the percentile falls in (0 if the histogram is empty)
+ */
+uint64_t kinetic_histogram_percentile(const kinetic_histogram_snapshot *histogram, double percentile);
+
+
+// Hooks used by the decoders
+#define KINETIC_INSTRUMENT_COUNT(counter)           kinetic_instrumentation_count(counter)
+#define KINETIC_INSTRUMENT_COMMAND_RESULT(result)   kinetic_instrumentation_command_result(result)
+#define KINETIC_INSTRUMENT_DECODE_BEGIN(start)      uint64_t start = kinetic_instrumentation_now()
+#define KINETIC_INSTRUMENT_DECODE_END(start)        kinetic_instrumentation_decode_time(start)
+
+#else
+
+#define KINETIC_INSTRUMENT_COUNT(counter)           ((void)0)
+#define KINETIC_INSTRUMENT_COMMAND_RESULT(result)   ((void)0)
+#define KINETIC_INSTRUMENT_DECODE_BEGIN(start)      ((void)0)
+#define KINETIC_INSTRUMENT_DECODE_END(start)        ((void)0)
+
+#endif /* KINETIC_INSTRUMENTATION */
+
+
+#endif /* Instrumentation_h */
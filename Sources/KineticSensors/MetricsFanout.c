@@ -0,0 +1,560 @@
+//
+//  MetricsFanout.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#include "MetricsFanout.h"
+#include "Tracing.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define EntryMax                40      // varint index (5) + mask + System Id (6) + 4 varints (4 x 5) + 3 bytes, rounded up
+
+
+static void put_u16(uint8_t *out, uint16_t value)
+{
+    out[0] = (uint8_t)value;
+    out[1] = (uint8_t)(value >> 8);
+}
+
+static void put_u32(uint8_t *out, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i) {
+        out[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+static void put_u64(uint8_t *out, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i) {
+        out[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+static uint16_t get_u16(const uint8_t *in)
+{
+    return (uint16_t)in[0] | ((uint16_t)in[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t *in)
+{
+    return (uint32_t)in[0] | ((uint32_t)in[1] << 8) | ((uint32_t)in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+static uint64_t get_u64(const uint8_t *in)
+{
+    return (uint64_t)get_u32(in) | ((uint64_t)get_u32(in + 4) << 32);
+}
+
+static size_t put_varint(uint8_t *out, uint64_t value)
+{
+    size_t size = 0;
+    while (value >= 0x80) {
+        out[size++] = (uint8_t)value | 0x80;
+        value >>= 7;
+    }
+    out[size++] = (uint8_t)value;
+    return size;
+}
+
+// Returns false if the varint runs past end or over 64 bits.
+static bool get_varint(const uint8_t **in, const uint8_t *end, uint64_t *value)
+{
+    uint64_t result = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if (*in >= end) {
+            return false;
+        }
+        uint8_t byte = *(*in)++;
+        result |= (uint64_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint64_t zigzag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+
+// Encoder
+
+void kinetic_fanout_encoder_init(kinetic_fanout_encoder *encoder, kinetic_fanout_device *devices, uint32_t deviceCount, uint32_t publisherId, uint32_t keyframeInterval)
+{
+    memset(devices, 0, sizeof(kinetic_fanout_device) * deviceCount);
+    encoder->devices = devices;
+    encoder->deviceCount = deviceCount;
+    encoder->publisherId = publisherId;
+    encoder->sequence = 0;
+    encoder->keyframeInterval = keyframeInterval > 0 ? keyframeInterval : KINETIC_FANOUT_KEYFRAME_INTERVAL;
+    encoder->ticksSinceKeyframe = 0;
+}
+
+static void update(kinetic_fanout_encoder *encoder, uint32_t deviceIndex, const uint8_t systemId[6], const kinetic_sample_record *record)
+{
+    if (deviceIndex >= encoder->deviceCount) {
+        return;
+    }
+    kinetic_fanout_device *device = &encoder->devices[deviceIndex];
+    if (device->active && memcmp(device->systemId, systemId, 6) != 0) {
+        device->sent = false;   // another device took the index, start it with an absolute entry
+    }
+    memcpy(device->systemId, systemId, 6);
+    device->current = *record;
+    device->active = true;
+    device->pending = true;
+}
+
+void kinetic_fanout_update_inride(kinetic_fanout_encoder *encoder, uint32_t deviceIndex, const uint8_t systemId[6], const inride_power_data *data)
+{
+    kinetic_sample_record record = inride_sample_pack(data, 0);
+    update(encoder, deviceIndex, systemId, &record);
+}
+
+void kinetic_fanout_update_smart_control(kinetic_fanout_encoder *encoder, uint32_t deviceIndex, const uint8_t systemId[6], const smart_control_power_data *data)
+{
+    kinetic_sample_record record = smart_control_sample_pack(data, 0);
+    update(encoder, deviceIndex, systemId, &record);
+}
+
+static uint8_t changed_fields(const kinetic_sample_record *a, const kinetic_sample_record *b)
+{
+    uint8_t mask = 0;
+    mask |= a->power != b->power ? KINETIC_FANOUT_FIELD_POWER : 0;
+    mask |= a->speed != b->speed ? KINETIC_FANOUT_FIELD_SPEED : 0;
+    mask |= a->cadence != b->cadence ? KINETIC_FANOUT_FIELD_CADENCE : 0;
+    mask |= a->resistance != b->resistance ? KINETIC_FANOUT_FIELD_RESISTANCE : 0;
+    mask |= a->flags != b->flags ? KINETIC_FANOUT_FIELD_FLAGS : 0;
+    mask |= a->status != b->status ? KINETIC_FANOUT_FIELD_STATUS : 0;
+    mask |= a->calibration != b->calibration ? KINETIC_FANOUT_FIELD_CALIBRATION : 0;
+    return mask;
+}
+
+static size_t encode_entry(uint8_t *out, uint32_t deviceIndex, const kinetic_fanout_device *device, bool absolute)
+{
+    static const kinetic_sample_record zero;
+    const kinetic_sample_record *base = absolute ? &zero : &device->last;
+    const kinetic_sample_record *record = &device->current;
+    // absolute entries leave out the zero fields
+    uint8_t mask = changed_fields(record, base) | (absolute ? KINETIC_FANOUT_FIELD_ABSOLUTE : 0);
+
+    size_t size = put_varint(out, deviceIndex);
+    out[size++] = mask;
+    if (absolute) {
+        memcpy(&out[size], device->systemId, 6);
+        size += 6;
+    }
+    if (mask & KINETIC_FANOUT_FIELD_POWER) {
+        size += put_varint(&out[size], zigzag((int64_t)record->power - (int64_t)base->power));
+    }
+    if (mask & KINETIC_FANOUT_FIELD_SPEED) {
+        size += put_varint(&out[size], zigzag((int64_t)record->speed - (int64_t)base->speed));
+    }
+    if (mask & KINETIC_FANOUT_FIELD_CADENCE) {
+        size += put_varint(&out[size], zigzag((int64_t)record->cadence - (int64_t)base->cadence));
+    }
+    if (mask & KINETIC_FANOUT_FIELD_RESISTANCE) {
+        size += put_varint(&out[size], zigzag((int64_t)record->resistance - (int64_t)base->resistance));
+    }
+    if (mask & KINETIC_FANOUT_FIELD_FLAGS) {
+        out[size++] = record->flags;
+    }
+    if (mask & KINETIC_FANOUT_FIELD_STATUS) {
+        out[size++] = record->status;
+    }
+    if (mask & KINETIC_FANOUT_FIELD_CALIBRATION) {
+        out[size++] = record->calibration;
+    }
+    return size;
+}
+
+static void emit_datagram(kinetic_fanout_encoder *encoder, uint8_t *datagram, size_t size, uint16_t entries, bool keyframe, uint64_t tickTime, kinetic_fanout_datagram_handler handler, void *context)
+{
+    put_u32(&datagram[0], KINETIC_FANOUT_MAGIC);
+    datagram[4] = KINETIC_FANOUT_VERSION;
+    datagram[5] = keyframe ? KINETIC_FANOUT_FLAG_KEYFRAME : 0;
+    put_u16(&datagram[6], entries);
+    put_u32(&datagram[8], encoder->publisherId);
+    put_u32(&datagram[12], encoder->sequence++);
+    put_u64(&datagram[16], tickTime);
+    handler(context, datagram, size);
+}
+
+size_t kinetic_fanout_encode_tick(kinetic_fanout_encoder *encoder, uint64_t tickTime, kinetic_fanout_datagram_handler handler, void *context)
+{
+    KINETIC_TRACE_BEGIN(traceStart);
+    bool keyframe = false;
+    if (++encoder->ticksSinceKeyframe >= encoder->keyframeInterval) {
+        keyframe = true;
+        encoder->ticksSinceKeyframe = 0;
+    }
+
+    uint8_t datagram[KINETIC_FANOUT_DATAGRAM_MAX];
+    size_t size = KINETIC_FANOUT_HEADER_SIZE;
+    uint16_t entries = 0;
+    size_t datagrams = 0;
+
+    for (uint32_t i = 0; i < encoder->deviceCount; ++i) {
+        kinetic_fanout_device *device = &encoder->devices[i];
+        if (!device->active) {
+            continue;
+        }
+        bool absolute = keyframe || !device->sent;
+        if (!absolute && (!device->pending || changed_fields(&device->current, &device->last) == 0)) {
+            device->pending = false;
+            continue;
+        }
+        if (size + EntryMax > sizeof(datagram)) {
+            emit_datagram(encoder, datagram, size, entries, keyframe, tickTime, handler, context);
+            datagrams++;
+            size = KINETIC_FANOUT_HEADER_SIZE;
+            entries = 0;
+        }
+        size += encode_entry(&datagram[size], i, device, absolute);
+        entries++;
+        device->last = device->current;
+        device->sent = true;
+        device->pending = false;
+    }
+    if (entries > 0) {
+        emit_datagram(encoder, datagram, size, entries, keyframe, tickTime, handler, context);
+        datagrams++;
+    }
+    KINETIC_TRACE_END(traceStart, "fanout_encode");
+    return datagrams;
+}
+
+
+// Decoder
+
+void kinetic_fanout_decoder_init(kinetic_fanout_decoder *decoder, kinetic_fanout_device *devices, uint32_t deviceCount)
+{
+    memset(devices, 0, sizeof(kinetic_fanout_device) * deviceCount);
+    decoder->devices = devices;
+    decoder->deviceCount = deviceCount;
+    decoder->publisherId = 0;
+    decoder->nextSequence = 0;
+    decoder->started = false;
+    decoder->lost = 0;
+    decoder->rejected = 0;
+}
+
+static void desync(kinetic_fanout_decoder *decoder)
+{
+    for (uint32_t i = 0; i < decoder->deviceCount; ++i) {
+        decoder->devices[i].active = false;
+    }
+}
+
+static bool get_numeric(const uint8_t **in, const uint8_t *end, uint8_t mask, uint8_t field, int64_t base, uint64_t limit, int64_t *value)
+{
+    *value = base;
+    if ((mask & field) == 0) {
+        return true;
+    }
+    uint64_t raw;
+    if (!get_varint(in, end, &raw)) {
+        return false;
+    }
+    *value = base + unzigzag(raw);
+    return *value >= 0 && (uint64_t)*value <= limit;
+}
+
+static bool get_byte(const uint8_t **in, const uint8_t *end, uint8_t mask, uint8_t field, uint8_t base, uint8_t *value)
+{
+    *value = base;
+    if ((mask & field) == 0) {
+        return true;
+    }
+    if (*in >= end) {
+        return false;
+    }
+    *value = *(*in)++;
+    return true;
+}
+
+int kinetic_fanout_decode(kinetic_fanout_decoder *decoder, const uint8_t *datagram, size_t size, kinetic_fanout_sample_handler handler, void *context)
+{
+    if (size < KINETIC_FANOUT_HEADER_SIZE || get_u32(&datagram[0]) != KINETIC_FANOUT_MAGIC || datagram[4] != KINETIC_FANOUT_VERSION) {
+        decoder->rejected++;
+        return -1;
+    }
+    uint16_t entries = get_u16(&datagram[6]);
+    uint32_t publisherId = get_u32(&datagram[8]);
+    uint32_t sequence = get_u32(&datagram[12]);
+    uint64_t tickTime = get_u64(&datagram[16]);
+
+    if (!decoder->started || publisherId != decoder->publisherId) {
+        desync(decoder);
+        decoder->started = true;
+        decoder->publisherId = publisherId;
+    } else if (sequence != decoder->nextSequence) {
+        int32_t gap = (int32_t)(sequence - decoder->nextSequence);
+        if (gap < 0) {
+            // late duplicate or reordered datagram: its differences apply to an older state
+            return 0;
+        }
+        decoder->lost += (uint64_t)gap;
+        desync(decoder);
+    }
+    decoder->nextSequence = sequence + 1;
+
+    static const kinetic_sample_record zero;
+    const uint8_t *in = &datagram[KINETIC_FANOUT_HEADER_SIZE];
+    const uint8_t *end = datagram + size;
+    int delivered = 0;
+
+    for (uint16_t e = 0; e < entries; ++e) {
+        uint64_t deviceIndex;
+        if (!get_varint(&in, end, &deviceIndex) || in >= end) {
+            goto truncated;
+        }
+        uint8_t mask = *in++;
+        bool absolute = (mask & KINETIC_FANOUT_FIELD_ABSOLUTE) != 0;
+        uint8_t systemId[6] = { 0 };
+        if (absolute) {
+            if (end - in < 6) {
+                goto truncated;
+            }
+            memcpy(systemId, in, 6);
+            in += 6;
+        }
+
+        kinetic_fanout_device *device = deviceIndex < decoder->deviceCount ? &decoder->devices[deviceIndex] : NULL;
+        const kinetic_sample_record *base = absolute || device == NULL ? &zero : &device->last;
+
+        int64_t power, speed, cadence, resistance;
+        kinetic_sample_record record = *base;
+        if (!get_numeric(&in, end, mask, KINETIC_FANOUT_FIELD_POWER, base->power, UINT16_MAX, &power) ||
+            !get_numeric(&in, end, mask, KINETIC_FANOUT_FIELD_SPEED, base->speed, UINT32_MAX, &speed) ||
+            !get_numeric(&in, end, mask, KINETIC_FANOUT_FIELD_CADENCE, base->cadence, UINT16_MAX, &cadence) ||
+            !get_numeric(&in, end, mask, KINETIC_FANOUT_FIELD_RESISTANCE, base->resistance, UINT16_MAX, &resistance) ||
+            !get_byte(&in, end, mask, KINETIC_FANOUT_FIELD_FLAGS, base->flags, &record.flags) ||
+            !get_byte(&in, end, mask, KINETIC_FANOUT_FIELD_STATUS, base->status, &record.status) ||
+            !get_byte(&in, end, mask, KINETIC_FANOUT_FIELD_CALIBRATION, base->calibration, &record.calibration)) {
+            goto truncated;
+        }
+        if (device == NULL || (!absolute && !device->active)) {
+            continue;
+        }
+        record.power = (uint16_t)power;
+        record.speed = (uint32_t)speed;
+        record.cadence = (uint16_t)cadence;
+        record.resistance = (uint16_t)resistance;
+
+        if (absolute) {
+            if (device->active && memcmp(device->systemId, systemId, 6) != 0) {
+                device->lastTime = 0;
+            }
+            memcpy(device->systemId, systemId, 6);
+            device->active = true;
+        }
+        device->last = record;
+
+        uint64_t elapsed = device->lastTime != 0 && tickTime > device->lastTime ? (tickTime - device->lastTime) / 1000 : 0;
+        kinetic_sample_set_time_delta(&record, elapsed);
+        device->lastTime = tickTime;
+
+        handler(context, (uint32_t)deviceIndex, device->systemId, tickTime, &record);
+        delivered++;
+    }
+    return delivered;
+
+truncated:
+    decoder->rejected++;
+    desync(decoder);
+    return -1;
+}
+
+
+// UDP transport
+
+static bool parse_address(const char *address, uint16_t port, struct sockaddr_storage *storage, socklen_t *length, bool *multicast)
+{
+    memset(storage, 0, sizeof(*storage));
+    struct sockaddr_in *in4 = (struct sockaddr_in *)storage;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)storage;
+    if (inet_pton(AF_INET, address, &in4->sin_addr) == 1) {
+        in4->sin_family = AF_INET;
+        in4->sin_port = htons(port);
+        *length = sizeof(*in4);
+        *multicast = IN_MULTICAST(ntohl(in4->sin_addr.s_addr));
+        return true;
+    }
+    if (inet_pton(AF_INET6, address, &in6->sin6_addr) == 1) {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port);
+        *length = sizeof(*in6);
+        *multicast = IN6_IS_ADDR_MULTICAST(&in6->sin6_addr);
+        return true;
+    }
+    errno = EINVAL;
+    return false;
+}
+
+bool kinetic_fanout_publisher_open(kinetic_fanout_publisher *publisher, const char *address, uint16_t port, kinetic_fanout_device *devices, uint32_t deviceCount, uint32_t keyframeInterval)
+{
+    memset(publisher, 0, sizeof(*publisher));
+    publisher->fd = -1;
+    bool multicast;
+    if (!parse_address(address, port, &publisher->address, &publisher->addressLength, &multicast)) {
+        return false;
+    }
+    int fd = socket(publisher->address.ss_family, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return false;
+    }
+    if (multicast) {
+        // stay on the local network, and deliver to subscribers on this host too
+        if (publisher->address.ss_family == AF_INET) {
+            unsigned char ttl = 1, loop = 1;
+            setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+            setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+        } else {
+            int hops = 1, loop = 1;
+            setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &hops, sizeof(hops));
+            setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loop, sizeof(loop));
+        }
+    }
+    publisher->fd = fd;
+
+    // a random publisher id so subscribers notice restarts
+    uint32_t publisherId = (uint32_t)getpid() ^ (uint32_t)(uintptr_t)publisher ^ (uint32_t)time(NULL) * 2654435761u;
+    kinetic_fanout_encoder_init(&publisher->encoder, devices, deviceCount, publisherId, keyframeInterval);
+    return true;
+}
+
+static void send_datagram(void *context, const uint8_t *datagram, size_t size)
+{
+    kinetic_fanout_publisher *publisher = context;
+    if (sendto(publisher->fd, datagram, size, 0, (const struct sockaddr *)&publisher->address, publisher->addressLength) == (ssize_t)size) {
+        publisher->datagramsSent++;
+    } else {
+        publisher->sendErrors++;
+    }
+}
+
+size_t kinetic_fanout_publisher_tick(kinetic_fanout_publisher *publisher, uint64_t tickTime)
+{
+    return kinetic_fanout_encode_tick(&publisher->encoder, tickTime, send_datagram, publisher);
+}
+
+void kinetic_fanout_publisher_close(kinetic_fanout_publisher *publisher)
+{
+    if (publisher->fd >= 0) {
+        close(publisher->fd);
+    }
+    publisher->fd = -1;
+}
+
+bool kinetic_fanout_subscriber_open(kinetic_fanout_subscriber *subscriber, const char *address, uint16_t port, kinetic_fanout_device *devices, uint32_t deviceCount)
+{
+    subscriber->fd = -1;
+    kinetic_fanout_decoder_init(&subscriber->decoder, devices, deviceCount);
+
+    struct sockaddr_storage group;
+    socklen_t length;
+    bool multicast = false;
+    if (!parse_address(address != NULL ? address : "0.0.0.0", port, &group, &length, &multicast)) {
+        return false;
+    }
+    int fd = socket(group.ss_family, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return false;
+    }
+    if (multicast) {
+        // every member of the group gets a copy. Sharing a unicast port would spread the datagrams over the
+        // sockets instead, and each subscriber would see sequence gaps.
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
+    }
+
+    // multicast subscribers bind the wildcard address and join the group
+    struct sockaddr_storage local = group;
+    if (multicast) {
+        if (local.ss_family == AF_INET) {
+            ((struct sockaddr_in *)&local)->sin_addr.s_addr = htonl(INADDR_ANY);
+        } else {
+            ((struct sockaddr_in6 *)&local)->sin6_addr = in6addr_any;
+        }
+    }
+    if (bind(fd, (const struct sockaddr *)&local, length) != 0) {
+        goto failed;
+    }
+    if (multicast && group.ss_family == AF_INET) {
+        struct ip_mreq request;
+        request.imr_multiaddr = ((struct sockaddr_in *)&group)->sin_addr;
+        request.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &request, sizeof(request)) != 0) {
+            goto failed;
+        }
+    } else if (multicast) {
+        struct ipv6_mreq request;
+        request.ipv6mr_multiaddr = ((struct sockaddr_in6 *)&group)->sin6_addr;
+        request.ipv6mr_interface = 0;
+        if (setsockopt(fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &request, sizeof(request)) != 0) {
+            goto failed;
+        }
+    }
+    subscriber->fd = fd;
+    return true;
+
+failed:
+    {
+        int error = errno;
+        close(fd);
+        errno = error;
+    }
+    return false;
+}
+
+int kinetic_fanout_subscriber_receive(kinetic_fanout_subscriber *subscriber, int timeoutMS, kinetic_fanout_sample_handler handler, void *context)
+{
+    struct pollfd pfd = { subscriber->fd, POLLIN, 0 };
+    int ready = poll(&pfd, 1, timeoutMS);
+    if (ready < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    int samples = 0;
+    while (ready > 0) {
+        ssize_t size = recv(subscriber->fd, subscriber->datagram, sizeof(subscriber->datagram), MSG_DONTWAIT);
+        if (size < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                break;
+            }
+            return -1;
+        }
+        int delivered = kinetic_fanout_decode(&subscriber->decoder, subscriber->datagram, (size_t)size, handler, context);
+        if (delivered > 0) {
+            samples += delivered;
+        }
+    }
+    return samples;
+}
+
+void kinetic_fanout_subscriber_close(kinetic_fanout_subscriber *subscriber)
+{
+    if (subscriber->fd >= 0) {
+        close(subscriber->fd);
+    }
+    subscriber->fd = -1;
+}
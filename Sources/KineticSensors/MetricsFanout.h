@@ -0,0 +1,234 @@
+//
+//  MetricsFanout.h
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#ifndef MetricsFanout_h
+#define MetricsFanout_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#include "inRide.h"
+#include "SmartControl.h"
+#include "SampleRecord.h"
+
+// Decoded samples of many devices over UDP (multicast on the LAN, or loopback), one datagram per update tick.
+//
+// Datagram (little-endian):
+// - header (24 bytes): magic "KFAN", version, flags, entry count, publisher id, sequence, tick time (microseconds)
+// - entries, one per device that changed since the previous tick:
+//   - varint device index
+//   - field mask: power, speed, cadence, resistance, flags, status, calibration, ABSOLUTE
+//   - ABSOLUTE entries carry the 6 byte System Id and the fields as values, the others carry the changed fields only,
+//     as differences from the device's previous entry (zigzag varints for the numbers, bytes for the bit fields)
+// The fields are those of kinetic_sample_record, so the quantization is the one of SampleRecord.h.
+//
+// A device's first entry is absolute, and every keyframeInterval ticks all devices are sent absolute (KEYFRAME flag).
+// A subscriber that misses a datagram (sequence gap, publisher restart) drops the difference entries of every device
+// until that device's next absolute entry, so a lost datagram costs at most one keyframe interval of data.
+// A tick that does not fit in one datagram (KINETIC_FANOUT_DATAGRAM_MAX) is split over several with the same tick time.
+
+#define KINETIC_FANOUT_MAGIC            0x4E41464B  // "KFAN"
+#define KINETIC_FANOUT_VERSION          1
+#define KINETIC_FANOUT_HEADER_SIZE      24
+#define KINETIC_FANOUT_DATAGRAM_MAX     1400        // stays below the Ethernet MTU with IPv4 / IPv6 and UDP headers
+#define KINETIC_FANOUT_KEYFRAME_INTERVAL 20         // ticks between keyframes when 0 is given
+
+/*! Datagram Flags */
+typedef enum kinetic_fanout_flag
+{
+    KINETIC_FANOUT_FLAG_KEYFRAME        = 0x01
+} kinetic_fanout_flag;
+
+/*! Entry Field Mask */
+typedef enum kinetic_fanout_field
+{
+    KINETIC_FANOUT_FIELD_POWER          = 0x01,
+    KINETIC_FANOUT_FIELD_SPEED          = 0x02,
+    KINETIC_FANOUT_FIELD_CADENCE        = 0x04,
+    KINETIC_FANOUT_FIELD_RESISTANCE     = 0x08,
+    KINETIC_FANOUT_FIELD_FLAGS          = 0x10,
+    KINETIC_FANOUT_FIELD_STATUS         = 0x20,
+    KINETIC_FANOUT_FIELD_CALIBRATION    = 0x40,
+    KINETIC_FANOUT_FIELD_ABSOLUTE       = 0x80
+} kinetic_fanout_field;
+
+
+/*! Per device state (publisher and subscriber) */
+typedef struct kinetic_fanout_device
+{
+    /*! Last sample sent / received */
+    kinetic_sample_record last;
+    /*! Publisher: latest sample, not sent yet if pending */
+    kinetic_sample_record current;
+    uint8_t systemId[6];
+    /*! Publisher: the device has data. Subscriber: the device state is in sync with the publisher */
+    bool active;
+    bool pending;
+    /*! Publisher: an absolute entry was sent */
+    bool sent;
+    /*! Subscriber: tick time of the last entry (microseconds) */
+    uint64_t lastTime;
+} kinetic_fanout_device;
+
+/*! Encoder (publisher side, no I/O) */
+typedef struct kinetic_fanout_encoder
+{
+    kinetic_fanout_device *devices;
+    uint32_t deviceCount;
+    uint32_t publisherId;
+    uint32_t sequence;
+    /*! Ticks between keyframes */
+    uint32_t keyframeInterval;
+    uint32_t ticksSinceKeyframe;
+} kinetic_fanout_encoder;
+
+/*! Decoder (subscriber side, no I/O) */
+typedef struct kinetic_fanout_decoder
+{
+    kinetic_fanout_device *devices;
+    uint32_t deviceCount;
+    uint32_t publisherId;
+    uint32_t nextSequence;
+    bool started;
+    /*! Datagrams lost (sequence gaps) and rejected (bad magic / version / truncated) */
+    uint64_t lost;
+    uint64_t rejected;
+} kinetic_fanout_decoder;
+
+/*! Receives the datagrams of a tick */
+typedef void (*kinetic_fanout_datagram_handler)(void *context, const uint8_t *datagram, size_t size);
+
+/*! Receives the samples decoded from a datagram (record.timeDelta is the time since the device's previous sample) */
+typedef void (*kinetic_fanout_sample_handler)(void *context, uint32_t deviceIndex, const uint8_t systemId[6], uint64_t tickTime, const kinetic_sample_record *record);
+
+
+/*!
+ Initializes an encoder.
+
+ @param encoder Encoder
+ @param devices State of each device (deviceCount, owned by the caller)
+ @param deviceCount Number of devices
+ @param publisherId Identifies this publisher run (random), subscribers resync when it changes
+ @param keyframeInterval Ticks between keyframes (0 for KINETIC_FANOUT_KEYFRAME_INTERVAL: without keyframes a lost
+                         datagram or a late subscriber would never resync)
+ */
+void kinetic_fanout_encoder_init(kinetic_fanout_encoder *encoder, kinetic_fanout_device *devices, uint32_t deviceCount, uint32_t publisherId, uint32_t keyframeInterval);
+
+/*!
+ Sets the latest inRide sample of a device (sent on the next tick).
+ */
+void kinetic_fanout_update_inride(kinetic_fanout_encoder *encoder, uint32_t deviceIndex, const uint8_t systemId[6], const inride_power_data *data);
+
+/*!
+ Sets the latest Smart Control sample of a device (sent on the next tick).
+ */
+void kinetic_fanout_update_smart_control(kinetic_fanout_encoder *encoder, uint32_t deviceIndex, const uint8_t systemId[6], const smart_control_power_data *data);
+
+/*!
+ Encodes the pending samples of a tick.
+
+ @param encoder Encoder
+ @param tickTime Time of the tick (microseconds)
+ @param handler Receives each datagram (the buffer is only valid during the call)
+ @param context Passed to the handler
+
+ @return Number of datagrams (0 if nothing changed)
+ */
+size_t kinetic_fanout_encode_tick(kinetic_fanout_encoder *encoder, uint64_t tickTime, kinetic_fanout_datagram_handler handler, void *context);
+
+/*!
+ Initializes a decoder.
+
+ @param decoder Decoder
+ @param devices State of each device (deviceCount, owned by the caller). Entries of higher device indices are skipped.
+ @param deviceCount Number of devices
+ */
+void kinetic_fanout_decoder_init(kinetic_fanout_decoder *decoder, kinetic_fanout_device *devices, uint32_t deviceCount);
+
+/*!
+ Decodes a datagram.
+
+ @param decoder Decoder
+ @param datagram Datagram
+ @param size Size of the datagram
+ @param handler Receives each sample that could be decoded
+ @param context Passed to the handler
+
+ @return Number of samples delivered, -1 if the datagram was rejected
+ */
+int kinetic_fanout_decode(kinetic_fanout_decoder *decoder, const uint8_t *datagram, size_t size, kinetic_fanout_sample_handler handler, void *context);
+
+
+// UDP transport
+
+/*! Publisher (encoder + socket) */
+typedef struct kinetic_fanout_publisher
+{
+    kinetic_fanout_encoder encoder;
+    int fd;
+    struct sockaddr_storage address;
+    socklen_t addressLength;
+    uint64_t datagramsSent;
+    uint64_t sendErrors;
+} kinetic_fanout_publisher;
+
+/*! Subscriber (decoder + socket) */
+typedef struct kinetic_fanout_subscriber
+{
+    kinetic_fanout_decoder decoder;
+    int fd;
+    uint8_t datagram[KINETIC_FANOUT_DATAGRAM_MAX];
+} kinetic_fanout_subscriber;
+
+/*!
+ Opens a publisher.
+
+ @param publisher Publisher
+ @param address Destination: IPv4 / IPv6 multicast group ("239.255.75.1") or unicast address ("127.0.0.1")
+ @param port Destination port
+ @param devices State of each device (owned by the caller)
+ @param deviceCount Number of devices
+ @param keyframeInterval Ticks between keyframes (0 for KINETIC_FANOUT_KEYFRAME_INTERVAL)
+
+ @return false if the address is invalid or the socket could not be created (errno is set)
+ */
+bool kinetic_fanout_publisher_open(kinetic_fanout_publisher *publisher, const char *address, uint16_t port, kinetic_fanout_device *devices, uint32_t deviceCount, uint32_t keyframeInterval);
+
+/*!
+ Sends the samples updated since the previous tick (use kinetic_fanout_update_* on publisher->encoder).
+
+ @return Number of datagrams sent
+ */
+size_t kinetic_fanout_publisher_tick(kinetic_fanout_publisher *publisher, uint64_t tickTime);
+
+void kinetic_fanout_publisher_close(kinetic_fanout_publisher *publisher);
+
+/*!
+ Opens a subscriber.
+
+ @param subscriber Subscriber
+ @param address Multicast group to join, unicast address to receive on, or NULL for any IPv4 address
+ @param port Port to receive on (subscribers of a multicast group on one host can share it, a unicast port has a single subscriber)
+ @param devices State of each device (owned by the caller)
+ @param deviceCount Number of devices
+
+ @return false if the socket could not be created (errno is set)
+ */
+bool kinetic_fanout_subscriber_open(kinetic_fanout_subscriber *subscriber, const char *address, uint16_t port, kinetic_fanout_device *devices, uint32_t deviceCount);
+
+/*!
+ Receives and decodes the available datagrams, waiting up to timeoutMS for the first one.
+
+ @return Number of samples delivered, -1 on error
+ */
+int kinetic_fanout_subscriber_receive(kinetic_fanout_subscriber *subscriber, int timeoutMS, kinetic_fanout_sample_handler handler, void *context);
+
+void kinetic_fanout_subscriber_close(kinetic_fanout_subscriber *subscriber);
+
+
+#endif /* MetricsFanout_h */
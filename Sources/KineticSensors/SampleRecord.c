@@ -0,0 +1,182 @@
+//
+//  SampleRecord.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#include "SampleRecord.h"
+
+#define ResistanceScale         65535.0
+#define TimeDeltaMax            0xFFFFFFull
+
+
+// Rounds and clamps a non-negative value into [0, max]. Written with fmin / fmax (no branches) so the array loops vectorize.
+static inline uint32_t quantize(double value, double max)
+{
+    return (uint32_t)(fmin(fmax(value, 0.0), max) + 0.5);
+}
+
+uint64_t kinetic_sample_time_delta(const kinetic_sample_record *record)
+{
+    uint64_t delta = record->timeDelta | (uint64_t)record->timeDeltaHigh << 16;
+    return record->flags & KINETIC_SAMPLE_FLAG_TIME_SECONDS ? delta * 1000 : delta;
+}
+
+uint64_t kinetic_sample_set_time_delta(kinetic_sample_record *record, uint64_t milliseconds)
+{
+    uint64_t delta = milliseconds;
+    record->flags &= (uint8_t)~KINETIC_SAMPLE_FLAG_TIME_SECONDS;
+    if (delta > TimeDeltaMax) {
+        delta = (milliseconds + 500) / 1000;
+        delta = delta > TimeDeltaMax ? TimeDeltaMax : delta;
+        record->flags |= KINETIC_SAMPLE_FLAG_TIME_SECONDS;
+    }
+    record->timeDelta = (uint16_t)delta;
+    record->timeDeltaHigh = (uint8_t)(delta >> 16);
+    return kinetic_sample_time_delta(record);
+}
+
+// Stores the differences of the timestamps quantized to the millisecond. The time rebuilt by the reader is tracked, so
+// the rounding of one delta (and a gap rounded to the second) is made up by the next one instead of adding up.
+static void pack_time_deltas(const double *timestamps, double previousTimestamp, size_t count, kinetic_sample_record *records)
+{
+    int64_t rebuilt = llround(previousTimestamp * 1000.0);
+    for (size_t i = 0; i < count; ++i) {
+        int64_t millis = llround(timestamps[i] * 1000.0);
+        rebuilt += (int64_t)kinetic_sample_set_time_delta(&records[i], millis > rebuilt ? (uint64_t)(millis - rebuilt) : 0);
+    }
+}
+
+kinetic_sample_record inride_sample_pack(const inride_power_data *data, uint32_t timeDelta)
+{
+    kinetic_sample_record record;
+    record.flags = 0;
+    record.flags |= data->coasting ? KINETIC_SAMPLE_FLAG_COASTING : 0;
+    record.flags |= data->proFlywheel ? KINETIC_SAMPLE_FLAG_PRO_FLYWHEEL : 0;
+    record.power = (uint16_t)quantize(data->power, 65535.0);
+    record.speed = quantize(data->speedKPH * 1000.0, 4294967295.0);
+    record.cadence = (uint16_t)quantize(data->cadenceRPM * 10.0, 65535.0);
+    record.resistance = (uint16_t)quantize(data->rollerResistance * ResistanceScale, ResistanceScale);
+    record.status = (uint8_t)data->state | (uint8_t)data->commandResult;
+    record.calibration = (uint8_t)data->calibrationResult;
+    kinetic_sample_set_time_delta(&record, timeDelta);
+    return record;
+}
+
+inride_power_data inride_sample_unpack(const kinetic_sample_record *record)
+{
+    inride_power_data data;
+    data.state = record->status & 0x30;
+    data.commandResult = record->status & 0x0F;
+    data.power = record->power;
+    data.speedKPH = record->speed / 1000.0;
+    data.rollerRPM = 0;
+    data.cadenceRPM = record->cadence / 10.0;
+    data.coasting = (record->flags & KINETIC_SAMPLE_FLAG_COASTING) != 0;
+    data.calibrationResult = record->calibration;
+    data.proFlywheel = (record->flags & KINETIC_SAMPLE_FLAG_PRO_FLYWHEEL) != 0;
+    data.rollerResistance = record->resistance / ResistanceScale;
+    if (!data.proFlywheel) {
+        data.spindownTime = SpindownMin + (1 - data.rollerResistance) * (SpindownMax - SpindownMin);
+    } else {
+        data.spindownTime = SpindownMinPro + (1 - data.rollerResistance) * (SpindownMaxPro - SpindownMinPro);
+    }
+    data.lastSpindownResultTime = 0;
+    return data;
+}
+
+kinetic_sample_record smart_control_sample_pack(const smart_control_power_data *data, uint32_t timeDelta)
+{
+    kinetic_sample_record record;
+    record.flags = KINETIC_SAMPLE_FLAG_SMART_CONTROL;
+    record.power = data->power;
+    record.speed = quantize(data->speedKPH * 1000.0, 4294967295.0);
+    record.cadence = (uint16_t)data->cadenceRPM * 10;
+    record.resistance = data->targetResistance;
+    record.status = (uint8_t)data->mode;
+    record.calibration = 0;
+    kinetic_sample_set_time_delta(&record, timeDelta);
+    return record;
+}
+
+smart_control_power_data smart_control_sample_unpack(const kinetic_sample_record *record)
+{
+    smart_control_power_data data;
+    data.mode = record->status;
+    data.power = record->power;
+    data.speedKPH = record->speed / 1000.0;
+    data.cadenceRPM = (uint8_t)((record->cadence + 5) / 10);
+    data.targetResistance = record->resistance;
+    return data;
+}
+
+void inride_sample_pack_array(const inride_power_data *data, const double *timestamps, double previousTimestamp, size_t count, kinetic_sample_record *records)
+{
+    for (size_t i = 0; i < count; ++i) {
+        const inride_power_data *sample = &data[i];
+        kinetic_sample_record *record = &records[i];
+        uint8_t flags = 0;
+        flags |= sample->coasting ? KINETIC_SAMPLE_FLAG_COASTING : 0;
+        flags |= sample->proFlywheel ? KINETIC_SAMPLE_FLAG_PRO_FLYWHEEL : 0;
+        record->power = (uint16_t)quantize(sample->power, 65535.0);
+        record->speed = quantize(sample->speedKPH * 1000.0, 4294967295.0);
+        record->cadence = (uint16_t)quantize(sample->cadenceRPM * 10.0, 65535.0);
+        record->resistance = (uint16_t)quantize(sample->rollerResistance * ResistanceScale, ResistanceScale);
+        record->flags = flags;
+        record->status = (uint8_t)sample->state | (uint8_t)sample->commandResult;
+        record->calibration = (uint8_t)sample->calibrationResult;
+    }
+    pack_time_deltas(timestamps, previousTimestamp, count, records);
+}
+
+void smart_control_sample_pack_array(const smart_control_power_data *data, const double *timestamps, double previousTimestamp, size_t count, kinetic_sample_record *records)
+{
+    for (size_t i = 0; i < count; ++i) {
+        const smart_control_power_data *sample = &data[i];
+        kinetic_sample_record *record = &records[i];
+        uint8_t flags = KINETIC_SAMPLE_FLAG_SMART_CONTROL;
+        record->power = sample->power;
+        record->speed = quantize(sample->speedKPH * 1000.0, 4294967295.0);
+        record->cadence = (uint16_t)sample->cadenceRPM * 10;
+        record->resistance = sample->targetResistance;
+        record->flags = flags;
+        record->status = (uint8_t)sample->mode;
+        record->calibration = 0;
+    }
+    pack_time_deltas(timestamps, previousTimestamp, count, records);
+}
+
+double kinetic_sample_unpack_columns(const kinetic_sample_record *records, size_t count, double startTimestamp, const kinetic_sample_columns *columns)
+{
+    // One pass per column: each loop is a straight gather / convert that the compiler vectorizes.
+    if (columns->power != NULL) {
+        for (size_t i = 0; i < count; ++i) {
+            columns->power[i] = records[i].power;
+        }
+    }
+    if (columns->speedKPH != NULL) {
+        for (size_t i = 0; i < count; ++i) {
+            columns->speedKPH[i] = (float)records[i].speed * 0.001f;
+        }
+    }
+    if (columns->cadenceRPM != NULL) {
+        for (size_t i = 0; i < count; ++i) {
+            columns->cadenceRPM[i] = (float)records[i].cadence * 0.1f;
+        }
+    }
+    if (columns->flags != NULL) {
+        for (size_t i = 0; i < count; ++i) {
+            columns->flags[i] = records[i].flags;
+        }
+    }
+
+    // The running timestamp is a prefix sum, kept in integer milliseconds so long series do not drift.
+    uint64_t elapsed = 0;
+    for (size_t i = 0; i < count; ++i) {
+        elapsed += kinetic_sample_time_delta(&records[i]);
+        if (columns->timestamp != NULL) {
+            columns->timestamp[i] = startTimestamp + elapsed / 1000.0;
+        }
+    }
+    return startTimestamp + elapsed / 1000.0;
+}
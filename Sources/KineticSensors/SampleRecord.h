@@ -0,0 +1,183 @@
+//
+//  SampleRecord.h
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#ifndef SampleRecord_h
+#define SampleRecord_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "inRide.h"
+#include "SmartControl.h"
+
+// Compact storage format for decoded samples.
+// - inride_power_data is over 80 bytes and smart_control_power_data is 24 bytes, mostly doubles and padding.
+// - A record is 16 bytes, packed, little-endian on every platform we ship on.
+// - Records hold the decoded values, quantized. They are not lossless: the raw inRide counters (roller ticks,
+//   revolutions, cadence counter) are not kept, so power cannot be derived again from a record (after a recalibration,
+//   say). Keep the frame capture (FrameCapture.h) for that.
+// - Power (Watts, inRide negatives clamp to 0) and the state / mode / result fields are stored exactly.
+// - Speed is stored in meters / hour: exact for Smart Control firmware that broadcasts meters / hour, within 0.5 m/h
+//   for the speeds derived from roller ticks (inRide, older Smart Control firmware).
+// - Cadence is stored in 0.1 RPM: exact for Smart Control, within 0.05 RPM for the inRide (0.8652 RPM counter steps).
+// - Roller resistance is stored in 1/65535 steps, the inRide spindown time is rebuilt from it.
+// - Time is stored as the delta from the previous record: 24 bits of milliseconds (up to 4.6 hours), or of seconds for
+//   longer gaps (KINETIC_SAMPLE_FLAG_TIME_SECONDS). The array packers store the differences of the timestamps quantized
+//   to the millisecond, so the rounding does not add up: unpacked timestamps stay within 1 ms of the packed ones over any
+//   length of series (a record after a gap counted in seconds is within 0.5 s, the next record is back within 1 ms).
+// - Packing an unpacked record returns the identical record.
+
+
+/*! Sample Record Flags */
+typedef enum kinetic_sample_flag
+{
+    KINETIC_SAMPLE_FLAG_SMART_CONTROL   = 0x01, // record came from a Smart Control (otherwise an inRide)
+    KINETIC_SAMPLE_FLAG_COASTING        = 0x02, // inRide only
+    KINETIC_SAMPLE_FLAG_PRO_FLYWHEEL    = 0x04, // inRide only
+    KINETIC_SAMPLE_FLAG_TIME_SECONDS    = 0x08  // the time since the previous record is counted in seconds (4.6 hours or more)
+} kinetic_sample_flag;
+
+/*! Packed, quantized sample (16 bytes) */
+typedef struct kinetic_sample_record
+{
+    /*! Time since the previous record, low 16 bits (read and write it with kinetic_sample_time_delta / kinetic_sample_set_time_delta) */
+    uint16_t timeDelta;
+
+    /*! Power (Watts) */
+    uint16_t power;
+
+    /*! Speed (meters / hour) */
+    uint32_t speed;
+
+    /*! Cadence (0.1 RPM) */
+    uint16_t cadence;
+
+    /*! inRide: Roller Resistance (0..1 scaled to 0..65535). Smart Control: Target Resistance (Watts) */
+    uint16_t resistance;
+
+    /*! kinetic_sample_flag bitfield */
+    uint8_t flags;
+
+    /*! inRide: state | commandResult (same layout as the power frame). Smart Control: mode */
+    uint8_t status;
+
+    /*! inRide: calibrationResult. Smart Control: unused */
+    uint8_t calibration;
+
+    /*! Time since the previous record, high 8 bits */
+    uint8_t timeDeltaHigh;
+} __attribute__((packed)) kinetic_sample_record;
+
+
+/*! Column view of a series of records (any column pointer may be NULL to skip it) */
+typedef struct kinetic_sample_columns
+{
+    /*! Seconds, accumulated from the record time deltas (kinetic_sample_time_delta) */
+    double *timestamp;
+    uint16_t *power;
+    float *speedKPH;
+    float *cadenceRPM;
+    uint8_t *flags;
+} kinetic_sample_columns;
+
+
+/*!
+ Time since the previous record.
+
+ @param record Packed record
+
+ @return Milliseconds
+ */
+uint64_t kinetic_sample_time_delta(const kinetic_sample_record *record);
+
+/*!
+ Sets the time since the previous record (timeDelta, timeDeltaHigh and KINETIC_SAMPLE_FLAG_TIME_SECONDS).
+ Gaps of 4.6 hours and more are rounded to the second, gaps over 194 days saturate.
+
+ @param record Packed record
+ @param milliseconds Time since the previous record
+
+ @return Milliseconds actually stored
+ */
+uint64_t kinetic_sample_set_time_delta(kinetic_sample_record *record, uint64_t milliseconds);
+
+/*!
+ Packs a single decoded inRide sample.
+
+ @param data Decoded power data
+ @param timeDelta Milliseconds since the previous sample
+
+ @return Packed record
+ */
+kinetic_sample_record inride_sample_pack(const inride_power_data *data, uint32_t timeDelta);
+
+/*!
+ Unpacks a single inRide record.
+ The spindownTime is rebuilt from the rollerResistance, lastSpindownResultTime and rollerRPM are not stored (0).
+
+ @param record Packed record
+
+ @return Decoded power data
+ */
+inride_power_data inride_sample_unpack(const kinetic_sample_record *record);
+
+/*!
+ Packs a single decoded Smart Control sample.
+
+ @param data Decoded power data
+ @param timeDelta Milliseconds since the previous sample
+
+ @return Packed record
+ */
+kinetic_sample_record smart_control_sample_pack(const smart_control_power_data *data, uint32_t timeDelta);
+
+/*!
+ Unpacks a single Smart Control record.
+
+ @param record Packed record
+
+ @return Decoded power data
+ */
+smart_control_power_data smart_control_sample_unpack(const kinetic_sample_record *record);
+
+
+/*!
+ Packs an array of decoded inRide samples.
+
+ @param data Decoded power data
+ @param timestamps Timestamp of each sample (seconds, in order). The first record is relative to previousTimestamp.
+ @param previousTimestamp Timestamp of the sample before data[0] (use timestamps[0] to start a new series)
+ @param count Number of samples
+ @param records Output array (count records)
+ */
+void inride_sample_pack_array(const inride_power_data *data, const double *timestamps, double previousTimestamp, size_t count, kinetic_sample_record *records);
+
+/*!
+ Packs an array of decoded Smart Control samples.
+
+ @param data Decoded power data
+ @param timestamps Timestamp of each sample (seconds, in order). The first record is relative to previousTimestamp.
+ @param previousTimestamp Timestamp of the sample before data[0] (use timestamps[0] to start a new series)
+ @param count Number of samples
+ @param records Output array (count records)
+ */
+void smart_control_sample_pack_array(const smart_control_power_data *data, const double *timestamps, double previousTimestamp, size_t count, kinetic_sample_record *records);
+
+/*!
+ Unpacks an array of records (either device type) into columns.
+
+ @param records Packed records
+ @param count Number of records
+ @param startTimestamp Timestamp (seconds) the first record's timeDelta is relative to
+ @param columns Output columns, each with room for count values
+
+ @return Timestamp of the last record (pass as startTimestamp to continue the series)
+ */
+double kinetic_sample_unpack_columns(const kinetic_sample_record *records, size_t count, double startTimestamp, const kinetic_sample_columns *columns);
+
+
+#endif /* SampleRecord_h */
@@ -0,0 +1,224 @@
+//
+//  SharedMetrics.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#include "SharedMetrics.h"
+#include "Tracing.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ReadRetries             64
+
+static size_t segment_size(uint32_t slotCount)
+{
+    return sizeof(kinetic_shared_metrics_header) + (size_t)slotCount * sizeof(kinetic_shared_metrics_slot);
+}
+
+// Marks the segment of that name retired and removes the name. Resizing it in place would pull pages from under the
+// readers (SIGBUS), and Darwin sizes a shared memory object only once.
+static void retire(const char *name)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(kinetic_shared_metrics_header)) {
+        void *base = mmap(NULL, sizeof(kinetic_shared_metrics_header), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (base != MAP_FAILED) {
+            atomic_store_explicit(&((kinetic_shared_metrics_header *)base)->retired, 1, memory_order_release);
+            munmap(base, sizeof(kinetic_shared_metrics_header));
+        }
+    }
+    close(fd);
+    shm_unlink(name);
+}
+
+bool kinetic_shared_metrics_create(kinetic_shared_metrics *metrics, const char *name, uint32_t slotCount)
+{
+    memset(metrics, 0, sizeof(*metrics));
+    if (slotCount == 0) {
+        errno = EINVAL;
+        return false;
+    }
+    retire(name);
+    // a new object starts with zeroed slots (generation 0), and is sized once
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    size_t size = segment_size(slotCount);
+    if (ftruncate(fd, (off_t)size) != 0) {
+        int error = errno;
+        close(fd);
+        shm_unlink(name);
+        errno = error;
+        return false;
+    }
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return false;
+    }
+
+    metrics->header = (kinetic_shared_metrics_header *)base;
+    metrics->slots = (kinetic_shared_metrics_slot *)((uint8_t *)base + sizeof(kinetic_shared_metrics_header));
+    metrics->slotCount = slotCount;
+    metrics->mappedSize = size;
+    metrics->publisher = true;
+
+    metrics->header->version = KINETIC_SHARED_METRICS_VERSION;
+    metrics->header->slotSize = sizeof(kinetic_shared_metrics_slot);
+    metrics->header->slotCount = slotCount;
+    // the magic goes last: readers that see it also see the rest of the header
+    atomic_store_explicit(&metrics->header->magic, KINETIC_SHARED_METRICS_MAGIC, memory_order_release);
+    return true;
+}
+
+bool kinetic_shared_metrics_open(kinetic_shared_metrics *metrics, const char *name)
+{
+    memset(metrics, 0, sizeof(*metrics));
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(kinetic_shared_metrics_header)) {
+        close(fd);
+        errno = EAGAIN;
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    void *base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return false;
+    }
+
+    kinetic_shared_metrics_header *header = (kinetic_shared_metrics_header *)base;
+    if (atomic_load_explicit(&header->magic, memory_order_acquire) != KINETIC_SHARED_METRICS_MAGIC ||
+        header->version != KINETIC_SHARED_METRICS_VERSION ||
+        header->slotSize != sizeof(kinetic_shared_metrics_slot) ||
+        segment_size(header->slotCount) > size) {
+        munmap(base, size);
+        errno = EPROTO;
+        return false;
+    }
+
+    metrics->header = header;
+    metrics->slots = (kinetic_shared_metrics_slot *)((uint8_t *)base + sizeof(kinetic_shared_metrics_header));
+    metrics->slotCount = header->slotCount;
+    metrics->mappedSize = size;
+    metrics->publisher = false;
+    return true;
+}
+
+bool kinetic_shared_metrics_retired(const kinetic_shared_metrics *metrics)
+{
+    return metrics->header != NULL && atomic_load_explicit(&metrics->header->retired, memory_order_acquire) != 0;
+}
+
+void kinetic_shared_metrics_close(kinetic_shared_metrics *metrics)
+{
+    if (metrics->header != NULL) {
+        munmap(metrics->header, metrics->mappedSize);
+    }
+    memset(metrics, 0, sizeof(*metrics));
+}
+
+bool kinetic_shared_metrics_unlink(const char *name)
+{
+    return shm_unlink(name) == 0;
+}
+
+
+// Seqlock write: odd sequence, payload, even sequence. The payload words are relaxed atomics, so the copies of a
+// reader that races the publisher are torn (and discarded) but never undefined.
+static void publish(kinetic_shared_metrics *metrics, uint32_t slot, const kinetic_shared_metrics_sample *sample)
+{
+    if (!metrics->publisher || slot >= metrics->slotCount) {
+        return;
+    }
+    KINETIC_TRACE_BEGIN(traceStart);
+    kinetic_shared_metrics_slot *target = &metrics->slots[slot];
+    uint64_t words[KINETIC_SHARED_METRICS_WORDS] = { 0 };
+    memcpy(words, sample, sizeof(*sample));
+
+    uint64_t sequence = atomic_load_explicit(&target->sequence, memory_order_relaxed);
+    atomic_store_explicit(&target->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for (size_t i = 0; i < KINETIC_SHARED_METRICS_WORDS; ++i) {
+        atomic_store_explicit(&target->words[i], words[i], memory_order_relaxed);
+    }
+    atomic_store_explicit(&target->sequence, sequence + 2, memory_order_release);
+    KINETIC_TRACE_END(traceStart, "metrics_publish");
+}
+
+void kinetic_shared_metrics_publish_inride(kinetic_shared_metrics *metrics, uint32_t slot, const uint8_t systemId[6], uint64_t timestamp, const inride_power_data *data)
+{
+    kinetic_shared_metrics_sample sample;
+    memset(&sample, 0, sizeof(sample));
+    sample.deviceType = KINETIC_CAPTURE_DEVICE_INRIDE;
+    memcpy(sample.systemId, systemId, 6);
+    sample.timestamp = timestamp;
+    sample.inRide = *data;
+    publish(metrics, slot, &sample);
+}
+
+void kinetic_shared_metrics_publish_smart_control(kinetic_shared_metrics *metrics, uint32_t slot, const uint8_t systemId[6], uint64_t timestamp, const smart_control_power_data *data)
+{
+    kinetic_shared_metrics_sample sample;
+    memset(&sample, 0, sizeof(sample));
+    sample.deviceType = KINETIC_CAPTURE_DEVICE_SMART_CONTROL;
+    memcpy(sample.systemId, systemId, 6);
+    sample.timestamp = timestamp;
+    sample.smartControl = *data;
+    publish(metrics, slot, &sample);
+}
+
+uint64_t kinetic_shared_metrics_generation(const kinetic_shared_metrics *metrics, uint32_t slot)
+{
+    if (slot >= metrics->slotCount) {
+        return 0;
+    }
+    return atomic_load_explicit(&metrics->slots[slot].sequence, memory_order_acquire) >> 1;
+}
+
+bool kinetic_shared_metrics_read(const kinetic_shared_metrics *metrics, uint32_t slot, kinetic_shared_metrics_sample *sample, uint64_t *generation)
+{
+    if (slot >= metrics->slotCount) {
+        return false;
+    }
+    kinetic_shared_metrics_slot *source = &metrics->slots[slot];
+    uint64_t words[KINETIC_SHARED_METRICS_WORDS];
+
+    for (int attempt = 0; attempt < ReadRetries; ++attempt) {
+        uint64_t before = atomic_load_explicit(&source->sequence, memory_order_acquire);
+        if (before == 0) {
+            return false;
+        }
+        if (before & 1) {
+            continue;
+        }
+        for (size_t i = 0; i < KINETIC_SHARED_METRICS_WORDS; ++i) {
+            words[i] = atomic_load_explicit(&source->words[i], memory_order_relaxed);
+        }
+        atomic_thread_fence(memory_order_acquire);
+        uint64_t after = atomic_load_explicit(&source->sequence, memory_order_relaxed);
+        if (before == after) {
+            memcpy(sample, words, sizeof(*sample));
+            if (generation != NULL) {
+                *generation = before >> 1;
+            }
+            return true;
+        }
+    }
+    return false;
+}
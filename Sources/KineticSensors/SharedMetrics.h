@@ -0,0 +1,156 @@
+//
+//  SharedMetrics.h
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#ifndef SharedMetrics_h
+#define SharedMetrics_h
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "FrameCapture.h"
+#include "inRide.h"
+#include "SmartControl.h"
+
+// Latest decoded power data of every device in a POSIX shared memory segment (shm_open), for local consumers.
+// - One slot per device, each on its own cache lines, written by a single publisher (the decoder) once per frame
+// - Slots are seqlocks: the sequence is odd while the publisher writes, readers copy and retry if it changed
+// - Readers never block the publisher and never write to the segment (map it read only)
+// - generation (sequence / 2) counts the updates of a slot: poll it to find the slots that changed
+// - A segment is never resized in place. Creating it again replaces it by a new one under the same name and marks the
+//   old one retired: readers check kinetic_shared_metrics_retired and open the name again.
+//
+// The payload is the native inride_power_data / smart_control_power_data layout, so publisher and consumers must be
+// built from the same SDK version (the header records the version and slot size and open checks them).
+
+#define KINETIC_SHARED_METRICS_MAGIC    0x4D48534B  // "KSHM"
+#define KINETIC_SHARED_METRICS_VERSION  2
+
+
+/*! Decoded power data of a device */
+typedef struct kinetic_shared_metrics_sample
+{
+    /*! kinetic_capture_device */
+    uint16_t deviceType;
+    uint8_t systemId[6];
+    /*! Publish time (microseconds, publisher's clock) */
+    uint64_t timestamp;
+    union {
+        inride_power_data inRide;
+        smart_control_power_data smartControl;
+    };
+} kinetic_shared_metrics_sample;
+
+#define KINETIC_SHARED_METRICS_WORDS    ((sizeof(kinetic_shared_metrics_sample) + 7) / 8)
+
+/*! Slot of a device (whole cache lines) */
+typedef struct kinetic_shared_metrics_slot
+{
+    _Atomic uint64_t sequence;
+    _Atomic uint64_t words[KINETIC_SHARED_METRICS_WORDS];
+} __attribute__((aligned(64))) kinetic_shared_metrics_slot;
+
+/*! Segment Header */
+typedef struct kinetic_shared_metrics_header
+{
+    _Atomic uint32_t magic;
+    uint32_t version;
+    uint32_t slotSize;
+    uint32_t slotCount;
+    /*! Set when a new segment replaced this one */
+    _Atomic uint32_t retired;
+} __attribute__((aligned(64))) kinetic_shared_metrics_header;
+
+/*! Mapped Segment */
+typedef struct kinetic_shared_metrics
+{
+    kinetic_shared_metrics_header *header;
+    kinetic_shared_metrics_slot *slots;
+    uint32_t slotCount;
+    size_t mappedSize;
+    bool publisher;
+} kinetic_shared_metrics;
+
+
+/*!
+ Creates a segment and maps it for publishing. An existing segment of that name is retired and replaced (readers
+ that still map it keep a valid mapping until they reopen).
+
+ @param metrics Segment
+ @param name Shared memory name ("/kinetic-metrics")
+ @param slotCount Number of device slots
+
+ @return false if the segment could not be created (errno is set)
+ */
+bool kinetic_shared_metrics_create(kinetic_shared_metrics *metrics, const char *name, uint32_t slotCount);
+
+/*!
+ Maps an existing segment read only.
+
+ @param metrics Segment
+ @param name Shared memory name
+
+ @return false if the segment does not exist, is not initialized yet or was made by another SDK version
+ */
+bool kinetic_shared_metrics_open(kinetic_shared_metrics *metrics, const char *name);
+
+/*!
+ Whether the publisher replaced the segment (kinetic_shared_metrics_create again): close it and open the name again.
+ */
+bool kinetic_shared_metrics_retired(const kinetic_shared_metrics *metrics);
+
+/*!
+ Unmaps the segment (the segment stays until kinetic_shared_metrics_unlink).
+ */
+void kinetic_shared_metrics_close(kinetic_shared_metrics *metrics);
+
+/*!
+ Removes the segment name (mapped segments stay valid until closed).
+ */
+bool kinetic_shared_metrics_unlink(const char *name);
+
+/*!
+ Publishes the decoded power data of an inRide.
+
+ @param metrics Segment (publisher)
+ @param slot Slot of the device
+ @param systemId System Id of the device
+ @param timestamp Time of the update (microseconds)
+ @param data Decoded power data
+ */
+void kinetic_shared_metrics_publish_inride(kinetic_shared_metrics *metrics, uint32_t slot, const uint8_t systemId[6], uint64_t timestamp, const inride_power_data *data);
+
+/*!
+ Publishes the decoded power data of a Smart Control.
+
+ @param metrics Segment (publisher)
+ @param slot Slot of the device
+ @param systemId System Id of the device
+ @param timestamp Time of the update (microseconds)
+ @param data Decoded power data
+ */
+void kinetic_shared_metrics_publish_smart_control(kinetic_shared_metrics *metrics, uint32_t slot, const uint8_t systemId[6], uint64_t timestamp, const smart_control_power_data *data);
+
+/*!
+ Number of updates published to a slot (0 if the slot was never written). Cheap, use it to poll for changes.
+ */
+uint64_t kinetic_shared_metrics_generation(const kinetic_shared_metrics *metrics, uint32_t slot);
+
+/*!
+ Copies the latest sample of a slot.
+
+ @param metrics Segment
+ @param slot Slot of the device
+ @param sample Output
+ @param generation Output: generation of the copied sample (may be NULL)
+
+ @return false if the slot was never written, or the publisher kept it busy for all retries
+ */
+bool kinetic_shared_metrics_read(const kinetic_shared_metrics *metrics, uint32_t slot, kinetic_shared_metrics_sample *sample, uint64_t *generation);
+
+
+#endif /* SharedMetrics_h */
@@ -5,54 +5,66 @@
 //
 
 #include "SmartControl.h"
+#include "Instrumentation.h"
+#include "Tracing.h"
+
+#include <string.h>
+
+#if !defined(__APPLE__) && !defined(__FreeBSD__) && !defined(__OpenBSD__) && !defined(__NetBSD__)
+#include <sys/random.h>
+#endif
 
 #define SensorHz                10000
 
+#define UET_DELIMITER           0xE5
+#define UET_ESCAPE              0xE6
+#define UET_ESCAPE_XOR          0x80
+
 
-typedef enum smart_control_command
+typedef enum smart_control_opcode
 {
-    SMART_CONTROL_COMMAND_SET_PERFORMANCE       = 0x00,
-    SMART_CONTROL_COMMAND_SPINDOWN_CALIBRATION  = 0x03
-} smart_control_command;
+    SMART_CONTROL_OPCODE_SET_PERFORMANCE        = 0x00,
+    SMART_CONTROL_OPCODE_SPINDOWN_CALIBRATION   = 0x03
+} smart_control_opcode;
 
 
+static const uint8_t crc8_table[256] = {
+    0x00, 0x91, 0xe3, 0x72, 0x07, 0x96, 0xe4, 0x75,
+    0x0e, 0x9f, 0xed, 0x7c, 0x09, 0x98, 0xea, 0x7b,
+    0x1c, 0x8d, 0xff, 0x6e, 0x1b, 0x8a, 0xf8, 0x69,
+    0x12, 0x83, 0xf1, 0x60, 0x15, 0x84, 0xf6, 0x67,
+    0x38, 0xa9, 0xdb, 0x4a, 0x3f, 0xae, 0xdc, 0x4d,
+    0x36, 0xa7, 0xd5, 0x44, 0x31, 0xa0, 0xd2, 0x43,
+    0x24, 0xb5, 0xc7, 0x56, 0x23, 0xb2, 0xc0, 0x51,
+    0x2a, 0xbb, 0xc9, 0x58, 0x2d, 0xbc, 0xce, 0x5f,
+    0x70, 0xe1, 0x93, 0x02, 0x77, 0xe6, 0x94, 0x05,
+    0x7e, 0xef, 0x9d, 0x0c, 0x79, 0xe8, 0x9a, 0x0b,
+    0x6c, 0xfd, 0x8f, 0x1e, 0x6b, 0xfa, 0x88, 0x19,
+    0x62, 0xf3, 0x81, 0x10, 0x65, 0xf4, 0x86, 0x17,
+    0x48, 0xd9, 0xab, 0x3a, 0x4f, 0xde, 0xac, 0x3d,
+    0x46, 0xd7, 0xa5, 0x34, 0x41, 0xd0, 0xa2, 0x33,
+    0x54, 0xc5, 0xb7, 0x26, 0x53, 0xc2, 0xb0, 0x21,
+    0x5a, 0xcb, 0xb9, 0x28, 0x5d, 0xcc, 0xbe, 0x2f,
+    0xe0, 0x71, 0x03, 0x92, 0xe7, 0x76, 0x04, 0x95,
+    0xee, 0x7f, 0x0d, 0x9c, 0xe9, 0x78, 0x0a, 0x9b,
+    0xfc, 0x6d, 0x1f, 0x8e, 0xfb, 0x6a, 0x18, 0x89,
+    0xf2, 0x63, 0x11, 0x80, 0xf5, 0x64, 0x16, 0x87,
+    0xd8, 0x49, 0x3b, 0xaa, 0xdf, 0x4e, 0x3c, 0xad,
+    0xd6, 0x47, 0x35, 0xa4, 0xd1, 0x40, 0x32, 0xa3,
+    0xc4, 0x55, 0x27, 0xb6, 0xc3, 0x52, 0x20, 0xb1,
+    0xca, 0x5b, 0x29, 0xb8, 0xcd, 0x5c, 0x2e, 0xbf,
+    0x90, 0x01, 0x73, 0xe2, 0x97, 0x06, 0x74, 0xe5,
+    0x9e, 0x0f, 0x7d, 0xec, 0x99, 0x08, 0x7a, 0xeb,
+    0x8c, 0x1d, 0x6f, 0xfe, 0x8b, 0x1a, 0x68, 0xf9,
+    0x82, 0x13, 0x61, 0xf0, 0x85, 0x14, 0x66, 0xf7,
+    0xa8, 0x39, 0x4b, 0xda, 0xaf, 0x3e, 0x4c, 0xdd,
+    0xa6, 0x37, 0x45, 0xd4, 0xa1, 0x30, 0x42, 0xd3,
+    0xb4, 0x25, 0x57, 0xc6, 0xb3, 0x22, 0x50, 0xc1,
+    0xba, 0x2b, 0x59, 0xc8, 0xbd, 0x2c, 0x5e, 0xcf
+};
+
 uint8_t hash8WithSeed(uint8_t hash, const uint8_t *buffer, uint8_t length)
 {
-    const uint8_t crc8_table[256] = {
-        0x00, 0x91, 0xe3, 0x72, 0x07, 0x96, 0xe4, 0x75,
-        0x0e, 0x9f, 0xed, 0x7c, 0x09, 0x98, 0xea, 0x7b,
-        0x1c, 0x8d, 0xff, 0x6e, 0x1b, 0x8a, 0xf8, 0x69,
-        0x12, 0x83, 0xf1, 0x60, 0x15, 0x84, 0xf6, 0x67,
-        0x38, 0xa9, 0xdb, 0x4a, 0x3f, 0xae, 0xdc, 0x4d,
-        0x36, 0xa7, 0xd5, 0x44, 0x31, 0xa0, 0xd2, 0x43,
-        0x24, 0xb5, 0xc7, 0x56, 0x23, 0xb2, 0xc0, 0x51,
-        0x2a, 0xbb, 0xc9, 0x58, 0x2d, 0xbc, 0xce, 0x5f,
-        0x70, 0xe1, 0x93, 0x02, 0x77, 0xe6, 0x94, 0x05,
-        0x7e, 0xef, 0x9d, 0x0c, 0x79, 0xe8, 0x9a, 0x0b,
-        0x6c, 0xfd, 0x8f, 0x1e, 0x6b, 0xfa, 0x88, 0x19,
-        0x62, 0xf3, 0x81, 0x10, 0x65, 0xf4, 0x86, 0x17,
-        0x48, 0xd9, 0xab, 0x3a, 0x4f, 0xde, 0xac, 0x3d,
-        0x46, 0xd7, 0xa5, 0x34, 0x41, 0xd0, 0xa2, 0x33,
-        0x54, 0xc5, 0xb7, 0x26, 0x53, 0xc2, 0xb0, 0x21,
-        0x5a, 0xcb, 0xb9, 0x28, 0x5d, 0xcc, 0xbe, 0x2f,
-        0xe0, 0x71, 0x03, 0x92, 0xe7, 0x76, 0x04, 0x95,
-        0xee, 0x7f, 0x0d, 0x9c, 0xe9, 0x78, 0x0a, 0x9b,
-        0xfc, 0x6d, 0x1f, 0x8e, 0xfb, 0x6a, 0x18, 0x89,
-        0xf2, 0x63, 0x11, 0x80, 0xf5, 0x64, 0x16, 0x87,
-        0xd8, 0x49, 0x3b, 0xaa, 0xdf, 0x4e, 0x3c, 0xad,
-        0xd6, 0x47, 0x35, 0xa4, 0xd1, 0x40, 0x32, 0xa3,
-        0xc4, 0x55, 0x27, 0xb6, 0xc3, 0x52, 0x20, 0xb1,
-        0xca, 0x5b, 0x29, 0xb8, 0xcd, 0x5c, 0x2e, 0xbf,
-        0x90, 0x01, 0x73, 0xe2, 0x97, 0x06, 0x74, 0xe5,
-        0x9e, 0x0f, 0x7d, 0xec, 0x99, 0x08, 0x7a, 0xeb,
-        0x8c, 0x1d, 0x6f, 0xfe, 0x8b, 0x1a, 0x68, 0xf9,
-        0x82, 0x13, 0x61, 0xf0, 0x85, 0x14, 0x66, 0xf7,
-        0xa8, 0x39, 0x4b, 0xda, 0xaf, 0x3e, 0x4c, 0xdd,
-        0xa6, 0x37, 0x45, 0xd4, 0xa1, 0x30, 0x42, 0xd3,
-        0xb4, 0x25, 0x57, 0xc6, 0xb3, 0x22, 0x50, 0xc1,
-        0xba, 0x2b, 0x59, 0xc8, 0xbd, 0x2c, 0x5e, 0xcf
-    };
-    
     for (uint8_t byte_index = 0; byte_index < length; byte_index++) {
         hash = crc8_table[hash ^ buffer[byte_index]];
     }
@@ -74,6 +86,8 @@ double smart_control_ticks_to_seconds(uint32_t ticks)
 
 smart_control_power_data smart_control_process_power_data(uint8_t *data, size_t size)
 {
+    KINETIC_INSTRUMENT_DECODE_BEGIN(decodeStart);
+    KINETIC_TRACE_BEGIN(traceStart);
     uint8_t hashSeed = 0x42;
     uint8_t inData[size];
     for (int i = 0; i < size; ++i) {
@@ -106,13 +120,19 @@ smart_control_power_data smart_control_process_power_data(uint8_t *data, size_t
         powerData.cadenceRPM = 0;
         powerData.power = 0;
         powerData.speedKPH = 0;
+        KINETIC_INSTRUMENT_COUNT(KINETIC_COUNTER_BAD_LENGTH);
     }
     
+    KINETIC_INSTRUMENT_COUNT(KINETIC_COUNTER_FRAMES_DECODED);
+    KINETIC_INSTRUMENT_DECODE_END(decodeStart);
+    KINETIC_TRACE_END(traceStart, "smart_control_power_decode");
     return powerData;
 }
 
 smart_control_config_data smart_control_process_config_data(uint8_t *data, size_t size)
 {
+    KINETIC_INSTRUMENT_DECODE_BEGIN(decodeStart);
+    KINETIC_TRACE_BEGIN(traceStart);
     uint8_t hashSeed = 0x42;
     uint8_t inData[size];
     for (int i = 0; i < size; ++i) {
@@ -174,8 +194,12 @@ smart_control_config_data smart_control_process_config_data(uint8_t *data, size_
         configData.brakeStrength = 55;
         configData.brakeOffset = 128;
         configData.noiseFilter = 1;
+        KINETIC_INSTRUMENT_COUNT(KINETIC_COUNTER_BAD_LENGTH);
     }
     
+    KINETIC_INSTRUMENT_COUNT(KINETIC_COUNTER_FRAMES_DECODED);
+    KINETIC_INSTRUMENT_DECODE_END(decodeStart);
+    KINETIC_TRACE_END(traceStart, "smart_control_config_decode");
     return configData;
 }
 
@@ -187,169 +211,352 @@ smart_control_config_data smart_control_process_config_data(uint8_t *data, size_
 #endif
 
 
-smart_control_set_mode_erg_data smart_control_set_mode_erg_command(uint16_t targetWatts)
+// Nonces are drawn from a per-thread pool refilled in one system call (arc4random is not available everywhere, e.g. older glibc)
+#define NoncePoolSize           256
+#define NonceBatch              64
+
+typedef struct nonce_pool
 {
-    smart_control_set_mode_erg_data data;
-    
-    uint16_t clamped = MAX(0, MIN(0xFFFF, targetWatts));
-    
-    data.bytes[0] = SMART_CONTROL_COMMAND_SET_PERFORMANCE;
-    data.bytes[1] = SMART_CONTROL_MODE_ERG;
-    data.bytes[2] = (uint16_t)clamped >> 8;
-    data.bytes[3] = (uint16_t)clamped;
-    data.bytes[4] = arc4random_uniform(0x100); // nonce
-    uint8_t dataLength = 5;
-    
-    // Encode Packet
-    uint8_t hashSeed = 0x42;
-    uint8_t hash = hash8WithSeed(hashSeed, &data.bytes[dataLength - 1], 1);
-    for (unsigned index = 0; index < dataLength - 1; index++) {
-        uint8_t temp = data.bytes[index];
-        data.bytes[index] ^= hash;
-        hash = hash8WithSeed(hash, &temp, 1);
+    uint8_t bytes[NoncePoolSize];
+    size_t next;
+} nonce_pool;
+
+static _Thread_local nonce_pool noncePool = { .next = NoncePoolSize };
+static _Thread_local smart_control_nonce_source nonceSource;
+static _Thread_local void *nonceContext;
+
+static void nonce_pool_fill(nonce_pool *pool)
+{
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+    arc4random_buf(pool->bytes, NoncePoolSize);
+#else
+    ssize_t filled = getrandom(pool->bytes, NoncePoolSize, 0);
+    for (size_t i = filled > 0 ? (size_t)filled : 0; i < NoncePoolSize; ++i) {
+        pool->bytes[i] = (uint8_t)rand();
     }
-    return data;
+#endif
+    pool->next = 0;
 }
 
+static void smart_control_nonces(uint8_t *nonces, size_t count)
+{
+    if (nonceSource) {
+        nonceSource(nonceContext, nonces, count);
+        return;
+    }
+    nonce_pool *pool = &noncePool;
+    while (count > 0) {
+        if (pool->next == NoncePoolSize) {
+            nonce_pool_fill(pool);
+        }
+        size_t n = MIN(count, NoncePoolSize - pool->next);
+        memcpy(nonces, &pool->bytes[pool->next], n);
+        pool->next += n;
+        nonces += n;
+        count -= n;
+    }
+}
 
+void smart_control_set_nonce_source(smart_control_nonce_source source, void *context)
+{
+    nonceSource = source;
+    nonceContext = context;
+}
+
+
+// Command descriptors: header bytes, then the fields in the order of smart_control_command.values
+
+typedef struct command_field
+{
+    uint8_t size;
+    float scale;
+    float minimum;
+    float maximum;
+} command_field;
+
+typedef struct command_descriptor
+{
+    uint8_t header[3];
+    uint8_t headerSize;
+    uint8_t fieldCount;
+    command_field fields[5];
+} command_descriptor;
+
+#define U8(scale, minimum, maximum)     { 1, (scale), (minimum), (maximum) }
+#define U16(scale, minimum, maximum)    { 2, (scale), (minimum), (maximum) }
+
+static const command_descriptor commandDescriptors[] = {
+    [SMART_CONTROL_SET_MODE_ERG] = {
+        { SMART_CONTROL_OPCODE_SET_PERFORMANCE, SMART_CONTROL_MODE_ERG }, 2, 1,
+        { U16(1, 0, UINT16_MAX) }
+    },
+    [SMART_CONTROL_SET_MODE_FLUID] = {
+        { SMART_CONTROL_OPCODE_SET_PERFORMANCE, SMART_CONTROL_MODE_FLUID }, 2, 1,
+        { U8(1, 0, 9) }
+    },
+    [SMART_CONTROL_SET_MODE_BRAKE] = {
+        { SMART_CONTROL_OPCODE_SET_PERFORMANCE, SMART_CONTROL_MODE_BRAKE }, 2, 1,
+        // percent (0-1) normalized to 0-65535
+        { U16(65535, 0, UINT16_MAX) }
+    },
+    [SMART_CONTROL_SET_MODE_SIMULATION] = {
+        { SMART_CONTROL_OPCODE_SET_PERFORMANCE, SMART_CONTROL_MODE_SIMULATION }, 2, 5,
+        {
+            U16(100, 0, UINT16_MAX),            // weight (kg), 2 points of precision
+            U16(10000, 0, UINT16_MAX),          // rolling coeff, 5 points of precision (up to 6.5535)
+            U16(10000, 0, UINT16_MAX),          // wind coeff, 5 points of precision (up to 6.5535)
+            U16(100, -4500, 4500),              // grade (-45 to 45), 2 points of precision
+            U16(100, INT16_MIN, INT16_MAX)      // wind speed, meters / second to cm / second
+        }
+    },
+    [SMART_CONTROL_START_CALIBRATION] = {
+        { SMART_CONTROL_OPCODE_SPINDOWN_CALIBRATION, 0x01 }, 2, 1,
+        { U8(1, 0, 1) }
+    },
+    [SMART_CONTROL_STOP_CALIBRATION] = {
+        { SMART_CONTROL_OPCODE_SPINDOWN_CALIBRATION, 0x00, 0x00 }, 3, 0
+    }
+};
+
+#define CommandTypeCount        (sizeof(commandDescriptors) / sizeof(commandDescriptors[0]))
+
+// Scaled, rounded and clamped field value (NaN gives the minimum)
+static inline int32_t field_value(const command_field *field, float value)
+{
+    float scaled = roundf(value * field->scale);
+    if (!(scaled > field->minimum)) {
+        return (int32_t)field->minimum;
+    }
+    return (int32_t)MIN(scaled, field->maximum);
+}
+
+// Encodes the command without its nonce, returns the size with it
+static size_t command_body(const smart_control_command *command, uint8_t *data)
+{
+    if ((unsigned)command->type >= CommandTypeCount) {
+        return 0;
+    }
+    const command_descriptor *descriptor = &commandDescriptors[command->type];
+    size_t size = descriptor->headerSize;
+    memcpy(data, descriptor->header, size);
+    for (uint8_t f = 0; f < descriptor->fieldCount; ++f) {
+        const command_field *field = &descriptor->fields[f];
+        int32_t value = field_value(field, command->values[f]);
+        if (field->size == 2) {
+            data[size++] = (uint8_t)(value >> 8);
+        }
+        data[size++] = (uint8_t)value;
+    }
+    return size + 1;
+}
+
+// Whitens the command with the hash of its last byte (the nonce)
+static void command_whiten(uint8_t *data, size_t size)
+{
+    uint8_t hash = crc8_table[0x42 ^ data[size - 1]];
+    for (size_t index = 0; index < size - 1; index++) {
+        uint8_t temp = data[index];
+        data[index] ^= hash;
+        hash = crc8_table[hash ^ temp];
+    }
+}
+
+size_t smart_control_encode_command(const smart_control_command *command, uint8_t *data)
+{
+    size_t size = command_body(command, data);
+    if (size == 0) {
+        return 0;
+    }
+    smart_control_nonces(&data[size - 1], 1);
+    command_whiten(data, size);
+    return size;
+}
+
+size_t smart_control_encode_commands(const smart_control_command *commands, size_t count, uint8_t *data, size_t stride, uint8_t *sizes)
+{
+    size_t encoded = 0;
+    uint8_t nonces[NonceBatch];
+    for (size_t offset = 0; offset < count; offset += NonceBatch) {
+        size_t n = MIN(count - offset, NonceBatch);
+        smart_control_nonces(nonces, n);
+        for (size_t i = 0; i < n; ++i) {
+            uint8_t *command = &data[(offset + i) * stride];
+            size_t size = command_body(&commands[offset + i], command);
+            sizes[offset + i] = (uint8_t)size;
+            if (size == 0) {
+                continue;
+            }
+            command[size - 1] = nonces[i];
+            command_whiten(command, size);
+            encoded++;
+        }
+    }
+    return encoded;
+}
+
+
+smart_control_set_mode_erg_data smart_control_set_mode_erg_command(uint16_t targetWatts)
+{
+    smart_control_set_mode_erg_data data;
+    smart_control_command command = { SMART_CONTROL_SET_MODE_ERG, { targetWatts } };
+    smart_control_encode_command(&command, data.bytes);
+    return data;
+}
 
 smart_control_set_mode_fluid_data smart_control_set_mode_fluid_command(uint8_t level)
 {
     smart_control_set_mode_fluid_data data;
-    
-    uint8_t clamped = MAX(0, MIN(9, level));
-    
-    data.bytes[0] = SMART_CONTROL_COMMAND_SET_PERFORMANCE;
-    data.bytes[1] = SMART_CONTROL_MODE_FLUID;
-    data.bytes[2] = clamped;
-    data.bytes[3] = arc4random_uniform(0x100); // nonce
-    uint8_t dataLength = 4;
-    
-    // Encode Packet
-    uint8_t hashSeed = 0x42;
-    uint8_t hash = hash8WithSeed(hashSeed, &data.bytes[dataLength - 1], 1);
-    for (unsigned index = 0; index < dataLength - 1; index++) {
-        uint8_t temp = data.bytes[index];
-        data.bytes[index] ^= hash;
-        hash = hash8WithSeed(hash, &temp, 1);
-    }
+    smart_control_command command = { SMART_CONTROL_SET_MODE_FLUID, { level } };
+    smart_control_encode_command(&command, data.bytes);
     return data;
 }
 
 smart_control_set_mode_brake_data smart_control_set_mode_brake_command(float percent)
 {
     smart_control_set_mode_brake_data data;
-    
-    // normalize to 0-65535
-    float clamped = MAX(0, MIN(1, percent));
-    uint16_t normalized = (uint16_t) round(65535 * clamped);
-    
-    data.bytes[0] = SMART_CONTROL_COMMAND_SET_PERFORMANCE;
-    data.bytes[1] = SMART_CONTROL_MODE_BRAKE;
-    data.bytes[2] = normalized >> 8;
-    data.bytes[3] = normalized;
-    data.bytes[4] = arc4random_uniform(0x100); // nonce
-    uint8_t dataLength = 5;
-    
-    // Encode Packet
-    uint8_t hashSeed = 0x42;
-    uint8_t hash = hash8WithSeed(hashSeed, &data.bytes[dataLength - 1], 1);
-    for (unsigned index = 0; index < dataLength - 1; index++) {
-        uint8_t temp = data.bytes[index];
-        data.bytes[index] ^= hash;
-        hash = hash8WithSeed(hash, &temp, 1);
-    }
+    smart_control_command command = { SMART_CONTROL_SET_MODE_BRAKE, { percent } };
+    smart_control_encode_command(&command, data.bytes);
     return data;
 }
 
 smart_control_set_mode_simulation_data smart_control_set_mode_simulation_command(float weightKG, float rollingCoeff, float windCoeff, float grade, float windSpeedMPS)
 {
     smart_control_set_mode_simulation_data data;
-    
-    data.bytes[0] = SMART_CONTROL_COMMAND_SET_PERFORMANCE;
-    data.bytes[1] = SMART_CONTROL_MODE_SIMULATION;
-    
-    // weight is in KGs ... multiply by 100 to get 2 points of precision
-    uint16_t weight100 = (uint16_t) roundf(MIN(655.36, weightKG) * 100);
-    data.bytes[2] = weight100 >> 8;
-    data.bytes[3] = weight100;
-    
-    // Rolling coeff is < 1. multiply by 10,000 to get 5 points of precision
-    // coeff cannot be larger than 6.5536 otherwise it rolls over ...
-    uint16_t rr10000 = (uint16_t) roundf(MIN(6.5536, rollingCoeff) * 10000);
-    data.bytes[4] = rr10000 >> 8;
-    data.bytes[5] = rr10000;
-    
-    // Wind coeff is typically < 1. multiply by 10,000 to get 5 points of precision
-    // coeff cannot be larger than 6.5536 otherwise it rolls over ...
-    uint16_t wr10000 = (uint16_t) roundf(MIN(6.5536, windCoeff) * 10000);
-    data.bytes[6] = wr10000 >> 8;
-    data.bytes[7] = wr10000;
-    
-    // Grade is between -45.0 and 45.0
-    // Mulitply by 100 to get 2 points of precision
-    int16_t grade100 = (int16_t) roundf(MAX(-45, MIN(45, grade)) * 100);
-    data.bytes[8] = grade100 >> 8;
-    data.bytes[9] = grade100;
-    
-    // windspeed is in meters / second. convert to CM / second
-    int16_t windSpeedCM = (int16_t) roundf(windSpeedMPS * 100);
-    data.bytes[10] = windSpeedCM >> 8;
-    data.bytes[11] = windSpeedCM;
-    
-    data.bytes[12] = arc4random_uniform(0x100); // nonce
-    uint8_t dataLength = 13;    
-    
-    // Encode Packet
-    uint8_t hashSeed = 0x42;
-    uint8_t hash = hash8WithSeed(hashSeed, &data.bytes[dataLength - 1], 1);
-    for (unsigned index = 0; index < dataLength - 1; index++) {
-        uint8_t temp = data.bytes[index];
-        data.bytes[index] ^= hash;
-        hash = hash8WithSeed(hash, &temp, 1);
-    }
+    smart_control_command command = { SMART_CONTROL_SET_MODE_SIMULATION, { weightKG, rollingCoeff, windCoeff, grade, windSpeedMPS } };
+    smart_control_encode_command(&command, data.bytes);
     return data;
 }
 
 smart_control_calibration_command_data smart_control_start_calibration_command(bool brakeCalibration)
 {
     smart_control_calibration_command_data data;
-    
-    data.bytes[0] = SMART_CONTROL_COMMAND_SPINDOWN_CALIBRATION;
-    data.bytes[1] = 0x01;
-    data.bytes[2] = brakeCalibration ? 0x01 : 0x00;
-    data.bytes[3] = arc4random_uniform(0x100); // nonce
-    uint8_t dataLength = 4;
-    
-    // Encode Packet
-    uint8_t hashSeed = 0x42;
-    uint8_t hash = hash8WithSeed(hashSeed, &data.bytes[dataLength - 1], 1);
-    for (unsigned index = 0; index < dataLength - 1; index++) {
-        uint8_t temp = data.bytes[index];
-        data.bytes[index] ^= hash;
-        hash = hash8WithSeed(hash, &temp, 1);
-    }
+    smart_control_command command = { SMART_CONTROL_START_CALIBRATION, { brakeCalibration ? 1 : 0 } };
+    smart_control_encode_command(&command, data.bytes);
     return data;
 }
 
 smart_control_calibration_command_data smart_control_stop_calibration_command()
 {
     smart_control_calibration_command_data data;
+    smart_control_command command = { .type = SMART_CONTROL_STOP_CALIBRATION };
+    smart_control_encode_command(&command, data.bytes);
+    return data;
+}
+
+
+////////////////////////////////////
+// USB (UET framing)
+////////////////////////////////////
+
+// CRC-8 used by the USB framing (hash8 with an inverted seed and result)
+static uint8_t crc8WithSeed(uint8_t crc, const uint8_t *buffer, uint8_t length)
+{
+    return hash8WithSeed(crc ^ 0xFF, buffer, length) ^ 0xFF;
+}
+
+size_t smart_control_usb_request(bool read, bool write, uint16_t identifier, const uint8_t *data, size_t size, uint8_t *packet)
+{
+    if (size > SMART_CONTROL_USB_DATA_MAX) {
+        return 0;
+    }
+    uint8_t crcPacket[SMART_CONTROL_USB_DATA_MAX + 4];
+    uint8_t crcPacketLen = 0;
+    crcPacket[crcPacketLen++] = identifier >> 8;
+    crcPacket[crcPacketLen++] = identifier;
+    uint8_t type = 0x00;
+    if (read) {
+        type |= 0x01;
+    }
+    if (write) {
+        type |= 0x02;
+    }
+    crcPacket[crcPacketLen++] = type;
+    for (size_t i = 0; i < size; ++i) {
+        crcPacket[crcPacketLen++] = data[i];
+    }
+    uint8_t crc = crc8WithSeed(0, crcPacket, crcPacketLen);
+    crcPacket[crcPacketLen++] = crc;
     
-    data.bytes[0] = SMART_CONTROL_COMMAND_SPINDOWN_CALIBRATION;
-    data.bytes[1] = 0x00;
-    data.bytes[2] = 0x00;
-    data.bytes[3] = arc4random_uniform(0x100); // nonce
-    uint8_t dataLength = 4;
-    
-    // Encode Packet
-    uint8_t hashSeed = 0x42;
-    uint8_t hash = hash8WithSeed(hashSeed, &data.bytes[dataLength - 1], 1);
-    for (unsigned index = 0; index < dataLength - 1; index++) {
-        uint8_t temp = data.bytes[index];
-        data.bytes[index] ^= hash;
-        hash = hash8WithSeed(hash, &temp, 1);
+    // escape payload
+    size_t packetLen = 0;
+    packet[packetLen++] = UET_DELIMITER;
+    for (uint8_t i = 0; i < crcPacketLen; ++i) {
+        uint8_t tmp_b = crcPacket[i];
+        if ((tmp_b == UET_DELIMITER) || (tmp_b == UET_ESCAPE)) {
+            packet[packetLen++] = UET_ESCAPE;
+            packet[packetLen++] = tmp_b ^ UET_ESCAPE_XOR;
+        } else {
+            packet[packetLen++] = tmp_b;
+        }
     }
-    return data;
+    packet[packetLen++] = UET_DELIMITER;
+    return packetLen;
+}
+
+void smart_control_usb_parser_init(smart_control_usb_parser *parser)
+{
+    parser->rxPacketLen = 0;
+    parser->rxLastByteWasEscape = false;
+    parser->discarding = false;
 }
 
+size_t smart_control_usb_process_data(smart_control_usb_parser *parser, const uint8_t *inBuf, size_t inSize, smart_control_usb_packet_handler handler, void *context)
+{
+    KINETIC_TRACE_BEGIN(traceStart);
+    size_t packets = 0;
+    for (size_t index = 0; index < inSize; index++) {
+        if (parser->discarding) {
+            // throw away everything up to the next delimiter
+            if (inBuf[index] != UET_DELIMITER) {
+                continue;
+            }
+            parser->discarding = false;
+        }
+        if ((parser->rxPacketLen == sizeof(parser->rxPacket)) && ((parser->rxLastByteWasEscape) || (inBuf[index] != UET_DELIMITER))) {
+            parser->rxPacketLen = 0;            // The packet in rxPacket is too long.  It must be invalid.
+            parser->rxLastByteWasEscape = false;
+            parser->discarding = true;
+            KINETIC_INSTRUMENT_COUNT(KINETIC_COUNTER_USB_RESYNCS);
+            continue;
+        }
+        if (parser->rxLastByteWasEscape) {
+            parser->rxPacket[parser->rxPacketLen++] = inBuf[index] ^ UET_ESCAPE_XOR;
+            parser->rxLastByteWasEscape = false;
+        }
+        else {
+            switch (inBuf[index]) {
+                case UET_DELIMITER:
+                    if (parser->rxPacketLen >= 4) {     // back-to-back delimiters are common (length = 0)
+                        uint8_t *rxPacket = parser->rxPacket;
+                        uint8_t rxPacketLen = parser->rxPacketLen;
+                        if (crc8WithSeed(0, rxPacket, rxPacketLen - 1) == rxPacket[rxPacketLen - 1]) {
+                            smart_control_usb_packet packet;
+                            packet.identifier = ((uint16_t)rxPacket[0] << 8) | (uint16_t)rxPacket[1];
+                            packet.type = rxPacket[2];
+                            packet.data = &rxPacket[3];
+                            packet.size = rxPacketLen - 4;
+                            handler(context, &packet);
+                            packets++;
+                            KINETIC_INSTRUMENT_COUNT(KINETIC_COUNTER_USB_PACKETS);
+                        } else {
+                            KINETIC_INSTRUMENT_COUNT(KINETIC_COUNTER_USB_CRC_FAILURES);
+                        }
+                    } else if (parser->rxPacketLen > 0) {
+                        KINETIC_INSTRUMENT_COUNT(KINETIC_COUNTER_BAD_LENGTH);
+                    }
+                    parser->rxPacketLen = 0;
+                    break;
+                    
+                case UET_ESCAPE:
+                    parser->rxLastByteWasEscape = true;
+                    break;
+                    
+                default:
+                    parser->rxPacket[parser->rxPacketLen++] = inBuf[index];
+                    break;
+            }
+        }
+    }
+    KINETIC_TRACE_END(traceStart, "usb_unframe");
+    return packets;
+}
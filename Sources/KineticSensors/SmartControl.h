@@ -8,6 +8,7 @@
 #define SmartControl_h
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
@@ -19,6 +20,18 @@ static const char SMART_CONTROL_SERVICE_CONFIG_UUID[]  = "E9410202-B434-446B-B5C
 static const char SMART_CONTROL_SERVICE_CONTROL_UUID[] = "E9410203-B434-446B-B5CC-36592FC4C724";
 
 
+/*!
+ CRC-8 (x^8 + x^2 + x + 1) continued from a seed. Used to whiten the power, config and command data.
+ 
+ @param hash Seed (previous hash)
+ @param buffer Bytes to hash
+ @param length Number of bytes
+ 
+ @return Hash
+ */
+uint8_t hash8WithSeed(uint8_t hash, const uint8_t *buffer, uint8_t length);
+
+
 /*! Smart Control Resistance Mode */
 typedef enum smart_control_mode
 {
@@ -213,5 +226,143 @@ smart_control_calibration_command_data smart_control_start_calibration_command(b
 smart_control_calibration_command_data smart_control_stop_calibration_command(void);
 
 
+// Generic command serializer (the builders above are wrappers around it).
+// - Every command is described by a row of a table: its header bytes and its fields (size, sign, scale, range).
+//   The values are scaled, rounded and clamped to their field, written big endian, followed by the nonce, and whitened.
+// - Nonces come from a per-thread pool filled by the system random source a few hundred at a time, or from a
+//   source set with smart_control_set_nonce_source (deterministic tests, replay).
+
+/*! Largest command (simulation) */
+#define SMART_CONTROL_COMMAND_MAX       13
+
+/*! Command Types */
+typedef enum smart_control_command_type
+{
+    SMART_CONTROL_SET_MODE_ERG,
+    SMART_CONTROL_SET_MODE_FLUID,
+    SMART_CONTROL_SET_MODE_BRAKE,
+    SMART_CONTROL_SET_MODE_SIMULATION,
+    SMART_CONTROL_START_CALIBRATION,
+    SMART_CONTROL_STOP_CALIBRATION
+} smart_control_command_type;
+
+/*!
+ Command to encode. The values are the parameters of the matching builder, in order:
+    ERG: target watts
+    Fluid: level
+    Brake: percent (0-1)
+    Simulation: weight (kg), rolling coeff, wind coeff, grade, wind speed (m/s)
+    Start Calibration: brake calibration (0 or 1)
+    Stop Calibration: none
+ */
+typedef struct smart_control_command
+{
+    smart_control_command_type type;
+    float values[5];
+} smart_control_command;
+
+/*!
+ Nonce source: fills nonces with count bytes.
+ */
+typedef void (*smart_control_nonce_source)(void *context, uint8_t *nonces, size_t count);
+
+/*!
+ Sets the nonce source of the calling thread.
+
+ @param source Source (NULL restores the random pool)
+ @param context Passed to the source
+ */
+void smart_control_set_nonce_source(smart_control_nonce_source source, void *context);
+
+/*!
+ Encodes a command.
+
+ @param command Command
+ @param data Output (at least SMART_CONTROL_COMMAND_MAX bytes)
+
+ @return Size of the command (write data to the Control Point Characteristic), 0 if the type is unknown
+ */
+size_t smart_control_encode_command(const smart_control_command *command, uint8_t *data);
+
+/*!
+ Encodes commands for many devices at once (the nonces are drawn together).
+
+ @param commands Commands
+ @param count Number of commands
+ @param data Output: command i is written at data + i * stride
+ @param stride Distance between two commands in data (at least SMART_CONTROL_COMMAND_MAX)
+ @param sizes Output: size of each command (0 if its type is unknown)
+
+ @return Number of commands encoded
+ */
+size_t smart_control_encode_commands(const smart_control_command *commands, size_t count, uint8_t *data, size_t stride, uint8_t *sizes);
+
+
+
+/*! Maximum characteristic data in a USB packet */
+#define SMART_CONTROL_USB_DATA_MAX      20
+
+/*! Maximum size of a framed USB packet (every byte escaped plus the delimiters) */
+#define SMART_CONTROL_USB_PACKET_MAX    (2 + 2 * (SMART_CONTROL_USB_DATA_MAX + 4))
+
+/*! Smart Control USB Packet (the data points into the parser and is only valid during the handler call) */
+typedef struct smart_control_usb_packet
+{
+    /*! Characteristic Identifier of the data source */
+    uint16_t identifier;
+    
+    /*! Packet Type Bitmask (Request | Data) */
+    uint8_t type;
+    
+    /*! Characteristic Packet Data (up to 20 bytes) */
+    const uint8_t *data;
+    size_t size;
+} smart_control_usb_packet;
+
+/*! Receives the packets found by smart_control_usb_process_data */
+typedef void (*smart_control_usb_packet_handler)(void *context, const smart_control_usb_packet *packet);
+
+/*! USB stream parser state. A packet may be split across reads, keep one parser per serial device. */
+typedef struct smart_control_usb_parser
+{
+    uint8_t rxPacket[24];
+    uint8_t rxPacketLen;
+    bool rxLastByteWasEscape;
+    bool discarding;
+} smart_control_usb_parser;
+
+/*!
+ Create a USB Packet to write to the system serial USB device.
+ 
+ @param read Request Smart Control to send the data of non-broadcast Characteristic
+ @param write Indicate that the packet contains data to write to the specific Characteristic
+ @param identifier The Characteristic Identifier to Read / Write to
+ @param data The data to write to the Characteristic (if indicated)
+ @param size Size of the data (up to SMART_CONTROL_USB_DATA_MAX)
+ @param packet Output buffer (at least SMART_CONTROL_USB_PACKET_MAX bytes)
+ 
+ @return The size of the packet to write to the serial USB device (0 if the data is too large)
+ */
+size_t smart_control_usb_request(bool read, bool write, uint16_t identifier, const uint8_t *data, size_t size, uint8_t *packet);
+
+/*!
+ Resets a USB stream parser.
+ */
+void smart_control_usb_parser_init(smart_control_usb_parser *parser);
+
+/*!
+ Deserialize a chunk of bytes from the serial USB device into USB Packets which can be further processed.
+ 
+ @param parser Parser of the serial device
+ @param data The raw byte bundle recieved from the USB serial device
+ @param size Size of the bundle
+ @param handler Receives each valid packet
+ @param context Passed to the handler
+ 
+ @return Number of packets found
+ */
+size_t smart_control_usb_process_data(smart_control_usb_parser *parser, const uint8_t *data, size_t size, smart_control_usb_packet_handler handler, void *context);
+
+
 #endif /* SmartControl_h */
 
@@ -0,0 +1,105 @@
+//
+//  SpeedEstimator.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#include "SpeedEstimator.h"
+
+#include <math.h>
+
+#define SensorHz                32768
+#define InitialAccelerationVar  25.0    // (KPH / s)^2, the first acceleration is unknown
+
+
+kinetic_speed_estimator_config kinetic_speed_estimator_config_for_smoothing(double smoothing)
+{
+    if (smoothing < 0) {
+        smoothing = 0;
+    } else if (smoothing > 1) {
+        smoothing = 1;
+    }
+    kinetic_speed_estimator_config config;
+    // 100 (follows a sprint within one update) ... 0.03 (steady state riding), logarithmic in between
+    config.processNoise = 100.0 * pow(10.0, -3.5 * smoothing);
+    config.measurementNoise = 1.0;
+    config.resetGap = 3.0;
+    return config;
+}
+
+void kinetic_speed_estimator_init(kinetic_speed_estimator *estimator, const kinetic_speed_estimator_config *config)
+{
+    estimator->config = *config;
+    kinetic_speed_estimator_reset(estimator);
+}
+
+void kinetic_speed_estimator_reset(kinetic_speed_estimator *estimator)
+{
+    estimator->speedKPH = 0;
+    estimator->acceleration = 0;
+    estimator->p00 = 0;
+    estimator->p01 = 0;
+    estimator->p11 = 0;
+    estimator->initialized = false;
+}
+
+double kinetic_speed_estimator_update(kinetic_speed_estimator *estimator, double elapsed, double measuredKPH, double window, double samples)
+{
+    // stopped is certain (no revolutions in the measurement)
+    if (measuredKPH <= 0) {
+        kinetic_speed_estimator_reset(estimator);
+        return 0;
+    }
+    double r = estimator->config.measurementNoise * estimator->config.measurementNoise / (samples > 1 ? samples : 1);
+
+    if (!estimator->initialized || elapsed > estimator->config.resetGap || elapsed < 0) {
+        estimator->speedKPH = measuredKPH;
+        estimator->acceleration = 0;
+        estimator->p00 = r;
+        estimator->p01 = 0;
+        estimator->p11 = InitialAccelerationVar;
+        estimator->initialized = true;
+        return measuredKPH;
+    }
+
+    // predict: x = F x, P = F P F' + Q (white noise jerk)
+    double dt = elapsed;
+    double q = estimator->config.processNoise;
+    estimator->speedKPH += estimator->acceleration * dt;
+    double p00 = estimator->p00 + 2 * dt * estimator->p01 + dt * dt * estimator->p11 + q * dt * dt * dt / 3.0;
+    double p01 = estimator->p01 + dt * estimator->p11 + q * dt * dt / 2.0;
+    double p11 = estimator->p11 + q * dt;
+
+    // correct with the measurement of the speed in the middle of the window: H = [1, -window / 2]
+    double h = -window * 0.5;
+    double c0 = p00 + h * p01;
+    double c1 = p01 + h * p11;
+    double s = c0 + h * c1 + r;
+    double k0 = c0 / s;
+    double k1 = c1 / s;
+    double innovation = measuredKPH - (estimator->speedKPH + h * estimator->acceleration);
+    estimator->speedKPH += k0 * innovation;
+    estimator->acceleration += k1 * innovation;
+    estimator->p00 = p00 - k0 * c0;
+    estimator->p01 = p01 - k0 * c1;
+    estimator->p11 = p11 - k1 * c1;
+
+    if (estimator->speedKPH < 0) {
+        estimator->speedKPH = 0;
+    }
+    return estimator->speedKPH;
+}
+
+void inride_estimate_power(kinetic_speed_estimator *estimator, const inride_raw_power_data *raw, inride_power_data *data)
+{
+    double elapsed = (double)raw->interval / SensorHz;
+    double window = (double)raw->ticks / SensorHz;
+    double speed = kinetic_speed_estimator_update(estimator, elapsed, data->speedKPH, window, raw->revs);
+    data->speedKPH = speed;
+    data->power = data->coasting ? 0 : inride_power_for_speed(speed, data->spindownTime);
+}
+
+void smart_control_estimate_speed(kinetic_speed_estimator *estimator, double elapsed, smart_control_power_data *data)
+{
+    data->speedKPH = kinetic_speed_estimator_update(estimator, elapsed, data->speedKPH, 0, 1);
+}
@@ -0,0 +1,101 @@
+//
+//  SpeedEstimator.h
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#ifndef SpeedEstimator_h
+#define SpeedEstimator_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "inRide.h"
+#include "SmartControl.h"
+
+// Predictive speed smoothing (Kalman filter with a constant acceleration model), and the inRide power from that speed.
+// - State: speed (KPH) and acceleration (KPH / s). Each update predicts the state forward by the time since the
+//   previous update and corrects it with the measured speed.
+// - The measured speed is an average over the measurement window (the ticks of the last roller revolutions), i.e. the
+//   speed in the middle of the window. The filter accounts for that, so it does not lag by half a window like the raw value.
+// - Unlike a moving average, a steady acceleration is followed without delay; only the noise is filtered out.
+// - One knob (smoothing 0 ... 1) trades latency for calm: 0 follows the raw value closely, 1 is very calm.
+// - Constant time and no allocation per update; keep one estimator per device.
+
+
+/*! Estimator Tuning */
+typedef struct kinetic_speed_estimator_config
+{
+    /*! Variance of the random change of acceleration ((KPH / s^2)^2 / s). Higher follows faster. */
+    double processNoise;
+    /*! Standard deviation of a speed measurement over a single roller revolution (KPH) */
+    double measurementNoise;
+    /*! Updates further apart than this (seconds) restart the estimate */
+    double resetGap;
+} kinetic_speed_estimator_config;
+
+/*! Estimator State */
+typedef struct kinetic_speed_estimator
+{
+    kinetic_speed_estimator_config config;
+    double speedKPH;
+    double acceleration;
+    /*! Covariance of the estimate */
+    double p00, p01, p11;
+    bool initialized;
+} kinetic_speed_estimator;
+
+
+/*!
+ Tuning for a position of the latency / noise knob.
+
+ @param smoothing 0 (lowest latency) ... 1 (calmest), 0.5 is a good default for 4 Hz updates
+
+ @return Estimator tuning
+ */
+kinetic_speed_estimator_config kinetic_speed_estimator_config_for_smoothing(double smoothing);
+
+/*!
+ Initializes an estimator.
+ */
+void kinetic_speed_estimator_init(kinetic_speed_estimator *estimator, const kinetic_speed_estimator_config *config);
+
+/*!
+ Restarts the estimate (the next measurement is taken as is).
+ */
+void kinetic_speed_estimator_reset(kinetic_speed_estimator *estimator);
+
+/*!
+ Updates the estimate with a speed measurement.
+
+ @param estimator Estimator
+ @param elapsed Seconds since the previous update
+ @param measuredKPH Measured speed (0 when stopped)
+ @param window Seconds the measurement averages over (0 for an instantaneous measurement)
+ @param samples Number of revolutions (or counts) averaged in the measurement, scales the measurement noise
+
+ @return Estimated speed (KPH)
+ */
+double kinetic_speed_estimator_update(kinetic_speed_estimator *estimator, double elapsed, double measuredKPH, double window, double samples);
+
+/*!
+ Replaces the speed and power of a decoded inRide update with the ones of the estimated speed.
+
+ @param estimator Estimator of the device
+ @param raw Raw counters of the update (inride_decode_power_data)
+ @param data Decoded update (inride_process_raw_power_data), speedKPH and power are updated. Power stays 0 when coasting.
+ */
+void inride_estimate_power(kinetic_speed_estimator *estimator, const inride_raw_power_data *raw, inride_power_data *data);
+
+/*!
+ Replaces the speed of a decoded Smart Control update with the estimated speed (the power is measured by the trainer).
+
+ @param estimator Estimator of the device
+ @param elapsed Seconds since the previous update (1 / updateRate)
+ @param data Decoded update, speedKPH is updated
+ */
+void smart_control_estimate_speed(kinetic_speed_estimator *estimator, double elapsed, smart_control_power_data *data);
+
+
+#endif /* SpeedEstimator_h */
@@ -0,0 +1,247 @@
+//
+//  TimelineFusion.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#include "TimelineFusion.h"
+
+#include <math.h>
+#include <string.h>
+
+static inline kinetic_fusion_sample *stream_sample(const kinetic_fusion *fusion, const kinetic_fusion_stream *stream, uint32_t position)
+{
+    return &stream->buffer[(stream->head + position) % fusion->capacity];
+}
+
+static inline double head_time(const kinetic_fusion *fusion, uint32_t stream)
+{
+    const kinetic_fusion_stream *s = &fusion->streams[stream];
+    return s->buffer[s->head].timestamp;
+}
+
+static void heap_swap(kinetic_fusion *fusion, uint32_t a, uint32_t b)
+{
+    uint32_t stream = fusion->heap[a];
+    fusion->heap[a] = fusion->heap[b];
+    fusion->heap[b] = stream;
+    fusion->streams[fusion->heap[a]].heapIndex = a;
+    fusion->streams[fusion->heap[b]].heapIndex = b;
+}
+
+static void heap_up(kinetic_fusion *fusion, uint32_t index)
+{
+    while (index > 0) {
+        uint32_t parent = (index - 1) / 2;
+        if (head_time(fusion, fusion->heap[parent]) <= head_time(fusion, fusion->heap[index])) {
+            break;
+        }
+        heap_swap(fusion, parent, index);
+        index = parent;
+    }
+}
+
+static void heap_down(kinetic_fusion *fusion, uint32_t index)
+{
+    for (;;) {
+        uint32_t smallest = index;
+        uint32_t left = 2 * index + 1;
+        uint32_t right = left + 1;
+        if (left < fusion->heapSize && head_time(fusion, fusion->heap[left]) < head_time(fusion, fusion->heap[smallest])) {
+            smallest = left;
+        }
+        if (right < fusion->heapSize && head_time(fusion, fusion->heap[right]) < head_time(fusion, fusion->heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == index) {
+            return;
+        }
+        heap_swap(fusion, smallest, index);
+        index = smallest;
+    }
+}
+
+void kinetic_fusion_init(kinetic_fusion *fusion, kinetic_fusion_stream *streams, uint32_t streamCount, kinetic_fusion_sample *samples, uint32_t capacity, uint32_t *heap, double maxLatency)
+{
+    for (uint32_t i = 0; i < streamCount; ++i) {
+        streams[i].buffer = &samples[(size_t)i * capacity];
+        streams[i].head = 0;
+        streams[i].count = 0;
+        streams[i].heapIndex = 0;
+    }
+    fusion->streams = streams;
+    fusion->streamCount = streamCount;
+    fusion->capacity = capacity;
+    fusion->heap = heap;
+    fusion->heapSize = 0;
+    fusion->maxLatency = maxLatency;
+    fusion->watermark = -INFINITY;
+    fusion->late = 0;
+    fusion->overflow = 0;
+}
+
+bool kinetic_fusion_push(kinetic_fusion *fusion, uint32_t stream, double timestamp, const kinetic_sample_record *record)
+{
+    if (stream >= fusion->streamCount) {
+        return false;
+    }
+    if (timestamp < fusion->watermark) {
+        fusion->late++;
+        return false;
+    }
+    kinetic_fusion_stream *s = &fusion->streams[stream];
+    if (s->count == fusion->capacity) {
+        fusion->overflow++;
+        return false;
+    }
+
+    // insertion from the back: in order samples cost nothing, late ones move past the newer ones
+    uint32_t position = s->count;
+    while (position > 0 && stream_sample(fusion, s, position - 1)->timestamp > timestamp) {
+        *stream_sample(fusion, s, position) = *stream_sample(fusion, s, position - 1);
+        position--;
+    }
+    kinetic_fusion_sample *sample = stream_sample(fusion, s, position);
+    sample->timestamp = timestamp;
+    sample->stream = stream;
+    sample->record = *record;
+    s->count++;
+
+    if (s->count == 1) {
+        s->heapIndex = fusion->heapSize;
+        fusion->heap[fusion->heapSize++] = stream;
+        heap_up(fusion, s->heapIndex);
+    } else if (position == 0) {
+        heap_up(fusion, s->heapIndex);
+    }
+    return true;
+}
+
+static void pop(kinetic_fusion *fusion, kinetic_fusion_handler handler, void *context)
+{
+    uint32_t stream = fusion->heap[0];
+    kinetic_fusion_stream *s = &fusion->streams[stream];
+    kinetic_fusion_sample sample = s->buffer[s->head];
+    s->head = (s->head + 1) % fusion->capacity;
+    s->count--;
+
+    if (s->count > 0) {
+        heap_down(fusion, 0);
+    } else {
+        fusion->heapSize--;
+        if (fusion->heapSize > 0) {
+            heap_swap(fusion, 0, fusion->heapSize);
+            heap_down(fusion, 0);
+        }
+    }
+    fusion->watermark = sample.timestamp;
+    handler(context, &sample);
+}
+
+size_t kinetic_fusion_drain(kinetic_fusion *fusion, double now, kinetic_fusion_handler handler, void *context)
+{
+    size_t released = 0;
+    while (fusion->heapSize > 0) {
+        // every stream has a sample buffered: the oldest can not be preceded by anything still to come (except late samples)
+        bool complete = fusion->heapSize == fusion->streamCount;
+        if (!complete && head_time(fusion, fusion->heap[0]) > now - fusion->maxLatency) {
+            break;
+        }
+        pop(fusion, handler, context);
+        released++;
+    }
+    // nothing newer than now - maxLatency will be accepted late
+    if (now - fusion->maxLatency > fusion->watermark) {
+        fusion->watermark = now - fusion->maxLatency;
+    }
+    return released;
+}
+
+size_t kinetic_fusion_flush(kinetic_fusion *fusion, kinetic_fusion_handler handler, void *context)
+{
+    size_t released = 0;
+    while (fusion->heapSize > 0) {
+        pop(fusion, handler, context);
+        released++;
+    }
+    return released;
+}
+
+
+bool kinetic_resampler_init(kinetic_resampler *resampler, kinetic_resampler_stream *streams, kinetic_sample_record *row, uint8_t *valid, uint32_t streamCount,
+                            double startTime, double period, double maxAge, kinetic_resampler_handler handler, void *context)
+{
+    // the grid would never pass a sample (NaN included)
+    if (!(period > 0)) {
+        return false;
+    }
+    memset(streams, 0, sizeof(kinetic_resampler_stream) * streamCount);
+    resampler->streams = streams;
+    resampler->row = row;
+    resampler->valid = valid;
+    resampler->streamCount = streamCount;
+    resampler->startTime = startTime;
+    resampler->period = period;
+    resampler->maxAge = maxAge;
+    resampler->latest = -INFINITY;
+    resampler->next = 0;
+    resampler->handler = handler;
+    resampler->context = context;
+    return true;
+}
+
+static void emit_row(kinetic_resampler *resampler, double gridTime)
+{
+    for (uint32_t i = 0; i < resampler->streamCount; ++i) {
+        const kinetic_resampler_stream *stream = &resampler->streams[i];
+        bool valid = stream->hasValue && gridTime - stream->timestamp <= resampler->maxAge;
+        resampler->valid[i] = valid;
+        if (valid) {
+            resampler->row[i] = stream->value;
+        } else {
+            memset(&resampler->row[i], 0, sizeof(kinetic_sample_record));
+        }
+    }
+    resampler->handler(resampler->context, gridTime, resampler->row, resampler->valid, resampler->streamCount);
+}
+
+// Emits the grid points before a time. Grid points are computed from the index, so they do not drift.
+static size_t emit_before(kinetic_resampler *resampler, double time)
+{
+    size_t rows = 0;
+    for (;;) {
+        double gridTime = resampler->startTime + (double)resampler->next * resampler->period;
+        if (gridTime >= time) {
+            break;
+        }
+        if (!(gridTime - resampler->latest <= resampler->maxAge)) {
+            // every value is too old (or there is none yet): the rows up to time would be empty, jump past them
+            double last = floor((time - resampler->startTime) / resampler->period);
+            resampler->next = last > (double)resampler->next ? (uint64_t)last : resampler->next + 1;
+            continue;
+        }
+        emit_row(resampler, gridTime);
+        resampler->next++;
+        rows++;
+    }
+    return rows;
+}
+
+size_t kinetic_resampler_advance(kinetic_resampler *resampler, double time)
+{
+    return emit_before(resampler, time);
+}
+
+void kinetic_resampler_add(void *context, const kinetic_fusion_sample *sample)
+{
+    kinetic_resampler *resampler = context;
+    // grid points strictly before the sample see the values before it
+    emit_before(resampler, sample->timestamp);
+    if (sample->stream < resampler->streamCount) {
+        kinetic_resampler_stream *stream = &resampler->streams[sample->stream];
+        stream->value = sample->record;
+        stream->timestamp = sample->timestamp;
+        stream->hasValue = true;
+        resampler->latest = fmax(resampler->latest, sample->timestamp);
+    }
+}
@@ -0,0 +1,184 @@
+//
+//  TimelineFusion.h
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#ifndef TimelineFusion_h
+#define TimelineFusion_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "SampleRecord.h"
+
+// Merges the samples of many streams (devices) into one stream ordered by time, and resamples it to a fixed grid.
+//
+// Fusion (k-way merge):
+// - Each stream has a fixed size reorder buffer; samples that arrive out of order within a stream are sorted in.
+// - A min-heap over the oldest sample of each stream releases samples in time order, O(log streams) per sample.
+// - A sample is released once every stream has a newer one buffered, or at the latest maxLatency after its timestamp,
+//   so a silent device delays the output by maxLatency at most.
+// - Samples older than the last released one are dropped (late), as are samples that find their buffer full (overflow).
+//   Size the buffers for the fastest stream: capacity > update rate x maxLatency.
+//
+// Resampler:
+// - Takes the merged stream and emits one row per grid point (startTime + n x period) with the latest value of every
+//   stream at that time (sample and hold). Values older than maxAge are marked invalid.
+// - Grid points where no stream has a value within maxAge (before the first sample, during a gap in every stream) are
+//   skipped in one step, so a grid anchored at 0 can take Unix timestamps.
+// - kinetic_resampler_add has the signature of kinetic_fusion_handler, so the resampler can take the fusion output directly.
+//
+// All storage is passed in by the caller, nothing is allocated.
+
+
+/*! Sample of a stream */
+typedef struct kinetic_fusion_sample
+{
+    /*! Seconds (any clock shared by the streams) */
+    double timestamp;
+    uint32_t stream;
+    kinetic_sample_record record;
+} kinetic_fusion_sample;
+
+/*! Reorder buffer of a stream */
+typedef struct kinetic_fusion_stream
+{
+    kinetic_fusion_sample *buffer;
+    uint32_t head;
+    uint32_t count;
+    /*! Position in the heap (when count > 0) */
+    uint32_t heapIndex;
+} kinetic_fusion_stream;
+
+/*! Fusion State */
+typedef struct kinetic_fusion
+{
+    kinetic_fusion_stream *streams;
+    uint32_t streamCount;
+    uint32_t capacity;
+    /*! Streams with buffered samples, ordered by their oldest sample */
+    uint32_t *heap;
+    uint32_t heapSize;
+    double maxLatency;
+    /*! Timestamp of the last released sample */
+    double watermark;
+    uint64_t late;
+    uint64_t overflow;
+} kinetic_fusion;
+
+/*! Receives the merged samples, in time order */
+typedef void (*kinetic_fusion_handler)(void *context, const kinetic_fusion_sample *sample);
+
+
+/*!
+ Initializes a fusion.
+
+ @param fusion Fusion
+ @param streams State of each stream (streamCount)
+ @param streamCount Number of streams
+ @param samples Reorder buffer storage (streamCount x capacity)
+ @param capacity Reorder buffer size of each stream
+ @param heap Heap storage (streamCount)
+ @param maxLatency Longest time (seconds) a sample waits for the other streams
+ */
+void kinetic_fusion_init(kinetic_fusion *fusion, kinetic_fusion_stream *streams, uint32_t streamCount, kinetic_fusion_sample *samples, uint32_t capacity, uint32_t *heap, double maxLatency);
+
+/*!
+ Adds a sample to a stream.
+
+ @param fusion Fusion
+ @param stream Stream index
+ @param timestamp Time of the sample (seconds)
+ @param record Sample
+
+ @return false if the sample was dropped (late, buffer full or bad stream index)
+ */
+bool kinetic_fusion_push(kinetic_fusion *fusion, uint32_t stream, double timestamp, const kinetic_sample_record *record);
+
+/*!
+ Releases the samples that are ready at a given time.
+
+ @param fusion Fusion
+ @param now Current time (seconds, same clock as the samples)
+ @param handler Receives the samples in time order
+ @param context Passed to the handler
+
+ @return Number of samples released
+ */
+size_t kinetic_fusion_drain(kinetic_fusion *fusion, double now, kinetic_fusion_handler handler, void *context);
+
+/*!
+ Releases every buffered sample (end of the session).
+
+ @return Number of samples released
+ */
+size_t kinetic_fusion_flush(kinetic_fusion *fusion, kinetic_fusion_handler handler, void *context);
+
+
+/*! Latest value of a stream */
+typedef struct kinetic_resampler_stream
+{
+    kinetic_sample_record value;
+    double timestamp;
+    bool hasValue;
+} kinetic_resampler_stream;
+
+/*! Receives a grid row: the value of every stream (valid[i] is 0 if stream i has no value or it is too old) */
+typedef void (*kinetic_resampler_handler)(void *context, double gridTime, const kinetic_sample_record *values, const uint8_t *valid, uint32_t streamCount);
+
+/*! Resampler State */
+typedef struct kinetic_resampler
+{
+    kinetic_resampler_stream *streams;
+    kinetic_sample_record *row;
+    uint8_t *valid;
+    uint32_t streamCount;
+    double startTime;
+    double period;
+    double maxAge;
+    /*! Timestamp of the newest sample */
+    double latest;
+    /*! Index of the next grid point */
+    uint64_t next;
+    kinetic_resampler_handler handler;
+    void *context;
+} kinetic_resampler;
+
+
+/*!
+ Initializes a resampler.
+
+ @param resampler Resampler
+ @param streams State of each stream (streamCount)
+ @param row Row storage (streamCount)
+ @param valid Row validity storage (streamCount)
+ @param streamCount Number of streams
+ @param startTime Time of the first grid point (seconds)
+ @param period Grid period (seconds), e.g. 1.0 or 0.25
+ @param maxAge Oldest value (seconds) a row may use
+ @param handler Receives the rows
+ @param context Passed to the handler
+ @return false if the period is not positive
+ */
+bool kinetic_resampler_init(kinetic_resampler *resampler, kinetic_resampler_stream *streams, kinetic_sample_record *row, uint8_t *valid, uint32_t streamCount,
+                            double startTime, double period, double maxAge, kinetic_resampler_handler handler, void *context);
+
+/*!
+ Adds a sample (samples must come in time order, e.g. from kinetic_fusion_drain). Emits the grid points before it.
+
+ @param resampler kinetic_resampler (void * to be usable as a kinetic_fusion_handler context)
+ @param sample Sample
+ */
+void kinetic_resampler_add(void *resampler, const kinetic_fusion_sample *sample);
+
+/*!
+ Emits the grid points before a time (use the fusion watermark, or the end of the session).
+
+ @return Number of rows emitted
+ */
+size_t kinetic_resampler_advance(kinetic_resampler *resampler, double time);
+
+
+#endif /* TimelineFusion_h */
@@ -0,0 +1,209 @@
+//
+//  Tracing.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#include "Tracing.h"
+
+#ifdef KINETIC_TRACING
+
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define SpanMask                (KINETIC_TRACE_SPANS - 1)
+
+_Static_assert((KINETIC_TRACE_SPANS & SpanMask) == 0, "KINETIC_TRACE_SPANS must be a power of two");
+
+// A span is three words, stored relaxed: a dump racing the owner thread reads torn spans (and drops them) but never
+// undefined values
+typedef struct trace_span
+{
+    _Atomic uint64_t name;
+    _Atomic uint64_t start;
+    /*! duration (ticks, saturated) << 32 | frame */
+    _Atomic uint64_t durationFrame;
+} trace_span;
+
+typedef struct trace_buffer
+{
+    /*! Spans started (a slot is claimed before it is overwritten) and spans complete. The ring holds the last KINETIC_TRACE_SPANS. */
+    _Atomic uint64_t head;
+    _Atomic uint64_t committed;
+    _Atomic bool active;
+    char name[KINETIC_TRACE_THREAD_NAME_MAX];
+    trace_span spans[KINETIC_TRACE_SPANS];
+} trace_buffer;
+
+static trace_buffer buffers[KINETIC_TRACE_THREADS];
+static _Atomic uint32_t bufferCount;
+static _Atomic uint32_t frameCount;
+// Clock and tick counter read together on the first span, the dump converts ticks against a second pair
+static _Atomic uint64_t baseNanoseconds;
+static _Atomic uint64_t baseTicks;
+
+static _Thread_local trace_buffer *threadBuffer;
+static _Thread_local bool threadUntraced;
+static _Thread_local uint32_t threadFrame;
+
+
+static uint64_t clock_nanoseconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// The cycle counter where it is readable from user space (a few ns), the monotonic clock elsewhere
+uint64_t kinetic_trace_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    return clock_nanoseconds();
+#endif
+}
+
+static trace_buffer *thread_buffer(void)
+{
+    trace_buffer *buffer = threadBuffer;
+    if (buffer != NULL || threadUntraced) {
+        return buffer;
+    }
+    uint32_t index = atomic_fetch_add_explicit(&bufferCount, 1, memory_order_relaxed);
+    if (index >= KINETIC_TRACE_THREADS) {
+        threadUntraced = true;
+        return NULL;
+    }
+    if (index == 0) {
+        atomic_store_explicit(&baseNanoseconds, clock_nanoseconds(), memory_order_relaxed);
+        atomic_store_explicit(&baseTicks, kinetic_trace_now(), memory_order_relaxed);
+    }
+    buffer = &buffers[index];
+    snprintf(buffer->name, sizeof(buffer->name), "thread %u", index + 1);
+    atomic_store_explicit(&buffer->active, true, memory_order_release);
+    threadBuffer = buffer;
+    return buffer;
+}
+
+void kinetic_trace_record(const char *name, uint64_t start)
+{
+    uint64_t duration = kinetic_trace_now() - start;
+    trace_buffer *buffer = thread_buffer();
+    if (buffer == NULL) {
+        return;
+    }
+    uint64_t head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    trace_span *span = &buffer->spans[head & SpanMask];
+    // claim the slot before overwriting it, so a dump copying the old span knows to drop it
+    atomic_store_explicit(&buffer->head, head + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&span->name, (uint64_t)(uintptr_t)name, memory_order_relaxed);
+    atomic_store_explicit(&span->start, start, memory_order_relaxed);
+    atomic_store_explicit(&span->durationFrame, ((duration < UINT32_MAX ? duration : UINT32_MAX) << 32) | threadFrame, memory_order_relaxed);
+    atomic_store_explicit(&buffer->committed, head + 1, memory_order_release);
+}
+
+uint32_t kinetic_trace_frame_begin(void)
+{
+    threadFrame = atomic_fetch_add_explicit(&frameCount, 1, memory_order_relaxed) + 1;
+    return threadFrame;
+}
+
+void kinetic_trace_set_frame(uint32_t frame)
+{
+    threadFrame = frame;
+}
+
+void kinetic_trace_thread_name(const char *name)
+{
+    trace_buffer *buffer = thread_buffer();
+    if (buffer != NULL) {
+        snprintf(buffer->name, sizeof(buffer->name), "%s", name);
+    }
+}
+
+static void write_string(FILE *file, const char *string)
+{
+    fputc('"', file);
+    for (; *string; ++string) {
+        if (*string == '"' || *string == '\\') {
+            fputc('\\', file);
+        }
+        if ((unsigned char)*string >= 0x20) {
+            fputc(*string, file);
+        }
+    }
+    fputc('"', file);
+}
+
+bool kinetic_trace_dump_file(FILE *file)
+{
+    int pid = (int)getpid();
+    bool first = true;
+    // microseconds per tick
+    uint64_t nanoseconds = clock_nanoseconds();
+    uint64_t ticks = kinetic_trace_now();
+    uint64_t firstNanoseconds = atomic_load_explicit(&baseNanoseconds, memory_order_relaxed);
+    uint64_t firstTicks = atomic_load_explicit(&baseTicks, memory_order_relaxed);
+    double scale = 1e-3;
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+    if (ticks > firstTicks && nanoseconds > firstNanoseconds) {
+        scale = (double)(nanoseconds - firstNanoseconds) / (double)(ticks - firstTicks) * 1e-3;
+    }
+#endif
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    uint32_t count = atomic_load_explicit(&bufferCount, memory_order_relaxed);
+    for (uint32_t index = 0; index < count && index < KINETIC_TRACE_THREADS; ++index) {
+        trace_buffer *buffer = &buffers[index];
+        if (!atomic_load_explicit(&buffer->active, memory_order_acquire)) {
+            continue;
+        }
+        int tid = (int)index + 1;
+        fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":", first ? "" : ",", pid, tid);
+        write_string(file, buffer->name);
+        fprintf(file, "}}");
+        first = false;
+
+        uint64_t committed = atomic_load_explicit(&buffer->committed, memory_order_acquire);
+        uint64_t oldest = committed > KINETIC_TRACE_SPANS ? committed - KINETIC_TRACE_SPANS : 0;
+        for (uint64_t i = oldest; i < committed; ++i) {
+            trace_span *span = &buffer->spans[i & SpanMask];
+            const char *name = (const char *)(uintptr_t)atomic_load_explicit(&span->name, memory_order_relaxed);
+            uint64_t start = atomic_load_explicit(&span->start, memory_order_relaxed);
+            uint64_t durationFrame = atomic_load_explicit(&span->durationFrame, memory_order_relaxed);
+            // dropped if the owner claimed the slot for a newer span while it was copied
+            atomic_thread_fence(memory_order_acquire);
+            if (i + KINETIC_TRACE_SPANS < atomic_load_explicit(&buffer->head, memory_order_relaxed)) {
+                continue;
+            }
+            fprintf(file, ",\n{\"name\":");
+            write_string(file, name);
+            fprintf(file, ",\"cat\":\"kinetic\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%u}}",
+                    pid, tid, firstNanoseconds * 1e-3 + ((double)start - (double)firstTicks) * scale, (durationFrame >> 32) * scale, (uint32_t)durationFrame);
+        }
+    }
+    fprintf(file, "\n]}\n");
+    return !ferror(file);
+}
+
+bool kinetic_trace_dump(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return false;
+    }
+    bool written = kinetic_trace_dump_file(file);
+    return fclose(file) == 0 && written;
+}
+
+#endif /* KINETIC_TRACING */
@@ -0,0 +1,92 @@
+//
+//  Tracing.h
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#ifndef Tracing_h
+#define Tracing_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Pipeline tracing: spans (name, start, duration, frame) of the decode stages, dumped as Chrome trace event JSON
+// (open in chrome://tracing or ui.perfetto.dev). Build with KINETIC_TRACING defined to enable.
+// - Every thread records into its own ring of KINETIC_TRACE_SPANS spans, taken from a static pool on its first span
+//   (up to KINETIC_TRACE_THREADS threads, later threads are not traced). Recording never locks: two reads of the cycle
+//   counter and a handful of relaxed stores. Ticks are converted to time when dumping.
+// - Spans carry the frame id of their thread (kinetic_trace_frame_begin): the stages of one notification line up
+//   across threads when the id is handed over with kinetic_trace_set_frame.
+// - The rings keep the latest spans. kinetic_trace_dump can run at any time from any thread: spans overwritten
+//   while it copies them are left out.
+// - Span names must be string literals (or live until the dump): only the pointer is recorded.
+// - Durations are kept on 32 bits of ticks: spans longer than about a second are cut.
+// Without KINETIC_TRACING the hooks compile to nothing and this header declares no functions.
+
+#ifndef KINETIC_TRACE_SPANS
+#define KINETIC_TRACE_SPANS             8192    // per thread, a power of two
+#endif
+#ifndef KINETIC_TRACE_THREADS
+#define KINETIC_TRACE_THREADS           32
+#endif
+#define KINETIC_TRACE_THREAD_NAME_MAX   32
+
+
+#ifdef KINETIC_TRACING
+
+/*!
+ Clock of the spans (cycle counter ticks, not nanoseconds).
+ */
+uint64_t kinetic_trace_now(void);
+
+/*!
+ Records a span of the calling thread that started at start (kinetic_trace_now) and ends now.
+
+ @param name Stage name (string literal)
+ @param start Start of the span
+ */
+void kinetic_trace_record(const char *name, uint64_t start);
+
+/*!
+ Starts a new frame (a notification or a chunk read from a transport) on the calling thread.
+
+ @return Frame id (pass it to kinetic_trace_set_frame to continue the frame on another thread)
+ */
+uint32_t kinetic_trace_frame_begin(void);
+
+/*!
+ Sets the frame the next spans of the calling thread belong to.
+ */
+void kinetic_trace_set_frame(uint32_t frame);
+
+/*!
+ Names the calling thread in the trace.
+ */
+void kinetic_trace_thread_name(const char *name);
+
+/*!
+ Writes the recorded spans of every thread as Chrome trace event JSON.
+
+ @return false if the file cannot be written
+ */
+bool kinetic_trace_dump(const char *path);
+bool kinetic_trace_dump_file(FILE *file);
+
+
+// Hooks used by the pipeline
+#define KINETIC_TRACE_BEGIN(start)          uint64_t start = kinetic_trace_now()
+#define KINETIC_TRACE_END(start, name)      kinetic_trace_record(name, start)
+#define KINETIC_TRACE_FRAME_BEGIN()         ((void)kinetic_trace_frame_begin())
+
+#else
+
+#define KINETIC_TRACE_BEGIN(start)          ((void)0)
+#define KINETIC_TRACE_END(start, name)      ((void)0)
+#define KINETIC_TRACE_FRAME_BEGIN()         ((void)0)
+
+#endif /* KINETIC_TRACING */
+
+
+#endif /* Tracing_h */
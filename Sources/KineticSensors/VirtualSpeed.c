@@ -0,0 +1,176 @@
+//
+//  VirtualSpeed.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#include "VirtualSpeed.h"
+
+#include <math.h>
+
+#define Gravity                 9.80665
+#define WindCoeffMin            1e-6    // keeps the cubic a cubic
+#define IterationsMax           64      // bisection steps included
+#define Tolerance               1e-7    // m/s
+#define Lanes                   4
+
+typedef double v4d __attribute__((vector_size(Lanes * sizeof(double))));
+typedef int64_t v4l __attribute__((vector_size(Lanes * sizeof(int64_t))));
+
+#define splat(value)            ((v4d){ (value), (value), (value), (value) })
+#define blend(mask, a, b)       ((v4d)(((v4l)(a) & (mask)) | ((v4l)(b) & ~(mask))))     // mask ? a : b
+
+
+double smart_control_simulation_power(double speedKPH, double weightKG, double rollingCoeff, double windCoeff, double grade, double windSpeedMPS)
+{
+    double speed = speedKPH / 3.6;
+    double angle = atan(grade / 100.0);
+    double air = speed + windSpeedMPS;
+    double force = weightKG * Gravity * (rollingCoeff * cos(angle) + sin(angle)) + windCoeff * air * fabs(air);
+    double power = speed * force;
+    return power > 0 ? power : 0;
+}
+
+// Gravity and rolling force (N) on a grade
+static inline double slope_force(const kinetic_virtual_speed_params *params, double grade)
+{
+    double g = grade / 100.0;
+    double hypotenuse = sqrt(1.0 + g * g);
+    return params->weightKG * Gravity * (params->rollingCoeff + g) / hypotenuse;
+}
+
+// A speed (m/s) above the largest root of v (A + k u |u|) = P, u = v + wind:
+// with a = cbrt(P / k) and b = sqrt(-A / k), any v >= a + b + max(-wind, 0) has f(v) >= k a^2 v - P >= 0.
+static inline double start_speed(double force, double k, double wind, double power)
+{
+    double a = power > 0 ? cbrt(power / k) : 0;
+    double b = force < 0 ? sqrt(-force / k) : 0;
+    return a + b + (wind < 0 ? -wind : 0) + 0.1;
+}
+
+// A speed (m/s) below the largest root: the road force A + k u |u| grows with v, so v (A + k u |u|) - P is negative
+// while the force is not positive and increasing once it is. The root is the only one above the speed where the
+// force vanishes (or above 0).
+static inline double bracket_speed(double force, double k, double wind)
+{
+    double u = force < 0 ? sqrt(-force / k) : -sqrt(force / k);
+    return u - wind > 0 ? u - wind : 0;
+}
+
+void kinetic_virtual_speed_solve(const kinetic_virtual_speed_params *params, const double *power, const double *grade, double *speedKPH, size_t count)
+{
+    double k = params->windCoeff > WindCoeffMin ? params->windCoeff : WindCoeffMin;
+    const v4d zero = splat(0.0);
+    const v4d vk = splat(k);
+    const v4d wind = splat(params->windSpeedMPS);
+
+    for (size_t offset = 0; offset < count; offset += Lanes) {
+        size_t lanes = count - offset < Lanes ? count - offset : Lanes;
+        v4d force = zero, watts = zero, v = zero, low = zero, high = zero;
+        for (size_t lane = 0; lane < lanes; ++lane) {
+            double f = slope_force(params, grade[offset + lane]);
+            double p = power[offset + lane] > 0 ? power[offset + lane] : 0;
+            force[lane] = f;
+            watts[lane] = p;
+            low[lane] = bracket_speed(f, k, params->windSpeedMPS);
+            high[lane] = start_speed(f, k, params->windSpeedMPS, p);
+            v[lane] = high[lane];
+        }
+
+        // Newton from above the root, kept inside the bracket [low, high]. With a tail wind the root can sit where the
+        // curve is concave: a step that leaves the bracket (or a slope that is not positive) bisects instead.
+        for (int iteration = 0; iteration < IterationsMax; ++iteration) {
+            v4d u = v + wind;
+            v4d absU = blend((v4l)(u < zero), -u, u);
+            v4d drag = vk * u * absU;
+            v4d f = v * (force + drag) - watts;
+            v4d slope = force + drag + splat(2.0) * vk * v * absU;
+            v4l above = (v4l)(f > zero);
+            high = blend(above, v, high);
+            low = blend(above, low, v);
+            v4l valid = (v4l)(slope > zero);
+            v4d newton = v - f / blend(valid, slope, splat(1.0));
+            v4l inside = valid & (v4l)(newton >= low) & (v4l)(newton <= high);
+            v4d next = blend(inside, newton, splat(0.5) * (low + high));
+            v4d step = v - next;
+            v = next;
+            v4l moving = (v4l)(step > splat(Tolerance)) | (v4l)(step < splat(-Tolerance));
+            if (!(moving[0] | moving[1] | moving[2] | moving[3])) {
+                break;
+            }
+        }
+
+        for (size_t lane = 0; lane < lanes; ++lane) {
+            speedKPH[offset + lane] = v[lane] * 3.6;
+        }
+    }
+}
+
+bool kinetic_virtual_speed_table_init(kinetic_virtual_speed_table *table, const kinetic_virtual_speed_params *params, float *speeds,
+                                      uint32_t powerCount, double powerMax, uint32_t gradeCount, double gradeMin, double gradeMax)
+{
+    if (powerCount < 2 || gradeCount < 2 || !(powerMax > 0) || !(gradeMax > gradeMin)) {
+        return false;
+    }
+    table->params = *params;
+    table->speeds = speeds;
+    table->powerCount = powerCount;
+    table->gradeCount = gradeCount;
+    table->powerMax = powerMax;
+    table->gradeMin = gradeMin;
+    table->gradeMax = gradeMax;
+    table->powerScale = (powerCount - 1) / powerMax;
+    table->gradeScale = (gradeCount - 1) / (gradeMax - gradeMin);
+
+    // a row at a time through the solver
+    double power[Lanes * 16], grade[Lanes * 16], speed[Lanes * 16];
+    for (uint32_t row = 0; row < gradeCount; row++) {
+        double g = gradeMin + row / table->gradeScale;
+        for (uint32_t column = 0; column < powerCount; column += Lanes * 16) {
+            uint32_t n = powerCount - column < Lanes * 16 ? powerCount - column : Lanes * 16;
+            for (uint32_t i = 0; i < n; i++) {
+                power[i] = (column + i) / table->powerScale;
+                grade[i] = g;
+            }
+            kinetic_virtual_speed_solve(params, power, grade, speed, n);
+            for (uint32_t i = 0; i < n; i++) {
+                speeds[(size_t)row * powerCount + column + i] = (float)speed[i];
+            }
+        }
+    }
+    return true;
+}
+
+double kinetic_virtual_speed_lookup(const kinetic_virtual_speed_table *table, double power, double grade)
+{
+    if (power < 0) {
+        power = 0;
+    }
+    if (power > table->powerMax || !(grade >= table->gradeMin && grade <= table->gradeMax)) {
+        double speed;
+        kinetic_virtual_speed_solve(&table->params, &power, &grade, &speed, 1);
+        return speed;
+    }
+    double x = power * table->powerScale;
+    double y = (grade - table->gradeMin) * table->gradeScale;
+    uint32_t column = (uint32_t)x;
+    uint32_t row = (uint32_t)y;
+    if (column > table->powerCount - 2) {
+        column = table->powerCount - 2;
+    }
+    if (row > table->gradeCount - 2) {
+        row = table->gradeCount - 2;
+    }
+    double fx = x - column;
+    double fy = y - row;
+    const float *low = &table->speeds[(size_t)row * table->powerCount + column];
+    const float *high = low + table->powerCount;
+    double bottom = low[0] + (low[1] - low[0]) * fx;
+    double top = high[0] + (high[1] - high[0]) * fx;
+    return bottom + (top - bottom) * fy;
+}
+
+double smart_control_virtual_speed(const kinetic_virtual_speed_table *table, const smart_control_power_data *data, double grade)
+{
+    return kinetic_virtual_speed_lookup(table, data->power, grade);
+}
@@ -0,0 +1,106 @@
+//
+//  VirtualSpeed.h
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#ifndef VirtualSpeed_h
+#define VirtualSpeed_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "SmartControl.h"
+
+// Virtual road speed in simulation mode: the speed at which the simulated road takes the rider's power.
+// - Road model (the one the simulation command parameters describe, also used by the emulator):
+//   power = v x (weight x g x (Crr x cos(angle) + sin(angle)) + windCoeff x (v + wind) x |v + wind|)
+// - Solving it for v is a cubic. kinetic_virtual_speed_solve runs Newton's method 4 values at a time with vector
+//   extensions, starting above the root. Each lane keeps a bracket of the root (the road force grows with v, so only one
+//   root lies above the speed where it vanishes) and bisects when a Newton step leaves it, as it can with a tail wind.
+// - For a rider parameter set (weight, Crr, wind), a table of speeds over power x grade is solved once; a lookup is then a
+//   bilinear interpolation, constant time. Inputs outside the table fall back to the solver.
+// - Table storage is passed in by the caller (powerCount x gradeCount floats), nothing is allocated.
+
+
+/*! Rider and road parameters (see smart_control_set_mode_simulation_command) */
+typedef struct kinetic_virtual_speed_params
+{
+    double weightKG;
+    double rollingCoeff;
+    double windCoeff;
+    double windSpeedMPS;
+} kinetic_virtual_speed_params;
+
+/*! Speed table of a parameter set */
+typedef struct kinetic_virtual_speed_table
+{
+    kinetic_virtual_speed_params params;
+    /*! Speeds (KPH), row per grade, column per power */
+    float *speeds;
+    uint32_t powerCount;
+    uint32_t gradeCount;
+    double powerMax;
+    double gradeMin;
+    double gradeMax;
+    /*! Cells per Watt and per grade percent */
+    double powerScale;
+    double gradeScale;
+} kinetic_virtual_speed_table;
+
+
+/*!
+ Power (Watts) of the simulation road model at a speed.
+
+ @param speedKPH Road speed
+ @param weightKG Weight of rider and bike
+ @param rollingCoeff Rolling resistance coefficient
+ @param windCoeff Wind resistance coefficient
+ @param grade Grade (percent)
+ @param windSpeedMPS Head (positive) or tail wind speed
+
+ @return Power (0 if the road pushes the rider)
+ */
+double smart_control_simulation_power(double speedKPH, double weightKG, double rollingCoeff, double windCoeff, double grade, double windSpeedMPS);
+
+/*!
+ Solves the road speeds of a batch of power and grade pairs.
+
+ @param params Rider and road parameters
+ @param power Power (Watts) of each pair
+ @param grade Grade (percent) of each pair
+ @param speedKPH Output: road speed of each pair
+ @param count Number of pairs
+ */
+void kinetic_virtual_speed_solve(const kinetic_virtual_speed_params *params, const double *power, const double *grade, double *speedKPH, size_t count);
+
+/*!
+ Builds the speed table of a parameter set (e.g. 61 powers up to 1500 W x 81 grades from -20 % to 20 %).
+
+ @param table Table
+ @param params Rider and road parameters
+ @param speeds Storage (powerCount x gradeCount)
+ @param powerCount Columns, from 0 to powerMax Watts (2 or more)
+ @param powerMax Largest power in the table
+ @param gradeCount Rows, from gradeMin to gradeMax (2 or more)
+ @param gradeMin Smallest grade (percent)
+ @param gradeMax Largest grade (percent)
+
+ @return false if the dimensions are invalid
+ */
+bool kinetic_virtual_speed_table_init(kinetic_virtual_speed_table *table, const kinetic_virtual_speed_params *params, float *speeds,
+                                      uint32_t powerCount, double powerMax, uint32_t gradeCount, double gradeMin, double gradeMax);
+
+/*!
+ Road speed (KPH) for a power and grade: interpolated in the table, solved outside of it.
+ */
+double kinetic_virtual_speed_lookup(const kinetic_virtual_speed_table *table, double power, double grade);
+
+/*!
+ Road speed (KPH) of a decoded Smart Control update on a grade (the grade of the last simulation command).
+ */
+double smart_control_virtual_speed(const kinetic_virtual_speed_table *table, const smart_control_power_data *data, double grade);
+
+
+#endif /* VirtualSpeed_h */
@@ -0,0 +1,296 @@
+//
+//  Workout.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#include "Workout.h"
+
+#include <math.h>
+#include <string.h>
+
+#define WheelSize           (1u << KINETIC_WORKOUT_WHEEL_BITS)
+#define LevelSize           (1u << KINETIC_WORKOUT_LEVEL_BITS)
+#define LevelMask           (LevelSize - 1)
+#define MaxDelta            ((1ull << (KINETIC_WORKOUT_WHEEL_BITS + KINETIC_WORKOUT_LEVELS * KINETIC_WORKOUT_LEVEL_BITS)) - 1)
+#define RepeatDepthMax      8
+#define FiringSlot          KINETIC_WORKOUT_SLOTS
+
+
+typedef struct compiler
+{
+    const kinetic_workout_step *steps;
+    double ftp;
+    double updateRate;
+    kinetic_workout_setpoint *setpoints;
+    size_t capacity;
+    size_t count;
+    double time;
+    int lastWatts;
+    bool overflow;
+} compiler;
+
+static void emit(compiler *c, double time, double target)
+{
+    long watts = lround(target * c->ftp);
+    watts = watts < 0 ? 0 : watts > 65535 ? 65535 : watts;
+    if (watts == c->lastWatts) {
+        return;
+    }
+    if (c->count >= c->capacity) {
+        c->overflow = true;
+        return;
+    }
+    c->setpoints[c->count].time = (uint32_t)llround(time * 1000.0);
+    c->setpoints[c->count].watts = (uint16_t)watts;
+    c->count++;
+    c->lastWatts = (int)watts;
+}
+
+static bool compile_steps(compiler *c, size_t first, size_t last, int depth)
+{
+    for (size_t i = first; i < last && !c->overflow; i++) {
+        const kinetic_workout_step *step = &c->steps[i];
+        switch (step->type) {
+            case KINETIC_WORKOUT_STEADY:
+                if (!(step->duration > 0)) {
+                    return false;
+                }
+                emit(c, c->time, step->start);
+                c->time += step->duration;
+                break;
+
+            case KINETIC_WORKOUT_RAMP: {
+                if (!(step->duration > 0)) {
+                    return false;
+                }
+                // one setpoint per trainer update, the end target is reached by the next step
+                double period = 1.0 / c->updateRate;
+                size_t n = (size_t)ceil(step->duration * c->updateRate);
+                for (size_t k = 0; k < n; k++) {
+                    double t = k * period;
+                    emit(c, c->time + t, step->start + (step->end - step->start) * (t / step->duration));
+                }
+                c->time += step->duration;
+                break;
+            }
+
+            case KINETIC_WORKOUT_REPEAT:
+                if (step->repeatSteps > i - first || depth >= RepeatDepthMax) {
+                    return false;
+                }
+                for (uint16_t r = 0; r < step->repeatCount; r++) {
+                    if (!compile_steps(c, i - step->repeatSteps, i, depth + 1)) {
+                        return false;
+                    }
+                }
+                break;
+
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+size_t kinetic_workout_compile(const kinetic_workout_step *steps, size_t stepCount, double ftp, double updateRate,
+                               kinetic_workout_setpoint *setpoints, size_t capacity, uint32_t *duration)
+{
+    compiler c;
+    c.steps = steps;
+    c.ftp = ftp;
+    c.updateRate = updateRate > 0 ? updateRate : 1;
+    c.setpoints = setpoints;
+    c.capacity = capacity;
+    c.count = 0;
+    c.time = 0;
+    c.lastWatts = -1;
+    c.overflow = false;
+    if (!compile_steps(&c, 0, stepCount, 0) || c.overflow || c.time * 1000.0 > UINT32_MAX) {
+        return 0;
+    }
+    if (duration != NULL) {
+        *duration = (uint32_t)llround(c.time * 1000.0);
+    }
+    return c.count;
+}
+
+
+// Timer wheel (ticks are milliseconds). Slot 0 ... 255 is the wheel, then 64 slots per level.
+
+static void link(kinetic_workout_executor *executor, uint32_t index, uint16_t slot)
+{
+    kinetic_workout_rider *rider = &executor->riders[index];
+    uint32_t head = executor->slots[slot];
+    rider->slot = slot;
+    rider->timerPrevious = KINETIC_WORKOUT_NONE;
+    rider->timerNext = head;
+    if (head != KINETIC_WORKOUT_NONE) {
+        executor->riders[head].timerPrevious = index;
+    }
+    executor->slots[slot] = index;
+}
+
+static void unlink(kinetic_workout_executor *executor, uint32_t index)
+{
+    kinetic_workout_rider *rider = &executor->riders[index];
+    if (rider->timerPrevious != KINETIC_WORKOUT_NONE) {
+        executor->riders[rider->timerPrevious].timerNext = rider->timerNext;
+    } else {
+        executor->slots[rider->slot] = rider->timerNext;
+    }
+    if (rider->timerNext != KINETIC_WORKOUT_NONE) {
+        executor->riders[rider->timerNext].timerPrevious = rider->timerPrevious;
+    }
+}
+
+static void insert(kinetic_workout_executor *executor, uint32_t index)
+{
+    uint64_t expires = executor->riders[index].expires;
+    uint64_t tick = executor->tick;
+    if (expires < tick) {
+        // overdue: the slot processed next
+        link(executor, index, (uint16_t)(tick & (WheelSize - 1)));
+        return;
+    }
+    uint64_t delta = expires - tick;
+    if (delta < WheelSize) {
+        link(executor, index, (uint16_t)(expires & (WheelSize - 1)));
+        return;
+    }
+    if (delta > MaxDelta) {
+        // parked in the last level, placed again when that slot cascades
+        expires = tick + MaxDelta;
+    }
+    for (unsigned level = 0; level < KINETIC_WORKOUT_LEVELS; level++) {
+        unsigned shift = KINETIC_WORKOUT_WHEEL_BITS + (level + 1) * KINETIC_WORKOUT_LEVEL_BITS;
+        if (level == KINETIC_WORKOUT_LEVELS - 1 || delta < (1ull << shift)) {
+            unsigned slot = (unsigned)((expires >> (shift - KINETIC_WORKOUT_LEVEL_BITS)) & LevelMask);
+            link(executor, index, (uint16_t)(WheelSize + level * LevelSize + slot));
+            return;
+        }
+    }
+}
+
+static void arm(kinetic_workout_executor *executor, uint32_t index)
+{
+    kinetic_workout_rider *rider = &executor->riders[index];
+    rider->expires = rider->startTime + rider->schedule[rider->next].time;
+    rider->armed = true;
+    executor->armed++;
+    insert(executor, index);
+}
+
+static void disarm(kinetic_workout_executor *executor, uint32_t index)
+{
+    kinetic_workout_rider *rider = &executor->riders[index];
+    if (rider->armed) {
+        unlink(executor, index);
+        rider->armed = false;
+        executor->armed--;
+    }
+}
+
+// Moves the timers of a level slot down; returns the slot index (0 continues with the next level)
+static unsigned cascade(kinetic_workout_executor *executor, unsigned level)
+{
+    unsigned shift = KINETIC_WORKOUT_WHEEL_BITS + level * KINETIC_WORKOUT_LEVEL_BITS;
+    unsigned slot = (unsigned)((executor->tick >> shift) & LevelMask);
+    uint16_t slotIndex = (uint16_t)(WheelSize + level * LevelSize + slot);
+    uint32_t index = executor->slots[slotIndex];
+    executor->slots[slotIndex] = KINETIC_WORKOUT_NONE;
+    while (index != KINETIC_WORKOUT_NONE) {
+        uint32_t next = executor->riders[index].timerNext;
+        insert(executor, index);
+        index = next;
+    }
+    return slot;
+}
+
+void kinetic_workout_executor_init(kinetic_workout_executor *executor, kinetic_workout_rider *riders, uint32_t riderCount, uint64_t now)
+{
+    executor->riders = riders;
+    executor->riderCount = riderCount;
+    executor->armed = 0;
+    executor->tick = now;
+    for (size_t i = 0; i <= KINETIC_WORKOUT_SLOTS; i++) {
+        executor->slots[i] = KINETIC_WORKOUT_NONE;
+    }
+    memset(riders, 0, sizeof(*riders) * riderCount);
+}
+
+void kinetic_workout_executor_start(kinetic_workout_executor *executor, uint32_t rider, const kinetic_workout_setpoint *schedule, uint32_t count, uint64_t startTime)
+{
+    if (rider >= executor->riderCount) {
+        return;
+    }
+    disarm(executor, rider);
+    kinetic_workout_rider *r = &executor->riders[rider];
+    r->schedule = schedule;
+    r->count = count;
+    r->next = 0;
+    r->startTime = startTime;
+    r->watts = 0;
+    if (count > 0) {
+        arm(executor, rider);
+    }
+}
+
+void kinetic_workout_executor_stop(kinetic_workout_executor *executor, uint32_t rider)
+{
+    if (rider < executor->riderCount) {
+        disarm(executor, rider);
+        executor->riders[rider].count = 0;
+    }
+}
+
+static size_t fire(kinetic_workout_executor *executor, uint32_t index, uint64_t now, kinetic_workout_handler handler, void *context)
+{
+    kinetic_workout_rider *rider = &executor->riders[index];
+    unlink(executor, index);
+    rider->armed = false;
+    executor->armed--;
+    // skip to the latest setpoint that is due
+    while (rider->next + 1 < rider->count && rider->startTime + rider->schedule[rider->next + 1].time <= now) {
+        rider->next++;
+    }
+    rider->watts = rider->schedule[rider->next].watts;
+    rider->next++;
+    if (rider->next < rider->count) {
+        arm(executor, index);
+    }
+    if (handler != NULL) {
+        smart_control_set_mode_erg_data command = smart_control_set_mode_erg_command(rider->watts);
+        handler(context, index, rider->watts, &command);
+    }
+    return 1;
+}
+
+size_t kinetic_workout_executor_advance(kinetic_workout_executor *executor, uint64_t now, kinetic_workout_handler handler, void *context)
+{
+    size_t fired = 0;
+    while (executor->tick <= now) {
+        if (executor->armed == 0) {
+            // nothing to cascade or fire
+            executor->tick = now + 1;
+            break;
+        }
+        unsigned index = (unsigned)(executor->tick & (WheelSize - 1));
+        if (index == 0) {
+            for (unsigned level = 0; level < KINETIC_WORKOUT_LEVELS && cascade(executor, level) == 0; level++) {
+            }
+        }
+        // move the due timers to their own list, so that the handler can start and stop any rider meanwhile
+        uint32_t rider = executor->slots[index];
+        executor->slots[index] = KINETIC_WORKOUT_NONE;
+        executor->slots[FiringSlot] = rider;
+        for (; rider != KINETIC_WORKOUT_NONE; rider = executor->riders[rider].timerNext) {
+            executor->riders[rider].slot = FiringSlot;
+        }
+        executor->tick++;
+        while ((rider = executor->slots[FiringSlot]) != KINETIC_WORKOUT_NONE) {
+            fired += fire(executor, rider, now, handler, context);
+        }
+    }
+    return fired;
+}
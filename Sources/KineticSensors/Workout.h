@@ -0,0 +1,160 @@
+//
+//  Workout.h
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#ifndef Workout_h
+#define Workout_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "SmartControl.h"
+
+// Structured ERG workouts for many trainers from one thread.
+//
+// Compiler:
+// - A workout is a list of steps: steady (one target), ramp (start to end target) and repeat (runs the preceding steps
+//   again). Targets are a fraction of FTP (0.75 = 75 %).
+// - Compiling for a rider's FTP produces the schedule of ERG setpoints (time, watts). Ramps produce a setpoint per
+//   update of the trainer (updateRate Hz, see smart_control_config_data), setpoints that do not change the target are left out.
+//
+// Executor:
+// - Hierarchical timer wheel with a 1 ms tick (256 slots, then 3 levels of 64, up to 18 hours ahead). Each rider has one
+//   timer (its next setpoint): arming and firing are O(1), the far levels are cascaded down as time gets close.
+// - kinetic_workout_executor_advance fires the setpoints that are due and hands the encoded ERG command to the caller.
+//   When called late, a rider gets only its latest due setpoint. Jitter is the call period: call every few milliseconds.
+//   The handler may start and stop workouts.
+// - Riders and schedules are caller storage, nothing is allocated.
+
+#define KINETIC_WORKOUT_WHEEL_BITS      8
+#define KINETIC_WORKOUT_LEVEL_BITS      6
+#define KINETIC_WORKOUT_LEVELS          3
+#define KINETIC_WORKOUT_SLOTS           ((1 << KINETIC_WORKOUT_WHEEL_BITS) + KINETIC_WORKOUT_LEVELS * (1 << KINETIC_WORKOUT_LEVEL_BITS))
+#define KINETIC_WORKOUT_NONE            UINT32_MAX
+
+
+/*! Workout Step Type */
+typedef enum kinetic_workout_step_type
+{
+    KINETIC_WORKOUT_STEADY          = 0,
+    KINETIC_WORKOUT_RAMP            = 1,
+    KINETIC_WORKOUT_REPEAT          = 2
+} kinetic_workout_step_type;
+
+/*! Workout Step */
+typedef struct kinetic_workout_step
+{
+    kinetic_workout_step_type type;
+    /*! Seconds (steady, ramp) */
+    double duration;
+    /*! Target at the start and at the end of a ramp (fraction of FTP), a steady step uses start */
+    float start;
+    float end;
+    /*! Repeat: number of preceding steps to run again, and how many more times */
+    uint16_t repeatSteps;
+    uint16_t repeatCount;
+} kinetic_workout_step;
+
+/*! ERG Setpoint */
+typedef struct kinetic_workout_setpoint
+{
+    /*! Milliseconds from the start of the workout */
+    uint32_t time;
+    uint16_t watts;
+} kinetic_workout_setpoint;
+
+/*! Timer of a rider */
+typedef struct kinetic_workout_rider
+{
+    const kinetic_workout_setpoint *schedule;
+    uint32_t count;
+    /*! Next setpoint to fire */
+    uint32_t next;
+    /*! Time the workout started (ms, executor clock) */
+    uint64_t startTime;
+    /*! Time the timer fires (ms) */
+    uint64_t expires;
+    /*! Links of the wheel slot the timer is in */
+    uint32_t timerNext;
+    uint32_t timerPrevious;
+    uint16_t slot;
+    bool armed;
+    /*! Last setpoint fired */
+    uint16_t watts;
+} kinetic_workout_rider;
+
+/*! Executor State */
+typedef struct kinetic_workout_executor
+{
+    kinetic_workout_rider *riders;
+    uint32_t riderCount;
+    uint32_t armed;
+    /*! Next tick to process (ms) */
+    uint64_t tick;
+    /*! Heads of the slot lists, and of the timers being fired (last) */
+    uint32_t slots[KINETIC_WORKOUT_SLOTS + 1];
+} kinetic_workout_executor;
+
+/*! Receives the setpoints that fire */
+typedef void (*kinetic_workout_handler)(void *context, uint32_t rider, uint16_t watts, const smart_control_set_mode_erg_data *command);
+
+
+/*!
+ Compiles a workout for a rider.
+
+ @param steps Steps
+ @param stepCount Number of steps
+ @param ftp Rider's FTP (Watts)
+ @param updateRate Setpoints per second during ramps (the trainer's update rate)
+ @param setpoints Output
+ @param capacity Size of setpoints
+ @param duration Output: length of the workout (ms), may be NULL
+
+ @return Number of setpoints, 0 if the workout is invalid or does not fit
+ */
+size_t kinetic_workout_compile(const kinetic_workout_step *steps, size_t stepCount, double ftp, double updateRate,
+                               kinetic_workout_setpoint *setpoints, size_t capacity, uint32_t *duration);
+
+/*!
+ Initializes an executor.
+
+ @param executor Executor
+ @param riders Rider storage (riderCount)
+ @param riderCount Number of riders
+ @param now Current time (ms, any monotonic clock)
+ */
+void kinetic_workout_executor_init(kinetic_workout_executor *executor, kinetic_workout_rider *riders, uint32_t riderCount, uint64_t now);
+
+/*!
+ Starts a workout for a rider (replaces the one running).
+
+ @param executor Executor
+ @param rider Rider index
+ @param schedule Compiled setpoints (must outlive the workout)
+ @param count Number of setpoints
+ @param startTime Time (ms) of the start of the workout
+ */
+void kinetic_workout_executor_start(kinetic_workout_executor *executor, uint32_t rider, const kinetic_workout_setpoint *schedule, uint32_t count, uint64_t startTime);
+
+/*!
+ Stops the workout of a rider.
+ */
+void kinetic_workout_executor_stop(kinetic_workout_executor *executor, uint32_t rider);
+
+/*!
+ Fires the setpoints that are due.
+
+ @param executor Executor
+ @param now Current time (ms)
+ @param handler Receives each setpoint with its ERG command
+ @param context Passed to the handler
+
+ @return Number of setpoints fired
+ */
+size_t kinetic_workout_executor_advance(kinetic_workout_executor *executor, uint64_t now, kinetic_workout_handler handler, void *context);
+
+
+#endif /* Workout_h */
@@ -5,13 +5,11 @@
 //
 
 #include "inRide.h"
+#include "inRideBatch.h"
+#include "Instrumentation.h"
+#include "Tracing.h"
 
 #define SensorHz                32768
-#define SpindownMin             1.5
-#define SpindownMinPro          4.7
-#define SpindownMax             2.0
-#define SpindownMaxPro          6.5
-#define SpindownDefault         ((SpindownMin + SpindownMax) * 0.5)
 
 bool inride_has_pro_flywheel(double spindown)
 {
@@ -101,6 +99,8 @@ inride_calibration_result result_for_spindown(double time)
 
 inride_config_data inride_process_config_data(uint8_t data[20])
 {
+    KINETIC_INSTRUMENT_DECODE_BEGIN(decodeStart);
+    KINETIC_TRACE_BEGIN(traceStart);
     inride_config_data configData;
     configData.calibrationReady = (uint16_t)data[0];
     configData.calibrationReady |= ((uint16_t)data[1] << 8);
@@ -120,12 +120,23 @@ inride_config_data inride_process_config_data(uint8_t data[20])
     configData.updateRateCalibration = (uint16_t)data[14];
     configData.updateRateCalibration |= ((uint16_t)data[15] << 8);
     configData.proFlywheel = inride_has_pro_flywheel(configData.currentSpindownTime);
+    KINETIC_INSTRUMENT_COUNT(KINETIC_COUNTER_FRAMES_DECODED);
+    KINETIC_INSTRUMENT_DECODE_END(decodeStart);
+    KINETIC_TRACE_END(traceStart, "inride_config_decode");
     return configData;
 }
 
-inride_power_data inride_process_power_data(uint8_t data[20])
+// Obfuscation permutations, selected by the top 2 bits of the first byte
+static const uint8_t indices[4][19] = {
+    {14,15,12,16,11,5,17,3,2,1,19,13,6,4,8,9,10,18,7},
+    {12,14,8,11,16,4,7,13,18,1,3,19,6,15,9,5,10,17,2},
+    {11,5,1,9,4,18,7,15,6,2,10,12,16,3,14,13,19,17,8},
+    {13,5,18,1,3,12,15,10,14,19,16,8,6,11,2,9,4,17,7}
+};
+
+inride_raw_power_data inride_decode_power_data(uint8_t data[20])
 {
-    inride_power_data powerData;
+    inride_raw_power_data raw;
     
     // deobfuscate the power data
     uint8_t i = 0;
@@ -138,12 +149,6 @@ inride_power_data inride_process_power_data(uint8_t data[20])
     xorIdx1 %= 4;
     uint8_t xorIdx2 = xorIdx1 + 1;
     xorIdx2 %= 4;
-    static uint8_t indices[4][19] = {
-        {14,15,12,16,11,5,17,3,2,1,19,13,6,4,8,9,10,18,7},
-        {12,14,8,11,16,4,7,13,18,1,3,19,6,15,9,5,10,17,2},
-        {11,5,1,9,4,18,7,15,6,2,10,12,16,3,14,13,19,17,8},
-        {13,5,18,1,3,12,15,10,14,19,16,8,6,11,2,9,4,17,7}
-    };
     for (i = 1; i < 20; ++i) {
         deob[i] = deob[i] ^ (indices[xorIdx1][i - 1] + indices[xorIdx2][i - 1]);
     }
@@ -153,71 +158,139 @@ inride_power_data inride_process_power_data(uint8_t data[20])
         powerBytes[i + 1] = deob[indices[posRotate][i]];
     }
     
-    powerData.state = powerBytes[0] & 0x30;
-    powerData.commandResult = powerBytes[0] & 0x0F;
+    raw.status = powerBytes[0] & 0x3F;
     
     i = 1;
-    uint32_t interval = ((uint32_t)powerBytes[i++]);
-    interval |= ((uint32_t)powerBytes[i++]) << 8;
-    interval |= ((uint32_t)powerBytes[i++]) << 16;
+    raw.interval = ((uint32_t)powerBytes[i++]);
+    raw.interval |= ((uint32_t)powerBytes[i++]) << 8;
+    raw.interval |= ((uint32_t)powerBytes[i++]) << 16;
     
-    uint32_t ticks = ((uint32_t)powerBytes[i++]);
-    ticks |= ((uint32_t)powerBytes[i++]) << 8;
-    ticks |= ((uint32_t)powerBytes[i++]) << 16;
-    ticks |= ((uint32_t)powerBytes[i++]) << 24;
+    raw.ticks = ((uint32_t)powerBytes[i++]);
+    raw.ticks |= ((uint32_t)powerBytes[i++]) << 8;
+    raw.ticks |= ((uint32_t)powerBytes[i++]) << 16;
+    raw.ticks |= ((uint32_t)powerBytes[i++]) << 24;
     
-    uint8_t revs = powerBytes[i++];
+    raw.revs = powerBytes[i++];
     
-    uint32_t ticksPrevious = ((uint32_t)powerBytes[i++]);
-    ticksPrevious |= ((uint32_t)powerBytes[i++]) << 8;
-    ticksPrevious |= ((uint32_t)powerBytes[i++]) << 16;
-    ticksPrevious |= ((uint32_t)powerBytes[i++]) << 24;
+    raw.ticksPrevious = ((uint32_t)powerBytes[i++]);
+    raw.ticksPrevious |= ((uint32_t)powerBytes[i++]) << 8;
+    raw.ticksPrevious |= ((uint32_t)powerBytes[i++]) << 16;
+    raw.ticksPrevious |= ((uint32_t)powerBytes[i++]) << 24;
     
-    uint8_t revsPrevious = powerBytes[i++];
+    raw.revsPrevious = powerBytes[i++];
     
-    uint16_t cadenceRaw = ((uint16_t)powerBytes[i++]);
-    cadenceRaw |= ((uint16_t)powerBytes[i++]) << 8;
-    powerData.cadenceRPM = cadenceRaw == 0 ? 0 : (0.8652 * ((double)cadenceRaw) + 5.2617);
+    raw.cadenceRaw = ((uint16_t)powerBytes[i++]);
+    raw.cadenceRaw |= ((uint16_t)powerBytes[i++]) << 8;
     
-    uint32_t spindownTicks = ((uint32_t)powerBytes[i++]);
-    spindownTicks |= ((uint32_t)powerBytes[i++]) << 8;
-    spindownTicks |= ((uint32_t)powerBytes[i++]) << 16;
-    spindownTicks |= ((uint32_t)powerBytes[i++]) << 24;
+    raw.spindownTicks = ((uint32_t)powerBytes[i++]);
+    raw.spindownTicks |= ((uint32_t)powerBytes[i++]) << 8;
+    raw.spindownTicks |= ((uint32_t)powerBytes[i++]) << 16;
+    raw.spindownTicks |= ((uint32_t)powerBytes[i++]) << 24;
     
-    powerData.lastSpindownResultTime = inride_ticks_to_seconds(spindownTicks);
-    powerData.speedKPH = inride_speed_for_ticks(ticks, revs);
+    return raw;
+}
+
+void inride_encode_power_data(const inride_raw_power_data *raw, uint8_t posRotate, uint8_t data[20])
+{
+    uint8_t i = 0;
+    uint8_t powerBytes[20];
+    powerBytes[0] = raw->status & 0x3F;
     
-    powerData.rollerRPM = 0.0;
-    if (ticks > 0) {
-        double seconds = inride_ticks_to_seconds(ticks);
-        double rollerRPS = revs / seconds;
-        powerData.rollerRPM = rollerRPS * 60;
-    }
+    i = 1;
+    powerBytes[i++] = raw->interval;
+    powerBytes[i++] = raw->interval >> 8;
+    powerBytes[i++] = raw->interval >> 16;
+    
+    powerBytes[i++] = raw->ticks;
+    powerBytes[i++] = raw->ticks >> 8;
+    powerBytes[i++] = raw->ticks >> 16;
+    powerBytes[i++] = raw->ticks >> 24;
+    
+    powerBytes[i++] = raw->revs;
+    
+    powerBytes[i++] = raw->ticksPrevious;
+    powerBytes[i++] = raw->ticksPrevious >> 8;
+    powerBytes[i++] = raw->ticksPrevious >> 16;
+    powerBytes[i++] = raw->ticksPrevious >> 24;
+    
+    powerBytes[i++] = raw->revsPrevious;
+    
+    powerBytes[i++] = raw->cadenceRaw;
+    powerBytes[i++] = raw->cadenceRaw >> 8;
     
-    double speedKPHPrev = inride_speed_for_ticks(ticksPrevious, revsPrevious);
-    powerData.proFlywheel = false;
+    powerBytes[i++] = raw->spindownTicks;
+    powerBytes[i++] = raw->spindownTicks >> 8;
+    powerBytes[i++] = raw->spindownTicks >> 16;
+    powerBytes[i++] = raw->spindownTicks >> 24;
     
-    powerData.spindownTime = SpindownDefault;
-    if (powerData.lastSpindownResultTime >= SpindownMin && powerData.lastSpindownResultTime <= SpindownMax) {
-        powerData.spindownTime = powerData.lastSpindownResultTime;
-    } else if (powerData.lastSpindownResultTime >= SpindownMinPro && powerData.lastSpindownResultTime <= SpindownMaxPro) {
-        powerData.spindownTime = powerData.lastSpindownResultTime;
-        powerData.proFlywheel = true;
+    // inverse of the permutation and XOR in inride_decode_power_data
+    posRotate &= 0x03;
+    uint8_t xorIdx1 = (posRotate + 1) % 4;
+    uint8_t xorIdx2 = (xorIdx1 + 1) % 4;
+    data[0] = powerBytes[0] | (posRotate << 6);
+    for (i = 0; i < 19; ++i) {
+        data[indices[posRotate][i]] = powerBytes[i + 1];
+    }
+    for (i = 1; i < 20; ++i) {
+        data[i] ^= (indices[xorIdx1][i - 1] + indices[xorIdx2][i - 1]);
     }
+}
+
+double inride_spindown_time_for_result(double lastSpindownResultTime, bool *proFlywheel)
+{
+    *proFlywheel = false;
+    if (lastSpindownResultTime >= SpindownMin && lastSpindownResultTime <= SpindownMax) {
+        return lastSpindownResultTime;
+    } else if (lastSpindownResultTime >= SpindownMinPro && lastSpindownResultTime <= SpindownMaxPro) {
+        *proFlywheel = true;
+        return lastSpindownResultTime;
+    }
+    return SpindownDefault;
+}
+
+double inride_roller_resistance(double spindownTime, bool proFlywheel)
+{
+    if (!proFlywheel) {
+        return 1 - ((spindownTime - SpindownMin) / (SpindownMax - SpindownMin));
+    }
+    return 1 - ((spindownTime - SpindownMinPro) / (SpindownMaxPro - SpindownMinPro));
+}
+
+int inride_power_for_speed(double speedKPH, double spindownTime)
+{
+    return power_for_speed(speedKPH, spindownTime, 0, 0);
+}
+
+inride_power_data inride_process_raw_power_data(const inride_raw_power_data *raw)
+{
+    inride_power_data powerData;
     
-    if (!powerData.proFlywheel) {
-        powerData.rollerResistance = 1 - ((powerData.spindownTime - SpindownMin) / (SpindownMax - SpindownMin));
-    } else {
-        powerData.rollerResistance = 1 - ((powerData.spindownTime - SpindownMinPro) / (SpindownMaxPro - SpindownMinPro));
+    powerData.state = raw->status & 0x30;
+    powerData.commandResult = raw->status & 0x0F;
+    powerData.cadenceRPM = raw->cadenceRaw == 0 ? 0 : (0.8652 * ((double)raw->cadenceRaw) + 5.2617);
+    
+    powerData.lastSpindownResultTime = inride_ticks_to_seconds(raw->spindownTicks);
+    powerData.speedKPH = inride_speed_for_ticks(raw->ticks, raw->revs);
+    
+    powerData.rollerRPM = 0.0;
+    if (raw->ticks > 0) {
+        double seconds = inride_ticks_to_seconds(raw->ticks);
+        double rollerRPS = raw->revs / seconds;
+        powerData.rollerRPM = rollerRPS * 60;
     }
     
-    alpha_coast ac = alpha(interval, ticks, revs, powerData.speedKPH, ticksPrevious, revsPrevious, speedKPHPrev, powerData.proFlywheel);
+    double speedKPHPrev = inride_speed_for_ticks(raw->ticksPrevious, raw->revsPrevious);
+    
+    powerData.spindownTime = inride_spindown_time_for_result(powerData.lastSpindownResultTime, &powerData.proFlywheel);
+    powerData.rollerResistance = inride_roller_resistance(powerData.spindownTime, powerData.proFlywheel);
+    
+    alpha_coast ac = alpha(raw->interval, raw->ticks, raw->revs, powerData.speedKPH, raw->ticksPrevious, raw->revsPrevious, speedKPHPrev, powerData.proFlywheel);
     powerData.coasting = ac.coasting;
     
     if (powerData.coasting) {
         powerData.power = 0;
     } else {
-        powerData.power = power_for_speed(powerData.speedKPH, powerData.spindownTime, ac.alpha, revs);
+        powerData.power = power_for_speed(powerData.speedKPH, powerData.spindownTime, ac.alpha, raw->revs);
     }
     
     powerData.calibrationResult = result_for_spindown(powerData.lastSpindownResultTime);
@@ -225,7 +298,98 @@ inride_power_data inride_process_power_data(uint8_t data[20])
     return powerData;
 }
 
-uint16_t command_key(uint8_t systemId[6])
+inride_power_data inride_process_power_data(uint8_t data[20])
+{
+    KINETIC_INSTRUMENT_DECODE_BEGIN(decodeStart);
+    KINETIC_TRACE_BEGIN(traceStart);
+    inride_raw_power_data raw = inride_decode_power_data(data);
+    KINETIC_TRACE_END(traceStart, "inride_decode_power_data");
+    KINETIC_TRACE_BEGIN(modelStart);
+    inride_power_data powerData = inride_process_raw_power_data(&raw);
+    KINETIC_TRACE_END(modelStart, "inride_power_model");
+    KINETIC_INSTRUMENT_COUNT(KINETIC_COUNTER_FRAMES_DECODED);
+    if (powerData.coasting) {
+        KINETIC_INSTRUMENT_COUNT(KINETIC_COUNTER_COASTING);
+    }
+    if (powerData.commandResult != INRIDE_COM_RESULT_NONE) {
+        KINETIC_INSTRUMENT_COMMAND_RESULT(powerData.commandResult);
+    }
+    KINETIC_INSTRUMENT_DECODE_END(decodeStart);
+    return powerData;
+}
+
+// Applies one spindown time to a run of samples, through the vectorized model in blocks.
+static void recalibrate_run(const inride_raw_power_data *raw, size_t count, double spindownTime, bool proFlywheel, inride_power_data *data)
+{
+    enum { BlockSize = 256 };
+    uint32_t ticks[BlockSize], ticksPrevious[BlockSize];
+    uint8_t revs[BlockSize], revsPrevious[BlockSize], coasting[BlockSize];
+    double spindown[BlockSize];
+    int32_t power[BlockSize];
+    inride_batch_input input = { ticks, revs, ticksPrevious, revsPrevious, spindown };
+    inride_batch_output output = { NULL, NULL, coasting, power };
+    
+    double rollerResistance = inride_roller_resistance(spindownTime, proFlywheel);
+    for (size_t i = 0; i < BlockSize; ++i) {
+        spindown[i] = spindownTime;
+    }
+    for (size_t start = 0; start < count; start += BlockSize) {
+        size_t block = count - start < BlockSize ? count - start : BlockSize;
+        for (size_t i = 0; i < block; ++i) {
+            ticks[i] = raw[start + i].ticks;
+            revs[i] = raw[start + i].revs;
+            ticksPrevious[i] = raw[start + i].ticksPrevious;
+            revsPrevious[i] = raw[start + i].revsPrevious;
+        }
+        inride_power_batch(&input, block, &output);
+        for (size_t i = 0; i < block; ++i) {
+            inride_power_data *sample = &data[start + i];
+            sample->spindownTime = spindownTime;
+            sample->proFlywheel = proFlywheel;
+            sample->rollerResistance = rollerResistance;
+            sample->coasting = coasting[i];
+            sample->power = power[i];
+        }
+    }
+}
+
+void inride_recalibrate(const inride_raw_power_data *raw, size_t count, double spindownTime, inride_power_data *data)
+{
+    bool proFlywheel;
+    double applied = inride_spindown_time_for_result(spindownTime, &proFlywheel);
+    recalibrate_run(raw, count, applied, proFlywheel, data);
+}
+
+size_t inride_recalibrate_segments(const inride_raw_power_data *raw, size_t count, const inride_calibration_change *changes, size_t changeCount, inride_power_data *data)
+{
+    size_t recomputed = 0;
+    for (size_t c = 0; c < changeCount; ++c) {
+        size_t start = changes[c].index;
+        size_t end = c + 1 < changeCount ? changes[c + 1].index : count;
+        end = end > count ? count : end;
+        
+        bool proFlywheel;
+        double applied = inride_spindown_time_for_result(changes[c].spindownTime, &proFlywheel);
+        
+        // Only the runs that were computed with a different spindown are recomputed.
+        size_t i = start;
+        while (i < end) {
+            if (data[i].spindownTime == applied && data[i].proFlywheel == proFlywheel) {
+                i++;
+                continue;
+            }
+            size_t runStart = i;
+            while (i < end && (data[i].spindownTime != applied || data[i].proFlywheel != proFlywheel)) {
+                i++;
+            }
+            recalibrate_run(&raw[runStart], i - runStart, applied, proFlywheel, &data[runStart]);
+            recomputed += i - runStart;
+        }
+    }
+    return recomputed;
+}
+
+uint16_t inride_command_key(uint8_t systemId[6])
 {
     uint8_t sysidx1 = systemId[3] % 6;
     uint8_t sysidx2 = systemId[5] % 6;
@@ -235,7 +399,7 @@ uint16_t command_key(uint8_t systemId[6])
 inride_config_sensor_command inride_create_config_sensor_command_data(inride_update_rate updateRate, uint8_t systemId[6])
 {
     inride_config_sensor_command command;
-    command.commandKey = command_key(systemId);
+    command.commandKey = inride_command_key(systemId);
     command.command = 0x01;
     command.calReady = 602;
     command.calStart = 655;
@@ -249,7 +413,7 @@ inride_config_sensor_command inride_create_config_sensor_command_data(inride_upd
 inride_start_calibration_command inride_create_start_calibration_command_data(uint8_t systemId[6])
 {
     inride_start_calibration_command command;
-    command.commandKey = command_key(systemId);
+    command.commandKey = inride_command_key(systemId);
     command.command = 0x03;
     return command;
 }
@@ -257,7 +421,7 @@ inride_start_calibration_command inride_create_start_calibration_command_data(ui
 inride_stop_calibration_command inride_create_stop_calibration_command_data(uint8_t systemId[6])
 {
     inride_stop_calibration_command command;
-    command.commandKey = command_key(systemId);
+    command.commandKey = inride_command_key(systemId);
     command.command = 0x04;
     return command;
 }
@@ -265,7 +429,7 @@ inride_stop_calibration_command inride_create_stop_calibration_command_data(uint
 inride_set_spindown_time_command inride_create_set_spindown_time_command_data(double seconds, uint8_t systemId[6])
 {
     inride_set_spindown_time_command command;
-    command.commandKey = command_key(systemId);
+    command.commandKey = inride_command_key(systemId);
     command.command = 0x05;
     command.spindown = (uint32_t)(seconds * 32768);
     return command;
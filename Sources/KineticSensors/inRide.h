@@ -8,6 +8,7 @@
 #define inRide_h
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
@@ -17,6 +18,13 @@ static const char INRIDE_SERVICE_POWER_UUID[]   = "E9410101-B434-446B-B5CC-36592
 static const char INRIDE_SERVICE_CONFIG_UUID[]  = "E9410104-B434-446B-B5CC-36592FC4C724";
 static const char INRIDE_SERVICE_CONTROL_UUID[] = "E9410102-B434-446B-B5CC-36592FC4C724";
 
+// Spindown time windows (seconds) of a valid calibration with the normal and pro flywheel
+#define SpindownMin             1.5
+#define SpindownMinPro          4.7
+#define SpindownMax             2.0
+#define SpindownMaxPro          6.5
+#define SpindownDefault         ((SpindownMin + SpindownMax) * 0.5)
+
 // The inRide also exposes Characteristics on the Device Information Service (0x180A)
 // - FW Rev, HW Rev, Manufacturer Name, and System Id (!)
 // - You will need the System ID value to de-obfuscate the power data and send the sensor commands (see below)
@@ -98,6 +106,28 @@ typedef struct inride_power_data
 } inride_power_data;
 
 
+// The raw counters of a power update (deobfuscated, before any calculations).
+// Store these to recompute a ride later (new spindown, power model changes).
+typedef struct inride_raw_power_data
+{
+    uint8_t status;             // state (0x30) | commandResult (0x0F)
+    uint8_t revs;               // roller revolutions in the last measurement
+    uint8_t revsPrevious;       // roller revolutions in the measurement before
+    uint16_t cadenceRaw;
+    uint32_t interval;          // 32768 Hz ticks
+    uint32_t ticks;             // 32768 Hz ticks of the last measurement
+    uint32_t ticksPrevious;     // 32768 Hz ticks of the measurement before
+    uint32_t spindownTicks;     // 32768 Hz ticks of the last spindown result
+} inride_raw_power_data;
+
+// A calibration (spindown time) that applies from the sample at index onwards.
+typedef struct inride_calibration_change
+{
+    size_t index;
+    double spindownTime;
+} inride_calibration_change;
+
+
 typedef struct inride_start_calibration_command
 {
     uint16_t commandKey;
@@ -138,6 +168,36 @@ typedef struct inride_config_sensor_command
 inride_config_data inride_process_config_data(uint8_t data[20]);
 inride_power_data inride_process_power_data(uint8_t data[20]);
 
+// inride_process_power_data split in two steps: deobfuscate the counters, then calculate speed, cadence and power.
+inride_raw_power_data inride_decode_power_data(uint8_t data[20]);
+inride_power_data inride_process_raw_power_data(const inride_raw_power_data *raw);
+
+// Inverse of inride_decode_power_data: obfuscates the counters into a power frame (posRotate 0..3 selects the permutation).
+void inride_encode_power_data(const inride_raw_power_data *raw, uint8_t posRotate, uint8_t data[20]);
+
+// Spindown time (and pro flywheel) the power calculation applies for a spindown result (SpindownDefault if the result is out of range).
+double inride_spindown_time_for_result(double lastSpindownResultTime, bool *proFlywheel);
+double inride_roller_resistance(double spindownTime, bool proFlywheel);
+
+// Power (Watts) of the power model at a roller speed, for a spindown time (see inride_spindown_time_for_result).
+int inride_power_for_speed(double speedKPH, double spindownTime);
+
+
+// Retroactive calibration: recompute a stored ride with a different spindown time.
+// - raw and data are parallel arrays (data is what inride_process_raw_power_data returned for raw, or an earlier recalibration)
+// - spindownTime, proFlywheel, rollerResistance, coasting and power are updated, everything else is left as is
+// - the spindown time is applied like a spindown result (out of range values fall back to SpindownDefault)
+
+// Applies spindownTime to the whole ride.
+void inride_recalibrate(const inride_raw_power_data *raw, size_t count, double spindownTime, inride_power_data *data);
+
+// Applies each change from its index up to the next change (changes sorted by index, samples before the first change are
+// left alone). Only the samples that were computed with a different spindown time are recomputed. Returns that count.
+size_t inride_recalibrate_segments(const inride_raw_power_data *raw, size_t count, const inride_calibration_change *changes, size_t changeCount, inride_power_data *data);
+
+
+// The key the sensor expects at the start of every control point command
+uint16_t inride_command_key(uint8_t systemId[6]);
 
 // The command structs that are created are packed...
 // Send the bytes to the Control Point (INRIDE_SERVICE_CONTROL_UUID) to configure the sensor and start / stop the calibration process
@@ -0,0 +1,124 @@
+//
+//  inRideBatch.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#include "inRideBatch.h"
+
+#include <string.h>
+
+#define Lanes                   4
+
+typedef double v4d __attribute__((vector_size(Lanes * sizeof(double))));
+typedef int64_t v4l __attribute__((vector_size(Lanes * sizeof(int64_t))));
+
+// Macros (and vectors passed by pointer): 32 byte vectors are not passed in registers without AVX.
+#define splat(value)            ((v4d){ (value), (value), (value), (value) })
+#define keep(mask, value)       ((v4d)((v4l)(value) & (mask)))                          // mask ? value : 0
+#define blend(mask, a, b)       ((v4d)(((v4l)(a) & (mask)) | ((v4l)(b) & ~(mask))))     // mask ? a : b
+
+typedef struct lanes_in
+{
+    v4d ticks;
+    v4d revs;
+    v4d ticksPrevious;
+    v4d revsPrevious;
+    v4d spindown;
+} lanes_in;
+
+typedef struct lanes_out
+{
+    v4d speed;
+    v4d alpha;
+    v4l coasting;
+    v4d power;
+} lanes_out;
+
+// Same math (and operation order) as inride_speed_for_ticks, alpha and power_for_speed in inRide.c.
+static inline __attribute__((always_inline)) void power_lanes(const lanes_in *in, lanes_out *out)
+{
+    const v4d zero = splat(0.0);
+    const v4d ticks = in->ticks, revs = in->revs, ticksPrevious = in->ticksPrevious, revsPrevious = in->revsPrevious, spindown = in->spindown;
+
+    v4d speed = keep((v4l)(ticks != zero) & (v4l)(revs > zero), (splat(20012.256849) * revs) / ticks);
+    v4d speedPrevious = keep((v4l)(ticksPrevious != zero) & (v4l)(revsPrevious > zero), (splat(20012.256849) * revsPrevious) / ticksPrevious);
+
+    v4l proFlywheel = (v4l)(spindown >= splat(SpindownMinPro)) & (v4l)(spindown <= splat(SpindownMaxPro));
+
+    v4d dtpr = (ticks / revs) - (ticksPrevious / revsPrevious);
+    v4l hasAlpha = (v4l)(ticks > zero) & (v4l)(ticksPrevious > zero) & (v4l)(dtpr > zero);
+    v4d alpha = keep(hasAlpha, (speedPrevious - speed) * dtpr);
+    v4d threshold = blend(proFlywheel, splat(20.0), splat(200.0));
+    v4l coasting = hasAlpha & (v4l)(alpha > threshold);
+
+    v4d mph = speed * splat(0.621371);
+    v4d rawPower = (splat(5.244820) * mph) + (splat(0.019168) * (mph * mph * mph));
+    v4d spindownMS = spindown * splat(1000.0);
+    v4d dragOffsetSlope = blend(proFlywheel, splat(-0.021), splat(-0.1425));
+    v4d dragOffsetPowerSlope = blend(proFlywheel, splat(2.62), splat(4.55));
+    v4d yIntercept = blend(proFlywheel, splat(104.97), splat(236.20));
+    v4d dragOffset = (dragOffsetPowerSlope * spindownMS * rawPower * splat(0.00001)) + (dragOffsetSlope * spindownMS) + yIntercept;
+    v4d power = rawPower + keep((v4l)(spindown > zero) & (v4l)(rawPower > zero), dragOffset);
+    power = keep((v4l)(power > zero) & ~coasting, power);
+
+    out->speed = speed;
+    out->alpha = alpha;
+    out->coasting = coasting;
+    out->power = power;
+}
+
+static inline __attribute__((always_inline)) void store_lanes(const inride_batch_output *output, size_t offset, size_t lanes, const lanes_out *out)
+{
+    v4l watts = __builtin_convertvector(out->power, v4l);
+    for (size_t lane = 0; lane < lanes; ++lane) {
+        output->power[offset + lane] = (int32_t)watts[lane];
+    }
+    if (output->speedKPH != NULL) {
+        for (size_t lane = 0; lane < lanes; ++lane) {
+            output->speedKPH[offset + lane] = out->speed[lane];
+        }
+    }
+    if (output->alpha != NULL) {
+        for (size_t lane = 0; lane < lanes; ++lane) {
+            output->alpha[offset + lane] = out->alpha[lane];
+        }
+    }
+    if (output->coasting != NULL) {
+        for (size_t lane = 0; lane < lanes; ++lane) {
+            output->coasting[offset + lane] = out->coasting[lane] != 0;
+        }
+    }
+}
+
+void inride_power_batch(const inride_batch_input *input, size_t count, const inride_batch_output *output)
+{
+    size_t i = 0;
+    for (; i + Lanes <= count; i += Lanes) {
+        lanes_in in;
+        in.ticks = (v4d){ input->ticks[i], input->ticks[i + 1], input->ticks[i + 2], input->ticks[i + 3] };
+        in.revs = (v4d){ input->revs[i], input->revs[i + 1], input->revs[i + 2], input->revs[i + 3] };
+        in.ticksPrevious = (v4d){ input->ticksPrevious[i], input->ticksPrevious[i + 1], input->ticksPrevious[i + 2], input->ticksPrevious[i + 3] };
+        in.revsPrevious = (v4d){ input->revsPrevious[i], input->revsPrevious[i + 1], input->revsPrevious[i + 2], input->revsPrevious[i + 3] };
+        memcpy(&in.spindown, &input->spindownTime[i], sizeof(in.spindown));
+
+        lanes_out out;
+        power_lanes(&in, &out);
+        store_lanes(output, i, Lanes, &out);
+    }
+
+    // Tail: pad with stopped frames (ticks = 0), which take the all-zero path in every lane.
+    if (i < count) {
+        lanes_in in = { splat(0.0), splat(0.0), splat(0.0), splat(0.0), splat(0.0) };
+        for (size_t lane = 0; i + lane < count; ++lane) {
+            in.ticks[lane] = input->ticks[i + lane];
+            in.revs[lane] = input->revs[i + lane];
+            in.ticksPrevious[lane] = input->ticksPrevious[i + lane];
+            in.revsPrevious[lane] = input->revsPrevious[i + lane];
+            in.spindown[lane] = input->spindownTime[i + lane];
+        }
+        lanes_out out;
+        power_lanes(&in, &out);
+        store_lanes(output, i, count - i, &out);
+    }
+}
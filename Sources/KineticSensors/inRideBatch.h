@@ -0,0 +1,53 @@
+//
+//  inRideBatch.h
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+
+#ifndef inRideBatch_h
+#define inRideBatch_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "inRide.h"
+
+// Array in / array out version of the inRide speed, coasting and power model (see inride_process_raw_power_data).
+// The frames are processed 4 at a time with vector extensions (SSE / AVX2 / NEON depending on the target) and
+// the branches of the scalar model (pro flywheel, coasting thresholds, clamping) are replaced by lane masks.
+// Results match the scalar model to the watt (bit exact unless the compiler contracts the two differently).
+
+
+/*! Input columns of a batch (count values each) */
+typedef struct inride_batch_input
+{
+    const uint32_t *ticks;
+    const uint8_t *revs;
+    const uint32_t *ticksPrevious;
+    const uint8_t *revsPrevious;
+    /*! Spindown time applied to each frame (see inride_spindown_time_for_result) */
+    const double *spindownTime;
+} inride_batch_input;
+
+/*! Output columns of a batch (any column may be NULL, power is required) */
+typedef struct inride_batch_output
+{
+    double *speedKPH;
+    double *alpha;
+    uint8_t *coasting;
+    int32_t *power;
+} inride_batch_output;
+
+
+/*!
+ Computes speed, alpha, coasting and power for a batch of frames.
+
+ @param input Input columns
+ @param count Number of frames
+ @param output Output columns
+ */
+void inride_power_batch(const inride_batch_input *input, size_t count, const inride_batch_output *output);
+
+
+#endif /* inRideBatch_h */
@@ -0,0 +1,344 @@
+//
+//  arrow.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+//  Arrow IPC stream regression tests. The stream is read back here with a small flatbuffers reader:
+//  - message framing (continuation, metadata size, 8 byte alignment, end of stream marker)
+//  - schema field names and types, with and without the mode dictionary, and the dictionary values
+//  - record batch lengths and every column value, found through the batch's buffer list
+//
+//  The streams (arrow-plain.arrow, arrow-dictionary.arrow) and the expected rows (arrow-expected.csv) are left in the
+//  working directory for arrow_read.py, which reads them again with pyarrow.
+//
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "ArrowWriter.h"
+
+#define ROWS            1000
+#define BATCH_SIZE      256
+#define START_TIME      1500000000.0
+#define FILE_MAX        (1 << 20)
+
+// Message.fbs / Schema.fbs
+#define HEADER_SCHEMA           1
+#define HEADER_DICTIONARY_BATCH 2
+#define HEADER_RECORD_BATCH     3
+#define TYPE_INT                2
+#define TYPE_FLOATING_POINT     3
+#define TYPE_UTF8               5
+#define TYPE_BOOL               6
+#define TYPE_TIMESTAMP          10
+
+typedef struct arrow_row
+{
+    int64_t timestamp;
+    uint16_t power;
+    float speedKPH;
+    float cadenceRPM;
+    bool coasting;
+    uint8_t mode;
+    uint16_t targetResistance;
+} arrow_row;
+
+static arrow_row expected[ROWS];
+
+static const char *columnNames[KINETIC_ARROW_COLUMNS] = {
+    "timestamp", "power", "speedKPH", "cadenceRPM", "coasting", "mode", "targetResistance"
+};
+static const uint8_t columnTypes[KINETIC_ARROW_COLUMNS] = {
+    TYPE_TIMESTAMP, TYPE_INT, TYPE_FLOATING_POINT, TYPE_FLOATING_POINT, TYPE_BOOL, TYPE_INT, TYPE_INT
+};
+static const char *modeNames[8] = {
+    "erg", "fluid", "brake", "simulation", "normal", "spindown_idle", "spindown_ready", "spindown_active"
+};
+
+
+// Writes the rows through the three add functions (inRide, Smart Control, sample record)
+static bool write_stream(const char *path, bool dictionary)
+{
+    static uint8_t storage[KINETIC_ARROW_STORAGE_SIZE(BATCH_SIZE)] __attribute__((aligned(8)));
+    static kinetic_arrow_writer writer;
+    if (!kinetic_arrow_writer_open(&writer, path, storage, BATCH_SIZE, dictionary)) {
+        return false;
+    }
+    bool ok = true;
+    for (int i = 0; i < ROWS; ++i) {
+        double timestamp = START_TIME + i * 0.25;
+        arrow_row *row = &expected[i];
+        memset(row, 0, sizeof(*row));
+        row->timestamp = llround(timestamp * 1e6);
+        if (i % 3 == 0) {
+            inride_power_data data;
+            memset(&data, 0, sizeof(data));
+            data.state = (inride_sensor_state)(((i / 3) % 4) << 4);
+            data.power = 50 + i % 400;
+            data.speedKPH = 20 + i * 0.013;
+            data.cadenceRPM = 70 + (i % 30) * 0.8652;
+            data.coasting = i % 4 == 0;
+            ok = ok && inride_arrow_writer_add(&writer, timestamp, &data);
+            row->power = (uint16_t)data.power;
+            row->speedKPH = (float)data.speedKPH;
+            row->cadenceRPM = (float)data.cadenceRPM;
+            row->coasting = data.coasting;
+            row->mode = (uint8_t)(KINETIC_ARROW_MODE_INRIDE_NORMAL + (i / 3) % 4);
+        } else if (i % 3 == 1) {
+            smart_control_power_data data = { (smart_control_mode)(i % 4), (uint16_t)(100 + i), 25 + (i % 100) * 0.1,
+                                              (uint8_t)(60 + i % 50), (uint16_t)(200 + i % 300) };
+            ok = ok && smart_control_arrow_writer_add(&writer, timestamp, &data);
+            row->power = data.power;
+            row->speedKPH = (float)data.speedKPH;
+            row->cadenceRPM = data.cadenceRPM;
+            row->mode = (uint8_t)data.mode;
+            row->targetResistance = data.targetResistance;
+        } else {
+            inride_power_data data;
+            memset(&data, 0, sizeof(data));
+            data.state = INRIDE_STATE_SPINDOWN_READY;
+            data.power = i;
+            data.speedKPH = 31.234;
+            data.cadenceRPM = 88.8;
+            data.coasting = i % 5 == 0;
+            kinetic_sample_record record = inride_sample_pack(&data, 250);
+            ok = ok && kinetic_arrow_writer_add_record(&writer, timestamp, &record);
+            row->power = record.power;
+            row->speedKPH = (float)(record.speed / 1000.0);
+            row->cadenceRPM = (float)(record.cadence / 10.0);
+            row->coasting = data.coasting;
+            row->mode = KINETIC_ARROW_MODE_INRIDE_SPINDOWN_READY;
+        }
+    }
+    return kinetic_arrow_writer_close(&writer) && ok;
+}
+
+static bool write_expected(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return false;
+    }
+    fprintf(file, "timestamp,power,speedKPH,cadenceRPM,coasting,mode,targetResistance\n");
+    for (int i = 0; i < ROWS; ++i) {
+        const arrow_row *row = &expected[i];
+        fprintf(file, "%lld,%u,%.9g,%.9g,%d,%u,%u\n", (long long)row->timestamp, row->power, row->speedKPH, row->cadenceRPM,
+                row->coasting, row->mode, row->targetResistance);
+    }
+    return fclose(file) == 0;
+}
+
+
+// Flatbuffers reading (little endian)
+
+static uint32_t get_u32(const uint8_t *data)
+{
+    return data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+static int64_t get_i64(const uint8_t *data)
+{
+    return (int64_t)(get_u32(data) | (uint64_t)get_u32(data + 4) << 32);
+}
+
+static uint16_t get_u16(const uint8_t *data)
+{
+    return (uint16_t)(data[0] | data[1] << 8);
+}
+
+// Field of a table, NULL if it is absent (default value)
+static const uint8_t *fb_field(const uint8_t *table, int id)
+{
+    const uint8_t *vtable = table - (int32_t)get_u32(table);
+    if (4 + 2 * id >= get_u16(vtable)) {
+        return NULL;
+    }
+    uint16_t offset = get_u16(vtable + 4 + 2 * id);
+    return offset != 0 ? table + offset : NULL;
+}
+
+static const uint8_t *fb_deref(const uint8_t *field)
+{
+    return field != NULL ? field + get_u32(field) : NULL;
+}
+
+static int64_t fb_scalar(const uint8_t *table, int id, int size)
+{
+    const uint8_t *field = fb_field(table, id);
+    if (field == NULL) {
+        return 0;
+    }
+    switch (size) {
+        case 1: return field[0];
+        case 2: return get_u16(field);
+        case 4: return get_u32(field);
+    }
+    return get_i64(field);
+}
+
+static bool fb_string_equals(const uint8_t *string, const char *expected)
+{
+    return string != NULL && get_u32(string) == strlen(expected) && memcmp(string + 4, expected, strlen(expected)) == 0;
+}
+
+
+static void check_schema(const uint8_t *schema, bool dictionary)
+{
+    const uint8_t *fields = fb_deref(fb_field(schema, 1));
+    CHECK(fields != NULL && get_u32(fields) == KINETIC_ARROW_COLUMNS);
+    if (fields == NULL || get_u32(fields) != KINETIC_ARROW_COLUMNS) {
+        return;
+    }
+    for (int i = 0; i < KINETIC_ARROW_COLUMNS; ++i) {
+        const uint8_t *field = fb_deref(fields + 4 + 4 * i);
+        CHECK(fb_string_equals(fb_deref(fb_field(field, 0)), columnNames[i]));
+        CHECK(fb_scalar(field, 1, 1) == 0);    // not nullable
+        bool encoded = dictionary && i == 5;
+        CHECK(fb_scalar(field, 2, 1) == (encoded ? TYPE_UTF8 : columnTypes[i]));
+        CHECK((fb_field(field, 4) != NULL) == encoded);
+        if (columnTypes[i] == TYPE_TIMESTAMP) {
+            const uint8_t *type = fb_deref(fb_field(field, 3));
+            CHECK(fb_scalar(type, 0, 2) == 2);  // microseconds
+            CHECK(fb_string_equals(fb_deref(fb_field(type, 1)), "UTC"));
+        }
+    }
+}
+
+static void check_dictionary(const uint8_t *dictionary, const uint8_t *body, int64_t bodyLength)
+{
+    const uint8_t *batch = fb_deref(fb_field(dictionary, 1));
+    CHECK(fb_scalar(batch, 0, 8) == 8);
+    const uint8_t *buffers = fb_deref(fb_field(batch, 2));
+    CHECK(get_u32(buffers) == 3);
+    int64_t offsetsAt = get_i64(buffers + 4 + 16), valuesAt = get_i64(buffers + 4 + 32);
+    CHECK(offsetsAt + 36 <= bodyLength && valuesAt <= bodyLength);
+    const uint8_t *offsets = body + offsetsAt;
+    for (int i = 0; i < 8; ++i) {
+        uint32_t start = get_u32(offsets + 4 * i), end = get_u32(offsets + 4 * (i + 1));
+        CHECK(end - start == strlen(modeNames[i]) && memcmp(body + valuesAt + start, modeNames[i], end - start) == 0);
+    }
+}
+
+// Checks the columns of a record batch against the expected rows from firstRow, returns the batch length
+static int64_t check_record_batch(const uint8_t *batch, const uint8_t *body, int64_t bodyLength, int64_t firstRow)
+{
+    int64_t rows = fb_scalar(batch, 0, 8);
+    CHECK(rows > 0 && firstRow + rows <= ROWS);
+    if (rows <= 0 || firstRow + rows > ROWS) {
+        return rows > 0 ? rows : 0;
+    }
+    const uint8_t *nodes = fb_deref(fb_field(batch, 1));
+    const uint8_t *buffers = fb_deref(fb_field(batch, 2));
+    CHECK(get_u32(nodes) == KINETIC_ARROW_COLUMNS && get_u32(buffers) == 2 * KINETIC_ARROW_COLUMNS);
+    for (int c = 0; c < KINETIC_ARROW_COLUMNS; ++c) {
+        CHECK(get_i64(nodes + 4 + 16 * c) == rows && get_i64(nodes + 4 + 16 * c + 8) == 0);
+        CHECK(get_i64(buffers + 4 + 32 * c + 8) == 0);  // no validity bitmap
+    }
+
+    size_t mismatches = 0;
+    const uint8_t *column[KINETIC_ARROW_COLUMNS];
+    for (int c = 0; c < KINETIC_ARROW_COLUMNS; ++c) {
+        int64_t offset = get_i64(buffers + 4 + 32 * c + 16), length = get_i64(buffers + 4 + 32 * c + 24);
+        CHECK(offset % 8 == 0 && offset + length <= bodyLength);
+        column[c] = body + offset;
+    }
+    for (int64_t r = 0; r < rows; ++r) {
+        const arrow_row *row = &expected[firstRow + r];
+        float speed, cadence;
+        memcpy(&speed, column[2] + 4 * r, 4);
+        memcpy(&cadence, column[3] + 4 * r, 4);
+        bool match = get_i64(column[0] + 8 * r) == row->timestamp &&
+                     get_u16(column[1] + 2 * r) == row->power &&
+                     speed == row->speedKPH && cadence == row->cadenceRPM &&
+                     ((column[4][r / 8] >> (r % 8)) & 1) == row->coasting &&
+                     column[5][r] == row->mode &&
+                     get_u16(column[6] + 2 * r) == row->targetResistance;
+        if (!match && mismatches++ < 5) {
+            fprintf(stderr, "row %lld does not match\n", (long long)(firstRow + r));
+        }
+    }
+    CHECK(mismatches == 0);
+    return rows;
+}
+
+static void check_stream(const char *path, bool dictionary)
+{
+    static uint8_t file[FILE_MAX];
+    FILE *stream = fopen(path, "rb");
+    CHECK(stream != NULL);
+    if (stream == NULL) {
+        return;
+    }
+    size_t size = fread(file, 1, sizeof(file), stream);
+    fclose(stream);
+    CHECK(size > 0 && size < sizeof(file));
+
+    size_t offset = 0;
+    int messages = 0, dictionaries = 0, batches = 0;
+    int64_t rows = 0;
+    bool ended = false;
+    while (offset + 8 <= size && !ended) {
+        CHECK(get_u32(file + offset) == 0xFFFFFFFF);
+        uint32_t metadataSize = get_u32(file + offset + 4);
+        if (metadataSize == 0) {
+            ended = true;
+            offset += 8;
+            break;
+        }
+        CHECK((8 + metadataSize) % 8 == 0);
+        const uint8_t *metadata = file + offset + 8;
+        const uint8_t *message = fb_deref(metadata);
+        int64_t bodyLength = fb_scalar(message, 3, 8);
+        const uint8_t *body = metadata + metadataSize;
+        CHECK(bodyLength % 8 == 0 && offset + 8 + metadataSize + bodyLength <= size);
+        CHECK(fb_scalar(message, 0, 2) == 4);  // V5
+        const uint8_t *header = fb_deref(fb_field(message, 2));
+
+        switch (fb_scalar(message, 1, 1)) {
+            case HEADER_SCHEMA:
+                CHECK(messages == 0);
+                check_schema(header, dictionary);
+                break;
+            case HEADER_DICTIONARY_BATCH:
+                CHECK(messages == 1);
+                dictionaries++;
+                check_dictionary(header, body, bodyLength);
+                break;
+            case HEADER_RECORD_BATCH:
+                batches++;
+                rows += check_record_batch(header, body, bodyLength, rows);
+                break;
+            default:
+                CHECK(!"unknown message");
+                break;
+        }
+        messages++;
+        offset += 8 + metadataSize + (size_t)bodyLength;
+    }
+    CHECK(ended && offset == size);
+    CHECK(dictionaries == (dictionary ? 1 : 0));
+    CHECK(batches == (ROWS + BATCH_SIZE - 1) / BATCH_SIZE);
+    CHECK(rows == ROWS);
+}
+
+static void test_rejects_unaligned_storage(void)
+{
+    static uint64_t storage[KINETIC_ARROW_STORAGE_SIZE(4) / 8 + 1];
+    kinetic_arrow_writer writer;
+    CHECK(!kinetic_arrow_writer_open(&writer, "arrow-unaligned.arrow", (uint8_t *)storage + 1, 4, false));
+    CHECK(!kinetic_arrow_writer_open(&writer, "arrow-unaligned.arrow", storage, 0, false));
+    unlink("arrow-unaligned.arrow");
+}
+
+int main(void)
+{
+    CHECK(write_stream("arrow-plain.arrow", false));
+    check_stream("arrow-plain.arrow", false);
+    CHECK(write_stream("arrow-dictionary.arrow", true));
+    check_stream("arrow-dictionary.arrow", true);
+    CHECK(write_expected("arrow-expected.csv"));
+    test_rejects_unaligned_storage();
+    return check_result("arrow");
+}
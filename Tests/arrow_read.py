@@ -0,0 +1,75 @@
+#
+#  arrow_read.py
+#
+#  Copyright © 2017 Kinetic. All rights reserved.
+#
+#  Reads the streams written by the arrow test with pyarrow and compares them with the expected rows.
+#
+#  usage: arrow_read.py directory
+#
+
+import csv
+import os
+import sys
+
+import pyarrow as pa
+import pyarrow.ipc as ipc
+
+MODES = ["erg", "fluid", "brake", "simulation", "normal", "spindown_idle", "spindown_ready", "spindown_active"]
+
+
+def main(directory):
+    with open(os.path.join(directory, "arrow-expected.csv"), newline="") as file:
+        expected = list(csv.DictReader(file))
+
+    failures = 0
+    for name, dictionary in (("arrow-plain.arrow", False), ("arrow-dictionary.arrow", True)):
+        with open(os.path.join(directory, name), "rb") as file:
+            reader = ipc.open_stream(file)
+            schema = reader.schema
+            table = reader.read_all()
+
+        mode_type = pa.dictionary(pa.int8(), pa.utf8()) if dictionary else pa.uint8()
+        expected_schema = pa.schema([
+            pa.field("timestamp", pa.timestamp("us", tz="UTC"), nullable=False),
+            pa.field("power", pa.uint16(), nullable=False),
+            pa.field("speedKPH", pa.float32(), nullable=False),
+            pa.field("cadenceRPM", pa.float32(), nullable=False),
+            pa.field("coasting", pa.bool_(), nullable=False),
+            pa.field("mode", mode_type, nullable=False),
+            pa.field("targetResistance", pa.uint16(), nullable=False),
+        ])
+        if not schema.equals(expected_schema):
+            print(f"{name}: schema\n{schema}\nexpected\n{expected_schema}", file=sys.stderr)
+            failures += 1
+            continue
+        if table.num_rows != len(expected):
+            print(f"{name}: {table.num_rows} rows, expected {len(expected)}", file=sys.stderr)
+            failures += 1
+            continue
+
+        columns = table.to_pydict()
+        timestamps = table.column("timestamp").cast(pa.int64()).to_pylist()
+        speeds = table.column("speedKPH").to_pylist()
+        cadences = table.column("cadenceRPM").to_pylist()
+        for index, row in enumerate(expected):
+            mode = MODES[int(row["mode"])] if dictionary else int(row["mode"])
+            actual = (timestamps[index], columns["power"][index], columns["coasting"][index], columns["mode"][index],
+                      columns["targetResistance"][index])
+            wanted = (int(row["timestamp"]), int(row["power"]), row["coasting"] == "1", mode, int(row["targetResistance"]))
+            # the floats were printed with 9 significant digits, enough to round trip a float32
+            floats_match = (pa.scalar(float(row["speedKPH"]), pa.float32()).as_py() == speeds[index] and
+                            pa.scalar(float(row["cadenceRPM"]), pa.float32()).as_py() == cadences[index])
+            if actual != wanted or not floats_match:
+                print(f"{name}: row {index} is {actual} {speeds[index]} {cadences[index]}, expected {row}", file=sys.stderr)
+                failures += 1
+                break
+
+    if failures:
+        return 1
+    print("arrow_read: ok")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1] if len(sys.argv) > 1 else "."))
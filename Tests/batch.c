@@ -0,0 +1,80 @@
+//
+//  batch.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+//  Batch power model regression test: inride_power_batch against the scalar model (inride_process_raw_power_data)
+//  over 100k emulated frames with sprints, coasting, stops and both flywheels.
+//
+
+#include <stdint.h>
+
+#include "check.h"
+#include "Emulator.h"
+#include "inRide.h"
+#include "inRideBatch.h"
+
+#define BATCH_FRAMES    100000
+
+static const uint8_t systemId[6] = { 0xC4, 0x7F, 0x51, 0x02, 0x9A, 0x3B };
+
+static void test_batch_matches_scalar(void)
+{
+    static uint32_t ticks[BATCH_FRAMES], ticksPrevious[BATCH_FRAMES];
+    static uint8_t revs[BATCH_FRAMES], revsPrevious[BATCH_FRAMES], coasting[BATCH_FRAMES];
+    static double spindownTime[BATCH_FRAMES], speedKPH[BATCH_FRAMES];
+    static int32_t power[BATCH_FRAMES];
+    static inride_power_data expected[BATCH_FRAMES];
+
+    kinetic_emulator_device device;
+    kinetic_emulator_init_inride(&device, systemId, 7);
+    for (size_t i = 0; i < BATCH_FRAMES; ++i) {
+        // rides of a few minutes with sprints, coasting, stops and both flywheels
+        if (i % 5000 == 0) {
+            device.inRide.spindownTicks = (uint32_t)((i / 5000 % 2 ? 3.2 : 1.4 + 0.05 * (i / 10000)) * 32768);
+        }
+        double phase = (double)(i % 300) / 300.0;
+        bool coast = (i % 113) < 15;
+        device.speedKPH = (i % 997) < 20 ? 0 : 8 + 50 * phase * phase;
+        device.cadenceRPM = coast ? 0 : 50 + 60 * phase;
+        if (coast) {
+            device.speedKPH *= 0.9;
+        }
+
+        uint8_t frame[20];
+        kinetic_emulator_power_frame(&device, frame);
+        inride_raw_power_data raw = inride_decode_power_data(frame);
+        bool proFlywheel;
+        ticks[i] = raw.ticks;
+        revs[i] = raw.revs;
+        ticksPrevious[i] = raw.ticksPrevious;
+        revsPrevious[i] = raw.revsPrevious;
+        spindownTime[i] = inride_spindown_time_for_result(raw.spindownTicks / 32768.0, &proFlywheel);
+        expected[i] = inride_process_raw_power_data(&raw);
+    }
+
+    inride_batch_input input = { ticks, revs, ticksPrevious, revsPrevious, spindownTime };
+    inride_batch_output output = { speedKPH, NULL, coasting, power };
+    inride_power_batch(&input, BATCH_FRAMES, &output);
+
+    size_t mismatches = 0, coastingFrames = 0;
+    for (size_t i = 0; i < BATCH_FRAMES; ++i) {
+        coastingFrames += expected[i].coasting;
+        if (power[i] != expected[i].power || (bool)coasting[i] != expected[i].coasting ||
+            fabs(speedKPH[i] - expected[i].speedKPH) > 1e-9 * (1 + expected[i].speedKPH)) {
+            if (mismatches++ < 5) {
+                fprintf(stderr, "frame %zu: batch %d W %.9f KPH coasting %d, scalar %d W %.9f KPH coasting %d\n", i, power[i],
+                        speedKPH[i], coasting[i], expected[i].power, expected[i].speedKPH, expected[i].coasting);
+            }
+        }
+    }
+    CHECK(mismatches == 0);
+    // the ride must exercise both branches of the model
+    CHECK(coastingFrames > 0 && coastingFrames < BATCH_FRAMES / 2);
+}
+
+int main(void)
+{
+    test_batch_matches_scalar();
+    return check_result("batch");
+}
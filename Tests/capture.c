@@ -0,0 +1,270 @@
+//
+//  capture.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+//  Frame capture regression tests:
+//  - BLE frames written, appended to and replayed through the decoders, a record cut short by a crash is dropped
+//  - appending to a capture of another device is rejected (EINVAL), a header cut short is started over
+//  - USB chunks replayed through the USB unframing, with packets spanning chunks
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "Emulator.h"
+#include "FrameCapture.h"
+
+#define FRAMES          200
+#define START_TIME      1500000000000000ull
+#define INRIDE_PATH     "capture-inride.kcap"
+#define USB_PATH        "capture-usb.kcap"
+
+static const uint8_t systemId[6] = { 0x10, 0x32, 0x54, 0x76, 0x98, 0xBA };
+
+typedef struct replayed
+{
+    size_t powerCount;
+    size_t configCount;
+    size_t chunkCount;
+    uint64_t timestamps[2 * FRAMES];
+    uint16_t power[2 * FRAMES];
+    double speedKPH[2 * FRAMES];
+    double spindownTime;
+} replayed;
+
+static void on_inride_power(void *context, uint64_t timestamp, const inride_power_data *data)
+{
+    replayed *r = context;
+    if (r->powerCount < 2 * FRAMES) {
+        r->timestamps[r->powerCount] = timestamp;
+        r->power[r->powerCount] = (uint16_t)data->power;
+        r->speedKPH[r->powerCount] = data->speedKPH;
+    }
+    r->powerCount++;
+}
+
+static void on_inride_config(void *context, uint64_t timestamp, const inride_config_data *data)
+{
+    (void)timestamp;
+    replayed *r = context;
+    r->configCount++;
+    r->spindownTime = data->currentSpindownTime;
+}
+
+static void on_smart_control_power(void *context, uint64_t timestamp, const smart_control_power_data *data)
+{
+    replayed *r = context;
+    if (r->powerCount < 2 * FRAMES) {
+        r->timestamps[r->powerCount] = timestamp;
+        r->power[r->powerCount] = data->power;
+        r->speedKPH[r->powerCount] = data->speedKPH;
+    }
+    r->powerCount++;
+}
+
+static void on_smart_control_config(void *context, uint64_t timestamp, const smart_control_config_data *data)
+{
+    (void)timestamp;
+    replayed *r = context;
+    r->configCount++;
+    r->spindownTime = data->spindownTime;
+}
+
+static void on_usb_chunk(void *context, uint64_t timestamp, const uint8_t *data, size_t size)
+{
+    (void)timestamp;
+    (void)data;
+    (void)size;
+    replayed *r = context;
+    r->chunkCount++;
+}
+
+static kinetic_capture_header capture_header(kinetic_capture_device type, const uint8_t id[6])
+{
+    kinetic_capture_header header;
+    memset(&header, 0, sizeof(header));
+    header.deviceType = type;
+    memcpy(header.systemId, id, 6);
+    strncpy(header.firmwareRevision, "1.0.42", sizeof(header.firmwareRevision));
+    header.startTime = START_TIME;
+    return header;
+}
+
+static void test_inride_capture(void)
+{
+    unlink(INRIDE_PATH);
+    kinetic_emulator_device device;
+    kinetic_emulator_init_inride(&device, systemId, 11);
+    device.inRide.spindownTicks = (uint32_t)(2.1 * 32768);
+
+    static uint8_t frames[2 * FRAMES][20];
+    static inride_power_data expected[2 * FRAMES];
+    for (size_t i = 0; i < 2 * FRAMES; ++i) {
+        device.speedKPH = 20 + 15 * (double)(i % 50) / 50;
+        device.cadenceRPM = 85;
+        kinetic_emulator_power_frame(&device, frames[i]);
+        expected[i] = inride_process_power_data(frames[i]);
+    }
+    uint8_t config[20];
+    kinetic_emulator_config_frame(&device, config);
+
+    kinetic_capture_header header = capture_header(KINETIC_CAPTURE_DEVICE_INRIDE, systemId);
+    static kinetic_capture_writer writer;
+    CHECK(kinetic_capture_writer_open(&writer, INRIDE_PATH, &header, 50));
+    CHECK(kinetic_capture_write_frame(&writer, START_TIME, KINETIC_CAPTURE_INRIDE_CONFIG, config, 20));
+    for (size_t i = 0; i < FRAMES; ++i) {
+        CHECK(kinetic_capture_write_frame(&writer, START_TIME + 250000 * (i + 1), KINETIC_CAPTURE_INRIDE_POWER, frames[i], 20));
+    }
+    CHECK(kinetic_capture_writer_close(&writer));
+
+    // a crash in the middle of a record
+    int fd = open(INRIDE_PATH, O_WRONLY | O_APPEND);
+    CHECK(fd >= 0);
+    const uint8_t partial[7] = { 1, 2, 3, 4, 5, 6, 7 };
+    CHECK(write(fd, partial, sizeof(partial)) == (ssize_t)sizeof(partial));
+    close(fd);
+
+    // another device, or another kind of device, cannot append
+    const uint8_t otherId[6] = { 0x10, 0x32, 0x54, 0x76, 0x98, 0xBB };
+    kinetic_capture_header other = capture_header(KINETIC_CAPTURE_DEVICE_INRIDE, otherId);
+    errno = 0;
+    bool opened = kinetic_capture_writer_open(&writer, INRIDE_PATH, &other, 0);
+    CHECK(!opened && errno == EINVAL);
+    other = capture_header(KINETIC_CAPTURE_DEVICE_SMART_CONTROL, systemId);
+    errno = 0;
+    opened = kinetic_capture_writer_open(&writer, INRIDE_PATH, &other, 0);
+    CHECK(!opened && errno == EINVAL);
+
+    CHECK(kinetic_capture_writer_open(&writer, INRIDE_PATH, &header, 0));
+    for (size_t i = FRAMES; i < 2 * FRAMES; ++i) {
+        CHECK(kinetic_capture_write_frame(&writer, START_TIME + 250000 * (i + 1), KINETIC_CAPTURE_INRIDE_POWER, frames[i], 20));
+    }
+    CHECK(kinetic_capture_writer_close(&writer));
+
+    kinetic_capture_reader reader;
+    CHECK(kinetic_capture_reader_open(&reader, INRIDE_PATH));
+    CHECK(reader.header.magic == KINETIC_CAPTURE_MAGIC && reader.header.version == KINETIC_CAPTURE_VERSION);
+    CHECK(reader.header.deviceType == KINETIC_CAPTURE_DEVICE_INRIDE && reader.header.startTime == START_TIME);
+    CHECK(memcmp(reader.header.systemId, systemId, 6) == 0);
+    CHECK(strcmp(reader.header.firmwareRevision, "1.0.42") == 0);
+
+    static replayed r;
+    memset(&r, 0, sizeof(r));
+    kinetic_capture_handlers handlers = { on_inride_power, on_inride_config, NULL, NULL, NULL };
+    CHECK(kinetic_capture_replay(&reader, &handlers, &r) == 2 * FRAMES + 1);
+    CHECK(r.configCount == 1);
+    CHECK_NEAR(r.spindownTime, 2.1, 1e-4);
+    CHECK(r.powerCount == 2 * FRAMES);
+    for (size_t i = 0; i < 2 * FRAMES && i < r.powerCount; ++i) {
+        CHECK(r.timestamps[i] == START_TIME + 250000 * (i + 1));
+        CHECK(r.power[i] == (uint16_t)expected[i].power && r.speedKPH[i] == expected[i].speedKPH);
+    }
+
+    // the records can be read again
+    kinetic_capture_rewind(&reader);
+    kinetic_capture_entry entry;
+    CHECK(kinetic_capture_next(&reader, &entry));
+    CHECK(entry.type == KINETIC_CAPTURE_RECORD_BLE_FRAME && entry.characteristic == KINETIC_CAPTURE_INRIDE_CONFIG);
+    CHECK(entry.size == 20 && memcmp(entry.data, config, 20) == 0);
+    kinetic_capture_reader_close(&reader);
+    unlink(INRIDE_PATH);
+}
+
+static void test_usb_capture(void)
+{
+    unlink(USB_PATH);
+    kinetic_emulator_device device;
+    kinetic_emulator_init_smart_control(&device, systemId, 13);
+    device.smartControl.calibrationState = SMART_CONTROL_CALIBRATION_STATE_COMPLETE;
+    device.spindownTime = 0.9;
+
+    // the serial stream: a config packet then the power packets, read back in chunks that cut across packets
+    static uint8_t stream[(FRAMES + 1) * SMART_CONTROL_USB_PACKET_MAX];
+    static size_t packetEnd[FRAMES + 1];
+    static smart_control_power_data expected[FRAMES];
+    uint8_t frame[20];
+    kinetic_emulator_config_frame(&device, frame);
+    size_t streamSize = smart_control_usb_request(false, true, KINETIC_CAPTURE_SMART_CONTROL_CONFIG, frame, 20, stream);
+    packetEnd[0] = streamSize;
+    for (size_t i = 0; i < FRAMES; ++i) {
+        device.speedKPH = 18 + (double)(i % 40) / 2;
+        device.smartControl.targetWatts = (uint16_t)(150 + i);
+        kinetic_emulator_power_frame(&device, frame);
+        expected[i] = smart_control_process_power_data(frame, 20);
+        streamSize += smart_control_usb_request(false, true, KINETIC_CAPTURE_SMART_CONTROL_POWER, frame, 20, &stream[streamSize]);
+        packetEnd[i + 1] = streamSize;
+    }
+
+    kinetic_capture_header header = capture_header(KINETIC_CAPTURE_DEVICE_SMART_CONTROL, systemId);
+    static kinetic_capture_writer writer;
+    CHECK(kinetic_capture_writer_open(&writer, USB_PATH, &header, 0));
+    enum { Chunk = 7 };
+    size_t chunks = 0;
+    for (size_t offset = 0; offset < streamSize; offset += Chunk, chunks++) {
+        size_t size = streamSize - offset < Chunk ? streamSize - offset : Chunk;
+        CHECK(kinetic_capture_write_usb(&writer, START_TIME + offset, &stream[offset], size));
+    }
+    CHECK(kinetic_capture_writer_close(&writer));
+
+    kinetic_capture_reader reader;
+    CHECK(kinetic_capture_reader_open(&reader, USB_PATH));
+    static replayed r;
+    memset(&r, 0, sizeof(r));
+    kinetic_capture_handlers handlers = { NULL, NULL, on_smart_control_power, on_smart_control_config, on_usb_chunk };
+    CHECK(kinetic_capture_replay(&reader, &handlers, &r) == chunks);
+    CHECK(r.chunkCount == chunks);
+    CHECK(r.configCount == 1);
+    CHECK_NEAR(r.spindownTime, 0.9, 1e-4);
+    CHECK(r.powerCount == FRAMES);
+    for (size_t i = 0; i < FRAMES && i < r.powerCount; ++i) {
+        // stamped with the chunk holding the last byte of the packet
+        CHECK(r.timestamps[i] == START_TIME + (packetEnd[i + 1] - 1) / Chunk * Chunk);
+        CHECK(r.power[i] == expected[i].power && r.speedKPH[i] == expected[i].speedKPH);
+    }
+    kinetic_capture_reader_close(&reader);
+    unlink(USB_PATH);
+}
+
+static void test_short_header(void)
+{
+    kinetic_capture_header header = capture_header(KINETIC_CAPTURE_DEVICE_INRIDE, systemId);
+    header.magic = KINETIC_CAPTURE_MAGIC;
+    header.version = KINETIC_CAPTURE_VERSION;
+    const uint8_t frame[20] = { 0x5A };
+    for (size_t size = 1; size < sizeof(header); size += 6) {
+        // a crash while the capture was being created
+        int fd = open(INRIDE_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        CHECK(fd >= 0);
+        CHECK(write(fd, &header, size) == (ssize_t)size);
+        close(fd);
+
+        static kinetic_capture_writer writer;
+        CHECK(kinetic_capture_writer_open(&writer, INRIDE_PATH, &header, 0));
+        CHECK(kinetic_capture_write_frame(&writer, START_TIME, KINETIC_CAPTURE_INRIDE_POWER, frame, 20));
+        CHECK(kinetic_capture_writer_close(&writer));
+
+        kinetic_capture_reader reader;
+        bool opened = kinetic_capture_reader_open(&reader, INRIDE_PATH);
+        CHECK(opened);
+        if (opened) {
+            kinetic_capture_entry entry;
+            CHECK(kinetic_capture_next(&reader, &entry) && entry.timestamp == START_TIME && entry.data[0] == 0x5A);
+            CHECK(!kinetic_capture_next(&reader, &entry));
+            kinetic_capture_reader_close(&reader);
+        }
+    }
+    unlink(INRIDE_PATH);
+}
+
+int main(void)
+{
+    test_inride_capture();
+    test_short_header();
+    test_usb_capture();
+    return check_result("capture");
+}
@@ -0,0 +1,48 @@
+//
+//  check.h
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+//  Minimal assertions for the regression tests: a failed check prints its location and the test carries on, main
+//  returns check_result() so ctest sees the failure.
+//
+
+#ifndef check_h
+#define check_h
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static int checkFailures;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            checkFailures++; \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        } \
+    } while (0)
+
+#define CHECK_NEAR(value, expected, tolerance) \
+    do { \
+        double checkValue = (double)(value); \
+        double checkExpected = (double)(expected); \
+        if (!(fabs(checkValue - checkExpected) <= (double)(tolerance))) { \
+            checkFailures++; \
+            fprintf(stderr, "%s:%d: check failed: %s = %.9g, expected %.9g (+/- %g)\n", __FILE__, __LINE__, #value, \
+                    checkValue, checkExpected, (double)(tolerance)); \
+        } \
+    } while (0)
+
+static inline int check_result(const char *name)
+{
+    if (checkFailures > 0) {
+        fprintf(stderr, "%s: %d check(s) failed\n", name, checkFailures);
+        return EXIT_FAILURE;
+    }
+    printf("%s: ok\n", name);
+    return EXIT_SUCCESS;
+}
+
+#endif /* check_h */
@@ -0,0 +1,199 @@
+//
+//  commands.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+//  Smart Control command regression tests. The expected bytes were produced by the original hand written builders
+//  with the same nonces (smart_control_set_nonce_source), so they pin the wire format of the table driven encoder:
+//  - every builder, smart_control_encode_command and smart_control_encode_commands against the expected bytes
+//  - the emulator's control point decodes every command back to its parameters
+//
+
+#include <stdint.h>
+#include <string.h>
+
+#include "check.h"
+#include "Emulator.h"
+#include "SmartControl.h"
+
+typedef struct golden_command
+{
+    smart_control_command command;
+    uint8_t size;
+    uint8_t bytes[SMART_CONTROL_COMMAND_MAX];
+} golden_command;
+
+static const golden_command golden[] = {
+    { { SMART_CONTROL_SET_MODE_ERG, { 0 } },                            5, { 0xEF, 0xD3, 0xFE, 0x5E, 0x0B } },
+    { { SMART_CONTROL_SET_MODE_ERG, { 250 } },                          5, { 0xB7, 0xB1, 0x55, 0x00, 0x30 } },
+    { { SMART_CONTROL_SET_MODE_ERG, { 65535 } },                        5, { 0x69, 0xD7, 0x06, 0x1B, 0x55 } },
+    { { SMART_CONTROL_SET_MODE_FLUID, { 0 } },                          4, { 0x2A, 0xD4, 0x8B, 0x7A } },
+    { { SMART_CONTROL_SET_MODE_FLUID, { 9 } },                          4, { 0x14, 0x1A, 0xF8, 0x9F } },
+    { { SMART_CONTROL_SET_MODE_FLUID, { 255 } },                        4, { 0x04, 0x06, 0xED, 0xC4 } },
+    { { SMART_CONTROL_SET_MODE_BRAKE, { -0.1f } },                      5, { 0xA4, 0xDD, 0x14, 0x1B, 0xE9 } },
+    { { SMART_CONTROL_SET_MODE_BRAKE, { 0.35f } },                      5, { 0x79, 0xC9, 0x56, 0x11, 0x0E } },
+    { { SMART_CONTROL_SET_MODE_BRAKE, { 1.2f } },                       5, { 0xC5, 0x04, 0xF8, 0x45, 0x33 } },
+    { { SMART_CONTROL_SET_MODE_SIMULATION, { 80, 0.004f, 0.6f, 2.5f, 0 } }, 13,
+        { 0xF1, 0x26, 0xC3, 0xA2, 0x3B, 0x70, 0x43, 0x72, 0xB7, 0x4B, 0x0C, 0x09, 0x58 } },
+    { { SMART_CONTROL_SET_MODE_SIMULATION, { 95.5f, 0.0052f, 0.41f, -7.25f, -3.5f } }, 13,
+        { 0x5F, 0x14, 0x3E, 0x80, 0xE0, 0x9C, 0xE5, 0x3A, 0x34, 0x08, 0xF0, 0x16, 0x7D } },
+    { { SMART_CONTROL_SET_MODE_SIMULATION, { 200, 0.1f, 2, 45, 30 } }, 13,
+        { 0xA8, 0xD5, 0x54, 0x4B, 0x0F, 0x93, 0xC0, 0xB0, 0xD5, 0x8E, 0x01, 0x29, 0xA2 } },
+    { { SMART_CONTROL_START_CALIBRATION, { 0 } },                       4, { 0x75, 0xC3, 0xE2, 0xC7 } },
+    { { SMART_CONTROL_START_CALIBRATION, { 1 } },                       4, { 0x31, 0xB4, 0xC2, 0xEC } },
+    { { SMART_CONTROL_STOP_CALIBRATION, { 0 } },                        4, { 0x1D, 0x84, 0xE7, 0x11 } },
+};
+
+#define GOLDEN_COUNT    (sizeof(golden) / sizeof(golden[0]))
+
+static void sequence_nonces(void *context, uint8_t *nonces, size_t count)
+{
+    uint32_t *counter = context;
+    for (size_t i = 0; i < count; ++i) {
+        nonces[i] = (uint8_t)((*counter)++ * 37 + 11);
+    }
+}
+
+// Encodes a command through its builder
+static size_t build(const smart_control_command *command, uint8_t *data)
+{
+    const float *v = command->values;
+    switch (command->type) {
+        case SMART_CONTROL_SET_MODE_ERG: {
+            smart_control_set_mode_erg_data bytes = smart_control_set_mode_erg_command((uint16_t)v[0]);
+            memcpy(data, bytes.bytes, sizeof(bytes));
+            return sizeof(bytes);
+        }
+        case SMART_CONTROL_SET_MODE_FLUID: {
+            smart_control_set_mode_fluid_data bytes = smart_control_set_mode_fluid_command((uint8_t)v[0]);
+            memcpy(data, bytes.bytes, sizeof(bytes));
+            return sizeof(bytes);
+        }
+        case SMART_CONTROL_SET_MODE_BRAKE: {
+            smart_control_set_mode_brake_data bytes = smart_control_set_mode_brake_command(v[0]);
+            memcpy(data, bytes.bytes, sizeof(bytes));
+            return sizeof(bytes);
+        }
+        case SMART_CONTROL_SET_MODE_SIMULATION: {
+            smart_control_set_mode_simulation_data bytes = smart_control_set_mode_simulation_command(v[0], v[1], v[2], v[3], v[4]);
+            memcpy(data, bytes.bytes, sizeof(bytes));
+            return sizeof(bytes);
+        }
+        case SMART_CONTROL_START_CALIBRATION: {
+            smart_control_calibration_command_data bytes = smart_control_start_calibration_command(v[0] != 0);
+            memcpy(data, bytes.bytes, sizeof(bytes));
+            return sizeof(bytes);
+        }
+        case SMART_CONTROL_STOP_CALIBRATION: {
+            smart_control_calibration_command_data bytes = smart_control_stop_calibration_command();
+            memcpy(data, bytes.bytes, sizeof(bytes));
+            return sizeof(bytes);
+        }
+    }
+    return 0;
+}
+
+static void check_golden(const char *path, size_t index, const uint8_t *data, size_t size)
+{
+    const golden_command *expected = &golden[index];
+    if (size != expected->size || memcmp(data, expected->bytes, expected->size) != 0) {
+        checkFailures++;
+        fprintf(stderr, "%s: command %zu does not match the expected bytes:", path, index);
+        for (size_t i = 0; i < size; ++i) {
+            fprintf(stderr, " %02X", data[i]);
+        }
+        fprintf(stderr, "\n");
+    }
+}
+
+static void test_golden_bytes(void)
+{
+    uint32_t counter = 0;
+    smart_control_set_nonce_source(sequence_nonces, &counter);
+    for (size_t i = 0; i < GOLDEN_COUNT; ++i) {
+        uint8_t data[SMART_CONTROL_COMMAND_MAX];
+        check_golden("builder", i, data, build(&golden[i].command, data));
+    }
+
+    counter = 0;
+    for (size_t i = 0; i < GOLDEN_COUNT; ++i) {
+        uint8_t data[SMART_CONTROL_COMMAND_MAX];
+        check_golden("smart_control_encode_command", i, data, smart_control_encode_command(&golden[i].command, data));
+    }
+
+    // the batch draws its nonces in one go, in command order
+    enum { Stride = 16 };
+    smart_control_command commands[GOLDEN_COUNT];
+    uint8_t data[GOLDEN_COUNT * Stride];
+    uint8_t sizes[GOLDEN_COUNT];
+    for (size_t i = 0; i < GOLDEN_COUNT; ++i) {
+        commands[i] = golden[i].command;
+    }
+    counter = 0;
+    CHECK(smart_control_encode_commands(commands, GOLDEN_COUNT, data, Stride, sizes) == GOLDEN_COUNT);
+    for (size_t i = 0; i < GOLDEN_COUNT; ++i) {
+        check_golden("smart_control_encode_commands", i, &data[i * Stride], sizes[i]);
+    }
+    CHECK(counter == GOLDEN_COUNT);
+
+    smart_control_command unknown = { (smart_control_command_type)99, { 0 } };
+    CHECK(smart_control_encode_command(&unknown, data) == 0);
+    smart_control_set_nonce_source(NULL, NULL);
+}
+
+static void test_emulator_accepts_commands(void)
+{
+    const uint8_t systemId[6] = { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06 };
+    kinetic_emulator_device device;
+    kinetic_emulator_init_smart_control(&device, systemId, 1);
+
+    // random nonces from here on: the emulator must not depend on them
+    for (size_t i = 0; i < GOLDEN_COUNT; ++i) {
+        const smart_control_command *command = &golden[i].command;
+        uint8_t data[SMART_CONTROL_COMMAND_MAX];
+        size_t size = smart_control_encode_command(command, data);
+        CHECK(kinetic_emulator_write_control_point(&device, data, size));
+
+        const kinetic_emulator_smart_control *sc = &device.smartControl;
+        const float *v = command->values;
+        switch (command->type) {
+            case SMART_CONTROL_SET_MODE_ERG:
+                CHECK(sc->mode == SMART_CONTROL_MODE_ERG && sc->targetWatts == (uint16_t)v[0]);
+                break;
+            case SMART_CONTROL_SET_MODE_FLUID:
+                CHECK(sc->mode == SMART_CONTROL_MODE_FLUID && sc->fluidLevel == (v[0] > 9 ? 9 : v[0]));
+                break;
+            case SMART_CONTROL_SET_MODE_BRAKE:
+                CHECK(sc->mode == SMART_CONTROL_MODE_BRAKE);
+                CHECK_NEAR(sc->brakePercent, v[0] < 0 ? 0 : v[0] > 1 ? 1 : v[0], 1e-4);
+                break;
+            case SMART_CONTROL_SET_MODE_SIMULATION:
+                CHECK(sc->mode == SMART_CONTROL_MODE_SIMULATION);
+                CHECK_NEAR(sc->weightKG, v[0], 0.005);
+                CHECK_NEAR(sc->rollingCoeff, v[1], 0.00005);
+                CHECK_NEAR(sc->windCoeff, v[2], 0.00005);
+                CHECK_NEAR(sc->grade, v[3], 0.005);
+                CHECK_NEAR(sc->windSpeedMPS, v[4], 0.005);
+                break;
+            case SMART_CONTROL_START_CALIBRATION:
+                CHECK(sc->calibrationState == SMART_CONTROL_CALIBRATION_STATE_INITIALIZING);
+                CHECK(sc->brakeCalibration == (v[0] != 0));
+                break;
+            case SMART_CONTROL_STOP_CALIBRATION:
+                CHECK(sc->calibrationState == SMART_CONTROL_CALIBRATION_STATE_NOT_PERFORMED);
+                break;
+        }
+    }
+
+    // a command cut short is rejected
+    uint8_t data[SMART_CONTROL_COMMAND_MAX];
+    size_t size = smart_control_encode_command(&golden[9].command, data);
+    CHECK(!kinetic_emulator_write_control_point(&device, data, size - 2));
+}
+
+int main(void)
+{
+    test_golden_bytes();
+    test_emulator_accepts_commands();
+    return check_result("commands");
+}
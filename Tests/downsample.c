@@ -0,0 +1,224 @@
+//
+//  downsample.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+//  Downsampler regression tests: the streaming LTTB (convex hull candidates, one bucket of delay) against a reference
+//  LTTB that keeps every sample of every bucket, and the envelopes against the samples, over random rides with gaps
+//  and sprint spikes.
+//
+
+#include <stdint.h>
+#include <string.h>
+
+#include "check.h"
+#include "Downsampler.h"
+
+#define RIDES           50
+#define SAMPLES_MAX     50000
+#define BUCKET_SECONDS  5.0
+
+typedef struct series
+{
+    size_t count;
+    kinetic_downsample_point points[SAMPLES_MAX];
+} series;
+
+typedef struct envelopes
+{
+    size_t count;
+    kinetic_downsample_envelope envelopes[SAMPLES_MAX];
+} envelopes;
+
+typedef struct outputs
+{
+    series points;
+    envelopes envelopes;
+} outputs;
+
+static uint32_t randomState = 0x2545F491;
+
+static double uniform(void)
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState / 4294967296.0;
+}
+
+static void on_point(void *context, const kinetic_downsample_point *point)
+{
+    series *s = &((outputs *)context)->points;
+    if (s->count < SAMPLES_MAX) {
+        s->points[s->count++] = *point;
+    }
+}
+
+static void on_envelope(void *context, const kinetic_downsample_envelope *envelope)
+{
+    envelopes *e = &((outputs *)context)->envelopes;
+    if (e->count < SAMPLES_MAX) {
+        e->envelopes[e->count++] = *envelope;
+    }
+}
+
+static double triangle(const kinetic_downsample_point *a, const kinetic_downsample_point *b, const kinetic_downsample_point *c)
+{
+    return fabs((b->time - a->time) * (c->value - a->value) - (b->value - a->value) * (c->time - a->time));
+}
+
+// Plain LTTB over the non-empty buckets, every sample a candidate
+static void reference_lttb(const series *input, double bucketSeconds, outputs *expected)
+{
+    static size_t bucketStart[SAMPLES_MAX + 1];
+    size_t buckets = 0;
+    double origin = input->points[0].time;
+    int64_t previousIndex = -1;
+    for (size_t i = 0; i < input->count; ++i) {
+        int64_t index = (int64_t)floor((input->points[i].time - origin) / bucketSeconds);
+        if (index != previousIndex) {
+            bucketStart[buckets++] = i;
+            previousIndex = index;
+        }
+    }
+    bucketStart[buckets] = input->count;
+
+    series *points = &expected->points;
+    envelopes *env = &expected->envelopes;
+    points->count = 0;
+    env->count = 0;
+    for (size_t b = 0; b < buckets; ++b) {
+        kinetic_downsample_envelope *e = &env->envelopes[env->count++];
+        e->time = origin + floor((input->points[bucketStart[b]].time - origin) / bucketSeconds) * bucketSeconds;
+        e->minimum = INFINITY;
+        e->maximum = -INFINITY;
+        double sum = 0;
+        for (size_t i = bucketStart[b]; i < bucketStart[b + 1]; ++i) {
+            e->minimum = fmin(e->minimum, input->points[i].value);
+            e->maximum = fmax(e->maximum, input->points[i].value);
+            sum += input->points[i].value;
+        }
+        e->count = (uint32_t)(bucketStart[b + 1] - bucketStart[b]);
+        e->mean = sum / e->count;
+    }
+
+    kinetic_downsample_point selected = input->points[0];
+    points->points[points->count++] = selected;
+    for (size_t b = 0; b < buckets; ++b) {
+        bool lastBucket = b + 1 == buckets;
+        kinetic_downsample_point c = input->points[input->count - 1];
+        if (!lastBucket) {
+            double sumTime = 0, sumValue = 0;
+            for (size_t i = bucketStart[b + 1]; i < bucketStart[b + 2]; ++i) {
+                sumTime += input->points[i].time;
+                sumValue += input->points[i].value;
+            }
+            size_t n = bucketStart[b + 2] - bucketStart[b + 1];
+            c = (kinetic_downsample_point){ sumTime / n, sumValue / n };
+        }
+        kinetic_downsample_point best = input->points[bucketStart[b]];
+        double largest = -1;
+        for (size_t i = bucketStart[b]; i < bucketStart[b + 1]; ++i) {
+            double area = triangle(&selected, &input->points[i], &c);
+            if (area > largest) {
+                largest = area;
+                best = input->points[i];
+            }
+        }
+        if (best.time != selected.time && (!lastBucket || best.time != c.time)) {
+            points->points[points->count++] = best;
+            selected = best;
+        }
+    }
+    kinetic_downsample_point last = input->points[input->count - 1];
+    if (last.time != selected.time) {
+        points->points[points->count++] = last;
+    }
+}
+
+// A ride at 4 Hz: drifting power with noise, sprint spikes and dropouts
+static void random_ride(series *ride)
+{
+    size_t count = 2000 + (size_t)(uniform() * (SAMPLES_MAX - 2000));
+    double time = 1500000000 + uniform() * 1000;
+    double level = 200;
+    ride->count = 0;
+    while (ride->count < count) {
+        time += 0.25;
+        if (uniform() < 0.002) {
+            time += 5 + uniform() * 60;     // dropout, empty buckets
+        }
+        level += (uniform() - 0.5) * 4;
+        double value = level + (uniform() - 0.5) * 30;
+        if (uniform() < 0.003) {
+            value += 400 + uniform() * 600; // sprint
+        }
+        ride->points[ride->count++] = (kinetic_downsample_point){ time, value };
+    }
+}
+
+static void test_against_reference(void)
+{
+    static series ride;
+    static outputs actual, expected;
+    size_t mismatchedRides = 0;
+    for (int r = 0; r < RIDES; ++r) {
+        random_ride(&ride);
+        memset(&actual, 0, sizeof(actual));
+        kinetic_downsampler downsampler;
+        kinetic_downsampler_init(&downsampler, BUCKET_SECONDS, on_point, on_envelope, &actual);
+        for (size_t i = 0; i < ride.count; ++i) {
+            kinetic_downsampler_add(&downsampler, ride.points[i].time, ride.points[i].value);
+        }
+        kinetic_downsampler_flush(&downsampler);
+        reference_lttb(&ride, BUCKET_SECONDS, &expected);
+
+        bool match = actual.points.count == expected.points.count && actual.envelopes.count == expected.envelopes.count;
+        for (size_t i = 0; match && i < expected.points.count; ++i) {
+            match = actual.points.points[i].time == expected.points.points[i].time &&
+                    actual.points.points[i].value == expected.points.points[i].value;
+        }
+        for (size_t i = 0; match && i < expected.envelopes.count; ++i) {
+            const kinetic_downsample_envelope *a = &actual.envelopes.envelopes[i], *e = &expected.envelopes.envelopes[i];
+            match = fabs(a->time - e->time) < 1e-6 && a->minimum == e->minimum && a->maximum == e->maximum &&
+                    a->count == e->count && fabs(a->mean - e->mean) < 1e-9 * fabs(e->mean) + 1e-9;
+        }
+        if (!match) {
+            fprintf(stderr, "ride %d (%zu samples): %zu points / %zu envelopes, reference %zu / %zu\n", r, ride.count,
+                    actual.points.count, actual.envelopes.count, expected.points.count, expected.envelopes.count);
+            mismatchedRides++;
+        }
+    }
+    CHECK(mismatchedRides == 0);
+}
+
+static void test_short_series(void)
+{
+    static outputs actual;
+    memset(&actual, 0, sizeof(actual));
+    kinetic_downsampler downsampler;
+    kinetic_downsampler_init(&downsampler, BUCKET_SECONDS, on_point, on_envelope, &actual);
+    kinetic_downsampler_flush(&downsampler);
+    CHECK(actual.points.count == 0 && actual.envelopes.count == 0);
+
+    // one sample: kept once
+    kinetic_downsampler_add(&downsampler, 10, 150);
+    kinetic_downsampler_flush(&downsampler);
+    CHECK(actual.points.count == 1 && actual.envelopes.count == 1);
+    CHECK(actual.envelopes.envelopes[0].count == 1 && actual.envelopes.envelopes[0].mean == 150);
+
+    // a new series after a flush starts over
+    memset(&actual, 0, sizeof(actual));
+    kinetic_downsampler_add(&downsampler, 100, 1);
+    kinetic_downsampler_add(&downsampler, 101, 2);
+    kinetic_downsampler_flush(&downsampler);
+    CHECK(actual.points.count == 2 && actual.points.points[0].time == 100 && actual.points.points[1].time == 101);
+    CHECK(actual.envelopes.count == 1 && actual.envelopes.envelopes[0].time == 100);
+}
+
+int main(void)
+{
+    test_against_reference();
+    test_short_series();
+    return check_result("downsample");
+}
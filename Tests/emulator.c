@@ -0,0 +1,103 @@
+//
+//  emulator.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+//  Emulator regression tests: emulator -> decoder round trips of the inRide and Smart Control power and config
+//  characteristics.
+//
+
+#include <stdint.h>
+
+#include "check.h"
+#include "Emulator.h"
+#include "inRide.h"
+#include "SmartControl.h"
+
+static const uint8_t systemId[6] = { 0xC4, 0x7F, 0x51, 0x02, 0x9A, 0x3B };
+
+static void test_inride_round_trip(void)
+{
+    kinetic_emulator_device device;
+    kinetic_emulator_init_inride(&device, systemId, 3);
+    device.inRide.spindownTicks = (uint32_t)(1.8 * 32768);
+
+    const double speeds[] = { 12.5, 25, 32.4, 45, 60 };
+    for (size_t s = 0; s < sizeof(speeds) / sizeof(speeds[0]); ++s) {
+        device.speedKPH = speeds[s];
+        device.cadenceRPM = 90;
+        uint8_t frame[20];
+        inride_power_data data;
+        // the first frames carry the previous speed
+        for (int i = 0; i < 4; ++i) {
+            CHECK(kinetic_emulator_power_frame(&device, frame) == 20);
+            data = inride_process_power_data(frame);
+        }
+        CHECK(data.state == INRIDE_STATE_NORMAL);
+        CHECK(!data.coasting);
+        CHECK_NEAR(data.speedKPH, speeds[s], speeds[s] * 0.01);
+        CHECK_NEAR(data.cadenceRPM, 90, 1);
+        CHECK_NEAR(data.lastSpindownResultTime, 1.8, 1e-4);
+        CHECK_NEAR(data.power, kinetic_emulator_power(&device), 1 + 0.02 * kinetic_emulator_power(&device));
+    }
+
+    uint8_t config[20];
+    CHECK(kinetic_emulator_config_frame(&device, config) == 20);
+    inride_config_data configData = inride_process_config_data(config);
+    CHECK_NEAR(configData.currentSpindownTime, 1.8, 1e-4);
+    CHECK(configData.calibrationReady == 602);
+    CHECK(configData.updateRateDefault == INRIDE_UPDATE_RATE_1000);
+    CHECK(configData.updateRateCalibration == INRIDE_UPDATE_RATE_250);
+}
+
+static void test_smart_control_round_trip(void)
+{
+    kinetic_emulator_device device;
+    kinetic_emulator_init_smart_control(&device, systemId, 5);
+
+    const double speeds[] = { 0, 9.75, 27.3, 41.06, 72.5 };
+    const uint16_t targets[] = { 50, 180, 275, 400, 1200 };
+    for (size_t s = 0; s < sizeof(speeds) / sizeof(speeds[0]); ++s) {
+        device.speedKPH = speeds[s];
+        device.cadenceRPM = 60 + 10 * s;
+        device.smartControl.targetWatts = targets[s];
+        uint8_t frame[20];
+        CHECK(kinetic_emulator_power_frame(&device, frame) == 20);
+        smart_control_power_data data = smart_control_process_power_data(frame, 20);
+        CHECK(data.mode == SMART_CONTROL_MODE_ERG);
+        CHECK(data.targetResistance == targets[s]);
+        CHECK(data.power == (uint16_t)(kinetic_emulator_power(&device) + 0.5));
+        CHECK_NEAR(data.speedKPH, speeds[s], 0.0005);
+        CHECK(data.cadenceRPM == 60 + 10 * s);
+    }
+
+    device.speedKPH = 30;
+    device.smartControl.mode = SMART_CONTROL_MODE_SIMULATION;
+    device.smartControl.grade = 4;
+    uint8_t frame[20];
+    kinetic_emulator_power_frame(&device, frame);
+    smart_control_power_data data = smart_control_process_power_data(frame, 20);
+    CHECK(data.mode == SMART_CONTROL_MODE_SIMULATION);
+    CHECK(data.power == (uint16_t)(kinetic_emulator_power(&device) + 0.5));
+    CHECK(data.power > 200);
+
+    device.smartControl.calibrationState = SMART_CONTROL_CALIBRATION_STATE_COMPLETE;
+    device.spindownTime = 1.25;
+    uint8_t config[20];
+    CHECK(kinetic_emulator_config_frame(&device, config) == 20);
+    smart_control_config_data configData = smart_control_process_config_data(config, 20);
+    CHECK(configData.updateRate == 4);
+    CHECK(configData.tickRate == 10000);
+    CHECK(configData.calibrationState == SMART_CONTROL_CALIBRATION_STATE_COMPLETE);
+    CHECK_NEAR(configData.spindownTime, 1.25, 1e-4);
+    CHECK_NEAR(configData.calibrationThresholdKPH, 33.8, 1e-3);
+    CHECK_NEAR(configData.brakeCalibrationThresholdKPH, 45, 1e-3);
+    CHECK(configData.systemStatus == 0);
+}
+
+int main(void)
+{
+    test_inride_round_trip();
+    test_smart_control_round_trip();
+    return check_result("emulator");
+}
@@ -0,0 +1,228 @@
+//
+//  fanout.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+//  Metrics fan-out regression tests:
+//  - encoder -> decoder: every update arrives (absolute and difference entries, ticks split over several datagrams)
+//  - a lost datagram drops the difference entries until the next keyframe, which resyncs every device
+//  - keyframeInterval 0 still sends keyframes, malformed datagrams are rejected
+//  - publisher -> subscriber over UDP on the loopback interface
+//
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "check.h"
+#include "MetricsFanout.h"
+
+#define DEVICES             200
+#define TICKS               40
+#define KEYFRAME_INTERVAL   10
+#define LOST_TICK           12
+#define DATAGRAMS_MAX       16
+
+typedef struct received
+{
+    kinetic_sample_record last[DEVICES];
+    uint8_t systemId[DEVICES][6];
+    size_t count[DEVICES];
+    size_t samples;
+} received;
+
+typedef struct tick_datagrams
+{
+    size_t count;
+    size_t size[DATAGRAMS_MAX];
+    uint8_t data[DATAGRAMS_MAX][KINETIC_FANOUT_DATAGRAM_MAX];
+} tick_datagrams;
+
+static void device_id(uint32_t index, uint8_t systemId[6])
+{
+    const uint8_t id[6] = { 0xC4, 0x7F, 0x51, (uint8_t)(index >> 16), (uint8_t)(index >> 8), (uint8_t)index };
+    memcpy(systemId, id, 6);
+}
+
+static smart_control_power_data device_data(uint32_t index, uint32_t tick)
+{
+    smart_control_power_data data = { (smart_control_mode)(index % 4), (uint16_t)(100 + 3 * tick + index),
+                                      20 + 0.137 * tick + 0.01 * index, (uint8_t)(70 + tick % 30), (uint16_t)(150 + index) };
+    return data;
+}
+
+// Same sample, ignoring the time since the previous one
+static bool same_sample(const kinetic_sample_record *a, const kinetic_sample_record *b)
+{
+    return a->power == b->power && a->speed == b->speed && a->cadence == b->cadence && a->resistance == b->resistance &&
+           (a->flags & ~KINETIC_SAMPLE_FLAG_TIME_SECONDS) == (b->flags & ~KINETIC_SAMPLE_FLAG_TIME_SECONDS) &&
+           a->status == b->status && a->calibration == b->calibration;
+}
+
+static void collect_datagram(void *context, const uint8_t *datagram, size_t size)
+{
+    tick_datagrams *datagrams = context;
+    CHECK(size <= KINETIC_FANOUT_DATAGRAM_MAX && datagrams->count < DATAGRAMS_MAX);
+    if (datagrams->count < DATAGRAMS_MAX) {
+        memcpy(datagrams->data[datagrams->count], datagram, size);
+        datagrams->size[datagrams->count++] = size;
+    }
+}
+
+static void collect_sample(void *context, uint32_t deviceIndex, const uint8_t systemId[6], uint64_t tickTime, const kinetic_sample_record *record)
+{
+    (void)tickTime;
+    received *r = context;
+    CHECK(deviceIndex < DEVICES);
+    if (deviceIndex < DEVICES) {
+        r->last[deviceIndex] = *record;
+        memcpy(r->systemId[deviceIndex], systemId, 6);
+        r->count[deviceIndex]++;
+    }
+    r->samples++;
+}
+
+static void test_encode_decode(void)
+{
+    static kinetic_fanout_device encoderDevices[DEVICES], decoderDevices[DEVICES];
+    static kinetic_sample_record expected[DEVICES];
+    static received r;
+    static tick_datagrams datagrams;
+    memset(&r, 0, sizeof(r));
+
+    kinetic_fanout_encoder encoder;
+    kinetic_fanout_decoder decoder;
+    kinetic_fanout_encoder_init(&encoder, encoderDevices, DEVICES, 0x5EED, KEYFRAME_INTERVAL);
+    kinetic_fanout_decoder_init(&decoder, decoderDevices, DEVICES);
+
+    size_t keyframeDatagrams = 0;
+    for (uint32_t tick = 0; tick < TICKS; ++tick) {
+        for (uint32_t d = 0; d < DEVICES; ++d) {
+            if ((d + tick) % 3 == 0 || tick == 0) {
+                uint8_t systemId[6];
+                device_id(d, systemId);
+                smart_control_power_data data = device_data(d, tick);
+                kinetic_fanout_update_smart_control(&encoder, d, systemId, &data);
+                expected[d] = smart_control_sample_pack(&data, 0);
+            }
+        }
+        datagrams.count = 0;
+        size_t sent = kinetic_fanout_encode_tick(&encoder, 1000000ull * (tick + 1), collect_datagram, &datagrams);
+        CHECK(sent == datagrams.count && sent > 0);
+        if (tick % KEYFRAME_INTERVAL == KEYFRAME_INTERVAL - 1) {
+            keyframeDatagrams = sent;
+        }
+
+        size_t samplesBefore = r.samples;
+        for (size_t i = 0; i < datagrams.count; ++i) {
+            if (tick == LOST_TICK && i == 0) {
+                continue;
+            }
+            CHECK(kinetic_fanout_decode(&decoder, datagrams.data[i], datagrams.size[i], collect_sample, &r) >= 0);
+        }
+
+        if (tick < LOST_TICK || tick % KEYFRAME_INTERVAL == KEYFRAME_INTERVAL - 1) {
+            // in sync: the subscriber's view is the publisher's
+            size_t mismatches = 0;
+            for (uint32_t d = 0; d < DEVICES; ++d) {
+                uint8_t systemId[6];
+                device_id(d, systemId);
+                mismatches += !same_sample(&r.last[d], &expected[d]) || memcmp(r.systemId[d], systemId, 6) != 0;
+            }
+            CHECK(mismatches == 0);
+        } else if (tick < LOST_TICK + KEYFRAME_INTERVAL - LOST_TICK % KEYFRAME_INTERVAL - 1) {
+            // after the loss, nothing until the keyframe
+            CHECK(r.samples == samplesBefore);
+        }
+    }
+    CHECK(decoder.lost == 1 && decoder.rejected == 0);
+    // a keyframe of every device does not fit in one datagram
+    CHECK(keyframeDatagrams > 1);
+    // the first tick sends every device
+    for (uint32_t d = 0; d < DEVICES; ++d) {
+        CHECK(r.count[d] > 0);
+    }
+
+    // malformed datagrams
+    uint8_t bad[KINETIC_FANOUT_HEADER_SIZE] = { 'K', 'F', 'A', 'X' };
+    CHECK(kinetic_fanout_decode(&decoder, bad, sizeof(bad), collect_sample, &r) == -1);
+    CHECK(kinetic_fanout_decode(&decoder, bad, 3, collect_sample, &r) == -1);
+    CHECK(decoder.rejected == 2);
+}
+
+static void test_default_keyframes(void)
+{
+    kinetic_fanout_device devices[1];
+    kinetic_fanout_encoder encoder;
+    kinetic_fanout_encoder_init(&encoder, devices, 1, 1, 0);
+    CHECK(encoder.keyframeInterval == KINETIC_FANOUT_KEYFRAME_INTERVAL);
+
+    uint8_t systemId[6];
+    device_id(0, systemId);
+    smart_control_power_data data = device_data(0, 0);
+    kinetic_fanout_update_smart_control(&encoder, 0, systemId, &data);
+    static tick_datagrams datagrams;
+    size_t keyframes = 0;
+    for (uint32_t tick = 0; tick < 3 * KINETIC_FANOUT_KEYFRAME_INTERVAL; ++tick) {
+        datagrams.count = 0;
+        kinetic_fanout_encode_tick(&encoder, tick, collect_datagram, &datagrams);
+        for (size_t i = 0; i < datagrams.count; ++i) {
+            keyframes += (datagrams.data[i][5] & KINETIC_FANOUT_FLAG_KEYFRAME) != 0;
+        }
+    }
+    // an unchanged device is only sent in keyframes
+    CHECK(keyframes == 3);
+}
+
+static void test_loopback(void)
+{
+    enum { Devices = 4, Ticks = 50 };
+    static kinetic_fanout_device publisherDevices[Devices], subscriberDevices[Devices];
+    kinetic_fanout_subscriber subscriber;
+    CHECK(kinetic_fanout_subscriber_open(&subscriber, "127.0.0.1", 0, subscriberDevices, Devices));
+    struct sockaddr_in local;
+    socklen_t length = sizeof(local);
+    CHECK(getsockname(subscriber.fd, (struct sockaddr *)&local, &length) == 0);
+    uint16_t port = ntohs(local.sin_port);
+
+    kinetic_fanout_publisher publisher;
+    CHECK(kinetic_fanout_publisher_open(&publisher, "127.0.0.1", port, publisherDevices, Devices, 5));
+
+    static received r;
+    memset(&r, 0, sizeof(r));
+    kinetic_sample_record expected[Devices];
+    for (uint32_t tick = 0; tick < Ticks; ++tick) {
+        for (uint32_t d = 0; d < Devices; ++d) {
+            uint8_t systemId[6];
+            device_id(d, systemId);
+            smart_control_power_data data = device_data(d, tick);
+            kinetic_fanout_update_smart_control(&publisher.encoder, d, systemId, &data);
+            expected[d] = smart_control_sample_pack(&data, 0);
+        }
+        CHECK(kinetic_fanout_publisher_tick(&publisher, 250000ull * (tick + 1)) == 1);
+        size_t before = r.samples;
+        for (int attempt = 0; attempt < 20 && r.samples < before + Devices; ++attempt) {
+            CHECK(kinetic_fanout_subscriber_receive(&subscriber, 100, collect_sample, &r) >= 0);
+        }
+        CHECK(r.samples == before + Devices);
+        for (uint32_t d = 0; d < Devices; ++d) {
+            CHECK(same_sample(&r.last[d], &expected[d]));
+        }
+    }
+    // 250 ms between ticks
+    CHECK(r.last[0].timeDelta == 250);
+    CHECK(publisher.datagramsSent == Ticks && publisher.sendErrors == 0);
+    CHECK(subscriber.decoder.lost == 0 && subscriber.decoder.rejected == 0);
+    kinetic_fanout_publisher_close(&publisher);
+    kinetic_fanout_subscriber_close(&subscriber);
+}
+
+int main(void)
+{
+    test_encode_decode();
+    test_default_keyframes();
+    test_loopback();
+    return check_result("fanout");
+}
@@ -0,0 +1,206 @@
+//
+//  filters.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+//  Filter bank regression tests: SMA, EMA, weighted SMA and median against naive references that keep every sample,
+//  over noisy series with ties and spikes, for windows from 1 to past KINETIC_FILTER_WINDOW_MAX, through window
+//  eviction, kinetic_filter_reset and zeroResets. Weights below 1 are clamped.
+//
+
+#include <stdint.h>
+#include <string.h>
+
+#include "check.h"
+#include "FilterBank.h"
+
+#define SAMPLES         5000
+#define RESET_AT        2000
+
+static uint32_t randomState = 0x1234567;
+
+static double uniform(void)
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState / 4294967296.0;
+}
+
+// Power-like samples: a drifting level, whole watts (ties), spikes and now and then a 0
+static void random_series(double *samples, size_t count)
+{
+    double level = 200;
+    for (size_t i = 0; i < count; ++i) {
+        level += (uniform() - 0.5) * 10;
+        double sample = round(level + (uniform() - 0.5) * 40);
+        if (uniform() < 0.01) {
+            sample += 1500;
+        }
+        samples[i] = uniform() < 0.01 ? 0 : sample;
+    }
+}
+
+static int compare(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// The filter output from scratch: the samples since the last (re)start, the newest at index count - 1
+static double reference(kinetic_filter_type type, const double *samples, size_t count, size_t window, double weight, double ema)
+{
+    size_t n = count < window ? count : window;
+    const double *last = &samples[count - n];
+    double sum = 0;
+    switch (type) {
+        case KINETIC_FILTER_SMA:
+            for (size_t i = 0; i < n; ++i) {
+                sum += last[i];
+            }
+            return sum / n;
+        case KINETIC_FILTER_WEIGHTED_SMA:
+            for (size_t i = 0; i + 1 < n; ++i) {
+                sum += last[i];
+            }
+            return (sum + weight * last[n - 1]) / (weight + n - 1);
+        case KINETIC_FILTER_MEDIAN: {
+            double sorted[KINETIC_FILTER_WINDOW_MAX];
+            memcpy(sorted, last, n * sizeof(double));
+            qsort(sorted, n, sizeof(double), compare);
+            return n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) * 0.5;
+        }
+        case KINETIC_FILTER_EMA:
+            return count == 1 ? samples[0] : ema + weight * (samples[count - 1] - ema);
+        default:
+            return samples[count - 1];
+    }
+}
+
+static void init(kinetic_filter *filter, kinetic_filter_type type, uint16_t window, double weight)
+{
+    switch (type) {
+        case KINETIC_FILTER_SMA:
+            kinetic_filter_init_sma(filter, window);
+            break;
+        case KINETIC_FILTER_EMA:
+            kinetic_filter_init_ema(filter, weight);
+            break;
+        case KINETIC_FILTER_WEIGHTED_SMA:
+            kinetic_filter_init_weighted_sma(filter, window, weight);
+            break;
+        default:
+            kinetic_filter_init_median(filter, window);
+            break;
+    }
+}
+
+static size_t run(kinetic_filter_type type, uint16_t window, double weight, bool zeroResets, const double *samples)
+{
+    kinetic_filter filter;
+    init(&filter, type, window, weight);
+    filter.zeroResets = zeroResets;
+    size_t effectiveWindow = window < 1 ? 1 : window > KINETIC_FILTER_WINDOW_MAX ? KINETIC_FILTER_WINDOW_MAX : window;
+    double effectiveWeight = type == KINETIC_FILTER_WEIGHTED_SMA && !(weight >= 1) ? 1 : weight;
+
+    size_t wrong = 0, start = 0;
+    double expected = 0;
+    for (size_t i = 0; i < SAMPLES; ++i) {
+        if (i == RESET_AT) {
+            kinetic_filter_reset(&filter);
+            start = i;
+        }
+        double value = kinetic_filter_update(&filter, samples[i]);
+        if (zeroResets && samples[i] == 0) {
+            wrong += value != 0;
+            start = i + 1;
+            continue;
+        }
+        expected = reference(type, &samples[start], i + 1 - start, effectiveWindow, effectiveWeight, expected);
+        if (!(fabs(value - expected) <= 1e-9 * fabs(expected) + 1e-9)) {
+            if (wrong++ < 3) {
+                fprintf(stderr, "type %d window %d weight %g: sample %zu filtered to %.12g, expected %.12g\n", type, window,
+                        weight, i, value, expected);
+            }
+        }
+    }
+    return wrong;
+}
+
+static void test_against_reference(void)
+{
+    static double samples[SAMPLES];
+    random_series(samples, SAMPLES);
+    const uint16_t windows[] = { 0, 1, 2, 3, 5, 8, 31, 64, 100 };
+    const double weights[] = { 1, 2, 3.5 };
+    size_t wrong = 0;
+    for (int zeroResets = 0; zeroResets < 2; ++zeroResets) {
+        for (size_t w = 0; w < sizeof(windows) / sizeof(windows[0]); ++w) {
+            wrong += run(KINETIC_FILTER_SMA, windows[w], 1, zeroResets, samples);
+            wrong += run(KINETIC_FILTER_MEDIAN, windows[w], 1, zeroResets, samples);
+            for (size_t k = 0; k < sizeof(weights) / sizeof(weights[0]); ++k) {
+                wrong += run(KINETIC_FILTER_WEIGHTED_SMA, windows[w], weights[k], zeroResets, samples);
+            }
+        }
+        const double alphas[] = { 0.05, 0.2, 2.0 / 9, 1 };
+        for (size_t a = 0; a < sizeof(alphas) / sizeof(alphas[0]); ++a) {
+            wrong += run(KINETIC_FILTER_EMA, 1, alphas[a], zeroResets, samples);
+        }
+    }
+    CHECK(wrong == 0);
+}
+
+static void test_clamped_parameters(void)
+{
+    static double samples[SAMPLES];
+    random_series(samples, SAMPLES);
+    // weights below 1 (0 used to divide by 0 on the first sample) act as a simple moving average
+    const double weights[] = { 0, -2, 0.5, NAN };
+    for (size_t k = 0; k < sizeof(weights) / sizeof(weights[0]); ++k) {
+        kinetic_filter filter;
+        kinetic_filter_init_weighted_sma(&filter, 4, weights[k]);
+        CHECK(filter.weight == 1);
+        CHECK(run(KINETIC_FILTER_WEIGHTED_SMA, 4, weights[k], false, samples) == 0);
+    }
+
+    // EMA alpha is clamped to 0 ... 1
+    kinetic_filter filter;
+    kinetic_filter_init_ema(&filter, 3);
+    CHECK(filter.weight == 1);
+    kinetic_filter_init_ema(&filter, -1);
+    CHECK(kinetic_filter_update(&filter, 10) == 10 && kinetic_filter_update(&filter, 20) == 10);
+}
+
+static void test_channels(void)
+{
+    kinetic_filter power, cadence;
+    kinetic_filter_init_sma(&power, 2);
+    kinetic_filter_init_median(&cadence, 3);
+    kinetic_channel_filters filters = { { &power, NULL, &cadence, NULL } };
+
+    smart_control_power_data data = { SMART_CONTROL_MODE_ERG, 200, 30.5, 90, 200 };
+    smart_control_filter_power_data(&filters, &data);
+    data.power = 203;
+    data.cadenceRPM = 250;
+    smart_control_filter_power_data(&filters, &data);
+    // (200 + 203) / 2 rounded, median of 90 and 250, speed untouched
+    CHECK(data.power == 202 && data.cadenceRPM == 170 && data.speedKPH == 30.5);
+
+    inride_power_data inRide;
+    memset(&inRide, 0, sizeof(inRide));
+    inRide.power = 101;
+    inRide.rollerRPM = 1200;
+    kinetic_filter_reset(&power);
+    inride_filter_power_data(&filters, &inRide);
+    inRide.power = 104;
+    inride_filter_power_data(&filters, &inRide);
+    CHECK(inRide.power == 103 && inRide.rollerRPM == 1200);
+}
+
+int main(void)
+{
+    test_against_reference();
+    test_clamped_parameters();
+    test_channels();
+    return check_result("filters");
+}
@@ -0,0 +1,252 @@
+//
+//  fit.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+//  FIT writer regression tests. The file is read back with a separate (bitwise) CRC-16 and message parser:
+//  - header CRC, data size and the file CRC the writer combines without reading the data back
+//  - one record per second with the second's average power, then lap, session and activity
+//  - a file flushed mid ride (crash) has a valid header for the data written so far
+//
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "FitWriter.h"
+
+#define FIT_EPOCH       631065600
+#define START_TIME      1500000000.0
+#define SECONDS         600
+#define FIT_PATH        "fit-ride.fit"
+#define FILE_MAX        65536
+
+static uint16_t fit_crc(uint16_t crc, const uint8_t *data, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc & 1) ? (uint16_t)((crc >> 1) ^ 0xA001) : (uint16_t)(crc >> 1);
+        }
+    }
+    return crc;
+}
+
+static uint32_t get32(const uint8_t *data)
+{
+    return data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+static size_t read_file(const char *path, uint8_t *data, size_t capacity)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t size = read(fd, data, capacity);
+    close(fd);
+    return size > 0 ? (size_t)size : 0;
+}
+
+// Sample power of a second (constant within the second, so the record carries it exactly)
+static double ride_power(uint32_t second)
+{
+    return 100 + (second % 60) * 3;
+}
+
+typedef struct fit_definition
+{
+    bool defined;
+    uint16_t global;
+    uint8_t fieldCount;
+    uint8_t fields[16][3];
+} fit_definition;
+
+typedef struct fit_contents
+{
+    size_t records;
+    size_t laps;
+    size_t sessions;
+    size_t activities;
+    size_t fileIds;
+    uint32_t firstTimestamp;
+    uint32_t lastTimestamp;
+    uint32_t lastDistance;
+    size_t powerErrors;
+    uint16_t sessionAveragePower;
+    uint16_t sessionMaxPower;
+} fit_contents;
+
+static uint32_t field_value(const uint8_t *data, uint8_t size)
+{
+    uint32_t value = 0;
+    for (uint8_t i = 0; i < size && i < 4; ++i) {
+        value |= (uint32_t)data[i] << (8 * i);
+    }
+    return value;
+}
+
+// Walks the messages of the data section, false if they do not end exactly at its end
+static bool parse_messages(const uint8_t *data, size_t size, fit_contents *contents)
+{
+    fit_definition definitions[16] = { { 0 } };
+    size_t offset = 0;
+    while (offset < size) {
+        uint8_t header = data[offset++];
+        if (header & 0x80) {
+            return false;   // compressed timestamps are not written
+        }
+        fit_definition *definition = &definitions[header & 0x0F];
+        if (header & 0x40) {
+            if (offset + 5 > size || data[offset + 1] != 0) {
+                return false;
+            }
+            definition->defined = true;
+            definition->global = (uint16_t)(data[offset + 2] | data[offset + 3] << 8);
+            definition->fieldCount = data[offset + 4];
+            offset += 5;
+            if (definition->fieldCount > 16 || offset + 3 * definition->fieldCount > size) {
+                return false;
+            }
+            memcpy(definition->fields, &data[offset], 3 * definition->fieldCount);
+            offset += 3 * definition->fieldCount;
+            continue;
+        }
+        if (!definition->defined) {
+            return false;
+        }
+
+        uint32_t timestamp = 0, power = 0, distance = 0, averagePower = 0, maxPower = 0;
+        for (uint8_t f = 0; f < definition->fieldCount; ++f) {
+            uint8_t number = definition->fields[f][0], fieldSize = definition->fields[f][1];
+            if (offset + fieldSize > size) {
+                return false;
+            }
+            uint32_t value = field_value(&data[offset], fieldSize);
+            offset += fieldSize;
+            if (number == 253) {
+                timestamp = value;
+            } else if (definition->global == 20 && number == 7) {
+                power = value;
+            } else if (definition->global == 20 && number == 5) {
+                distance = value;
+            } else if (definition->global == 18 && number == 20) {
+                averagePower = value;
+            } else if (definition->global == 18 && number == 21) {
+                maxPower = value;
+            }
+        }
+        switch (definition->global) {
+            case 0:
+                contents->fileIds++;
+                break;
+            case 20:
+                if (contents->records++ == 0) {
+                    contents->firstTimestamp = timestamp;
+                }
+                contents->lastTimestamp = timestamp;
+                contents->lastDistance = distance;
+                if (power != (uint32_t)ride_power(timestamp - (uint32_t)(START_TIME - FIT_EPOCH))) {
+                    contents->powerErrors++;
+                }
+                break;
+            case 19:
+                contents->laps++;
+                break;
+            case 18:
+                contents->sessions++;
+                contents->sessionAveragePower = (uint16_t)averagePower;
+                contents->sessionMaxPower = (uint16_t)maxPower;
+                break;
+            case 34:
+                contents->activities++;
+                break;
+        }
+    }
+    return offset == size;
+}
+
+static void check_header(const uint8_t *file, size_t size, size_t expectedData)
+{
+    CHECK(size >= KINETIC_FIT_HEADER_SIZE);
+    CHECK(file[0] == KINETIC_FIT_HEADER_SIZE);
+    CHECK(memcmp(&file[8], ".FIT", 4) == 0);
+    CHECK((uint16_t)(file[12] | file[13] << 8) == fit_crc(0, file, 12));
+    CHECK(get32(&file[4]) == expectedData);
+}
+
+static void test_ride(void)
+{
+    // the smallest buffer: the data goes out in many writes, the CRC is combined over all of them
+    uint8_t buffer[64];
+    kinetic_fit_writer writer;
+    CHECK(kinetic_fit_writer_open(&writer, FIT_PATH, buffer, sizeof(buffer), START_TIME, 1234, 0xC47F5102));
+
+    double powerSum = 0;
+    for (uint32_t s = 0; s < SECONDS; ++s) {
+        for (int q = 0; q < 4; ++q) {
+            CHECK(kinetic_fit_writer_add(&writer, START_TIME + s + q * 0.25, ride_power(s), 30, 90));
+        }
+        powerSum += ride_power(s);
+        if (s == SECONDS / 2) {
+            CHECK(kinetic_fit_writer_flush(&writer));
+        }
+    }
+    CHECK(kinetic_fit_writer_close(&writer));
+
+    static uint8_t file[FILE_MAX];
+    size_t size = read_file(FIT_PATH, file, sizeof(file));
+    CHECK(size > KINETIC_FIT_HEADER_SIZE + 2 && size < sizeof(file));
+    check_header(file, size, size - KINETIC_FIT_HEADER_SIZE - 2);
+    CHECK((uint16_t)(file[size - 2] | file[size - 1] << 8) == fit_crc(0, file, size - 2));
+    CHECK(fit_crc(0, file, size) == 0);
+
+    fit_contents contents = { 0 };
+    CHECK(parse_messages(&file[KINETIC_FIT_HEADER_SIZE], size - KINETIC_FIT_HEADER_SIZE - 2, &contents));
+    CHECK(contents.fileIds == 1);
+    CHECK(contents.records == SECONDS);
+    CHECK(contents.powerErrors == 0);
+    CHECK(contents.firstTimestamp == (uint32_t)(START_TIME - FIT_EPOCH));
+    CHECK(contents.lastTimestamp == contents.firstTimestamp + SECONDS - 1);
+    // 30 KPH from the first to the last sample (cm)
+    CHECK_NEAR(contents.lastDistance, 30 / 3.6 * (SECONDS - 0.25) * 100, 1);
+    CHECK(contents.laps == 1 && contents.sessions == 1 && contents.activities == 1);
+    CHECK(contents.sessionAveragePower == (uint16_t)lround(powerSum / SECONDS));
+    CHECK(contents.sessionMaxPower == 100 + 59 * 3);
+    unlink(FIT_PATH);
+}
+
+static void test_flushed_file(void)
+{
+    uint8_t buffer[4096];
+    kinetic_fit_writer writer;
+    CHECK(kinetic_fit_writer_open(&writer, FIT_PATH, buffer, sizeof(buffer), START_TIME, 1234, 1));
+    for (uint32_t s = 0; s < 120; ++s) {
+        CHECK(kinetic_fit_writer_add(&writer, START_TIME + s, ride_power(s), 25, 80));
+    }
+    CHECK(kinetic_fit_writer_flush(&writer));
+
+    // what a reader finds if the process dies here: no file CRC yet, but a header that covers the data
+    static uint8_t file[FILE_MAX];
+    size_t size = read_file(FIT_PATH, file, sizeof(file));
+    check_header(file, size, size - KINETIC_FIT_HEADER_SIZE);
+    fit_contents contents = { 0 };
+    CHECK(parse_messages(&file[KINETIC_FIT_HEADER_SIZE], size - KINETIC_FIT_HEADER_SIZE, &contents));
+    CHECK(contents.records == 119);
+    CHECK(contents.powerErrors == 0);
+
+    CHECK(kinetic_fit_writer_close(&writer));
+    size = read_file(FIT_PATH, file, sizeof(file));
+    CHECK(fit_crc(0, file, size) == 0);
+    unlink(FIT_PATH);
+}
+
+int main(void)
+{
+    test_ride();
+    test_flushed_file();
+    return check_result("fit");
+}
@@ -0,0 +1,113 @@
+//
+//  registry.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+//  Device registry regression tests: indexes, cached strings and command keys of a registry filled to its limit,
+//  re-interning, type upgrades and the frame sizes of each type, and the rejected cases (wrong length, full table, bad capacity).
+//
+
+#include <stdint.h>
+#include <string.h>
+
+#include "check.h"
+#include "DeviceRegistry.h"
+#include "inRide.h"
+
+#define CAPACITY        4096
+#define DEVICES         (CAPACITY * 3 / 4)
+
+static void device_id(uint32_t index, uint8_t systemId[6])
+{
+    // neighbouring ids and ids that differ in the high bytes only
+    uint32_t mixed = index * 2654435761u;
+    const uint8_t id[6] = { (uint8_t)(index & 1 ? mixed >> 24 : 0xC4), (uint8_t)(mixed >> 16), 0x51,
+                            (uint8_t)(index >> 16), (uint8_t)(index >> 8), (uint8_t)index };
+    memcpy(systemId, id, 6);
+}
+
+static bool frame_sizes(const kinetic_registry_entry *entry, uint8_t power, uint8_t config)
+{
+    return entry->powerFrameSize == power && entry->configFrameSize == config;
+}
+
+static void test_fill(void)
+{
+    static kinetic_registry_entry entries[CAPACITY];
+    kinetic_registry registry;
+    CHECK(!kinetic_registry_init(&registry, entries, 3000));
+    CHECK(kinetic_registry_init(&registry, entries, CAPACITY));
+
+    size_t wrong = 0;
+    for (uint32_t i = 0; i < DEVICES; ++i) {
+        uint8_t systemId[6];
+        device_id(i, systemId);
+        kinetic_capture_device type = i % 3 == 0 ? KINETIC_CAPTURE_DEVICE_UNKNOWN : KINETIC_CAPTURE_DEVICE_SMART_CONTROL;
+        kinetic_registry_entry *entry = kinetic_registry_intern(&registry, systemId, 6, type);
+        if (entry == NULL) {
+            wrong++;
+            continue;
+        }
+        char string[KINETIC_SYSTEM_ID_STRING_SIZE];
+        snprintf(string, sizeof(string), "%02x%02x%02x%02x%02x%02x", systemId[0], systemId[1], systemId[2], systemId[3],
+                 systemId[4], systemId[5]);
+        wrong += entry->index != i || strcmp(entry->string, string) != 0 || entry->commandKey != inride_command_key(systemId) ||
+                 memcmp(entry->systemId, systemId, 6) != 0 || entry->type != type ||
+                 entry->key != kinetic_system_id_key(systemId) ||
+                 !(type == KINETIC_CAPTURE_DEVICE_UNKNOWN ? frame_sizes(entry, 0, 0) : frame_sizes(entry, 20, 20));
+    }
+    CHECK(wrong == 0);
+    CHECK(registry.count == DEVICES);
+
+    // full: known devices are still found, new ones are rejected
+    uint8_t systemId[6];
+    device_id(DEVICES, systemId);
+    CHECK(kinetic_registry_intern(&registry, systemId, 6, KINETIC_CAPTURE_DEVICE_INRIDE) == NULL);
+    CHECK(kinetic_registry_find(&registry, systemId) == NULL);
+
+    wrong = 0;
+    for (uint32_t i = 0; i < DEVICES; ++i) {
+        device_id(i, systemId);
+        kinetic_registry_entry *found = kinetic_registry_find(&registry, systemId);
+        kinetic_registry_entry *again = kinetic_registry_intern(&registry, systemId, 6, KINETIC_CAPTURE_DEVICE_INRIDE);
+        // a known type replaces an unknown one, never another known type
+        kinetic_capture_device type = i % 3 == 0 ? KINETIC_CAPTURE_DEVICE_INRIDE : KINETIC_CAPTURE_DEVICE_SMART_CONTROL;
+        wrong += found == NULL || again != found || found->index != i || found->type != type || !frame_sizes(found, 20, 20) ||
+                 kinetic_registry_find_key(&registry, kinetic_system_id_key(systemId)) != found;
+    }
+    CHECK(wrong == 0);
+    CHECK(registry.count == DEVICES);
+
+    CHECK(kinetic_registry_intern(&registry, systemId, 5, KINETIC_CAPTURE_DEVICE_INRIDE) == NULL);
+    CHECK(kinetic_registry_intern(&registry, NULL, 6, KINETIC_CAPTURE_DEVICE_INRIDE) == NULL);
+
+    // cleared: indexes restart
+    kinetic_registry_clear(&registry);
+    CHECK(registry.count == 0 && kinetic_registry_find(&registry, systemId) == NULL);
+    kinetic_registry_entry *entry = kinetic_registry_intern(&registry, systemId, 6, KINETIC_CAPTURE_DEVICE_INRIDE);
+    CHECK(entry != NULL && entry->index == 0 && frame_sizes(entry, 20, 20));
+    // a device seen as unknown takes the frame sizes of the type it turns out to be, an unknown type changes nothing
+    device_id(1, systemId);
+    entry = kinetic_registry_intern(&registry, systemId, 6, KINETIC_CAPTURE_DEVICE_UNKNOWN);
+    CHECK(entry != NULL && entry->index == 1 && frame_sizes(entry, 0, 0));
+    CHECK(kinetic_registry_intern(&registry, systemId, 6, KINETIC_CAPTURE_DEVICE_UNKNOWN) == entry && frame_sizes(entry, 0, 0));
+    CHECK(kinetic_registry_intern(&registry, systemId, 6, KINETIC_CAPTURE_DEVICE_SMART_CONTROL) == entry);
+    CHECK(entry->type == KINETIC_CAPTURE_DEVICE_SMART_CONTROL && frame_sizes(entry, 20, 20));
+}
+
+static void test_strings(void)
+{
+    const uint8_t systemId[6] = { 0x00, 0xAB, 0x0F, 0xF0, 0x7E, 0x01 };
+    uint64_t key = kinetic_system_id_key(systemId);
+    CHECK(key == 0x00AB0FF07E01ull);
+    char string[KINETIC_SYSTEM_ID_STRING_SIZE];
+    kinetic_system_id_string(key, string);
+    CHECK(strcmp(string, "00ab0ff07e01") == 0);
+}
+
+int main(void)
+{
+    test_fill();
+    test_strings();
+    return check_result("registry");
+}
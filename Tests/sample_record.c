@@ -0,0 +1,172 @@
+//
+//  sample_record.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+//  Sample record regression tests:
+//  - single record pack / unpack / repack for both device types
+//  - time deltas: milliseconds up to 24 bits, seconds past that, saturation
+//  - array pack -> column unpack: timestamps stay within 1 ms over a long jittery series with gaps of minutes and
+//    hours, also when the series is packed in several calls
+//
+
+#include <stdint.h>
+#include <string.h>
+
+#include "check.h"
+#include "Emulator.h"
+#include "SampleRecord.h"
+
+#define SERIES_SAMPLES  200000
+#define CHUNK_SAMPLES   7919
+
+static const uint8_t systemId[6] = { 0xC4, 0x7F, 0x51, 0x02, 0x9A, 0x3B };
+
+static void test_single_records(void)
+{
+    CHECK(sizeof(kinetic_sample_record) == 16);
+
+    smart_control_power_data data = { SMART_CONTROL_MODE_SIMULATION, 312, 38.456, 97, 305 };
+    kinetic_sample_record record = smart_control_sample_pack(&data, 250);
+    CHECK(record.timeDelta == 250 && kinetic_sample_time_delta(&record) == 250);
+    CHECK(record.flags == KINETIC_SAMPLE_FLAG_SMART_CONTROL);
+    smart_control_power_data unpacked = smart_control_sample_unpack(&record);
+    CHECK(unpacked.mode == data.mode && unpacked.power == data.power && unpacked.cadenceRPM == data.cadenceRPM);
+    CHECK(unpacked.targetResistance == data.targetResistance);
+    CHECK_NEAR(unpacked.speedKPH, data.speedKPH, 0.0005);
+    kinetic_sample_record repacked = smart_control_sample_pack(&unpacked, 250);
+    CHECK(memcmp(&repacked, &record, sizeof(record)) == 0);
+
+    kinetic_emulator_device device;
+    kinetic_emulator_init_inride(&device, systemId, 9);
+    device.inRide.spindownTicks = (uint32_t)(1.6 * 32768);
+    device.speedKPH = 33;
+    device.cadenceRPM = 85;
+    uint8_t frame[20];
+    inride_power_data power;
+    for (int i = 0; i < 3; ++i) {
+        kinetic_emulator_power_frame(&device, frame);
+        power = inride_process_power_data(frame);
+    }
+    // over 65.535 s: still milliseconds
+    record = inride_sample_pack(&power, 70001);
+    CHECK(kinetic_sample_time_delta(&record) == 70001 && !(record.flags & KINETIC_SAMPLE_FLAG_TIME_SECONDS));
+    inride_power_data unpackedInRide = inride_sample_unpack(&record);
+    CHECK(unpackedInRide.power == power.power && unpackedInRide.state == power.state);
+    CHECK(unpackedInRide.coasting == power.coasting && unpackedInRide.proFlywheel == power.proFlywheel);
+    CHECK_NEAR(unpackedInRide.speedKPH, power.speedKPH, 0.0005);
+    CHECK_NEAR(unpackedInRide.cadenceRPM, power.cadenceRPM, 0.05);
+    CHECK_NEAR(unpackedInRide.rollerResistance, power.rollerResistance, 1.0 / 65535);
+    repacked = inride_sample_pack(&unpackedInRide, 70001);
+    CHECK(memcmp(&repacked, &record, sizeof(record)) == 0);
+}
+
+static void test_time_deltas(void)
+{
+    kinetic_sample_record record;
+    memset(&record, 0, sizeof(record));
+    record.flags = KINETIC_SAMPLE_FLAG_COASTING;
+
+    CHECK(kinetic_sample_set_time_delta(&record, 0xFFFFFF) == 0xFFFFFF);
+    CHECK(kinetic_sample_time_delta(&record) == 0xFFFFFF && record.flags == KINETIC_SAMPLE_FLAG_COASTING);
+
+    // 4.6 hours and more: seconds, rounded
+    CHECK(kinetic_sample_set_time_delta(&record, 0x1000000) == 16777000);
+    CHECK(record.flags == (KINETIC_SAMPLE_FLAG_COASTING | KINETIC_SAMPLE_FLAG_TIME_SECONDS));
+    CHECK(kinetic_sample_set_time_delta(&record, 5 * 3600000ull + 499) == 5 * 3600000ull);
+    CHECK(kinetic_sample_set_time_delta(&record, 5 * 3600000ull + 500) == 5 * 3600000ull + 1000);
+
+    // past 194 days: saturated
+    CHECK(kinetic_sample_set_time_delta(&record, 400 * 86400000ull) == 0xFFFFFFull * 1000);
+
+    // back to milliseconds: the flag is cleared, the other flags are kept
+    CHECK(kinetic_sample_set_time_delta(&record, 12) == 12 && record.flags == KINETIC_SAMPLE_FLAG_COASTING);
+}
+
+// A ride at about 4 Hz with jittery arrival times, a pause of a few minutes, a 70 s dropout and an overnight break
+static void series_timestamps(double *timestamps, size_t count)
+{
+    double time = 1500000000.123456;
+    uint32_t state = 0x9E3779B9;
+    for (size_t i = 0; i < count; ++i) {
+        state = state * 1664525 + 1013904223;
+        time += 0.25 + (state >> 8) / 16777216.0 * 0.0007;
+        if (i == 1000) {
+            time += 70.0004;
+        } else if (i == 50000) {
+            time += 185.2;
+        } else if (i == 120000) {
+            time += 9 * 3600 + 0.6;
+        }
+        timestamps[i] = time;
+    }
+}
+
+static void check_timestamps(const double *expected, const double *actual, size_t count, const char *name)
+{
+    size_t wrong = 0;
+    double largest = 0;
+    for (size_t i = 0; i < count; ++i) {
+        double error = fabs(actual[i] - expected[i]);
+        // the record after the overnight break is counted in seconds
+        double tolerance = i == 120000 ? 0.5005 : 0.0010001;
+        largest = fmax(largest, i == 120000 ? 0 : error);
+        if (!(error <= tolerance) && wrong++ < 5) {
+            fprintf(stderr, "%s: sample %zu at %.4f, expected %.4f\n", name, i, actual[i], expected[i]);
+        }
+    }
+    CHECK(wrong == 0);
+    CHECK(largest <= 0.0010001);
+}
+
+static void test_series(void)
+{
+    static double timestamps[SERIES_SAMPLES], unpacked[SERIES_SAMPLES];
+    static smart_control_power_data data[SERIES_SAMPLES];
+    static inride_power_data inRideData[SERIES_SAMPLES];
+    static kinetic_sample_record records[SERIES_SAMPLES];
+    static uint16_t power[SERIES_SAMPLES];
+    static float speedKPH[SERIES_SAMPLES];
+    series_timestamps(timestamps, SERIES_SAMPLES);
+    for (size_t i = 0; i < SERIES_SAMPLES; ++i) {
+        data[i] = (smart_control_power_data){ SMART_CONTROL_MODE_ERG, (uint16_t)(150 + i % 200), 20 + (i % 1000) * 0.031,
+                                              (uint8_t)(80 + i % 20), 200 };
+        memset(&inRideData[i], 0, sizeof(inRideData[i]));
+        inRideData[i].power = (int16_t)(i % 700);
+        inRideData[i].speedKPH = (i % 500) * 0.1;
+    }
+
+    // the first record is relative to previousTimestamp
+    smart_control_sample_pack_array(data, timestamps, timestamps[0] - 0.25, SERIES_SAMPLES, records);
+    CHECK(records[1000].flags == KINETIC_SAMPLE_FLAG_SMART_CONTROL && kinetic_sample_time_delta(&records[1000]) > 70000);
+    CHECK(records[120000].flags & KINETIC_SAMPLE_FLAG_TIME_SECONDS);
+    kinetic_sample_columns columns = { unpacked, power, speedKPH, NULL, NULL };
+    double last = kinetic_sample_unpack_columns(records, SERIES_SAMPLES, timestamps[0] - 0.25, &columns);
+    CHECK(last == unpacked[SERIES_SAMPLES - 1]);
+    check_timestamps(timestamps, unpacked, SERIES_SAMPLES, "smart control");
+    size_t wrong = 0;
+    for (size_t i = 0; i < SERIES_SAMPLES; ++i) {
+        wrong += power[i] != data[i].power || fabsf(speedKPH[i] - (float)data[i].speedKPH) > 0.001f;
+    }
+    CHECK(wrong == 0);
+
+    // packed in chunks, each continuing from the previous chunk's last timestamp, unpacked in one pass
+    for (size_t start = 0; start < SERIES_SAMPLES; start += CHUNK_SAMPLES) {
+        size_t count = SERIES_SAMPLES - start < CHUNK_SAMPLES ? SERIES_SAMPLES - start : CHUNK_SAMPLES;
+        double previous = start == 0 ? timestamps[0] : timestamps[start - 1];
+        inride_sample_pack_array(&inRideData[start], &timestamps[start], previous, count, &records[start]);
+    }
+    CHECK(kinetic_sample_time_delta(&records[0]) == 0);
+    columns = (kinetic_sample_columns){ unpacked, power, NULL, NULL, NULL };
+    kinetic_sample_unpack_columns(records, SERIES_SAMPLES, timestamps[0], &columns);
+    check_timestamps(timestamps, unpacked, SERIES_SAMPLES, "inride");
+    CHECK(power[SERIES_SAMPLES - 1] == (SERIES_SAMPLES - 1) % 700);
+}
+
+int main(void)
+{
+    test_single_records();
+    test_time_deltas();
+    test_series();
+    return check_result("sample_record");
+}
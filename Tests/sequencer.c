@@ -0,0 +1,274 @@
+//
+//  sequencer.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+//  inRide command sequencer regression tests, against the emulated sensor:
+//  - a batch of boostThreshold commands or more switches to the fast rate first and restores the default rate after
+//  - a lost write or a lost result is retried, after maxAttempts the command is reported as INRIDE_COM_RESULT_NONE
+//  - a config command queued in a boosted batch is sent at the fast rate, the restore applies its rate
+//  - INRIDE_COM_RESULT_CALIBRATION_RESULT does not complete the command in flight
+//
+
+#include <stdint.h>
+#include <string.h>
+
+#include "check.h"
+#include "CommandSequencer.h"
+#include "Emulator.h"
+
+#define OUTCOMES_MAX    32
+#define WRITES_MAX      64
+#define TIME_STEP       (1.0 / 64)
+
+typedef struct bench
+{
+    kinetic_emulator_device device;
+    inride_sequencer sequencer;
+    double now;
+
+    size_t outcomes;
+    uint32_t tag[OUTCOMES_MAX];
+    inride_command_result result[OUTCOMES_MAX];
+    uint8_t attempts[OUTCOMES_MAX];
+    double completed[OUTCOMES_MAX];
+
+    size_t writes;
+    uint8_t written[WRITES_MAX][INRIDE_SEQUENCER_COMMAND_MAX];
+    size_t writtenSize[WRITES_MAX];
+
+    /*! Writes of this command that never reach the sensor */
+    uint8_t lostCommand[INRIDE_SEQUENCER_COMMAND_MAX];
+    size_t lostCommandSize;
+    int lostWrites;
+    /*! Command results that never reach the sequencer */
+    int lostResults;
+} bench;
+
+static uint8_t systemId[6] = { 0xC4, 0x7F, 0x51, 0x02, 0x9A, 0x3B };
+
+static void on_outcome(void *context, uint32_t tag, inride_command_result result, uint8_t attempts)
+{
+    bench *b = context;
+    if (b->outcomes < OUTCOMES_MAX) {
+        b->tag[b->outcomes] = tag;
+        b->result[b->outcomes] = result;
+        b->attempts[b->outcomes] = attempts;
+        b->completed[b->outcomes] = b->now;
+    }
+    b->outcomes++;
+}
+
+static void on_frame(void *context, size_t deviceIndex, const uint8_t *data, size_t size)
+{
+    (void)deviceIndex;
+    bench *b = context;
+    CHECK(size == 20);
+    uint8_t frame[20];
+    memcpy(frame, data, 20);
+    inride_power_data power = inride_process_power_data(frame);
+    if (power.commandResult != INRIDE_COM_RESULT_NONE && b->lostResults > 0) {
+        b->lostResults--;
+        return;
+    }
+    inride_sequencer_power_update(&b->sequencer, power.commandResult);
+}
+
+static void bench_init(bench *b)
+{
+    memset(b, 0, sizeof(*b));
+    kinetic_emulator_init_inride(&b->device, systemId, 21);
+    inride_sequencer_init(&b->sequencer, systemId, INRIDE_UPDATE_RATE_1000, on_outcome, b);
+    b->now = 100;
+    b->device.nextUpdate = b->now;
+}
+
+// Runs the sensor and the sequencer until the sequencer is idle (or for the given time)
+static void bench_run(bench *b, double seconds)
+{
+    double end = b->now + seconds;
+    while (b->now < end) {
+        kinetic_emulator_step(&b->device, 1, b->now, on_frame, b);
+        uint8_t data[INRIDE_SEQUENCER_COMMAND_MAX];
+        size_t size = inride_sequencer_poll(&b->sequencer, b->now, data);
+        if (size > 0) {
+            if (b->writes < WRITES_MAX) {
+                memcpy(b->written[b->writes], data, size);
+                b->writtenSize[b->writes] = size;
+            }
+            b->writes++;
+            bool lost = b->lostWrites > 0 && size == b->lostCommandSize && memcmp(data, b->lostCommand, size) == 0;
+            if (lost) {
+                b->lostWrites--;
+            } else {
+                kinetic_emulator_write_control_point(&b->device, data, size);
+            }
+        }
+        if (!inride_sequencer_busy(&b->sequencer)) {
+            break;
+        }
+        b->now += TIME_STEP;
+    }
+}
+
+static bool is_config(const bench *b, size_t write, uint16_t rate)
+{
+    const uint8_t *data = b->written[write];
+    return b->writtenSize[write] == sizeof(inride_config_sensor_command) && data[2] == 0x01 && data[11] == (uint8_t)rate &&
+           data[12] == (uint8_t)(rate >> 8);
+}
+
+static void enqueue_spindown(bench *b, double seconds, uint32_t tag)
+{
+    inride_set_spindown_time_command command = inride_create_set_spindown_time_command_data(seconds, systemId);
+    CHECK(inride_sequencer_enqueue(&b->sequencer, &command, sizeof(command), tag));
+}
+
+static void test_boost_and_restore(void)
+{
+    static bench b;
+    bench_init(&b);
+    for (uint32_t tag = 1; tag <= 4; ++tag) {
+        enqueue_spindown(&b, 1.5 + 0.1 * tag, tag);
+    }
+    double start = b.now;
+    bench_run(&b, 30);
+    CHECK(!inride_sequencer_busy(&b.sequencer));
+
+    // boost, the 4 commands in order, restore
+    CHECK(b.writes == 6 && b.outcomes == 4);
+    CHECK(is_config(&b, 0, INRIDE_UPDATE_RATE_250));
+    for (size_t i = 0; i < 4 && i < b.outcomes; ++i) {
+        CHECK(b.tag[i] == i + 1 && b.result[i] == INRIDE_COM_RESULT_SUCCESS && b.attempts[i] == 1);
+        CHECK(b.written[i + 1][2] == 0x05);
+    }
+    CHECK(is_config(&b, 5, INRIDE_UPDATE_RATE_1000));
+    CHECK(b.device.inRide.updateRateDefault == INRIDE_UPDATE_RATE_1000);
+    CHECK(b.sequencer.currentRate == INRIDE_UPDATE_RATE_1000 && !b.sequencer.boosted);
+    CHECK_NEAR(b.device.inRide.spindownTicks / 32768.0, 1.9, 1e-4);
+    // at 4 updates a second the commands after the boost take about a second, not four
+    CHECK(b.outcomes == 4 && b.completed[3] - start < 2.6);
+
+    // below the threshold: no boost
+    bench_init(&b);
+    enqueue_spindown(&b, 1.7, 1);
+    enqueue_spindown(&b, 1.8, 2);
+    bench_run(&b, 30);
+    CHECK(b.writes == 2 && b.outcomes == 2 && b.written[0][2] == 0x05 && b.written[1][2] == 0x05);
+    CHECK(b.device.inRide.updateRateDefault == INRIDE_UPDATE_RATE_1000);
+}
+
+static void test_lost_writes_and_results(void)
+{
+    static bench b;
+    bench_init(&b);
+    b.sequencer.boostThreshold = 0;
+    inride_set_spindown_time_command lost = inride_create_set_spindown_time_command_data(1.65, systemId);
+    memcpy(b.lostCommand, &lost, sizeof(lost));
+    b.lostCommandSize = sizeof(lost);
+
+    // every write of the second command is lost, the third still goes out after it gives up
+    enqueue_spindown(&b, 1.6, 1);
+    CHECK(inride_sequencer_enqueue(&b.sequencer, &lost, sizeof(lost), 2));
+    enqueue_spindown(&b, 1.7, 3);
+    b.lostWrites = b.sequencer.maxAttempts;
+    bench_run(&b, 30);
+
+    CHECK(b.outcomes == 3 && b.lostWrites == 0);
+    CHECK(b.tag[1] == 2 && b.result[1] == INRIDE_COM_RESULT_NONE && b.attempts[1] == b.sequencer.maxAttempts);
+    CHECK(b.tag[2] == 3 && b.result[2] == INRIDE_COM_RESULT_SUCCESS && b.attempts[2] == 1);
+    // 1 + maxAttempts + 1 writes
+    CHECK(b.writes == 2 + (size_t)b.sequencer.maxAttempts);
+    CHECK_NEAR(b.device.inRide.spindownTicks / 32768.0, 1.7, 1e-4);
+
+    // a lost result: the command is sent again and completes on the next attempt
+    bench_init(&b);
+    b.sequencer.boostThreshold = 0;
+    enqueue_spindown(&b, 1.8, 7);
+    b.lostResults = 1;
+    bench_run(&b, 30);
+    CHECK(b.outcomes == 1 && b.tag[0] == 7 && b.result[0] == INRIDE_COM_RESULT_SUCCESS && b.attempts[0] == 2);
+    CHECK(b.writes == 2 && b.lostResults == 0);
+
+    // every result lost: reported as NONE after maxAttempts
+    bench_init(&b);
+    b.sequencer.boostThreshold = 0;
+    enqueue_spindown(&b, 1.8, 8);
+    b.lostResults = 100;
+    bench_run(&b, 30);
+    CHECK(b.outcomes == 1 && b.result[0] == INRIDE_COM_RESULT_NONE && b.attempts[0] == b.sequencer.maxAttempts);
+}
+
+static void test_config_in_batch(void)
+{
+    static bench b;
+    bench_init(&b);
+    enqueue_spindown(&b, 1.6, 1);
+    inride_config_sensor_command config = inride_create_config_sensor_command_data(INRIDE_UPDATE_RATE_500, systemId);
+    CHECK(inride_sequencer_enqueue(&b.sequencer, &config, sizeof(config), 2));
+    // adopted as the rate to restore when queued
+    CHECK(b.sequencer.defaultRate == INRIDE_UPDATE_RATE_500);
+    enqueue_spindown(&b, 1.7, 3);
+    bench_run(&b, 30);
+
+    CHECK(b.writes == 5 && b.outcomes == 3);
+    CHECK(is_config(&b, 0, INRIDE_UPDATE_RATE_250));
+    // the queued config goes out at the fast rate, the rest of the command as queued
+    CHECK(is_config(&b, 2, INRIDE_UPDATE_RATE_250));
+    CHECK(memcmp(b.written[2], &config, 11) == 0 && memcmp(&b.written[2][13], (const uint8_t *)&config + 13, sizeof(config) - 13) == 0);
+    CHECK(is_config(&b, 4, INRIDE_UPDATE_RATE_500));
+    for (size_t i = 0; i < 3 && i < b.outcomes; ++i) {
+        CHECK(b.tag[i] == i + 1 && b.result[i] == INRIDE_COM_RESULT_SUCCESS);
+    }
+    CHECK(b.device.inRide.updateRateDefault == INRIDE_UPDATE_RATE_500);
+    CHECK(b.sequencer.currentRate == INRIDE_UPDATE_RATE_500 && !inride_sequencer_busy(&b.sequencer));
+
+    // not boosted: the config goes out as queued and sets the current rate
+    bench_init(&b);
+    config = inride_create_config_sensor_command_data(INRIDE_UPDATE_RATE_250, systemId);
+    CHECK(inride_sequencer_enqueue(&b.sequencer, &config, sizeof(config), 1));
+    bench_run(&b, 30);
+    CHECK(b.writes == 1 && is_config(&b, 0, INRIDE_UPDATE_RATE_250) && b.sequencer.currentRate == INRIDE_UPDATE_RATE_250);
+}
+
+static void test_calibration_result(void)
+{
+    inride_sequencer sequencer;
+    static bench b;
+    memset(&b, 0, sizeof(b));
+    inride_sequencer_init(&sequencer, systemId, INRIDE_UPDATE_RATE_1000, on_outcome, &b);
+    inride_stop_calibration_command command = inride_create_stop_calibration_command_data(systemId);
+    CHECK(inride_sequencer_enqueue(&sequencer, &command, sizeof(command), 5));
+    uint8_t data[INRIDE_SEQUENCER_COMMAND_MAX];
+    CHECK(inride_sequencer_poll(&sequencer, 0, data) == sizeof(command));
+
+    // the end of a spindown, and updates without a result, leave the command in flight
+    CHECK(!inride_sequencer_power_update(&sequencer, INRIDE_COM_RESULT_CALIBRATION_RESULT));
+    CHECK(!inride_sequencer_power_update(&sequencer, INRIDE_COM_RESULT_NONE));
+    CHECK(b.outcomes == 0 && sequencer.inFlight);
+    CHECK(inride_sequencer_poll(&sequencer, 0.5, data) == 0);
+
+    CHECK(inride_sequencer_power_update(&sequencer, INRIDE_COM_RESULT_INVALID_REQUEST));
+    CHECK(b.outcomes == 1 && b.tag[0] == 5 && b.result[0] == INRIDE_COM_RESULT_INVALID_REQUEST);
+    CHECK(!inride_sequencer_busy(&sequencer));
+    // nothing in flight: results are not taken
+    CHECK(!inride_sequencer_power_update(&sequencer, INRIDE_COM_RESULT_SUCCESS));
+
+    // the queue is bounded, commands must fit
+    for (uint32_t i = 0; i < INRIDE_SEQUENCER_QUEUE_MAX; ++i) {
+        CHECK(inride_sequencer_enqueue(&sequencer, &command, sizeof(command), i));
+    }
+    CHECK(!inride_sequencer_enqueue(&sequencer, &command, sizeof(command), 99));
+    uint8_t tooLarge[INRIDE_SEQUENCER_COMMAND_MAX + 1] = { 0 };
+    inride_sequencer_init(&sequencer, systemId, INRIDE_UPDATE_RATE_1000, NULL, NULL);
+    CHECK(!inride_sequencer_enqueue(&sequencer, tooLarge, sizeof(tooLarge), 1));
+}
+
+int main(void)
+{
+    test_boost_and_restore();
+    test_lost_writes_and_results();
+    test_config_in_batch();
+    test_calibration_result();
+    return check_result("sequencer");
+}
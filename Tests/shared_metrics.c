@@ -0,0 +1,156 @@
+//
+//  shared_metrics.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+//  Shared metrics regression tests:
+//  - publish -> read round trip in one process, through a second (read only) mapping of the segment
+//  - a reader of a replaced segment sees it retired, the reopened segment has the new size and no stale data
+//  - a reader racing a publisher thread only ever copies whole samples
+//
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "SharedMetrics.h"
+
+#define SLOTS           16
+#define RACE_UPDATES    200000
+
+static const uint8_t systemId[6] = { 0xC4, 0x7F, 0x51, 0x02, 0x9A, 0x3B };
+
+static char segmentName[64];
+
+static smart_control_power_data smart_control_data(uint32_t update)
+{
+    smart_control_power_data data = { SMART_CONTROL_MODE_ERG, (uint16_t)update, update * 0.5, (uint8_t)update,
+                                      (uint16_t)(update + 7) };
+    return data;
+}
+
+static void test_round_trip(void)
+{
+    kinetic_shared_metrics publisher, reader;
+    CHECK(!kinetic_shared_metrics_create(&publisher, segmentName, 0));
+    CHECK(kinetic_shared_metrics_create(&publisher, segmentName, SLOTS));
+    CHECK(kinetic_shared_metrics_open(&reader, segmentName));
+    CHECK(reader.slotCount == SLOTS && !kinetic_shared_metrics_retired(&reader));
+
+    kinetic_shared_metrics_sample sample;
+    uint64_t generation = 99;
+    CHECK(kinetic_shared_metrics_generation(&reader, 3) == 0);
+    CHECK(!kinetic_shared_metrics_read(&reader, 3, &sample, &generation));
+
+    inride_power_data inRide;
+    memset(&inRide, 0, sizeof(inRide));
+    inRide.power = 245;
+    inRide.speedKPH = 31.25;
+    inRide.cadenceRPM = 88.2;
+    inRide.proFlywheel = true;
+    kinetic_shared_metrics_publish_inride(&publisher, 3, systemId, 1000, &inRide);
+    inRide.power = 250;
+    kinetic_shared_metrics_publish_inride(&publisher, 3, systemId, 2000, &inRide);
+    smart_control_power_data smartControl = smart_control_data(310);
+    kinetic_shared_metrics_publish_smart_control(&publisher, SLOTS - 1, systemId, 3000, &smartControl);
+    // out of range slots, and readers, do not publish
+    kinetic_shared_metrics_publish_smart_control(&publisher, SLOTS, systemId, 4000, &smartControl);
+    kinetic_shared_metrics_publish_smart_control(&reader, 0, systemId, 4000, &smartControl);
+
+    CHECK(kinetic_shared_metrics_generation(&reader, 3) == 2);
+    CHECK(kinetic_shared_metrics_read(&reader, 3, &sample, &generation) && generation == 2);
+    CHECK(sample.deviceType == KINETIC_CAPTURE_DEVICE_INRIDE && memcmp(sample.systemId, systemId, 6) == 0);
+    CHECK(sample.timestamp == 2000 && sample.inRide.power == 250 && sample.inRide.speedKPH == 31.25);
+    CHECK(sample.inRide.cadenceRPM == 88.2 && sample.inRide.proFlywheel);
+
+    CHECK(kinetic_shared_metrics_read(&reader, SLOTS - 1, &sample, NULL));
+    CHECK(sample.deviceType == KINETIC_CAPTURE_DEVICE_SMART_CONTROL && sample.timestamp == 3000);
+    CHECK(sample.smartControl.power == 310 && sample.smartControl.speedKPH == 155 && sample.smartControl.targetResistance == 317);
+    CHECK(kinetic_shared_metrics_generation(&reader, 0) == 0);
+    CHECK(!kinetic_shared_metrics_read(&reader, SLOTS, &sample, NULL));
+
+    // replaced: the old mapping stays readable and is marked retired, the name opens the new segment
+    kinetic_shared_metrics replacement;
+    CHECK(kinetic_shared_metrics_create(&replacement, segmentName, 2 * SLOTS));
+    CHECK(kinetic_shared_metrics_retired(&reader) && kinetic_shared_metrics_retired(&publisher));
+    CHECK(!kinetic_shared_metrics_retired(&replacement));
+    CHECK(kinetic_shared_metrics_read(&reader, 3, &sample, NULL) && sample.inRide.power == 250);
+    kinetic_shared_metrics_close(&reader);
+    CHECK(!kinetic_shared_metrics_retired(&reader));
+    CHECK(kinetic_shared_metrics_open(&reader, segmentName));
+    CHECK(reader.slotCount == 2 * SLOTS && !kinetic_shared_metrics_retired(&reader));
+    CHECK(kinetic_shared_metrics_generation(&reader, 3) == 0);
+    kinetic_shared_metrics_publish_smart_control(&replacement, 2 * SLOTS - 1, systemId, 5000, &smartControl);
+    CHECK(kinetic_shared_metrics_read(&reader, 2 * SLOTS - 1, &sample, &generation) && generation == 1);
+
+    kinetic_shared_metrics_close(&reader);
+    kinetic_shared_metrics_close(&replacement);
+    kinetic_shared_metrics_close(&publisher);
+    CHECK(kinetic_shared_metrics_unlink(segmentName));
+    CHECK(!kinetic_shared_metrics_open(&reader, segmentName));
+}
+
+typedef struct race
+{
+    kinetic_shared_metrics *publisher;
+    atomic_bool done;
+} race;
+
+static void *publish_updates(void *context)
+{
+    race *r = context;
+    for (uint32_t update = 1; update <= RACE_UPDATES; ++update) {
+        smart_control_power_data data = smart_control_data(update);
+        kinetic_shared_metrics_publish_smart_control(r->publisher, 0, systemId, update, &data);
+    }
+    atomic_store(&r->done, true);
+    return NULL;
+}
+
+static void test_race(void)
+{
+    kinetic_shared_metrics publisher, reader;
+    CHECK(kinetic_shared_metrics_create(&publisher, segmentName, 1));
+    CHECK(kinetic_shared_metrics_open(&reader, segmentName));
+    race r = { &publisher, false };
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, publish_updates, &r) == 0);
+
+    size_t reads = 0, torn = 0;
+    uint64_t lastGeneration = 0;
+    bool ordered = true;
+    while (!atomic_load(&r.done)) {
+        kinetic_shared_metrics_sample sample;
+        uint64_t generation;
+        if (!kinetic_shared_metrics_read(&reader, 0, &sample, &generation)) {
+            continue;
+        }
+        reads++;
+        // every field of a sample comes from the same update
+        uint32_t update = (uint32_t)sample.timestamp;
+        smart_control_power_data expected = smart_control_data(update);
+        torn += generation != update || sample.smartControl.power != expected.power ||
+                sample.smartControl.speedKPH != expected.speedKPH || sample.smartControl.cadenceRPM != expected.cadenceRPM ||
+                sample.smartControl.targetResistance != expected.targetResistance;
+        ordered = ordered && generation >= lastGeneration;
+        lastGeneration = generation;
+    }
+    pthread_join(thread, NULL);
+    CHECK(reads > 0 && torn == 0 && ordered);
+    CHECK(kinetic_shared_metrics_generation(&reader, 0) == RACE_UPDATES);
+
+    kinetic_shared_metrics_close(&reader);
+    kinetic_shared_metrics_close(&publisher);
+    kinetic_shared_metrics_unlink(segmentName);
+}
+
+int main(void)
+{
+    snprintf(segmentName, sizeof(segmentName), "/kinetic-test-metrics-%d", (int)getpid());
+    test_round_trip();
+    test_race();
+    return check_result("shared_metrics");
+}
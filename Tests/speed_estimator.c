@@ -0,0 +1,182 @@
+//
+//  speed_estimator.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+//  Speed estimator regression tests: a simulated roller (revolution times at 32768 Hz, 4 Hz inRide updates) ridden at a
+//  speed step and a speed ramp, the estimate (inride_estimate_power) against the raw speed of the revolutions
+//  (inride_process_raw_power_data, i.e. inride_speed_for_ticks):
+//  - step: the estimate reaches the new speed within an update of the raw series, overshoots by less than half the
+//    step and settles
+//  - ramp: the raw speed lags by half its window, the estimate does not, and settles after the ramp
+//  - power follows the estimated speed, stops and long gaps restart the estimate
+//
+
+#include <stdint.h>
+#include <string.h>
+
+#include "check.h"
+#include "SpeedEstimator.h"
+
+#define SENSOR_HZ       32768
+#define INTERVAL        8192                    // 4 Hz updates
+#define RIDE_SECONDS    25
+#define CROSSINGS_MAX   (1 << 16)
+
+typedef double (*speed_profile)(double seconds);
+
+typedef struct ride_result
+{
+    /*! First update at 38 KPH or more after 5 s, raw and estimated */
+    double rawReached;
+    double estimateReached;
+    /*! Last update after 5 s with the estimate more than 0.5 KPH off the true speed, before and after 15 s */
+    double lastOffDuring;
+    double lastOffAfter;
+    double peak;
+    /*! Mean error (KPH) from 7 to 15 s, raw and estimated */
+    double rawBias;
+    double estimateBias;
+    double rawError;
+    double estimateError;
+    size_t powerMismatches;
+} ride_result;
+
+static double speed_step(double seconds)
+{
+    return seconds < 5 ? 20 : 40;
+}
+
+static double speed_ramp(double seconds)
+{
+    return seconds < 5 ? 20 : seconds < 15 ? 20 + 3 * (seconds - 5) : 50;
+}
+
+static ride_result ride(speed_profile profile, double smoothing)
+{
+    static uint64_t crossings[CROSSINGS_MAX];
+    kinetic_speed_estimator_config config = kinetic_speed_estimator_config_for_smoothing(smoothing);
+    kinetic_speed_estimator estimator;
+    kinetic_speed_estimator_init(&estimator, &config);
+
+    ride_result result;
+    memset(&result, 0, sizeof(result));
+    result.rawReached = result.estimateReached = -1;
+    size_t count = 0, previousCount = 0, samples = 0;
+    double phase = 0;
+    inride_raw_power_data raw;
+    memset(&raw, 0, sizeof(raw));
+    raw.spindownTicks = (uint32_t)(1.8 * SENSOR_HZ);
+    raw.interval = INTERVAL;
+    for (uint64_t tick = 1; tick <= (uint64_t)RIDE_SECONDS * SENSOR_HZ; ++tick) {
+        double seconds = (double)tick / SENSOR_HZ;
+        double truth = profile(seconds);
+        // the roller: one revolution per InRideSpeedTicks / speed ticks
+        phase += truth / 20012.256849;
+        if (phase >= 1) {
+            phase -= 1;
+            if (count < CROSSINGS_MAX) {
+                crossings[count++] = tick;
+            }
+        }
+        if (tick % INTERVAL != 0) {
+            continue;
+        }
+        // the measurement: the whole revolutions of the interval, timed from crossing to crossing
+        size_t revs = count - previousCount > 255 ? 255 : count - previousCount;
+        raw.revsPrevious = raw.revs;
+        raw.ticksPrevious = raw.ticks;
+        raw.revs = (uint8_t)revs;
+        raw.ticks = revs > 0 ? (uint32_t)(crossings[count - 1] - crossings[count - 1 - revs]) : 0;
+        previousCount = count;
+
+        inride_power_data data = inride_process_raw_power_data(&raw);
+        // the raw speed of the revolutions (inride_speed_for_ticks)
+        double rawKPH = data.speedKPH;
+        inride_estimate_power(&estimator, &raw, &data);
+        result.powerMismatches += data.power != (data.coasting ? 0 : inride_power_for_speed(data.speedKPH, data.spindownTime));
+
+        if (seconds >= 5) {
+            if (result.rawReached < 0 && rawKPH >= 38) {
+                result.rawReached = seconds;
+            }
+            if (result.estimateReached < 0 && data.speedKPH >= 38) {
+                result.estimateReached = seconds;
+            }
+            if (fabs(data.speedKPH - truth) > 0.5) {
+                *(seconds < 15 ? &result.lastOffDuring : &result.lastOffAfter) = seconds;
+            }
+            if (seconds < 15) {
+                result.peak = fmax(result.peak, data.speedKPH);
+            }
+        }
+        if (seconds > 7 && seconds < 15) {
+            result.rawBias += rawKPH - truth;
+            result.estimateBias += data.speedKPH - truth;
+            result.rawError += fabs(rawKPH - truth);
+            result.estimateError += fabs(data.speedKPH - truth);
+            samples++;
+        }
+    }
+    result.rawBias /= samples;
+    result.estimateBias /= samples;
+    result.rawError /= samples;
+    result.estimateError /= samples;
+    return result;
+}
+
+static void test_step(void)
+{
+    const double smoothing[] = { 0, 0.5, 1 };
+    const double settle[] = { 1, 2, 4.5 };
+    for (size_t i = 0; i < 3; ++i) {
+        ride_result r = ride(speed_step, smoothing[i]);
+        CHECK(r.powerMismatches == 0);
+        // the raw speed has the new speed once its window is past the step
+        CHECK(r.rawReached > 5 && r.rawReached <= 5.5);
+        CHECK(r.estimateReached >= r.rawReached && r.estimateReached <= r.rawReached + 0.5);
+        CHECK(r.peak < 50);
+        CHECK(r.lastOffDuring <= 5 + settle[i] && r.lastOffAfter == 0);
+    }
+}
+
+static void test_ramp(void)
+{
+    const double smoothing[] = { 0, 0.5, 1 };
+    for (size_t i = 0; i < 3; ++i) {
+        ride_result r = ride(speed_ramp, smoothing[i]);
+        CHECK(r.powerMismatches == 0);
+        // 3 KPH / s, the raw window is about 1/4 s: the raw speed is about 0.4 KPH behind
+        CHECK_NEAR(r.rawBias, -0.4, 0.05);
+        CHECK(r.estimateError < r.rawError / 3);
+        CHECK(fabs(r.estimateBias) < fabs(r.rawBias) / 3);
+        // back within 0.5 KPH of a steady 50 KPH within 2.5 s of the end of the ramp
+        CHECK(r.lastOffAfter <= 17.5);
+    }
+}
+
+static void test_restart(void)
+{
+    kinetic_speed_estimator_config config = kinetic_speed_estimator_config_for_smoothing(0.5);
+    kinetic_speed_estimator estimator;
+    kinetic_speed_estimator_init(&estimator, &config);
+    CHECK(kinetic_speed_estimator_update(&estimator, 0.25, 30, 0.25, 10) == 30);
+    for (int i = 0; i < 20; ++i) {
+        kinetic_speed_estimator_update(&estimator, 0.25, 30, 0.25, 10);
+    }
+    CHECK_NEAR(estimator.speedKPH, 30, 1e-6);
+    // stopped: 0 at once
+    CHECK(kinetic_speed_estimator_update(&estimator, 0.25, 0, 0, 0) == 0 && !estimator.initialized);
+    // the first measurement after a stop, and after a gap, is taken as is
+    CHECK(kinetic_speed_estimator_update(&estimator, 0.25, 12, 0.25, 4) == 12);
+    CHECK(kinetic_speed_estimator_update(&estimator, config.resetGap + 1, 45, 0.25, 10) == 45);
+    CHECK(estimator.acceleration == 0);
+}
+
+int main(void)
+{
+    test_step();
+    test_ramp();
+    test_restart();
+    return check_result("speed_estimator");
+}
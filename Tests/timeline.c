@@ -0,0 +1,209 @@
+//
+//  timeline.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+//  Timeline fusion regression tests:
+//  - k-way merge of streams with samples out of order within their reorder buffer, late and overflowing samples
+//  - a silent stream holds the output back by maxLatency at most
+//  - resampler grid alignment and sample and hold, on a grid anchored at 0 fed Unix timestamps, across gaps longer
+//    than maxAge
+//
+
+#include <stdint.h>
+#include <string.h>
+
+#include "check.h"
+#include "TimelineFusion.h"
+
+#define STREAMS         4
+#define CAPACITY        16
+#define SAMPLES         2000
+#define ROWS_MAX        4096
+
+typedef struct merged
+{
+    size_t count;
+    double timestamp[STREAMS * SAMPLES];
+    uint32_t stream[STREAMS * SAMPLES];
+    uint16_t power[STREAMS * SAMPLES];
+} merged;
+
+typedef struct rows
+{
+    size_t count;
+    double gridTime[ROWS_MAX];
+    uint16_t power[ROWS_MAX][STREAMS];
+    uint8_t valid[ROWS_MAX][STREAMS];
+} rows;
+
+static void collect_sample(void *context, const kinetic_fusion_sample *sample)
+{
+    merged *m = context;
+    if (m->count < STREAMS * SAMPLES) {
+        m->timestamp[m->count] = sample->timestamp;
+        m->stream[m->count] = sample->stream;
+        m->power[m->count] = sample->record.power;
+    }
+    m->count++;
+}
+
+static void collect_row(void *context, double gridTime, const kinetic_sample_record *values, const uint8_t *valid, uint32_t streamCount)
+{
+    rows *r = context;
+    if (r->count < ROWS_MAX) {
+        r->gridTime[r->count] = gridTime;
+        for (uint32_t i = 0; i < streamCount && i < STREAMS; ++i) {
+            r->power[r->count][i] = values[i].power;
+            r->valid[r->count][i] = valid[i];
+        }
+    }
+    r->count++;
+}
+
+static kinetic_sample_record record(uint16_t power)
+{
+    kinetic_sample_record r;
+    memset(&r, 0, sizeof(r));
+    r.power = power;
+    return r;
+}
+
+static void test_merge(void)
+{
+    static kinetic_fusion_stream streams[STREAMS];
+    static kinetic_fusion_sample samples[STREAMS * CAPACITY];
+    static uint32_t heap[STREAMS];
+    static merged m;
+    memset(&m, 0, sizeof(m));
+    kinetic_fusion fusion;
+    kinetic_fusion_init(&fusion, streams, STREAMS, samples, CAPACITY, heap, 0.3);
+
+    // stream s updates every 0.05 x (s + 1) s with a phase, pairs of samples arrive swapped
+    size_t pushed = 0;
+    double now = 1500000000;
+    for (int step = 0; step < SAMPLES; ++step) {
+        now += 0.05;
+        for (uint32_t s = 0; s < STREAMS; ++s) {
+            int period = (int)s + 1;
+            if (step % (2 * period) != 2 * period - 1) {
+                continue;
+            }
+            // the sample of the previous period arrives after this one
+            for (int k = 0; k < 2; ++k) {
+                double t = now - 0.05 * (k == 0 ? 0 : period) - 0.01 * s;
+                kinetic_sample_record r = record((uint16_t)llround((t - 1500000000) * 100));
+                pushed += kinetic_fusion_push(&fusion, s, t, &r);
+            }
+        }
+        kinetic_fusion_drain(&fusion, now, collect_sample, &m);
+    }
+    kinetic_fusion_flush(&fusion, collect_sample, &m);
+    CHECK(fusion.late == 0 && fusion.overflow == 0);
+    CHECK(m.count == pushed && pushed > 0);
+    size_t disordered = 0;
+    for (size_t i = 1; i < m.count && i < STREAMS * SAMPLES; ++i) {
+        disordered += m.timestamp[i] < m.timestamp[i - 1];
+    }
+    CHECK(disordered == 0);
+    for (size_t i = 0; i < m.count && i < STREAMS * SAMPLES; ++i) {
+        CHECK(m.power[i] == (uint16_t)llround((m.timestamp[i] - 1500000000) * 100));
+    }
+
+    // older than the last released sample: late
+    kinetic_sample_record r = record(1);
+    CHECK(!kinetic_fusion_push(&fusion, 0, m.timestamp[m.count - 1] - 1, &r));
+    CHECK(fusion.late == 1);
+    // more than the reorder buffer holds: overflow
+    double t = m.timestamp[m.count - 1] + 1;
+    for (int i = 0; i < CAPACITY; ++i) {
+        CHECK(kinetic_fusion_push(&fusion, 1, t + i, &r));
+    }
+    CHECK(!kinetic_fusion_push(&fusion, 1, t + CAPACITY, &r));
+    CHECK(fusion.overflow == 1);
+    CHECK(!kinetic_fusion_push(&fusion, STREAMS, t, &r));
+}
+
+static void test_silent_stream(void)
+{
+    kinetic_fusion_stream streams[2];
+    kinetic_fusion_sample samples[2 * CAPACITY];
+    uint32_t heap[2];
+    static merged m;
+    memset(&m, 0, sizeof(m));
+    kinetic_fusion fusion;
+    kinetic_fusion_init(&fusion, streams, 2, samples, CAPACITY, heap, 0.5);
+
+    kinetic_sample_record r = record(7);
+    CHECK(kinetic_fusion_push(&fusion, 0, 10.0, &r));
+    CHECK(kinetic_fusion_push(&fusion, 0, 10.2, &r));
+    // stream 1 is silent: nothing until maxLatency has passed
+    CHECK(kinetic_fusion_drain(&fusion, 10.4, collect_sample, &m) == 0);
+    CHECK(kinetic_fusion_drain(&fusion, 10.5, collect_sample, &m) == 1 && m.timestamp[0] == 10.0);
+    // a sample of stream 1 releases the older samples of stream 0 at once
+    CHECK(kinetic_fusion_push(&fusion, 1, 10.3, &r));
+    CHECK(kinetic_fusion_drain(&fusion, 10.5, collect_sample, &m) == 1 && m.timestamp[1] == 10.2);
+    // behind the watermark (now - maxLatency): late
+    CHECK(!kinetic_fusion_push(&fusion, 0, 9.9, &r) && fusion.late == 1);
+    CHECK(kinetic_fusion_flush(&fusion, collect_sample, &m) == 1 && m.timestamp[2] == 10.3);
+}
+
+static void add(kinetic_resampler *resampler, uint32_t stream, double timestamp, uint16_t power)
+{
+    kinetic_fusion_sample sample = { timestamp, stream, record(power) };
+    kinetic_resampler_add(resampler, &sample);
+}
+
+static void test_resampler(void)
+{
+    kinetic_resampler_stream streams[2];
+    kinetic_sample_record row[2];
+    uint8_t valid[2];
+    static rows r;
+    memset(&r, 0, sizeof(r));
+    kinetic_resampler resampler;
+    CHECK(!kinetic_resampler_init(&resampler, streams, row, valid, 2, 0, 0, 2, collect_row, &r));
+    CHECK(!kinetic_resampler_init(&resampler, streams, row, valid, 2, 0, NAN, 2, collect_row, &r));
+    // anchored at 0, fed Unix timestamps: the empty grid before the first sample is skipped at once
+    CHECK(kinetic_resampler_init(&resampler, streams, row, valid, 2, 0, 0.25, 2, collect_row, &r));
+
+    const double start = 1500000000.1;
+    add(&resampler, 0, start, 100);
+    CHECK(r.count == 0);
+    add(&resampler, 1, start + 0.3, 200);
+    add(&resampler, 0, start + 1.05, 110);
+    // rows at .25, .5, .75, 1.0 past 1500000000: stream 0 from start, stream 1 from .5 on
+    CHECK(r.count == 4);
+    for (size_t i = 0; i < 4 && i < r.count; ++i) {
+        CHECK(r.gridTime[i] == 1500000000.25 + 0.25 * i);
+        CHECK(r.valid[i][0] && r.power[i][0] == 100);
+        CHECK(r.valid[i][1] == (i >= 1) && r.power[i][1] == (i >= 1 ? 200 : 0));
+    }
+
+    // a gap longer than maxAge in every stream: rows while a value is fresh, then nothing until the next sample
+    r.count = 0;
+    add(&resampler, 1, start + 3600, 210);
+    // rows from 1.25 to 3.0: stream 0 (1.05) stays fresh up to 3.05, stream 1 (0.3) up to 2.3
+    CHECK(r.count == 8);
+    for (size_t i = 0; i < r.count && i < 8; ++i) {
+        double gridTime = 1500000001.25 + 0.25 * i;
+        CHECK(r.gridTime[i] == gridTime);
+        CHECK(r.valid[i][0] && r.power[i][0] == 110);
+        CHECK(r.valid[i][1] == (gridTime - (start + 0.3) <= 2));
+    }
+
+    // advance with the end of the session: rows up to maxAge after the last sample, on the same grid
+    r.count = 0;
+    CHECK(kinetic_resampler_advance(&resampler, start + 100000) == 8);
+    CHECK(r.count == 8 && r.gridTime[0] == 1500003600.25 && r.gridTime[7] == 1500003602.0);
+    CHECK(r.valid[0][1] && !r.valid[0][0] && r.power[0][1] == 210 && r.power[0][0] == 0);
+    CHECK(kinetic_resampler_advance(&resampler, start + 100000) == 0);
+}
+
+int main(void)
+{
+    test_merge();
+    test_silent_stream();
+    test_resampler();
+    return check_result("timeline");
+}
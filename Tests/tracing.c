@@ -0,0 +1,306 @@
+//
+//  tracing.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+//  Pipeline tracing regression tests (built with KINETIC_TRACING only). The dump is read back with a small JSON parser:
+//  - an inRide power frame records the deobfuscation and the power model as two spans of the same frame
+//  - past KINETIC_TRACE_SPANS spans, the dump is well formed and holds exactly the last KINETIC_TRACE_SPANS spans
+//
+
+#include <stdint.h>
+#include <string.h>
+
+#include "check.h"
+#include "Emulator.h"
+#include "inRide.h"
+#include "Tracing.h"
+
+#define EVENTS_MAX      (2 * KINETIC_TRACE_SPANS)
+#define NAME_MAX        40
+#define DEPTH_MAX       16
+
+typedef struct span_event
+{
+    char name[NAME_MAX];
+    double frame;
+} span_event;
+
+typedef struct json_parser
+{
+    const char *p;
+    const char *end;
+    size_t events;
+    span_event event[EVENTS_MAX];
+    char threadName[NAME_MAX];
+} json_parser;
+
+/*! Members of an object the test looks at */
+typedef struct json_fields
+{
+    char name[NAME_MAX];
+    char ph[4];
+    double frame;
+} json_fields;
+
+static void skip_space(json_parser *parser)
+{
+    while (parser->p < parser->end && (*parser->p == ' ' || *parser->p == '\n' || *parser->p == '\r' || *parser->p == '\t')) {
+        parser->p++;
+    }
+}
+
+static bool consume(json_parser *parser, char c)
+{
+    skip_space(parser);
+    if (parser->p < parser->end && *parser->p == c) {
+        parser->p++;
+        return true;
+    }
+    return false;
+}
+
+// Parses a string, keeps its first size - 1 bytes (escapes kept as their character when it is ASCII)
+static bool parse_string(json_parser *parser, char *string, size_t size)
+{
+    size_t length = 0;
+    if (!consume(parser, '"')) {
+        return false;
+    }
+    while (parser->p < parser->end && *parser->p != '"') {
+        char c = *parser->p++;
+        if ((unsigned char)c < 0x20) {
+            return false;
+        }
+        if (c == '\\') {
+            if (parser->p >= parser->end) {
+                return false;
+            }
+            c = *parser->p++;
+            if (c == 'u') {
+                for (int i = 0; i < 4; ++i, ++parser->p) {
+                    if (parser->p >= parser->end || strchr("0123456789abcdefABCDEF", *parser->p) == NULL) {
+                        return false;
+                    }
+                }
+                c = '?';
+            } else if (strchr("\"\\/bfnrt", c) == NULL) {
+                return false;
+            }
+        }
+        if (string != NULL && length + 1 < size) {
+            string[length++] = c;
+        }
+    }
+    if (string != NULL && size > 0) {
+        string[length] = '\0';
+    }
+    return consume(parser, '"');
+}
+
+static bool parse_number(json_parser *parser, double *number)
+{
+    skip_space(parser);
+    const char *start = parser->p;
+    if (start >= parser->end || (*start != '-' && (*start < '0' || *start > '9'))) {
+        return false;
+    }
+    char *end;
+    double value = strtod(start, &end);
+    if (end == start || end > parser->end) {
+        return false;
+    }
+    parser->p = end;
+    if (number != NULL) {
+        *number = value;
+    }
+    return true;
+}
+
+static bool parse_value(json_parser *parser, json_fields *fields, int depth);
+
+static bool parse_object(json_parser *parser, json_fields *fields, int depth)
+{
+    json_fields own;
+    memset(&own, 0, sizeof(own));
+    own.frame = -1;
+    if (consume(parser, '}')) {
+        if (fields != NULL) {
+            *fields = own;
+        }
+        return true;
+    }
+    do {
+        char key[NAME_MAX];
+        if (!parse_string(parser, key, sizeof(key)) || !consume(parser, ':')) {
+            return false;
+        }
+        json_fields member;
+        bool parsed;
+        if (strcmp(key, "name") == 0 && (skip_space(parser), parser->p < parser->end && *parser->p == '"')) {
+            parsed = parse_string(parser, own.name, sizeof(own.name));
+        } else if (strcmp(key, "ph") == 0) {
+            parsed = parse_string(parser, own.ph, sizeof(own.ph));
+        } else if (strcmp(key, "frame") == 0) {
+            parsed = parse_number(parser, &own.frame);
+        } else {
+            member.frame = -1;
+            member.name[0] = '\0';
+            parsed = parse_value(parser, &member, depth + 1);
+            if (strcmp(key, "args") == 0) {
+                own.frame = member.frame;
+                if (member.name[0] != '\0') {
+                    memcpy(own.name, member.name, sizeof(own.name));
+                }
+            }
+        }
+        if (!parsed) {
+            return false;
+        }
+    } while (consume(parser, ','));
+    if (!consume(parser, '}')) {
+        return false;
+    }
+
+    if (strcmp(own.ph, "X") == 0 && parser->events < EVENTS_MAX) {
+        span_event *event = &parser->event[parser->events++];
+        memcpy(event->name, own.name, NAME_MAX);
+        event->frame = own.frame;
+    } else if (strcmp(own.ph, "M") == 0) {
+        memcpy(parser->threadName, own.name, NAME_MAX);
+    }
+    if (fields != NULL) {
+        *fields = own;
+    }
+    return true;
+}
+
+static bool parse_value(json_parser *parser, json_fields *fields, int depth)
+{
+    if (depth > DEPTH_MAX) {
+        return false;
+    }
+    skip_space(parser);
+    if (parser->p >= parser->end) {
+        return false;
+    }
+    switch (*parser->p) {
+        case '{':
+            parser->p++;
+            return parse_object(parser, fields, depth);
+        case '[':
+            parser->p++;
+            if (consume(parser, ']')) {
+                return true;
+            }
+            do {
+                if (!parse_value(parser, NULL, depth + 1)) {
+                    return false;
+                }
+            } while (consume(parser, ','));
+            return consume(parser, ']');
+        case '"':
+            return parse_string(parser, NULL, 0);
+        default:
+            for (int i = 0; i < 3; ++i) {
+                static const char *literals[] = { "true", "false", "null" };
+                size_t length = strlen(literals[i]);
+                if ((size_t)(parser->end - parser->p) >= length && memcmp(parser->p, literals[i], length) == 0) {
+                    parser->p += length;
+                    return true;
+                }
+            }
+            return parse_number(parser, NULL);
+    }
+}
+
+// Dumps the trace and parses it back, false if it is not well formed JSON
+static bool dump_and_parse(json_parser *parser)
+{
+    FILE *file = tmpfile();
+    CHECK(file != NULL);
+    if (file == NULL) {
+        return false;
+    }
+    CHECK(kinetic_trace_dump_file(file));
+    long size = ftell(file);
+    rewind(file);
+    char *json = malloc((size_t)size + 1);
+    size_t read = fread(json, 1, (size_t)size, file);
+    fclose(file);
+    json[read] = '\0';
+
+    memset(parser, 0, sizeof(*parser));
+    parser->p = json;
+    parser->end = json + read;
+    bool valid = parse_value(parser, NULL, 0);
+    skip_space(parser);
+    valid = valid && parser->p == parser->end;
+    free(json);
+    return valid;
+}
+
+static void test_power_spans(void)
+{
+    static json_parser parser;
+    kinetic_emulator_device device;
+    const uint8_t systemId[6] = { 0xC4, 0x7F, 0x51, 0x02, 0x9A, 0x3B };
+    kinetic_emulator_init_inride(&device, systemId, 5);
+    // the escapes of the thread name must keep the JSON valid
+    kinetic_trace_thread_name("test \"main\"\n");
+    for (uint32_t frame = 1; frame <= 3; ++frame) {
+        kinetic_trace_set_frame(frame);
+        uint8_t data[20];
+        CHECK(kinetic_emulator_power_frame(&device, data) == 20);
+        inride_process_power_data(data);
+    }
+    CHECK(dump_and_parse(&parser));
+    // control characters are left out
+    CHECK(strcmp(parser.threadName, "test \"main\"") == 0);
+    // deobfuscation then power model, in the frame of the notification
+    CHECK(parser.events == 6);
+    for (size_t i = 0; i + 1 < parser.events; i += 2) {
+        CHECK(strcmp(parser.event[i].name, "inride_decode_power_data") == 0 && parser.event[i].frame == i / 2 + 1);
+        CHECK(strcmp(parser.event[i + 1].name, "inride_power_model") == 0 && parser.event[i + 1].frame == i / 2 + 1);
+    }
+}
+
+static void test_ring_wraps(void)
+{
+    static json_parser parser;
+    const uint32_t recorded = KINETIC_TRACE_SPANS + KINETIC_TRACE_SPANS / 2 + 17;
+    for (uint32_t frame = 1000; frame < 1000 + recorded; ++frame) {
+        kinetic_trace_set_frame(frame);
+        uint64_t start = kinetic_trace_now();
+        kinetic_trace_record(frame & 1 ? "odd" : "even", start);
+    }
+    CHECK(dump_and_parse(&parser));
+    // the last KINETIC_TRACE_SPANS spans, oldest first: none of the earlier spans is left
+    CHECK(parser.events == KINETIC_TRACE_SPANS);
+    uint32_t first = 1000 + recorded - KINETIC_TRACE_SPANS;
+    size_t wrong = 0;
+    for (size_t i = 0; i < parser.events; ++i) {
+        uint32_t frame = first + (uint32_t)i;
+        wrong += parser.event[i].frame != frame || strcmp(parser.event[i].name, frame & 1 ? "odd" : "even") != 0;
+    }
+    CHECK(wrong == 0);
+
+    // not JSON
+    json_parser *bad = &parser;
+    const char *samples[] = { "{\"a\":[1,2,]}", "{\"a\":\"\x01\"}", "{\"a\":1} x", "[{\"a\" 1}]" };
+    for (size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); ++i) {
+        memset(bad, 0, sizeof(*bad));
+        bad->p = samples[i];
+        bad->end = samples[i] + strlen(samples[i]);
+        bool valid = parse_value(bad, NULL, 0);
+        skip_space(bad);
+        CHECK(!(valid && bad->p == bad->end));
+    }
+}
+
+int main(void)
+{
+    test_power_spans();
+    test_ring_wraps();
+    return check_result("tracing");
+}
@@ -0,0 +1,75 @@
+//
+//  usb.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+//  Smart Control USB framing regression tests: requests with bytes that must be escaped, unframed again from the
+//  stream cut into chunks of every size.
+//
+
+#include <stdint.h>
+#include <string.h>
+
+#include "check.h"
+#include "SmartControl.h"
+
+typedef struct usb_packets
+{
+    size_t count;
+    uint16_t identifier[64];
+    uint8_t data[64][SMART_CONTROL_USB_DATA_MAX];
+    size_t size[64];
+} usb_packets;
+
+static void collect_usb_packet(void *context, const smart_control_usb_packet *packet)
+{
+    usb_packets *packets = context;
+    if (packets->count < 64) {
+        packets->identifier[packets->count] = packet->identifier;
+        memcpy(packets->data[packets->count], packet->data, packet->size);
+        packets->size[packets->count] = packet->size;
+    }
+    packets->count++;
+}
+
+static void test_usb_round_trip(void)
+{
+    // frames with bytes that must be escaped (the delimiters show up in whitened data)
+    enum { Frames = 48 };
+    uint8_t frames[Frames][20];
+    uint8_t stream[Frames * SMART_CONTROL_USB_PACKET_MAX];
+    size_t streamSize = 0;
+    for (size_t i = 0; i < Frames; ++i) {
+        for (size_t b = 0; b < 20; ++b) {
+            frames[i][b] = (uint8_t)(i * 31 + b * 7 + (b % 3 == 0 ? 0x7D : 0));
+        }
+        size_t size = smart_control_usb_request(false, true, i % 2 ? 0x0202 : 0x0201, frames[i], 20, &stream[streamSize]);
+        CHECK(size > 20 && size <= SMART_CONTROL_USB_PACKET_MAX);
+        streamSize += size;
+    }
+    uint8_t tooLarge[SMART_CONTROL_USB_DATA_MAX + 1] = { 0 };
+    uint8_t unused[2 * SMART_CONTROL_USB_PACKET_MAX];
+    CHECK(smart_control_usb_request(false, true, 0x0201, tooLarge, sizeof(tooLarge), unused) == 0);
+
+    for (size_t chunk = 1; chunk <= 64; ++chunk) {
+        usb_packets packets = { 0 };
+        smart_control_usb_parser parser;
+        smart_control_usb_parser_init(&parser);
+        size_t found = 0;
+        for (size_t offset = 0; offset < streamSize; offset += chunk) {
+            size_t size = streamSize - offset < chunk ? streamSize - offset : chunk;
+            found += smart_control_usb_process_data(&parser, &stream[offset], size, collect_usb_packet, &packets);
+        }
+        CHECK(found == Frames && packets.count == Frames);
+        for (size_t i = 0; i < Frames && i < packets.count; ++i) {
+            CHECK(packets.identifier[i] == (i % 2 ? 0x0202 : 0x0201));
+            CHECK(packets.size[i] == 20 && memcmp(packets.data[i], frames[i], 20) == 0);
+        }
+    }
+}
+
+int main(void)
+{
+    test_usb_round_trip();
+    return check_result("usb");
+}
@@ -0,0 +1,110 @@
+//
+//  virtual_speed.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+//  Virtual speed regression tests:
+//  - the vectorized solver against a brute force root search of the road model, head and tail winds included
+//  - the speed table against the solver
+//
+
+#include <stdint.h>
+
+#include "check.h"
+#include "VirtualSpeed.h"
+
+#define POWERS          41
+#define GRADES          81
+
+// Signed road power (the model without the clamp at 0)
+static double road_power(double speedMPS, const kinetic_virtual_speed_params *params, double grade)
+{
+    double angle = atan(grade / 100.0);
+    double air = speedMPS + params->windSpeedMPS;
+    double force = params->weightKG * 9.80665 * (params->rollingCoeff * cos(angle) + sin(angle)) + params->windCoeff * air * fabs(air);
+    return speedMPS * force;
+}
+
+// Largest speed (KPH) at which the road takes the power: scan down from far above the root, then bisect
+static double brute_force_speed(const kinetic_virtual_speed_params *params, double power, double grade)
+{
+    const double step = 0.01;
+    int below = 15000;
+    while (below > 0 && road_power(below * step, params, grade) >= power) {
+        below--;
+    }
+    // the root is in [below, below + 1] steps (from 0 the road may push the rider up to a small speed)
+    double low = below * step, high = low + step;
+    for (int i = 0; i < 60; ++i) {
+        double middle = 0.5 * (low + high);
+        if (road_power(middle, params, grade) < power) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return 0.5 * (low + high) * 3.6;
+}
+
+static void test_solver(void)
+{
+    const double winds[] = { -15, -10, -6, -3, 0, 4, 12 };
+    const double windCoeffs[] = { 0.3, 0.6 };
+    size_t wrong = 0, solved = 0;
+    for (size_t w = 0; w < sizeof(winds) / sizeof(winds[0]); ++w) {
+        for (size_t k = 0; k < sizeof(windCoeffs) / sizeof(windCoeffs[0]); ++k) {
+            kinetic_virtual_speed_params params = { 80, 0.004, windCoeffs[k], winds[w] };
+            double power[POWERS * GRADES], grade[POWERS * GRADES], speed[POWERS * GRADES];
+            for (int p = 0; p < POWERS; ++p) {
+                for (int g = 0; g < GRADES; ++g) {
+                    power[p * GRADES + g] = 25.0 * p;
+                    grade[p * GRADES + g] = -20 + 0.5 * g;
+                }
+            }
+            kinetic_virtual_speed_solve(&params, power, grade, speed, POWERS * GRADES);
+            for (int i = 0; i < POWERS * GRADES; ++i) {
+                double expected = brute_force_speed(&params, power[i], grade[i]);
+                solved++;
+                if (!(fabs(speed[i] - expected) <= 0.01)) {
+                    if (wrong++ < 5) {
+                        fprintf(stderr, "wind %g m/s, k %g, %g W, %g %%: %.4f KPH, expected %.4f KPH\n", winds[w], windCoeffs[k],
+                                power[i], grade[i], speed[i], expected);
+                    }
+                }
+            }
+        }
+    }
+    CHECK(solved > 0 && wrong == 0);
+}
+
+static void test_table(void)
+{
+    kinetic_virtual_speed_params params = { 85, 0.004, 0.6, 0 };
+    static float speeds[61 * 81];
+    kinetic_virtual_speed_table table;
+    CHECK(!kinetic_virtual_speed_table_init(&table, &params, speeds, 1, 1500, 81, -20, 20));
+    CHECK(kinetic_virtual_speed_table_init(&table, &params, speeds, 61, 1500, 81, -20, 20));
+
+    double largest = 0;
+    for (double grade = -20; grade <= 20; grade += 0.13) {
+        for (double power = 50; power <= 1500; power += 7.1) {
+            double solved;
+            kinetic_virtual_speed_solve(&params, &power, &grade, &solved, 1);
+            largest = fmax(largest, fabs(kinetic_virtual_speed_lookup(&table, power, grade) - solved));
+        }
+    }
+    CHECK(largest < 0.15);
+
+    // outside the table: solved
+    double power = 2000, grade = 25, solved;
+    kinetic_virtual_speed_solve(&params, &power, &grade, &solved, 1);
+    CHECK(kinetic_virtual_speed_lookup(&table, power, grade) == solved);
+    CHECK_NEAR(smart_control_simulation_power(solved, 85, 0.004, 0.6, grade, 0), power, 0.01);
+}
+
+int main(void)
+{
+    test_solver();
+    test_table();
+    return check_result("virtual_speed");
+}
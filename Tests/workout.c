@@ -0,0 +1,285 @@
+//
+//  workout.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+//  ERG workout regression tests:
+//  - compiled ramps: one setpoint per trainer update, unchanged targets left out, repeats and capacity
+//  - every timer fires exactly at its time, across the cascades of each level and parked beyond the last level
+//  - a late advance fires only the latest due setpoint of a rider
+//  - the handler starts and stops riders, including the ones due in the same tick
+//
+
+#include <stdint.h>
+#include <string.h>
+
+#include "check.h"
+#include "Workout.h"
+
+#define RIDERS          2048
+#define WHEEL_SPAN      (1ull << KINETIC_WORKOUT_WHEEL_BITS)
+#define LEVEL_SPAN(l)   (1ull << (KINETIC_WORKOUT_WHEEL_BITS + ((l) + 1) * KINETIC_WORKOUT_LEVEL_BITS))
+#define MAX_DELTA       (LEVEL_SPAN(KINETIC_WORKOUT_LEVELS - 1) - 1)
+
+typedef struct fired
+{
+    kinetic_workout_executor *executor;
+    uint32_t count[RIDERS];
+    uint64_t tick[RIDERS];
+    uint16_t watts[RIDERS];
+    size_t total;
+    bool badCommand;
+
+    /*! Handler actions (once): the first of a pair to fire stops the other and starts a rider, a rider restarts itself */
+    uint32_t pair[2];
+    uint32_t starts;
+    const kinetic_workout_setpoint *startSchedule;
+    uint32_t startCount;
+    uint32_t restarted;
+    const kinetic_workout_setpoint *restartSchedule;
+    uint32_t restartCount;
+} fired;
+
+static void on_setpoint(void *context, uint32_t rider, uint16_t watts, const smart_control_set_mode_erg_data *command)
+{
+    fired *f = context;
+    f->badCommand |= command == NULL;
+    if (rider < RIDERS) {
+        f->count[rider]++;
+        // the tick being processed
+        f->tick[rider] = f->executor->tick - 1;
+        f->watts[rider] = watts;
+    }
+    f->total++;
+
+    uint64_t now = f->executor->tick - 1;
+    if (rider == f->pair[0] || rider == f->pair[1]) {
+        kinetic_workout_executor_stop(f->executor, rider == f->pair[0] ? f->pair[1] : f->pair[0]);
+        kinetic_workout_executor_start(f->executor, f->starts, f->startSchedule, f->startCount, now);
+        f->pair[0] = f->pair[1] = KINETIC_WORKOUT_NONE;
+    }
+    if (rider == f->restarted && f->restartSchedule != NULL) {
+        kinetic_workout_executor_start(f->executor, rider, f->restartSchedule, f->restartCount, now);
+        f->restartSchedule = NULL;
+    }
+}
+
+static void fired_init(fired *f, kinetic_workout_executor *executor)
+{
+    memset(f, 0, sizeof(*f));
+    f->executor = executor;
+    f->pair[0] = f->pair[1] = f->starts = f->restarted = KINETIC_WORKOUT_NONE;
+}
+
+static void test_compile(void)
+{
+    // 100 W to 120 W at 4 updates a second: 0.4 W per update, then steady at the end target
+    kinetic_workout_step ramp[] = {
+        { KINETIC_WORKOUT_RAMP, 12.5, 0.5f, 0.6f, 0, 0 },
+        { KINETIC_WORKOUT_STEADY, 60, 0.6f, 0, 0, 0 },
+        { KINETIC_WORKOUT_STEADY, 30, 0.4f, 0, 0, 0 },
+    };
+    kinetic_workout_setpoint setpoints[256];
+    uint32_t duration = 0;
+    size_t count = kinetic_workout_compile(ramp, 3, 200, 4, setpoints, 256, &duration);
+    // 100 ... 120 during the ramp (the steady 120 is left out), then 80
+    CHECK(count == 22 && duration == 102500);
+    size_t n = 0;
+    int last = -1;
+    for (uint32_t k = 0; k < 50; ++k) {
+        long watts = lround(100 + 0.4 * k);
+        if (watts != last && n < count) {
+            CHECK(setpoints[n].time == 250 * k && setpoints[n].watts == watts);
+            n++;
+            last = (int)watts;
+        }
+    }
+    CHECK(n == 21);
+    CHECK(count == 22 && setpoints[21].time == 72500 && setpoints[21].watts == 80);
+
+    // a ramp down at 1 update a second, shorter than a whole number of updates
+    kinetic_workout_step down[] = { { KINETIC_WORKOUT_RAMP, 4.5, 1.0f, 0.5f, 0, 0 } };
+    count = kinetic_workout_compile(down, 1, 300, 1, setpoints, 256, &duration);
+    const uint16_t downWatts[] = { 300, 267, 233, 200, 167 };
+    CHECK(count == 5 && duration == 4500);
+    for (size_t i = 0; i < 5 && i < count; ++i) {
+        CHECK(setpoints[i].time == 1000 * i && setpoints[i].watts == downWatts[i]);
+    }
+
+    // (ramp, steady) repeated twice more
+    kinetic_workout_step intervals[] = {
+        { KINETIC_WORKOUT_STEADY, 10, 0.5f, 0, 0, 0 },
+        { KINETIC_WORKOUT_RAMP, 2, 0.5f, 1.0f, 0, 0 },
+        { KINETIC_WORKOUT_STEADY, 5, 1.0f, 0, 0, 0 },
+        { KINETIC_WORKOUT_REPEAT, 0, 0, 0, 2, 2 },
+    };
+    count = kinetic_workout_compile(intervals, 4, 200, 2, setpoints, 256, &duration);
+    // ramp 100, 125, 150, 175 then 200: the first 100 is the steady step's
+    CHECK(count == 15 && duration == 3 * 7000 + 10000);
+    const uint32_t times[] = { 0, 10500, 11000, 11500, 12000, 17000, 17500, 18000, 18500, 19000, 24000, 24500, 25000, 25500, 26000 };
+    const uint16_t watts[] = { 100, 125, 150, 175, 200, 100, 125, 150, 175, 200, 100, 125, 150, 175, 200 };
+    for (size_t i = 0; i < 15 && i < count; ++i) {
+        CHECK(setpoints[i].time == times[i] && setpoints[i].watts == watts[i]);
+    }
+
+    // does not fit, invalid steps
+    CHECK(kinetic_workout_compile(ramp, 3, 200, 4, setpoints, 21, NULL) == 0);
+    kinetic_workout_step badRepeat[] = { { KINETIC_WORKOUT_REPEAT, 0, 0, 0, 1, 1 } };
+    CHECK(kinetic_workout_compile(badRepeat, 1, 200, 4, setpoints, 256, NULL) == 0);
+    kinetic_workout_step badRamp[] = { { KINETIC_WORKOUT_RAMP, 0, 0.5f, 1.0f, 0, 0 } };
+    CHECK(kinetic_workout_compile(badRamp, 1, 200, 4, setpoints, 256, NULL) == 0);
+}
+
+static void test_timer_levels(void)
+{
+    static kinetic_workout_rider riders[RIDERS];
+    static fired f;
+    static uint64_t expected[RIDERS];
+    static const kinetic_workout_setpoint single[] = { { 0, 150 } };
+    kinetic_workout_executor executor;
+    // not aligned on any slot
+    const uint64_t base = 7 * LEVEL_SPAN(1) + 3 * WHEEL_SPAN + 77;
+    kinetic_workout_executor_init(&executor, riders, RIDERS, base);
+    fired_init(&f, &executor);
+
+    // the edges of the wheel and of each level, beyond the last level (parked), then spread at random
+    uint64_t delays[64];
+    size_t edges = 0;
+    delays[edges++] = 0;
+    delays[edges++] = 1;
+    delays[edges++] = WHEEL_SPAN - 1;
+    delays[edges++] = WHEEL_SPAN;
+    delays[edges++] = WHEEL_SPAN + 1;
+    for (unsigned level = 0; level < KINETIC_WORKOUT_LEVELS; ++level) {
+        delays[edges++] = LEVEL_SPAN(level) - 1;
+        delays[edges++] = LEVEL_SPAN(level);
+        delays[edges++] = LEVEL_SPAN(level) + 1;
+    }
+    delays[edges++] = 2 * MAX_DELTA + 12345;
+    delays[edges++] = 2 * LEVEL_SPAN(KINETIC_WORKOUT_LEVELS - 1) - (base & (WHEEL_SPAN - 1));
+
+    uint64_t last = 0;
+    uint32_t seed = 12345;
+    for (uint32_t r = 0; r < RIDERS; ++r) {
+        uint64_t delay;
+        if (r < edges) {
+            delay = delays[r];
+        } else {
+            seed = seed * 1103515245u + 12345u;
+            uint64_t random = ((uint64_t)(seed >> 4) << 8) ^ r;
+            delay = random % (2 * MAX_DELTA);
+        }
+        expected[r] = base + delay;
+        last = expected[r] > last ? expected[r] : last;
+        kinetic_workout_executor_start(&executor, r, single, 1, expected[r]);
+    }
+    CHECK(executor.armed == RIDERS);
+
+    // in a few large steps: each timer must still fire at its own tick
+    size_t fired = 0;
+    for (uint64_t now = base; now < last; now += LEVEL_SPAN(1) * 37 + 11) {
+        fired += kinetic_workout_executor_advance(&executor, now, on_setpoint, &f);
+    }
+    fired += kinetic_workout_executor_advance(&executor, last, on_setpoint, &f);
+    CHECK(fired == RIDERS && f.total == RIDERS && !f.badCommand);
+    size_t wrong = 0;
+    for (uint32_t r = 0; r < RIDERS; ++r) {
+        wrong += f.count[r] != 1 || f.tick[r] != expected[r] || f.watts[r] != 150;
+    }
+    CHECK(wrong == 0);
+    CHECK(executor.armed == 0);
+
+    // one rider through every level, advanced a millisecond at a time
+    const kinetic_workout_setpoint schedule[] = {
+        { 0, 100 }, { 300, 110 }, { 20000, 120 }, { 20001, 130 }, { 1500000, 140 }, { 1500256, 150 },
+    };
+    uint64_t start = executor.tick + 5;
+    kinetic_workout_executor_start(&executor, 0, schedule, 6, start);
+    memset(f.count, 0, sizeof(f.count));
+    size_t index = 0;
+    for (uint64_t now = executor.tick; now <= start + 1500256; ++now) {
+        if (kinetic_workout_executor_advance(&executor, now, on_setpoint, &f) == 1) {
+            CHECK(index < 6 && now == start + schedule[index].time && f.watts[0] == schedule[index].watts);
+            index++;
+        }
+    }
+    CHECK(index == 6 && f.count[0] == 6 && executor.armed == 0);
+}
+
+static void test_late_advance(void)
+{
+    kinetic_workout_rider riders[2];
+    static fired f;
+    const kinetic_workout_setpoint schedule[] = { { 0, 100 }, { 100, 200 }, { 200, 300 }, { 300, 400 }, { 400, 500 } };
+    kinetic_workout_executor executor;
+    kinetic_workout_executor_init(&executor, riders, 2, 1000);
+    fired_init(&f, &executor);
+    kinetic_workout_executor_start(&executor, 0, schedule, 5, 1000);
+    kinetic_workout_executor_start(&executor, 1, schedule, 5, 1070);
+
+    // rider 0 is due 0, 100, 200, rider 1 only 0 and 100
+    CHECK(kinetic_workout_executor_advance(&executor, 1250, on_setpoint, &f) == 2);
+    CHECK(f.count[0] == 1 && f.watts[0] == 300 && f.count[1] == 1 && f.watts[1] == 200);
+    // the next setpoints are still on time
+    CHECK(kinetic_workout_executor_advance(&executor, 1299, on_setpoint, &f) == 1 && f.count[1] == 2 && f.tick[1] == 1270);
+    CHECK(kinetic_workout_executor_advance(&executor, 1300, on_setpoint, &f) == 1 && f.count[0] == 2 && f.tick[0] == 1300);
+    // long after the end: the last setpoint once
+    CHECK(kinetic_workout_executor_advance(&executor, 100000, on_setpoint, &f) == 2);
+    CHECK(f.count[0] == 3 && f.watts[0] == 500 && f.count[1] == 3 && f.watts[1] == 500);
+    CHECK(kinetic_workout_executor_advance(&executor, 200000, on_setpoint, &f) == 0 && executor.armed == 0);
+}
+
+static void test_handler_start_stop(void)
+{
+    kinetic_workout_rider riders[6];
+    static fired f;
+    const kinetic_workout_setpoint schedule[] = { { 10, 100 }, { 5000, 200 } };
+    const kinetic_workout_setpoint started[] = { { 0, 300 }, { 2, 310 } };
+    const kinetic_workout_setpoint restart[] = { { 20, 400 } };
+    kinetic_workout_executor executor;
+    kinetic_workout_executor_init(&executor, riders, 6, 0);
+    fired_init(&f, &executor);
+
+    // riders 0 and 1 are due in the same tick, the first to fire stops the other and starts rider 2 now
+    f.pair[0] = 0;
+    f.pair[1] = 1;
+    f.starts = 2;
+    f.startSchedule = started;
+    f.startCount = 2;
+    // rider 3 replaces its own workout when it fires
+    f.restarted = 3;
+    f.restartSchedule = restart;
+    f.restartCount = 1;
+    for (uint32_t r = 0; r < 5; ++r) {
+        if (r != 2) {
+            kinetic_workout_executor_start(&executor, r, schedule, 2, 0);
+        }
+    }
+    // rider 4 is stopped before it is due, stopping an idle rider does nothing
+    kinetic_workout_executor_stop(&executor, 4);
+    kinetic_workout_executor_stop(&executor, 5);
+    CHECK(executor.armed == 3);
+
+    CHECK(kinetic_workout_executor_advance(&executor, 10, on_setpoint, &f) == 2);
+    CHECK(f.count[0] + f.count[1] == 1 && f.count[3] == 1 && f.watts[3] == 100);
+    uint32_t first = f.count[0] == 1 ? 0 : 1;
+    // rider 2 started late in tick 10: its first setpoint fires in the next tick
+    CHECK(f.count[2] == 0);
+    CHECK(kinetic_workout_executor_advance(&executor, 11, on_setpoint, &f) == 1 && f.count[2] == 1 && f.watts[2] == 300);
+    CHECK(kinetic_workout_executor_advance(&executor, 12, on_setpoint, &f) == 1 && f.count[2] == 2 && f.watts[2] == 310);
+
+    CHECK(kinetic_workout_executor_advance(&executor, 10000, on_setpoint, &f) == 2);
+    // the first of the pair runs on, the other was stopped, rider 3 runs its new workout only
+    CHECK(f.count[first] == 2 && f.watts[first] == 200 && f.count[1 - first] == 0);
+    CHECK(f.count[3] == 2 && f.tick[3] == 30 && f.watts[3] == 400);
+    CHECK(f.count[4] == 0 && executor.armed == 0 && f.total == 6 && !f.badCommand);
+}
+
+int main(void)
+{
+    test_compile();
+    test_timer_levels();
+    test_late_advance();
+    test_handler_start_stop();
+    return check_result("workout");
+}
@@ -0,0 +1,452 @@
+//
+//  reprocess.c
+//
+//  Copyright © 2017 Kinetic. All rights reserved.
+//
+//  Re-derives inRide power for an archive of frame captures (see FrameCapture.h).
+//
+//  usage: kinetic-reprocess [-j threads] [-o output directory] [-t trace.json] capture...
+//
+//  Each capture is decoded on its own (no state is shared between files) so the output does not depend on the
+//  thread count or on the order the files are picked up. Files are handed out largest first and idle workers
+//  steal from the other workers' queues, so a few long rides do not hold up the tail of the run.
+//
+//  Output: one column file per capture (<output directory>/<capture name>.kcol). Captures with the same file name
+//  (from different directories) are rejected before anything is written, as their outputs would collide.
+//  - kcol_header
+//  - kcol_column[columnCount]
+//  - the column data, each column 8 byte aligned
+//
+//  -t (builds with KINETIC_TRACING): writes the spans of every frame (capture read, decode) as Chrome trace event JSON
+//
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "FrameCapture.h"
+#include "inRide.h"
+#include "Tracing.h"
+
+#define KCOL_MAGIC          0x4C4F434B  // "KCOL"
+#define KCOL_VERSION        1
+#define MAX_THREADS         256
+
+typedef enum kcol_type
+{
+    KCOL_TYPE_U8    = 0x01,
+    KCOL_TYPE_I32   = 0x04,
+    KCOL_TYPE_U64   = 0x08,
+    KCOL_TYPE_F64   = 0x18
+} kcol_type;
+
+typedef struct kcol_header
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t columnCount;
+    uint64_t rowCount;
+} __attribute__((packed)) kcol_header;
+
+typedef struct kcol_column
+{
+    char name[24];
+    uint32_t type;
+    uint32_t width;
+    uint64_t offset;
+} __attribute__((packed)) kcol_column;
+
+enum {
+    COLUMN_TIMESTAMP,
+    COLUMN_POWER,
+    COLUMN_SPEED,
+    COLUMN_CADENCE,
+    COLUMN_COASTING,
+    COLUMN_ROLLER_RESISTANCE,
+    COLUMN_SPINDOWN_TIME,
+    COLUMN_COUNT
+};
+
+static const struct {
+    const char *name;
+    kcol_type type;
+    uint32_t width;
+} columnLayout[COLUMN_COUNT] = {
+    { "timestamp",          KCOL_TYPE_U64,  8 },
+    { "power",              KCOL_TYPE_I32,  4 },
+    { "speedKPH",           KCOL_TYPE_F64,  8 },
+    { "cadenceRPM",         KCOL_TYPE_F64,  8 },
+    { "coasting",           KCOL_TYPE_U8,   1 },
+    { "rollerResistance",   KCOL_TYPE_F64,  8 },
+    { "spindownTime",       KCOL_TYPE_F64,  8 },
+};
+
+
+typedef struct job
+{
+    const char *path;
+    /*! File name part of path, names the output */
+    const char *name;
+    off_t size;
+} job;
+
+// Work queue of one worker, sorted largest first. The owner works from the top (largest first, so long rides
+// do not end up in the tail) and thieves take from the bottom (the smallest files, for fine grained balancing).
+typedef struct job_queue
+{
+    pthread_mutex_t lock;
+    size_t *jobs;
+    size_t top;
+    size_t bottom;
+} job_queue;
+
+typedef struct stage_times
+{
+    double map;
+    double decode;
+    double write;
+} stage_times;
+
+typedef struct worker
+{
+    pthread_t thread;
+    size_t index;
+    stage_times times;
+    uint64_t files;
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t steals;
+    uint64_t failures;
+
+    // column buffers, reused across files
+    size_t capacity;
+    uint8_t *columns[COLUMN_COUNT];
+} worker;
+
+static job *jobs;
+static size_t jobCount;
+static job_queue queues[MAX_THREADS];
+static worker workers[MAX_THREADS];
+static size_t workerCount;
+static const char *outputDirectory = ".";
+
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static int compare_jobs(const void *a, const void *b)
+{
+    const job *ja = a;
+    const job *jb = b;
+    if (ja->size != jb->size) {
+        return ja->size > jb->size ? -1 : 1;
+    }
+    return strcmp(ja->path, jb->path);
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(((const job *)a)->name, ((const job *)b)->name);
+}
+
+static bool pop_job(size_t self, size_t *jobIndex)
+{
+    job_queue *queue = &queues[self];
+    bool found = false;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->bottom > queue->top) {
+        *jobIndex = queue->jobs[queue->top++];
+        found = true;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    if (found) {
+        return true;
+    }
+
+    for (size_t offset = 1; offset < workerCount; ++offset) {
+        job_queue *victim = &queues[(self + offset) % workerCount];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->bottom > victim->top) {
+            *jobIndex = victim->jobs[--victim->bottom];
+            found = true;
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if (found) {
+            workers[self].steals++;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool reserve_columns(worker *w, size_t rows)
+{
+    if (rows <= w->capacity) {
+        return true;
+    }
+    for (size_t c = 0; c < COLUMN_COUNT; ++c) {
+        uint8_t *column = realloc(w->columns[c], rows * columnLayout[c].width);
+        if (column == NULL) {
+            return false;
+        }
+        w->columns[c] = column;
+    }
+    w->capacity = rows;
+    return true;
+}
+
+static bool write_columns(worker *w, const char *name, size_t rows)
+{
+    char outputPath[4096];
+    snprintf(outputPath, sizeof(outputPath), "%s/%s.kcol", outputDirectory, name);
+
+    kcol_header header;
+    header.magic = KCOL_MAGIC;
+    header.version = KCOL_VERSION;
+    header.columnCount = COLUMN_COUNT;
+    header.rowCount = rows;
+
+    kcol_column directory[COLUMN_COUNT];
+    uint64_t offset = sizeof(header) + sizeof(directory);
+    for (size_t c = 0; c < COLUMN_COUNT; ++c) {
+        memset(directory[c].name, 0, sizeof(directory[c].name));
+        strncpy(directory[c].name, columnLayout[c].name, sizeof(directory[c].name) - 1);
+        directory[c].type = columnLayout[c].type;
+        directory[c].width = columnLayout[c].width;
+        directory[c].offset = offset;
+        offset += (rows * columnLayout[c].width + 7) & ~(uint64_t)7;
+    }
+
+    FILE *file = fopen(outputPath, "wb");
+    if (file == NULL) {
+        return false;
+    }
+    static const uint8_t padding[8] = { 0 };
+    bool success = fwrite(&header, sizeof(header), 1, file) == 1;
+    success = success && fwrite(directory, sizeof(directory), 1, file) == 1;
+    for (size_t c = 0; c < COLUMN_COUNT && success; ++c) {
+        size_t size = rows * columnLayout[c].width;
+        success = fwrite(w->columns[c], 1, size, file) == size;
+        size_t pad = ((size + 7) & ~(size_t)7) - size;
+        success = success && fwrite(padding, 1, pad, file) == pad;
+    }
+    return fclose(file) == 0 && success;
+}
+
+static bool process_file(worker *w, const job *j)
+{
+    double start = now_seconds();
+    kinetic_capture_reader reader;
+    if (!kinetic_capture_reader_open(&reader, j->path)) {
+        fprintf(stderr, "kinetic-reprocess: cannot read capture %s\n", j->path);
+        return false;
+    }
+    // every BLE frame record is 40 bytes, so this bounds the number of rows
+    size_t maxRows = (reader.size - sizeof(kinetic_capture_header)) / (sizeof(kinetic_capture_record) + KINETIC_CAPTURE_FRAME_SIZE);
+    bool reserved = reserve_columns(w, maxRows);
+    double mapped = now_seconds();
+    w->times.map += mapped - start;
+    if (!reserved) {
+        kinetic_capture_reader_close(&reader);
+        return false;
+    }
+
+    uint64_t *timestamp = (uint64_t *)w->columns[COLUMN_TIMESTAMP];
+    int32_t *power = (int32_t *)w->columns[COLUMN_POWER];
+    double *speed = (double *)w->columns[COLUMN_SPEED];
+    double *cadence = (double *)w->columns[COLUMN_CADENCE];
+    uint8_t *coasting = w->columns[COLUMN_COASTING];
+    double *rollerResistance = (double *)w->columns[COLUMN_ROLLER_RESISTANCE];
+    double *spindownTime = (double *)w->columns[COLUMN_SPINDOWN_TIME];
+
+    size_t rows = 0;
+    kinetic_capture_entry entry;
+    for (;;) {
+        KINETIC_TRACE_FRAME_BEGIN();
+        KINETIC_TRACE_BEGIN(readStart);
+        bool read = kinetic_capture_next(&reader, &entry);
+        KINETIC_TRACE_END(readStart, "capture_read");
+        if (!read) {
+            break;
+        }
+        if (entry.type != KINETIC_CAPTURE_RECORD_BLE_FRAME || entry.characteristic != KINETIC_CAPTURE_INRIDE_POWER || entry.size != 20) {
+            continue;
+        }
+        inride_power_data data = inride_process_power_data((uint8_t *)entry.data);
+        timestamp[rows] = entry.timestamp;
+        power[rows] = data.power;
+        speed[rows] = data.speedKPH;
+        cadence[rows] = data.cadenceRPM;
+        coasting[rows] = data.coasting;
+        rollerResistance[rows] = data.rollerResistance;
+        spindownTime[rows] = data.spindownTime;
+        rows++;
+    }
+    size_t bytes = reader.size;
+    kinetic_capture_reader_close(&reader);
+    double decoded = now_seconds();
+    w->times.decode += decoded - mapped;
+
+    bool written = write_columns(w, j->name, rows);
+    w->times.write += now_seconds() - decoded;
+    if (!written) {
+        fprintf(stderr, "kinetic-reprocess: cannot write output for %s\n", j->path);
+        return false;
+    }
+
+    w->files++;
+    w->frames += rows;
+    w->bytes += bytes;
+    return true;
+}
+
+static void *worker_main(void *argument)
+{
+    worker *w = argument;
+#ifdef KINETIC_TRACING
+    char name[KINETIC_TRACE_THREAD_NAME_MAX];
+    snprintf(name, sizeof(name), "worker %zu", w->index + 1);
+    kinetic_trace_thread_name(name);
+#endif
+    size_t jobIndex;
+    while (pop_job(w->index, &jobIndex)) {
+        if (!process_file(w, &jobs[jobIndex])) {
+            w->failures++;
+        }
+    }
+    return NULL;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: kinetic-reprocess [-j threads] [-o output directory] [-t trace.json] capture...\n");
+}
+
+int main(int argc, char *argv[])
+{
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *tracePath = NULL;
+    int option;
+    while ((option = getopt(argc, argv, "j:o:t:h")) != -1) {
+        switch (option) {
+            case 'j':
+                threads = strtol(optarg, NULL, 10);
+                break;
+            case 'o':
+                outputDirectory = optarg;
+                break;
+            case 't':
+                tracePath = optarg;
+                break;
+            default:
+                usage();
+                return option == 'h' ? 0 : 2;
+        }
+    }
+    if (optind >= argc) {
+        usage();
+        return 2;
+    }
+#ifndef KINETIC_TRACING
+    if (tracePath != NULL) {
+        fprintf(stderr, "kinetic-reprocess: -t needs a build with KINETIC_TRACING\n");
+        return 2;
+    }
+#endif
+    threads = threads < 1 ? 1 : threads > MAX_THREADS ? MAX_THREADS : threads;
+
+    jobCount = (size_t)(argc - optind);
+    jobs = calloc(jobCount, sizeof(job));
+    if (jobs == NULL) {
+        return 1;
+    }
+    for (size_t i = 0; i < jobCount; ++i) {
+        struct stat st;
+        jobs[i].path = argv[optind + (int)i];
+        const char *slash = strrchr(jobs[i].path, '/');
+        jobs[i].name = slash == NULL ? jobs[i].path : slash + 1;
+        jobs[i].size = stat(jobs[i].path, &st) == 0 ? st.st_size : 0;
+    }
+    // two captures with the same name would write the same output file (possibly from two workers at once)
+    qsort(jobs, jobCount, sizeof(job), compare_names);
+    for (size_t i = 1; i < jobCount; ++i) {
+        if (strcmp(jobs[i - 1].name, jobs[i].name) == 0) {
+            fprintf(stderr, "kinetic-reprocess: %s and %s would both write %s.kcol\n", jobs[i - 1].path, jobs[i].path, jobs[i].name);
+            free(jobs);
+            return 2;
+        }
+    }
+    qsort(jobs, jobCount, sizeof(job), compare_jobs);
+
+    // Deal the files out round robin, largest first, so every queue starts with a similar amount of work.
+    workerCount = (size_t)threads;
+    for (size_t t = 0; t < workerCount; ++t) {
+        pthread_mutex_init(&queues[t].lock, NULL);
+        queues[t].jobs = calloc(jobCount / workerCount + 1, sizeof(size_t));
+        queues[t].top = 0;
+        queues[t].bottom = 0;
+        if (queues[t].jobs == NULL) {
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < jobCount; ++i) {
+        job_queue *queue = &queues[i % workerCount];
+        queue->jobs[queue->bottom++] = i;
+    }
+
+    double start = now_seconds();
+    for (size_t t = 0; t < workerCount; ++t) {
+        workers[t].index = t;
+        if (pthread_create(&workers[t].thread, NULL, worker_main, &workers[t]) != 0) {
+            fprintf(stderr, "kinetic-reprocess: cannot start worker thread: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+    uint64_t files = 0, frames = 0, bytes = 0, steals = 0, failures = 0;
+    stage_times total = { 0, 0, 0 };
+    for (size_t t = 0; t < workerCount; ++t) {
+        pthread_join(workers[t].thread, NULL);
+        files += workers[t].files;
+        frames += workers[t].frames;
+        bytes += workers[t].bytes;
+        steals += workers[t].steals;
+        failures += workers[t].failures;
+        total.map += workers[t].times.map;
+        total.decode += workers[t].times.decode;
+        total.write += workers[t].times.write;
+        for (size_t c = 0; c < COLUMN_COUNT; ++c) {
+            free(workers[t].columns[c]);
+        }
+    }
+    double elapsed = now_seconds() - start;
+
+    printf("threads:       %zu\n", workerCount);
+    printf("files:         %llu (%llu failed, %llu stolen)\n", (unsigned long long)files, (unsigned long long)failures, (unsigned long long)steals);
+    printf("frames:        %llu\n", (unsigned long long)frames);
+    printf("elapsed:       %.3f s\n", elapsed);
+    printf("throughput:    %.0f frames/s, %.1f MB/s\n", elapsed > 0 ? frames / elapsed : 0, elapsed > 0 ? bytes / elapsed / 1e6 : 0);
+    printf("stage map:     %.3f s (all threads)\n", total.map);
+    printf("stage decode:  %.3f s (all threads), %.1f ns/frame\n", total.decode, frames > 0 ? total.decode * 1e9 / frames : 0);
+    printf("stage write:   %.3f s (all threads)\n", total.write);
+#ifdef KINETIC_TRACING
+    if (tracePath != NULL && !kinetic_trace_dump(tracePath)) {
+        fprintf(stderr, "kinetic-reprocess: cannot write trace %s\n", tracePath);
+        failures++;
+    }
+#endif
+
+    for (size_t t = 0; t < workerCount; ++t) {
+        free(queues[t].jobs);
+        pthread_mutex_destroy(&queues[t].lock);
+    }
+    free(jobs);
+    return failures > 0 ? 1 : 0;
+}